@@ -1,9 +1,25 @@
 HEADERS += $$PWD/interfaces/SolARFBOWAPI.h \
     $$PWD/interfaces/SolARFBOWHelper.h \
     $$PWD/interfaces/SolARModuleFBOW_traits.h \
-    $$PWD/interfaces/SolARKeyframeRetrieverFBOW.h
+    $$PWD/interfaces/SolARKeyframeRetrieverFBOW.h \
+    $$PWD/interfaces/SolARFBOWVocabularyTree.h \
+    $$PWD/interfaces/SolARFBOWThreadPool.h \
+    $$PWD/interfaces/SolARFBOWKeyframeSpill.h \
+    $$PWD/interfaces/SolARFBOWIndexSegment.h \
+    $$PWD/interfaces/SolARFBOWHammingEmbedding.h \
+    $$PWD/interfaces/SolARFBOWQuerySession.h \
+    $$PWD/interfaces/SolARFBOWScoring.h \
+    $$PWD/interfaces/SolARFBOWQueryScratch.h
 
 SOURCES += $$PWD/src/SolARModuleFBOW.cpp \
     $$PWD/src/SolARFBOWHelper.cpp \
-    $$PWD/src/SolARKeyframeRetrieverFBOW.cpp
+    $$PWD/src/SolARKeyframeRetrieverFBOW.cpp \
+    $$PWD/src/SolARFBOWVocabularyTree.cpp \
+    $$PWD/src/SolARFBOWThreadPool.cpp \
+    $$PWD/src/SolARFBOWKeyframeSpill.cpp \
+    $$PWD/src/SolARFBOWIndexSegment.cpp \
+    $$PWD/src/SolARFBOWHammingEmbedding.cpp \
+    $$PWD/src/SolARFBOWQuerySession.cpp \
+    $$PWD/src/SolARFBOWScoring.cpp \
+    $$PWD/src/SolARFBOWQueryScratch.cpp
 
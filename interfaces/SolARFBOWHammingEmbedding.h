@@ -0,0 +1,91 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SOLARFBOWHAMMINGEMBEDDING_H
+#define SOLARFBOWHAMMINGEMBEDDING_H
+
+#include "SolARFBOWAPI.h"
+#include "SolARFBOWVocabularyTree.h"
+#include "datastructure/KeyframeRetrieval.h"
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace SolAR {
+namespace MODULES {
+namespace FBOW {
+
+/**
+ * @class SolARFBOWHammingEmbedding
+ * @brief <B>Binary signatures of the residuals of descriptors to the vocabulary nodes they are assigned to.</B>
+ *
+ * Two descriptors assigned to the same node are likely to match if the Hamming distance of their signatures is small.
+ * The signature of a float descriptor holds the signs of fixed random projections of its residual to the node centroid.
+ * The signature of a binary descriptor samples its bits, since residuals to a common centroid keep Hamming distances.
+ */
+class SOLARFBOW_EXPORT_API SolARFBOWHammingEmbedding
+{
+public:
+    /// @brief number of bits of a signature
+    static const uint32_t NB_BITS = 64;
+
+    /// @brief signatures of descriptors as (node id, signature) pairs sorted by node id
+    typedef std::vector<std::pair<uint32_t, uint64_t>> Signatures;
+
+    /// @brief Prepare the embedding of the nodes reported at a level by transform
+    /// @param[in] vocTree: the vocabulary
+    /// @param[in] level: the level of the BoW level features
+    /// @return FrameworkReturnCode::_SUCCESS if the vocabulary is valid, else FrameworkReturnCode::_ERROR_
+    FrameworkReturnCode init(const SolARFBOWVocabularyTree& vocTree, uint32_t level);
+
+    /// @brief Check if the embedding is initialized
+    bool isValid() const { return m_descSize > 0; }
+
+    /// @brief Compute the signatures of the descriptors of a BoW level feature
+    /// @param[in] descriptors: the descriptors stored as rows, as given to transform
+    /// @param[in] bowLevelFeature: the nodes of the descriptors
+    /// @param[out] signatures: one signature per descriptor of bowLevelFeature
+    void compute(const cv::Mat& descriptors, const datastructure::BoWLevelFeature& bowLevelFeature, Signatures& signatures) const;
+
+    /// @brief Compute the signatures of the descriptors of the nodes of flat buffers, reusing the memory of signatures
+    void compute(const cv::Mat& descriptors, const SolARFBOWFlatBoW& flatBoW, Signatures& signatures) const;
+
+    /// @brief Check if two sets of signatures of a node have a pair of signatures within a Hamming distance
+    /// @param[in] begin1, end1: first set of signatures
+    /// @param[in] begin2, end2: second set of signatures
+    /// @param[in] threshold: maximum Hamming distance
+    static bool hasCloseSignatures(Signatures::const_iterator begin1, Signatures::const_iterator end1,
+                                   Signatures::const_iterator begin2, Signatures::const_iterator end2, uint32_t threshold);
+
+private:
+    uint64_t computeSignature(const uint8_t* descriptor, const uint8_t* centroid) const;
+
+private:
+    int                                         m_descType = 0;
+    uint32_t                                    m_descSize = 0;
+    /// @brief centroids of the nodes at the level, in the original descriptor format
+    std::map<uint32_t, std::vector<uint8_t>>    m_centroids;
+    /// @brief random +1/-1 projections of float residuals, NB_BITS rows of the descriptor dimension
+    std::vector<float>                          m_projections;
+    /// @brief bits sampled from binary descriptors
+    std::vector<uint32_t>                       m_sampledBits;
+};
+
+}
+}
+}
+
+#endif // SOLARFBOWHAMMINGEMBEDDING_H
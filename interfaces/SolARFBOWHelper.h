@@ -20,6 +20,7 @@
 #include "SolARFBOWAPI.h"
 #include "fbow.h"
 #include "datastructure/KeyframeRetrieval.h"
+#include "SolARFBOWVocabularyTree.h"
 
 namespace SolAR {
 namespace MODULES {
@@ -40,12 +41,25 @@ class SOLARFBOW_EXPORT_API SolARFBOWHelper
 public:
     static datastructure::BoWFeature fbow2Solar(const fbow::fBow& fbow);
     static datastructure::BoWLevelFeature fbow2Solar(const fbow::fBow2& fbow2);
+    /// @brief Move the node descriptors of a fbow level feature instead of copying them
+    static datastructure::BoWLevelFeature fbow2Solar(fbow::fBow2&& fbow2);
+    /// @brief Lay out a BoW feature and a BoW level feature in the flat buffers of a query, reusing their memory
+    static void solar2Flat(const datastructure::BoWFeature& bowFeature, const datastructure::BoWLevelFeature& bowLevelFeature, SolARFBOWFlatBoW& flatBoW);
+    static void fbow2Flat(const fbow::fBow& fbow, const fbow::fBow2& fbow2, SolARFBOWFlatBoW& flatBoW);
     static double distanceBoW(const datastructure::BoWFeature& bow1, const datastructure::BoWFeature& bow2);
     static double distanceL1BoW(const datastructure::BoWFeature& bow1, const datastructure::BoWFeature& bow2);
     static double distanceChiSquareBoW(const datastructure::BoWFeature& bow1, const datastructure::BoWFeature& bow2);
     static double distanceKLSBoW(const datastructure::BoWFeature& bow1, const datastructure::BoWFeature& bow2);
     static double distanceBhattacharyyaBoW(const datastructure::BoWFeature& bow1, const datastructure::BoWFeature& bow2);
     static double distanceDotProductBoW(const datastructure::BoWFeature& bow1, const datastructure::BoWFeature& bow2);
+    // scores are sums over shared words of termBoW, plus baseBoW of the keyframe, passed to finalizeBoW
+    static double termBoW(ScoringType type, double kfWeight, double queryWeight);
+    static double baseBoW(ScoringType type, const datastructure::BoWFeature& kfBow);
+    // queryScale scales the query weights of the terms, for the metrics which have a query scale
+    static double finalizeBoW(ScoringType type, double sum, double queryScale = 1.);
+    // true if the terms of the metric are homogeneous in the query weight, so that a scale of the query can be applied to their sum
+    static bool hasQueryScale(ScoringType type);
+    static void remapBoW(const std::map<uint32_t, uint32_t>& wordRemap, datastructure::BoWFeature& bow);
 };
 
 }
@@ -0,0 +1,170 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SOLARFBOWINDEXSEGMENT_H
+#define SOLARFBOWINDEXSEGMENT_H
+
+#include "SolARFBOWAPI.h"
+#include "datastructure/KeyframeRetrieval.h"
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace SolAR {
+namespace MODULES {
+namespace FBOW {
+
+/**
+ * @class SolARFBOWIndexSegment
+ * @brief <B>Immutable memory-mapped segment of a keyframe index.</B>
+ *
+ * A segment file holds, for a set of keyframes sorted by id, their BoW features and BoW level features,
+ * followed by a keyframe table and an inverted index (level node to sorted keyframe ids).
+ * Segments are written once by SolARFBOWIndexSegmentWriter and never modified: deletions are applied
+ * by writing a new segment.
+ */
+class SOLARFBOW_EXPORT_API SolARFBOWIndexSegment
+{
+public:
+    SolARFBOWIndexSegment() = default;
+    ~SolARFBOWIndexSegment();
+
+    SolARFBOWIndexSegment(const SolARFBOWIndexSegment&) = delete;
+    SolARFBOWIndexSegment& operator=(const SolARFBOWIndexSegment&) = delete;
+
+    /// @brief Map a segment file in memory
+    /// @param[in] file: path to the segment file
+    /// @param[in] generation: generation of the segment, used to order segments
+    /// @return FrameworkReturnCode::_SUCCESS if the segment is valid, else FrameworkReturnCode::_ERROR_
+    FrameworkReturnCode open(const std::string& file, uint64_t generation);
+
+    /// @brief Get the path to the segment file
+    const std::string& getFileName() const { return m_fileName; }
+
+    /// @brief Get the generation of the segment
+    uint64_t getGeneration() const { return m_generation; }
+
+    /// @brief Delete the segment file once the segment is destroyed
+    void removeFileOnClose() { m_removeFile = true; }
+
+    /// @brief Get the number of keyframes of the segment
+    uint32_t getNbKeyframes() const;
+
+    /// @brief Get the id of the i-th keyframe of the segment (keyframes are sorted by id)
+    uint32_t getKeyframeId(uint32_t i) const;
+
+    /// @brief Check if the segment holds a keyframe
+    bool contains(uint32_t id) const { return findKeyframe(id) != nullptr; }
+
+    /// @brief Get the BoW feature of a keyframe
+    FrameworkReturnCode getBoWFeature(uint32_t id, datastructure::BoWFeature& bowFeature) const;
+
+    /// @brief Get the BoW level feature of a keyframe
+    FrameworkReturnCode getBoWLevelFeature(uint32_t id, datastructure::BoWLevelFeature& bowLevelFeature) const;
+
+    /// @brief Get the keyframes having descriptors assigned to a level node
+    /// @param[in] nodeId: the level node
+    /// @param[out] nbKeyframes: the number of keyframes
+    /// @return the sorted keyframe ids (nullptr if none)
+    const uint32_t* getInvertedIndex(uint32_t nodeId, uint32_t& nbKeyframes) const;
+
+    /// @brief Get the size of the segment file in bytes
+    uint64_t getFileSize() const { return m_region.get_size(); }
+
+private:
+    friend class SolARFBOWIndexSegmentWriter;
+
+    struct Header {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t nbKeyframes;
+        uint32_t nbNodes;
+        uint32_t reserved;
+        uint64_t keyframeTableOffset;
+        uint64_t nodeTableOffset;
+    };
+
+    struct KeyframeEntry {
+        uint32_t id;
+        uint32_t nbWords;
+        uint32_t nbNodes;
+        uint32_t reserved;
+        uint64_t offset;
+    };
+
+    struct NodeEntry {
+        uint32_t nodeId;
+        uint32_t nbKeyframes;
+        uint64_t offset;
+    };
+
+    static const uint64_t MAGIC = 0x46424f57534547ULL;
+    static const uint32_t VERSION = 1;
+
+    const KeyframeEntry* findKeyframe(uint32_t id) const;
+    const KeyframeEntry* getKeyframeTable() const;
+    const NodeEntry* getNodeTable() const;
+
+private:
+    std::string                             m_fileName;
+    uint64_t                                m_generation = 0;
+    bool                                    m_removeFile = false;
+    boost::interprocess::file_mapping       m_mapping;
+    boost::interprocess::mapped_region      m_region;
+    const char*                             m_data = nullptr;
+    Header                                  m_header = Header();
+};
+
+/**
+ * @class SolARFBOWIndexSegmentWriter
+ * @brief <B>Writes a segment file from keyframes added by increasing id.</B>
+ *
+ * BoW data is streamed to the file, only the keyframe table and the inverted index are kept in memory until close.
+ */
+class SOLARFBOW_EXPORT_API SolARFBOWIndexSegmentWriter
+{
+public:
+    SolARFBOWIndexSegmentWriter() = default;
+    ~SolARFBOWIndexSegmentWriter() = default;
+
+    /// @brief Create the segment file
+    FrameworkReturnCode open(const std::string& file);
+
+    /// @brief Append a keyframe. Keyframes must be added by increasing id.
+    FrameworkReturnCode add(uint32_t id, const datastructure::BoWFeature& bowFeature, const datastructure::BoWLevelFeature& bowLevelFeature);
+
+    /// @brief Write the keyframe table and the inverted index and close the file
+    FrameworkReturnCode close();
+
+    /// @brief Get the number of added keyframes
+    uint32_t getNbKeyframes() const { return static_cast<uint32_t>(m_keyframes.size()); }
+
+private:
+    std::string                                 m_fileName;
+    std::ofstream                               m_file;
+    uint64_t                                    m_offset = 0;
+    std::vector<SolARFBOWIndexSegment::KeyframeEntry>  m_keyframes;
+    std::map<uint32_t, std::vector<uint32_t>>   m_invertedIndex;
+};
+
+}
+}
+}
+
+#endif // SOLARFBOWINDEXSEGMENT_H
@@ -0,0 +1,110 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SOLARFBOWKEYFRAMESPILL_H
+#define SOLARFBOWKEYFRAMESPILL_H
+
+#include "SolARFBOWAPI.h"
+#include "datastructure/KeyframeRetrieval.h"
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace SolAR {
+namespace MODULES {
+namespace FBOW {
+
+/**
+ * @class SolARFBOWKeyframeSpill
+ * @brief <B>On-disk segment holding the BoW features of keyframes evicted from memory.</B>
+ *
+ * Records are appended to a single file. Only the file offset of each record and a compact inverted index
+ * (level node to keyframe ids) are kept in memory, so that spilled keyframes can still be found by queries.
+ */
+class SOLARFBOW_EXPORT_API SolARFBOWKeyframeSpill
+{
+public:
+    SolARFBOWKeyframeSpill() = default;
+    ~SolARFBOWKeyframeSpill() = default;
+
+    /// @brief Create (or truncate) the spill file
+    /// @param[in] file: path to the spill file
+    /// @return FrameworkReturnCode::_SUCCESS if the file is opened, else FrameworkReturnCode::_ERROR_
+    FrameworkReturnCode open(const std::string& file);
+
+    /// @brief Check if the spill file is opened
+    bool isOpen() const { return m_file.is_open(); }
+
+    /// @brief Forget all spilled keyframes and truncate the spill file
+    void clear();
+
+    /// @brief Write the BoW features of a keyframe to the spill file
+    /// @param[in] id: the keyframe id
+    /// @param[in] bowFeature: the BoW feature of the keyframe
+    /// @param[in] bowLevelFeature: the BoW level feature of the keyframe
+    /// @return FrameworkReturnCode::_SUCCESS if the writing succeed, else FrameworkReturnCode::_ERROR_
+    FrameworkReturnCode write(uint32_t id, const datastructure::BoWFeature& bowFeature, const datastructure::BoWLevelFeature& bowLevelFeature);
+
+    /// @brief Read the BoW features of a spilled keyframe and remove it from the segment
+    /// @param[in] id: the keyframe id
+    /// @param[out] bowFeature: the BoW feature of the keyframe
+    /// @param[out] bowLevelFeature: the BoW level feature of the keyframe
+    /// @return FrameworkReturnCode::_SUCCESS if the reading succeed, else FrameworkReturnCode::_ERROR_
+    FrameworkReturnCode read(uint32_t id, datastructure::BoWFeature& bowFeature, datastructure::BoWLevelFeature& bowLevelFeature);
+
+    /// @brief Remove a keyframe from the segment
+    /// @return true if the keyframe was spilled
+    bool erase(uint32_t id);
+
+    /// @brief Check if a keyframe is spilled
+    bool contains(uint32_t id) const { return m_records.find(id) != m_records.end(); }
+
+    /// @brief Get the ids of the spilled keyframes
+    void getKeyframes(std::vector<uint32_t>& ids) const;
+
+    /// @brief Get the spilled keyframes having descriptors assigned to a level node
+    /// @param[in] nodeId: the level node
+    /// @return the keyframe ids (nullptr if none)
+    const std::vector<uint32_t>* getInvertedIndex(uint32_t nodeId) const;
+
+    /// @brief Get the number of spilled keyframes
+    size_t getNbKeyframes() const { return m_records.size(); }
+
+    /// @brief Get the size of the spill file in bytes, including records of keyframes loaded back or removed
+    uint64_t getFileSize() const { return m_fileSize; }
+
+private:
+    struct Record {
+        uint64_t offset;
+        std::vector<uint32_t> nodes;
+    };
+
+    void eraseFromIndex(uint32_t id, const Record& record);
+
+private:
+    std::string                                 m_fileName;
+    std::fstream                                m_file;
+    uint64_t                                    m_fileSize = 0;
+    std::map<uint32_t, Record>                  m_records;
+    std::map<uint32_t, std::vector<uint32_t>>   m_invertedIndex;
+};
+
+}
+}
+}
+
+#endif // SOLARFBOWKEYFRAMESPILL_H
@@ -0,0 +1,109 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SOLARFBOWQUERYSCRATCH_H
+#define SOLARFBOWQUERYSCRATCH_H
+
+#include "SolARFBOWAPI.h"
+#include "SolARFBOWHammingEmbedding.h"
+#include "SolARFBOWScoring.h"
+#include "SolARFBOWVocabularyTree.h"
+#include <utility>
+#include <vector>
+
+namespace SolAR {
+namespace MODULES {
+namespace FBOW {
+
+class SolARFBOWIndexSegment;
+
+/**
+ * @class SolARFBOWQueryScratch
+ * @brief <B>Per-thread buffers reused by the queries of a thread.</B>
+ *
+ * The buffers are cleared but never shrunk, so once they have grown to the size of the largest query a query
+ * does not allocate them again. Each stage of a query owns its buffers: a stage must not use the buffers of
+ * another stage which may be running on the same thread.
+ */
+class SOLARFBOW_EXPORT_API SolARFBOWQueryScratch
+{
+public:
+    typedef std::vector<std::pair<uint32_t, double>> ScoredKeyframes;
+
+    /// @brief Get the scratch of the calling thread
+    static SolARFBOWQueryScratch& local();
+
+    /// @brief Forget the votes of the previous query
+    void resetVotes();
+
+    /// @brief Add a vote for a keyframe
+    void vote(uint32_t keyframe_id);
+
+    /// @brief Get the number of votes of a keyframe
+    int getVotes(uint32_t keyframe_id) const { return keyframe_id < m_votes.size() ? m_votes[keyframe_id] : 0; }
+
+    /// @brief Get the keyframes with at least one vote, sorted by id
+    const std::vector<uint32_t>& getVotedKeyframes();
+
+    /// @brief Get the memory used by the buffers in bytes
+    uint64_t getMemory() const;
+
+public:
+    /// @brief BoW feature and BoW level feature of the query
+    SolARFBOWFlatBoW                queryFlatBoW;
+    /// @brief residual signatures of the query
+    SolARFBOWHammingEmbedding::Signatures signatures;
+    /// @brief candidate keyframes of the query
+    std::vector<uint32_t>           candidates;
+    /// @brief keyframes voted from the in-memory index
+    std::vector<uint32_t>           memoryCandidates;
+    /// @brief shortlisted keyframes
+    std::vector<uint32_t>           bestCandidates;
+    /// @brief shortlisted keyframes ranked by their votes
+    std::vector<std::pair<uint64_t, uint32_t>> rankedCandidates;
+    /// @brief slice of the shortlisted keyframes scored before a deadline check
+    std::vector<uint32_t>           slice;
+    /// @brief coarse scores of the candidates
+    ScoredKeyframes                 coarseScores;
+    /// @brief coarse feature of the query
+    std::vector<std::pair<uint32_t, float>> coarseFeature;
+    /// @brief scored keyframes of the query, of the last slice and merge buffer
+    ScoredKeyframes                 distKeyframes;
+    ScoredKeyframes                 sliceKeyframes;
+    ScoredKeyframes                 mergedKeyframes;
+    /// @brief scored keyframes of each chunk of candidates and merge buffer of the chunks
+    std::vector<ScoredKeyframes>    chunkKeyframes;
+    ScoredKeyframes                 chunkMerged;
+    /// @brief scored candidates, their BoW features laid out for scoring and their on-disk segments
+    std::vector<uint32_t>           scoredCandidates;
+    std::vector<const SolARFBOWScoringBoW*> scoringBoWs;
+    std::vector<const SolARFBOWIndexSegment*> candidateSegments;
+    /// @brief query BoW feature laid out for scoring
+    SolARFBOWScoringBoW             queryBoW;
+    /// @brief keyframe BoW feature laid out on the fly by a scoring worker
+    SolARFBOWScoringBoW             keyframeBoW;
+
+private:
+    std::vector<int>                m_votes;
+    std::vector<uint32_t>           m_votedKeyframes;
+    bool                            m_isSorted = true;
+};
+
+}
+}
+}
+
+#endif // SOLARFBOWQUERYSCRATCH_H
@@ -0,0 +1,96 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SOLARFBOWQUERYSESSION_H
+#define SOLARFBOWQUERYSESSION_H
+
+#include "SolARFBOWAPI.h"
+#include "datastructure/KeyframeRetrieval.h"
+#include <map>
+
+namespace SolAR {
+namespace MODULES {
+namespace FBOW {
+
+class SolARKeyframeRetrieverFBOW;
+
+/**
+ * @class SolARFBOWQuerySession
+ * @brief <B>State of a streaming query over consecutive frames.</B>
+ *
+ * The session holds the BoW features of the previous frame, the number of level nodes shared with each candidate keyframe
+ * and the accumulated score terms of the scored candidates. A new frame of the session only traverses the posting lists of
+ * its added and removed level nodes and applies the weight deltas of its changed words to the accumulated scores.
+ * BoW weights are normalized, so adding or removing a few descriptors rescales the weights of all the words. For the
+ * metrics with a query scale (L2, Bhattacharyya and dot product), the session keeps the word weights up to a scale which
+ * is applied when the scores are finalized, and only the words whose weight changed otherwise count as changed words.
+ * Keyframes added, suppressed or moved to another partition since the previous frame are replayed from the change log of
+ * the retriever: their votes are counted again over the level nodes of the previous frame and they are scored again.
+ * A full query is run when the ratio of changed words is above maxDelta, every refreshPeriod frames to bound
+ * rounding drift, or when the change log does not cover the changes since the previous frame (e.g. after a new
+ * retrieval model or vocabulary is installed).
+ */
+class SOLARFBOW_EXPORT_API SolARFBOWQuerySession
+{
+public:
+    /// @param[in] maxDelta: ratio of changed words of a frame above which a full query is run
+    /// @param[in] refreshPeriod: number of incremental queries between two full queries (0 for no periodic refresh)
+    SolARFBOWQuerySession(float maxDelta = 0.5f, uint32_t refreshPeriod = 30) : m_maxDelta(maxDelta), m_refreshPeriod(refreshPeriod) {}
+    ~SolARFBOWQuerySession() = default;
+
+    /// @brief Forget the previous frame, the next query of the session is a full query
+    void reset();
+
+    /// @brief Get the number of full queries run by the session
+    uint32_t getNbFullQueries() const { return m_nbFullQueries; }
+
+    /// @brief Get the number of incremental queries run by the session
+    uint32_t getNbIncrementalQueries() const { return m_nbIncrementalQueries; }
+
+private:
+    friend class SolARKeyframeRetrieverFBOW;
+
+    struct Candidate {
+        /// @brief number of level nodes shared with the current frame
+        int votes = 0;
+        /// @brief true if the BoW feature and the score terms of the keyframe are cached
+        bool isScored = false;
+        datastructure::BoWFeature bowFeature;
+        /// @brief sum of the score terms of the shared words with the unscaled weights of the session, plus the keyframe base term
+        double sum = 0.;
+    };
+
+    float                                   m_maxDelta;
+    uint32_t                                m_refreshPeriod;
+    bool                                    m_isValid = false;
+    /// @brief sequence number of the last change of the retrieval model seen by the session
+    uint64_t                                m_modelSequence = 0;
+    uint64_t                                m_partitionMask = 0;
+    uint32_t                                m_nbQueriesSinceRefresh = 0;
+    uint32_t                                m_nbFullQueries = 0;
+    uint32_t                                m_nbIncrementalQueries = 0;
+    /// @brief word weights of the previous frame, divided by m_queryScale
+    datastructure::BoWFeature               m_bowFeature;
+    double                                  m_queryScale = 1.;
+    datastructure::BoWLevelFeature          m_bowLevelFeature;
+    std::map<uint32_t, Candidate>           m_candidates;
+};
+
+}
+}
+}
+
+#endif // SOLARFBOWQUERYSESSION_H
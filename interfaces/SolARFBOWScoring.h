@@ -0,0 +1,180 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SOLARFBOWSCORING_H
+#define SOLARFBOWSCORING_H
+
+#include "SolARFBOWAPI.h"
+#include "SolARFBOWHelper.h"
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+namespace SolAR {
+namespace MODULES {
+namespace FBOW {
+
+/**
+ * @struct SolARFBOWScoringBoW
+ * @brief <B>BoW feature laid out for scoring, with the metric transforms of its weights precomputed.</B>
+ */
+struct SolARFBOWScoringBoW {
+    /// @brief sorted word ids
+    std::vector<uint32_t> words;
+    /// @brief weights of the words
+    std::vector<float> weights;
+    /// @brief metric transforms of the weights (empty if the metric has none)
+    std::vector<float> terms;
+    /// @brief part of the score depending only on this BoW feature
+    double base = 0.;
+};
+
+/**
+ * @struct SolARFBOWMetric
+ * @brief <B>Score of a keyframe BoW v against a query BoW w, split into terms of their shared words.</B>
+ *
+ * score = finalize(base(v) + sum of term(v_i, w_i) over shared words i), where the transforms of v_i and w_i used by
+ * term are computed once per BoW feature.
+ */
+template<ScoringType T> struct SolARFBOWMetric;
+
+template<> struct SolARFBOWMetric<ScoringType::L2_NORM> {
+    static constexpr bool HAS_TERMS = false;
+    static float keyframeTerm(float) { return 0.f; }
+    static float queryTerm(float) { return 0.f; }
+    static double keyframeBase(float) { return 0.; }
+    static double term(float v, float, float w, float) { return v * w; }
+    // ||v - w||_{L2} = sqrt( 2 - 2 * Sum(v_i * w_i) ) (Nister, 2006)
+    static double finalize(double sum) { return (sum >= 1) ? 1.0 : 1.0 - sqrt(1.0 - sum); }
+};
+
+template<> struct SolARFBOWMetric<ScoringType::L1_NORM> {
+    static constexpr bool HAS_TERMS = false;
+    static float keyframeTerm(float) { return 0.f; }
+    static float queryTerm(float) { return 0.f; }
+    static double keyframeBase(float) { return 0.; }
+    static double term(float v, float, float w, float) { return fabs(v - w) - fabs(v) - fabs(w); }
+    // scaled_||v - w||_{L1} = 1 - 0.5 * ||v - w||_{L1}
+    static double finalize(double sum) { return -sum / 2.0; }
+};
+
+template<> struct SolARFBOWMetric<ScoringType::CHI_SQUARE> {
+    static constexpr bool HAS_TERMS = false;
+    static float keyframeTerm(float) { return 0.f; }
+    static float queryTerm(float) { return 0.f; }
+    static double keyframeBase(float) { return 0.; }
+    static double term(float v, float, float w, float) { return (v + w != 0.0) ? v * w / (v + w) : 0.; }
+    static double finalize(double sum) { return 2. * sum; }
+};
+
+template<> struct SolARFBOWMetric<ScoringType::BHATTACHARYYA> {
+    static constexpr bool HAS_TERMS = true;
+    static float keyframeTerm(float v) { return sqrt(v); }
+    static float queryTerm(float w) { return sqrt(w); }
+    static double keyframeBase(float) { return 0.; }
+    // sqrt(v * w) = sqrt(v) * sqrt(w)
+    static double term(float, float vt, float, float wt) { return vt * wt; }
+    static double finalize(double sum) { return sum; }
+};
+
+template<> struct SolARFBOWMetric<ScoringType::DOT_PRODUCT> {
+    static constexpr bool HAS_TERMS = false;
+    static float keyframeTerm(float) { return 0.f; }
+    static float queryTerm(float) { return 0.f; }
+    static double keyframeBase(float) { return 0.; }
+    static double term(float v, float, float w, float) { return v * w; }
+    static double finalize(double sum) { return sum; }
+};
+
+template<> struct SolARFBOWMetric<ScoringType::KLS> {
+    static constexpr bool HAS_TERMS = true;
+    static float keyframeTerm(float) { return 0.f; }
+    static float queryTerm(float w) { return (w != 0) ? log(w) : log(DBL_EPSILON); }
+    // a keyframe word missing from the query scores v * (log(v) - log(eps))
+    static double keyframeBase(float v) { return (v != 0) ? v * (log(v) - log(DBL_EPSILON)) : 0.; }
+    // v * log(v / w) replaces the missing word score of a shared word
+    static double term(float v, float, float, float wt) { return v * (log(DBL_EPSILON) - wt); }
+    static double finalize(double sum) { return sum; }
+};
+
+/**
+ * @class SolARFBOWScoring
+ * @brief <B>Scores BoW features with a metric chosen at compile time.</B>
+ */
+class SOLARFBOW_EXPORT_API SolARFBOWScoring
+{
+public:
+    /// @brief Lay out a BoW feature for scoring with a metric
+    /// @param[in] bowFeature: the BoW feature, a BoWFeature or (word id, weight) pairs sorted by word id
+    /// @param[in] isQuery: true for the BoW feature of a query, false for the BoW feature of a keyframe
+    /// @param[out] scoringBoW: the BoW feature laid out for scoring
+    template<ScoringType T, typename BoW>
+    static void prepare(const BoW& bowFeature, bool isQuery, SolARFBOWScoringBoW& scoringBoW)
+    {
+        typedef SolARFBOWMetric<T> Metric;
+        scoringBoW.words.clear();
+        scoringBoW.weights.clear();
+        scoringBoW.terms.clear();
+        scoringBoW.base = 0.;
+        scoringBoW.words.reserve(bowFeature.size());
+        scoringBoW.weights.reserve(bowFeature.size());
+        if (Metric::HAS_TERMS)
+            scoringBoW.terms.reserve(bowFeature.size());
+        for (const auto& it : bowFeature) {
+            scoringBoW.words.push_back(it.first);
+            scoringBoW.weights.push_back(it.second);
+            if (Metric::HAS_TERMS)
+                scoringBoW.terms.push_back(isQuery ? Metric::queryTerm(it.second) : Metric::keyframeTerm(it.second));
+            if (!isQuery)
+                scoringBoW.base += Metric::keyframeBase(it.second);
+        }
+    }
+
+    /// @brief Lay out a BoW feature for scoring with a metric chosen at run time
+    static void prepare(ScoringType type, const datastructure::BoWFeature& bowFeature, bool isQuery, SolARFBOWScoringBoW& scoringBoW);
+
+    /// @brief Score a keyframe BoW feature against a query BoW feature, both laid out for the metric
+    template<ScoringType T>
+    static double score(const SolARFBOWScoringBoW& kfBoW, const SolARFBOWScoringBoW& queryBoW)
+    {
+        typedef SolARFBOWMetric<T> Metric;
+        const uint32_t* kfWords = kfBoW.words.data();
+        const uint32_t* queryWords = queryBoW.words.data();
+        const size_t kfSize = kfBoW.words.size();
+        const size_t querySize = queryBoW.words.size();
+        double sum = kfBoW.base;
+        size_t i = 0, j = 0;
+        while ((i < kfSize) && (j < querySize)) {
+            if (kfWords[i] == queryWords[j]) {
+                sum += Metric::term(kfBoW.weights[i], Metric::HAS_TERMS ? kfBoW.terms[i] : 0.f,
+                                    queryBoW.weights[j], Metric::HAS_TERMS ? queryBoW.terms[j] : 0.f);
+                ++i;
+                ++j;
+            }
+            else if (kfWords[i] < queryWords[j])
+                ++i;
+            else
+                ++j;
+        }
+        return Metric::finalize(sum);
+    }
+};
+
+}
+}
+}
+
+#endif // SOLARFBOWSCORING_H
@@ -0,0 +1,86 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SOLARFBOWTHREADPOOL_H
+#define SOLARFBOWTHREADPOOL_H
+
+#include "SolARFBOWAPI.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace SolAR {
+namespace MODULES {
+namespace FBOW {
+
+/**
+ * @class SolARFBOWThreadPool
+ * @brief <B>Fixed set of worker threads used to run independent tasks in parallel.</B>
+ *
+ * The calling thread takes part in the work. If the pool is already running tasks for another caller,
+ * the tasks are run on the calling thread only.
+ */
+class SOLARFBOW_EXPORT_API SolARFBOWThreadPool
+{
+public:
+    /// @brief Create the pool
+    /// @param[in] nbThreads: total number of threads including the calling thread (0 to use the number of hardware threads)
+    explicit SolARFBOWThreadPool(uint32_t nbThreads = 0);
+    ~SolARFBOWThreadPool();
+
+    SolARFBOWThreadPool(const SolARFBOWThreadPool&) = delete;
+    SolARFBOWThreadPool& operator=(const SolARFBOWThreadPool&) = delete;
+
+    /// @brief Get the total number of threads including the calling thread
+    uint32_t getNbThreads() const { return static_cast<uint32_t>(m_workers.size()) + 1; }
+
+    /// @brief Run task(0) ... task(nbTasks - 1) in parallel and wait for their completion
+    /// @param[in] nbTasks: number of tasks
+    /// @param[in] task: the task to run, called with the task index. It must not throw.
+    void parallelFor(size_t nbTasks, const std::function<void(size_t)>& task);
+
+private:
+    struct Job {
+        const std::function<void(size_t)>* task = nullptr;
+        size_t nbTasks = 0;
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+    };
+
+    void workerLoop();
+    void runJob(Job& job);
+
+private:
+    std::vector<std::thread>    m_workers;
+    std::mutex                  m_mutex;
+    std::condition_variable     m_jobCondition;
+    std::condition_variable     m_doneCondition;
+    std::shared_ptr<Job>        m_job;
+    uint64_t                    m_generation = 0;
+    bool                        m_stop = false;
+    /// @brief held by the caller whose tasks are run by the workers
+    std::mutex                  m_callerMutex;
+};
+
+}
+}
+}
+
+#endif // SOLARFBOWTHREADPOOL_H
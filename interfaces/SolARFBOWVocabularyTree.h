@@ -0,0 +1,349 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SOLARFBOWVOCABULARYTREE_H
+#define SOLARFBOWVOCABULARYTREE_H
+
+#include "SolARFBOWAPI.h"
+#include "fbow.h"
+#include "core/Messages.h"
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace SolAR {
+namespace MODULES {
+namespace FBOW {
+
+/**
+ * @struct SolARFBOWFlatBoW
+ * @brief <B>BoW feature and BoW level feature of a query laid out in flat buffers.</B>
+ *
+ * Buffers are cleared but never shrunk, so that a query transformed into an instance kept across queries
+ * does not allocate once its buffers have grown to the size of the largest query.
+ */
+struct SolARFBOWFlatBoW
+{
+    /// @brief (word id, weight) sorted by word id, L2 normalized
+    std::vector<std::pair<uint32_t, float>> words;
+    /// @brief (node id, end of its rows in rows) sorted by node id
+    std::vector<std::pair<uint32_t, uint32_t>> nodes;
+    /// @brief rows of the descriptors assigned to each node, in ascending order per node
+    std::vector<uint32_t> rows;
+    /// @brief work buffers of the transform: (word id << 32 | row, weight), (node id << 32 | row) and prepared descriptor
+    std::vector<std::pair<uint64_t, float>> wordEntries;
+    std::vector<uint64_t> nodeEntries;
+    std::vector<uint8_t> prepared;
+
+    void clear() { words.clear(); nodes.clear(); rows.clear(); wordEntries.clear(); nodeEntries.clear(); }
+    /// @brief begin of the rows of the i-th node in rows
+    uint32_t getRowsBegin(size_t i) const { return i == 0 ? 0 : nodes[i - 1].second; }
+    /// @brief memory in bytes held by the buffers
+    uint64_t getMemory() const {
+        return words.capacity() * sizeof(std::pair<uint32_t, float>) + nodes.capacity() * sizeof(std::pair<uint32_t, uint32_t>) +
+               rows.capacity() * sizeof(uint32_t) + wordEntries.capacity() * sizeof(std::pair<uint64_t, float>) +
+               nodeEntries.capacity() * sizeof(uint64_t) + prepared.capacity();
+    }
+};
+
+/**
+ * @class SolARFBOWVocabularyTree
+ * @brief <B>Editable copy of a fbow vocabulary tree.</B>
+ *
+ * The tree is stored with the same binary layout as fbow::Vocabulary (a set of blocks, each block holding the
+ * centroids and node information of the children of one node), so that it can be read from a .fbow file,
+ * modified and loaded back into a fbow::Vocabulary.
+ */
+class SOLARFBOW_EXPORT_API SolARFBOWVocabularyTree
+{
+public:
+    /// @brief quantization of the centroids and descriptors of a float vocabulary
+    enum class Quantization {
+        NONE = 0,
+        UINT8 = 1,
+        INT16 = 2
+    };
+
+    /// @brief cpu kernel used to search the tree
+    enum class Kernel {
+        GENERIC = 0,
+        SSE42 = 1,
+        AVX2 = 2,
+        AVX512 = 3
+    };
+
+    SolARFBOWVocabularyTree() = default;
+    ~SolARFBOWVocabularyTree() = default;
+    SolARFBOWVocabularyTree(const SolARFBOWVocabularyTree&) = default;
+    SolARFBOWVocabularyTree& operator=(const SolARFBOWVocabularyTree&) = default;
+    /// @brief trees are moved without copying their blocks, e.g. when a vocabulary is swapped
+    SolARFBOWVocabularyTree(SolARFBOWVocabularyTree&&) = default;
+    SolARFBOWVocabularyTree& operator=(SolARFBOWVocabularyTree&&) = default;
+
+    /// @brief Load the tree from a .fbow file
+    /// @param[in] file: path to the vocabulary file
+    /// @return FrameworkReturnCode::_SUCCESS if the loading succeed, else FrameworkReturnCode::_ERROR_
+    FrameworkReturnCode readFromFile(const std::string& file);
+
+    /// @brief Save the tree to a .fbow file
+    /// @param[in] file: path to the vocabulary file
+    /// @return FrameworkReturnCode::_SUCCESS if the saving succeed, else FrameworkReturnCode::_ERROR_
+    FrameworkReturnCode saveToFile(const std::string& file) const;
+
+    /// @brief Read the tree from a stream written by fbow::Vocabulary::toStream
+    FrameworkReturnCode fromStream(std::istream& str);
+
+    /// @brief Write the tree to a stream readable by fbow::Vocabulary::fromStream
+    FrameworkReturnCode toStream(std::ostream& str) const;
+
+    /// @brief Copy the tree of a fbow vocabulary
+    FrameworkReturnCode fromVocabulary(const fbow::Vocabulary& voc);
+
+    /// @brief Load the tree into a fbow vocabulary
+    FrameworkReturnCode toVocabulary(fbow::Vocabulary& voc) const;
+
+    /// @brief Compact the tree according to word usage statistics.
+    /// Blocks of leaves whose total usage is lower than minOccupancy are collapsed into their parent node, and
+    /// leaves whose usage is lower than minOccupancy are pruned (at least one leaf is kept per block).
+    /// Remaining blocks are reordered breadth-first. Ids of the remaining words are not modified.
+    /// @param[in] wordUsage: number of occurrences of each word (missing words are considered unused)
+    /// @param[in] minOccupancy: occupancy threshold below which words are removed
+    /// @param[in] protectedLevels: number of top levels of the tree which are left untouched
+    /// @param[out] wordRemap: for each removed word, the id of the word which replaces it
+    /// @return the number of removed words
+    uint32_t compact(const std::map<uint32_t, uint32_t>& wordUsage, uint32_t minOccupancy, uint32_t protectedLevels,
+                     std::map<uint32_t, uint32_t>& wordRemap);
+
+    /// @brief Reorder the blocks of the tree breadth-first
+    void reorderBreadthFirst();
+
+    /// @brief Reorder the blocks of the tree for cache-friendly traversals, without changing node and word ids.
+    /// Blocks of the top levels are stored breadth-first, and each subtree below them is stored contiguously
+    /// (depth-first). Blocks and centroids are padded so that no centroid straddles a cache line.
+    /// @param[in] nbTopLevels: number of levels stored breadth-first
+    void optimizeLayout(uint32_t nbTopLevels);
+
+    /// @brief Check if the tree is valid
+    bool isValid() const { return m_params.nbBlocks > 0; }
+
+    /// @brief Map the nodes reported at a level by transform to their ancestor at a coarser level
+    /// @param[in] level: the level of the BoW level feature
+    /// @param[in] ancestorLevel: the coarser level
+    /// @param[out] ancestors: for each node id at level, the node id of its ancestor at ancestorLevel
+    void getLevelNodeAncestors(uint32_t level, uint32_t ancestorLevel, std::map<uint32_t, uint32_t>& ancestors) const;
+
+    /// @brief Get the centroids of the nodes reported at a level by transform. The root has no centroid.
+    /// @param[in] level: the level of the BoW level feature
+    /// @param[out] centroids: for each node id at level, its centroid in the original descriptor format
+    void getLevelNodeCentroids(uint32_t level, std::map<uint32_t, std::vector<uint8_t>>& centroids) const;
+
+    /// @brief Get the type of the descriptors (CV_8UC1 or CV_32FC1)
+    int getDescType() const { return m_params.descType; }
+
+    /// @brief Get the size in bytes of the descriptors
+    int getDescSize() const { return m_params.descSize; }
+
+    /// @brief Get the number of blocks (internal nodes) of the tree
+    uint32_t getNbBlocks() const { return m_params.nbBlocks; }
+
+    /// @brief Get the number of words (leaves) of the tree
+    uint32_t getNbWords() const;
+
+    /// @brief Get the size in bytes of the tree data
+    uint64_t getDataSize() const { return m_params.totalSize; }
+
+    /// @brief Get the memory in bytes held by the tree, including quantized centroids
+    uint64_t getMemorySize() const { return m_data.capacity() + m_quantizedFeatures.capacity(); }
+
+    /// @brief Set the quantization used to search the tree. Centroids of a float vocabulary are quantized
+    /// once, and descriptors are quantized with the same parameters before being compared to them.
+    /// @param[in] quantization: the quantization type (only Quantization::NONE for binary vocabularies)
+    /// @return FrameworkReturnCode::_SUCCESS if the quantization succeed, else FrameworkReturnCode::_ERROR_
+    FrameworkReturnCode setQuantization(Quantization quantization);
+
+    /// @brief Get the quantization used to search the tree
+    Quantization getQuantization() const { return m_quantization; }
+
+    /// @brief Get the most specialized kernel supported by the cpu
+    static Kernel getBestKernel();
+
+    /// @brief Check if a kernel is supported by the cpu
+    static bool isKernelSupported(Kernel kernel);
+
+    /// @brief Get the name of a kernel ("generic", "sse4.2", "avx2" or "avx512")
+    static std::string getKernelName(Kernel kernel);
+
+    /// @brief Set the cpu kernel used to search the tree. By default the best kernel supported by the cpu is used.
+    /// All kernels give the same word assignments: integer distances are exact and float distances are
+    /// accumulated in the same order by all kernels.
+    /// @param[in] kernel: the kernel to use
+    /// @return FrameworkReturnCode::_SUCCESS if the kernel is supported by the cpu, else FrameworkReturnCode::_ERROR_
+    FrameworkReturnCode setKernel(Kernel kernel);
+
+    /// @brief Get the cpu kernel used to search the tree
+    Kernel getKernel() const { return m_kernel; }
+
+    /// @brief Get the size in bytes of a descriptor prepared for the search
+    uint32_t getSearchDescriptorSize() const { return m_searchDescSize; }
+
+    /// @brief Prepare descriptors for the search (quantization of float descriptors if enabled)
+    /// @param[in] descriptors: descriptors stored as rows
+    /// @param[out] prepared: prepared descriptors, getSearchDescriptorSize() bytes each
+    void prepareDescriptors(const cv::Mat& descriptors, std::vector<uint8_t>& prepared) const;
+
+    /// @brief Prepare a subset of descriptors for the search
+    /// @param[in] descriptors: descriptors stored as rows
+    /// @param[in] rows: indices of the rows to prepare
+    /// @param[out] prepared: prepared descriptors in the order of rows, getSearchDescriptorSize() bytes each
+    void prepareDescriptors(const cv::Mat& descriptors, const std::vector<int>& rows, std::vector<uint8_t>& prepared) const;
+
+    /// @brief Distance between two prepared descriptors, in the unit of the original descriptors
+    /// (L2 distance for float descriptors, hamming distance for binary descriptors)
+    float distance(const uint8_t* descriptor1, const uint8_t* descriptor2) const;
+
+    /// @brief Transform descriptors stored as rows into a BoW feature and a BoW level feature.
+    /// Nodes of the BoW level feature are identified by the parent id stored in their block.
+    /// @param[in] features: descriptors stored as rows
+    /// @param[in] level: the level of the BoW level feature
+    /// @param[out] bow: the BoW feature (L2 normalized)
+    /// @param[out] bow2: the indices of the descriptors assigned to each node at the given level
+    void transform(const cv::Mat& features, int level, fbow::fBow& bow, fbow::fBow2& bow2) const;
+
+    /// @brief Transform a subset of the rows of a descriptor matrix, without copying them.
+    /// The BoW level feature holds the indices of the rows in features.
+    /// @param[in] features: descriptors stored as rows
+    /// @param[in] rows: indices of the rows to transform
+    /// @param[in] level: the level of the BoW level feature
+    /// @param[out] bow: the BoW feature (L2 normalized)
+    /// @param[out] bow2: the row indices assigned to each node at the given level
+    void transform(const cv::Mat& features, const std::vector<int>& rows, int level, fbow::fBow& bow, fbow::fBow2& bow2) const;
+
+    /// @brief Transform descriptors stored as rows into flat buffers, without allocating once they have grown.
+    /// Words and weights are the same as the ones of the transform into fbow maps.
+    /// @param[in] features: descriptors stored as rows
+    /// @param[in] level: the level of the BoW level feature
+    /// @param[out] bow: the BoW feature and BoW level feature
+    void transform(const cv::Mat& features, int level, SolARFBOWFlatBoW& bow) const;
+
+    /// @brief Transform descriptors stored as rows into a BoW feature
+    void transform(const cv::Mat& features, fbow::fBow& bow) const;
+
+    /// @brief Get the node at a given level of a prepared descriptor
+    /// @param[in] descriptor: a descriptor prepared by prepareDescriptors
+    /// @param[in] level: the level of the node
+    /// @return the id of the node
+    uint32_t transform(const uint8_t* descriptor, int level) const;
+
+    /// @brief Read word usage statistics (one "wordId count" pair per line)
+    static FrameworkReturnCode readWordUsage(const std::string& file, std::map<uint32_t, uint32_t>& wordUsage);
+
+    /// @brief Write word usage statistics (one "wordId count" pair per line)
+    static FrameworkReturnCode writeWordUsage(const std::string& file, const std::map<uint32_t, uint32_t>& wordUsage);
+
+    /// @brief Read a word remap table (one "oldId newId" pair per line)
+    static FrameworkReturnCode readWordRemap(const std::string& file, std::map<uint32_t, uint32_t>& wordRemap);
+
+    /// @brief Write a word remap table (one "oldId newId" pair per line)
+    static FrameworkReturnCode writeWordRemap(const std::string& file, const std::map<uint32_t, uint32_t>& wordRemap);
+
+private:
+    /// @brief allocator of cache line aligned buffers
+    template<typename T>
+    struct CacheLineAllocator {
+        typedef T value_type;
+        static const std::size_t ALIGNMENT = 64;
+        CacheLineAllocator() = default;
+        template<typename U> CacheLineAllocator(const CacheLineAllocator<U>&) {}
+        T* allocate(std::size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(ALIGNMENT))); }
+        void deallocate(T* p, std::size_t) { ::operator delete(p, std::align_val_t(ALIGNMENT)); }
+        template<typename U> bool operator==(const CacheLineAllocator<U>&) const { return true; }
+        template<typename U> bool operator!=(const CacheLineAllocator<U>&) const { return false; }
+    };
+    typedef std::vector<char, CacheLineAllocator<char>> BlockData;
+
+    /// @brief parameters of the vocabulary, same layout as the ones serialized by fbow::Vocabulary
+    struct Params {
+        char descName[50] = "";
+        uint32_t alignment = 0, nbBlocks = 0;
+        uint64_t descSizeBytesWp = 0;
+        uint64_t blockSizeBytesWp = 0;
+        uint64_t featureOffStart = 0;
+        uint64_t childOffStart = 0;
+        uint64_t totalSize = 0;
+        int32_t descType = 0, descSize = 0;
+        uint32_t k = 0;
+    };
+
+    /// @brief information about a node, same layout as in fbow blocks. The msb of idOrChildBlock is set for leaves.
+    struct NodeInfo {
+        uint32_t idOrChildBlock;
+        float weight;
+        bool isLeaf() const { return (idOrChildBlock & 0x80000000) != 0; }
+        uint32_t getId() const { return idOrChildBlock & 0x7FFFFFFF; }
+        uint32_t getChildBlock() const { return idOrChildBlock; }
+        void setId(uint32_t id) { idOrChildBlock = id | 0x80000000; }
+    };
+
+    char* getBlock(uint32_t b) { return m_data.data() + b * m_params.blockSizeBytesWp; }
+    const char* getBlock(uint32_t b) const { return m_data.data() + b * m_params.blockSizeBytesWp; }
+    uint16_t getN(uint32_t b) const;
+    void setN(uint32_t b, uint16_t n);
+    NodeInfo* getNodeInfo(uint32_t b, uint32_t i);
+    const NodeInfo* getNodeInfo(uint32_t b, uint32_t i) const;
+    char* getFeature(uint32_t b, uint32_t i);
+    const char* getFeature(uint32_t b, uint32_t i) const;
+    double featureDistance(const char* f1, const char* f2) const;
+    uint32_t getParentId(uint32_t b) const;
+    const uint8_t* getSearchFeature(uint32_t b, uint32_t i) const;
+    void prepareDescriptor(const uint8_t* descriptor, uint8_t* prepared) const;
+    void transformRows(const cv::Mat& features, const int* rows, size_t nbRows, int level, fbow::fBow& bow, fbow::fBow2& bow2) const;
+    void findWord(const uint8_t* descriptor, uint32_t level, uint32_t& wordId, float& weight, uint32_t& levelNode) const;
+    void updateSearchKernel();
+    void reorderBlocks(const std::vector<uint32_t>& order, const Params& params);
+
+    /// @brief function returning the index of the nearest of n features stored every stride bytes
+    typedef uint32_t (*NearestFeatureFunction)(const uint8_t* descriptor, const uint8_t* features, uint64_t stride, uint32_t n, uint32_t size);
+
+private:
+    Params              m_params;
+    BlockData           m_data;
+
+    /// @brief quantization used to search the tree
+    Quantization            m_quantization = Quantization::NONE;
+    /// @brief quantized centroids, m_searchDescSize bytes per node slot
+    std::vector<uint8_t, CacheLineAllocator<uint8_t>> m_quantizedFeatures;
+    /// @brief size in bytes of a descriptor used for the search
+    uint32_t                m_searchDescSize = 0;
+    /// @brief number of elements of a quantized descriptor (including zero padding)
+    uint32_t                m_quantizedDim = 0;
+    /// @brief quantization parameters: q = clamp(round((v - offset) * scale))
+    float                   m_quantizationOffset = 0.f;
+    float                   m_quantizationScale = 1.f;
+
+    /// @brief cpu kernel used to search the tree
+    Kernel                  m_kernel = getBestKernel();
+    /// @brief search function of the kernel and its parameters
+    NearestFeatureFunction  m_nearestFeature = nullptr;
+    uint32_t                m_nearestFeatureSize = 0;
+    uint64_t                m_featureStride = 0;
+};
+
+}
+}
+}
+
+#endif // SOLARFBOWVOCABULARYTREE_H
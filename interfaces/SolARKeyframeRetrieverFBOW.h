@@ -20,9 +20,27 @@
 #include "SolARFBOWAPI.h"
 #include "xpcf/component/ConfigurableBase.h"
 #include <vector>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <set>
 #include <fstream>
+#include <functional>
+#include <chrono>
 #include <core/SerializationDefinitions.h>
 #include "fbow.h"
+#include "SolARFBOWVocabularyTree.h"
+#include "SolARFBOWThreadPool.h"
+#include "SolARFBOWKeyframeSpill.h"
+#include "SolARFBOWIndexSegment.h"
+#include "SolARFBOWHammingEmbedding.h"
+#include "SolARFBOWQuerySession.h"
+#include "SolARFBOWScoring.h"
 
 namespace SolAR {
 namespace MODULES {
@@ -46,8 +64,100 @@ namespace FBOW {
  * @SolARComponentProperty{ matchingDistanceMax,
  *                          distance max used to keep good matches,
  *                          @SolARComponentPropertyDescNum{ float, [0..MAX FLOAT], 100.f }}
+ * @SolARComponentProperty{ compactionUsagePath,
+ *                          path to word usage statistics used to compact the vocabulary at loading (no compaction if empty),
+ *                          @SolARComponentPropertyDescString{ "" }}
+ * @SolARComponentProperty{ compactionMinOccupancy,
+ *                          occupancy below which words are removed when compacting the vocabulary,
+ *                          @SolARComponentPropertyDescNum{ int, [0..MAX INT], 1 }}
+ * @SolARComponentProperty{ wordRemapPath,
+ *                          path to the word remap table of a compacted vocabulary which is applied to BoW features of indexes built with the original vocabulary,
+ *                          @SolARComponentPropertyDescString{ "" }}
+ * @SolARComponentProperty{ layoutTopLevels,
+ *                          number of top levels stored breadth-first by the cache-friendly layout pass applied at load time (0 to keep the layout of the vocabulary file),
+ *                          @SolARComponentPropertyDescNum{ int, [0..MAX INT], 0 }}
+ * @SolARComponentProperty{ descriptorQuantization,
+ *                          quantization of float descriptors and centroids used for tree traversal and matching ("none" "uint8" or "int16"),
+ *                          @SolARComponentPropertyDescString{ "none" }}
+ * @SolARComponentProperty{ transformBackend,
+ *                          vocabulary transform backend ("fbow" or "cpu" for the cpu dispatched kernels of the module on binary or quantized vocabularies),
+ *                          @SolARComponentPropertyDescString{ "fbow" }}
+ * @SolARComponentProperty{ transformKernel,
+ *                          kernel of the cpu backend ("auto" "generic" "sse4.2" "avx2" or "avx512"),
+ *                          @SolARComponentPropertyDescString{ "auto" }}
+ * @SolARComponentProperty{ nbThreads,
+ *                          number of threads used to compute BoW features of several keyframes (0 to use all hardware threads),
+ *                          @SolARComponentPropertyDescNum{ int, [0..MAX INT], 0 }}
+ * @SolARComponentProperty{ parallelScoringMinCandidates,
+ *                          number of candidate keyframes of a query above which they are scored in parallel,
+ *                          @SolARComponentPropertyDescNum{ int, [0..MAX INT], 1000 }}
+ * @SolARComponentProperty{ coarseLevel,
+ *                          level of the node histograms used to shortlist candidates before the leaf-level scoring (0 to disable the coarse stage),
+ *                          @SolARComponentPropertyDescNum{ int, [0..MAX INT], 0 }}
+ * @SolARComponentProperty{ coarseShortlistSize,
+ *                          maximum number of candidates kept by the coarse stage,
+ *                          @SolARComponentPropertyDescNum{ int, [1..MAX INT], 100 }}
+ * @SolARComponentProperty{ coarseMinScoreRatio,
+ *                          minimum coarse score of a shortlisted candidate relative to the best coarse score,
+ *                          @SolARComponentPropertyDescNum{ float, [0..1], 0.3f }}
+ * @SolARComponentProperty{ signatureThreshold,
+ *                          maximum Hamming distance between the 64-bit residual signatures of two descriptors for a shared node to vote for a candidate (0 to vote on shared nodes only),
+ *                          @SolARComponentPropertyDescNum{ int, [0..64], 0 }}
+ * @SolARComponentProperty{ asyncIndexing,
+ *                          if 1 addKeyframe queues the keyframe and returns at once while a worker thread indexes it,
+ *                          @SolARComponentPropertyDescNum{ int, [0..1], 0 }}
+ * @SolARComponentProperty{ indexingQueueSize,
+ *                          maximal number of queued keyframes in asynchronous indexing mode (addKeyframe waits when the queue is full),
+ *                          @SolARComponentPropertyDescNum{ int, [1..MAX INT], 64 }}
+ * @SolARComponentProperty{ memoryBudget,
+ *                          memory budget in MB of the indexed BoW features (0 for no budget). Least recently retrieved keyframes are spilled to disk beyond it,
+ *                          @SolARComponentPropertyDescNum{ int, [0..MAX INT], 0 }}
+ * @SolARComponentProperty{ spillPath,
+ *                          path to the file where keyframes evicted from memory are spilled,
+ *                          @SolARComponentPropertyDescString{ "keyframeRetrievalFBOW.spill" }}
+ * @SolARComponentProperty{ segmentPath,
+ *                          path prefix of the immutable on-disk index segments (segments are disabled if empty),
+ *                          @SolARComponentPropertyDescString{ "" }}
+ * @SolARComponentProperty{ segmentMaxKeyframes,
+ *                          number of keyframes of the in-memory segment above which it is written to disk,
+ *                          @SolARComponentPropertyDescNum{ int, [1..MAX INT], 1000 }}
+ * @SolARComponentProperty{ segmentMergeFactor,
+ *                          number of on-disk segments above which they are merged in background,
+ *                          @SolARComponentPropertyDescNum{ int, [1..MAX INT], 4 }}
+ * @SolARComponentProperty{ tombstoneRatio,
+ *                          fraction of suppressed keyframes above which they are physically removed from the posting lists,
+ *                          @SolARComponentPropertyDescNum{ float, [0..1], 0.2f }}
+ * @SolARComponentProperty{ tombstoneCompactionBatch,
+ *                          maximum number of suppressed keyframes physically removed per indexing or suppression call,
+ *                          @SolARComponentPropertyDescNum{ int, [1..MAX INT], 100 }}
+ * @SolARComponentProperty{ duplicateThreshold,
+ *                          score above which a keyframe to add is a near-duplicate of an indexed keyframe of its partition (0 to disable the check),
+ *                          @SolARComponentPropertyDescNum{ float, [0..MAX FLOAT], 0.f }}
+ * @SolARComponentProperty{ duplicateNeighbours,
+ *                          number of indexed keyframes sharing the most level nodes with a keyframe to add which are scored by the near-duplicate check,
+ *                          @SolARComponentPropertyDescNum{ int, [1..MAX INT], 5 }}
+ * @SolARComponentProperty{ duplicatePolicy,
+ *                          "reject" to reject near-duplicate keyframes or "merge" to record them as merged into the indexed keyframe,
+ *                          @SolARComponentPropertyDescString{ "reject" }}
  * @SolARComponentPropertiesEnd
  *
+ * When a memory budget is set, spilled keyframes are removed from the keyframe retrieval model returned by
+ * getConstKeyframeRetrieval and loaded back when a query or a match needs them.
+ * When index segments are enabled, the keyframe retrieval model is the in-memory segment: once it holds
+ * segmentMaxKeyframes keyframes they are moved to an immutable memory-mapped segment file, and a background thread
+ * merges segment files and applies deletions. Queries are run on all segments.
+ * Suppressed keyframes are only marked as deleted and filtered out by queries. They are physically removed from the
+ * keyframe retrieval model by batches of tombstoneCompactionBatch keyframes once their fraction exceeds tombstoneRatio.
+ * Residual signatures are computed when keyframes are indexed and are not saved: keyframes of a loaded model vote on
+ * shared nodes only until they are re-indexed.
+ * Near-duplicate keyframes are checked against the in-memory keyframe retrieval model before being indexed. A rejected
+ * keyframe makes addKeyframe return FrameworkReturnCode::_STOP, a merged keyframe is not indexed and its retrieval is
+ * delegated to the indexed keyframe (see getMergedKeyframe). In asynchronous indexing mode a rejected keyframe is logged
+ * and recorded with its near-duplicate (see getRejectedKeyframe).
+ * A vocabulary swap builds a shadow retrieval model with the new vocabulary while queries and insertions keep using the
+ * current one. Queries are only blocked while the shadow model replaces the current one. Word remap and compaction
+ * apply to the vocabulary loaded by onConfigured only.
+ *
  */
 
 class SOLARFBOW_EXPORT_API SolARKeyframeRetrieverFBOW : public org::bcom::xpcf::ConfigurableBase,
@@ -60,17 +170,95 @@ public:
     org::bcom::xpcf::XPCFErrorCode onConfigured() override final;
     void unloadComponent () override final;
 
-	/// @brief Add a keyframe to the retrieval model
+	/// @brief Add a keyframe to the retrieval model.
+	/// In asynchronous indexing mode, the keyframe is queued and will be visible to retrieve once indexed (see flush)
 	/// @param[in] keyframe: the keyframe to add to the retrieval model
 	/// @param[in] useMatchedDescriptor: if true bow feature will be computed merely from descriptors which are matched to other frames, by default is set to false meaning that all descriptors will be used
-	/// @return FrameworkReturnCode::_SUCCESS if the keyfram adding succeed, else FrameworkReturnCode::_ERROR_
+	/// @return FrameworkReturnCode::_SUCCESS if the keyfram adding succeed, FrameworkReturnCode::_STOP if it is rejected as a near-duplicate, else FrameworkReturnCode::_ERROR_
     FrameworkReturnCode addKeyframe(const SRef<datastructure::Keyframe> keyframe, bool useMatchedDescriptor=false) override;
 
+	/// @brief Add a keyframe to a partition of the retrieval model (e.g. a floor or a session of a multi-map retriever)
+	/// @param[in] keyframe: the keyframe to add to the retrieval model
+	/// @param[in] useMatchedDescriptor: if true bow feature will be computed merely from descriptors which are matched to other frames
+	/// @param[in] partition: the partition of the keyframe, lower than MAX_PARTITIONS
+	/// @return FrameworkReturnCode::_SUCCESS if the keyfram adding succeed, else FrameworkReturnCode::_ERROR_
+	FrameworkReturnCode addKeyframe(const SRef<datastructure::Keyframe> keyframe, bool useMatchedDescriptor, uint32_t partition);
+
+	/// @brief Add a set of keyframes to the retrieval model.
+	/// BoW features are computed in parallel, then all keyframes are inserted under a single lock of the retrieval model.
+	/// @param[in] keyframes: the keyframes to add to the retrieval model
+	/// @param[in] useMatchedDescriptor: if true bow features will be computed merely from descriptors which are matched to other frames
+	/// @param[in] partition: the partition of the keyframes, lower than MAX_PARTITIONS
+	/// @return FrameworkReturnCode::_SUCCESS if all keyframes are added or merged, FrameworkReturnCode::_STOP if near-duplicates are rejected, else FrameworkReturnCode::_ERROR_
+    FrameworkReturnCode addKeyframes(const std::vector<SRef<datastructure::Keyframe>>& keyframes, bool useMatchedDescriptor = false, uint32_t partition = 0);
+
+	/// @brief number of partitions of the retrieval model
+	static const uint32_t MAX_PARTITIONS = 64;
+	/// @brief partition mask selecting all partitions
+	static const uint64_t ALL_PARTITIONS = ~uint64_t(0);
+
+	/// @brief Set the partition of a keyframe, e.g. for the keyframes of a loaded retrieval model (partition 0 by default)
+	/// @param[in] keyframe_id: the keyframe id
+	/// @param[in] partition: the partition, lower than MAX_PARTITIONS
+	/// @return FrameworkReturnCode::_SUCCESS if the partition is valid, else FrameworkReturnCode::_ERROR_
+	FrameworkReturnCode setKeyframePartition(uint32_t keyframe_id, uint32_t partition);
+
+	/// @brief Get the partition of a keyframe
+	uint32_t getKeyframePartition(uint32_t keyframe_id) const;
+
+	/// @brief Get the indexed keyframe into which a near-duplicate keyframe was merged
+	/// @param[in] keyframe_id: the merged keyframe
+	/// @param[out] indexedKeyframe_id: the indexed keyframe
+	/// @return FrameworkReturnCode::_SUCCESS if the keyframe was merged, else FrameworkReturnCode::_ERROR_
+	FrameworkReturnCode getMergedKeyframe(uint32_t keyframe_id, uint32_t& indexedKeyframe_id) const;
+
+	/// @brief Get the indexed keyframe of which a keyframe was rejected as a near-duplicate, e.g. in asynchronous indexing mode
+	/// @param[in] keyframe_id: the rejected keyframe
+	/// @param[out] indexedKeyframe_id: the indexed keyframe
+	/// @return FrameworkReturnCode::_SUCCESS if the keyframe was rejected, else FrameworkReturnCode::_ERROR_
+	FrameworkReturnCode getRejectedKeyframe(uint32_t keyframe_id, uint32_t& indexedKeyframe_id) const;
+
 	/// @brief Suppress a keyframe from the retrieval model
 	/// @param[in] keyframe_id: the keyframe to supress from the retrieval model
 	/// @return FrameworkReturnCode::_SUCCESS if the keyfram adding succeed, else FrameworkReturnCode::_ERROR_
 	FrameworkReturnCode suppressKeyframe(uint32_t keyframe_id) override;
 
+	/// @brief Suppress a set of keyframes from the retrieval model
+	/// @param[in] keyframes_id: the keyframes to supress from the retrieval model
+	/// @return FrameworkReturnCode::_SUCCESS if all keyframes are suppressed, else FrameworkReturnCode::_ERROR_
+	FrameworkReturnCode suppressKeyframes(const std::vector<uint32_t>& keyframes_id);
+
+	/// @brief Rebuild the retrieval model from stored keyframes, e.g. after a change of the vocabulary or of the level.
+	/// Keyframes are transformed in parallel with the current vocabulary into a shadow retrieval model, which replaces
+	/// the current one once complete. Retrieval keeps using the current model until then, and keyframes added or
+	/// suppressed during the build are applied to the shadow model before it replaces the current one.
+	/// @param[in] keyframes: the keyframes of the new retrieval model
+	/// @param[in] level: level of the BoW level features, or -1 to keep the current level (which loadFromFile reads from the archive)
+	/// @param[in] useMatchedDescriptor: if true bow features are computed merely from descriptors which are matched to other frames
+	/// @return FrameworkReturnCode::_SUCCESS if all keyframes are indexed, else FrameworkReturnCode::_ERROR_
+	FrameworkReturnCode reindex(const std::vector<SRef<datastructure::Keyframe>>& keyframes, int level = -1, bool useMatchedDescriptor = false);
+
+	/// @brief Replace the vocabulary without interrupting the service.
+	/// The new vocabulary is loaded and prepared like the current one, then keyframes are transformed in parallel into
+	/// a shadow retrieval model. Queries and insertions keep using the current vocabulary meanwhile, and keyframes added
+	/// or suppressed during the build are applied to the shadow model before it replaces the current one.
+	/// @param[in] vocabularyPath: path to the new vocabulary, with the descriptor type and size of the current one
+	/// @param[in] keyframes: the keyframes of the new retrieval model
+	/// @param[in] useMatchedDescriptor: if true bow features are computed merely from descriptors which are matched to other frames
+	/// @return FrameworkReturnCode::_SUCCESS if all keyframes are indexed with the new vocabulary, else FrameworkReturnCode::_ERROR_ (the vocabulary is kept if it cannot be loaded)
+	FrameworkReturnCode swapVocabulary(const std::string& vocabularyPath, const std::vector<SRef<datastructure::Keyframe>>& keyframes, bool useMatchedDescriptor = false);
+
+	/// @brief Run swapVocabulary on a background thread
+	/// @return FrameworkReturnCode::_SUCCESS if the swap is started, else FrameworkReturnCode::_ERROR_ if the previous swap was not waited for
+	FrameworkReturnCode startVocabularySwap(const std::string& vocabularyPath, const std::vector<SRef<datastructure::Keyframe>>& keyframes, bool useMatchedDescriptor = false);
+
+	/// @brief Wait for the end of the swap started by startVocabularySwap
+	/// @return the result of swapVocabulary, FrameworkReturnCode::_ERROR_ if no swap was started
+	FrameworkReturnCode waitVocabularySwap();
+
+	/// @brief true while a vocabulary swap is building its shadow retrieval model
+	bool isSwappingVocabulary() const;
+
 
 	/// @brief Retrieve a set of keyframes close to the frame pass in input.
 	/// @param[in] frame: the frame for which we want to retrieve close keyframes.
@@ -78,6 +266,63 @@ public:
 	/// @return FrameworkReturnCode::_SUCCESS if the retrieve succeed, else FrameworkReturnCode::_ERROR_
     FrameworkReturnCode retrieve(const SRef<datastructure::Frame> frame, std::vector<uint32_t> &retKeyframes_id) override;
 
+	/// @brief Retrieve a set of keyframes of some partitions close to the frame pass in input.
+	/// Keyframes of other partitions are skipped while the posting lists are traversed.
+	/// @param[in] frame: the frame for which we want to retrieve close keyframes.
+	/// @param[in] partitionMask: bit i is set if keyframes of partition i can be retrieved
+	/// @param[out] retKeyframes_id: a set of keyframe ids which are close to the frame pass in input
+	/// @return FrameworkReturnCode::_SUCCESS if the retrieve succeed, else FrameworkReturnCode::_ERROR_
+	FrameworkReturnCode retrieve(const SRef<datastructure::Frame> frame, uint64_t partitionMask, std::vector<uint32_t> &retKeyframes_id);
+
+	/// @brief filter of the keyframes which can be retrieved, given as a bitmap over keyframe ids
+	struct KeyframeFilter {
+		/// @brief false to retrieve only the keyframes of the bitmap, true to retrieve all keyframes but them
+		bool exclude = false;
+		std::vector<bool> bits;
+		void set(uint32_t id) { if (id >= bits.size()) bits.resize(id + 1, false); bits[id] = true; }
+		bool accept(uint32_t id) const { return ((id < bits.size()) && bits[id]) != exclude; }
+	};
+
+	/// @brief Retrieve a set of keyframes close to the frame pass in input among the keyframes accepted by a filter.
+	/// The filter is applied while the posting lists are traversed, e.g. to exclude recent keyframes from a loop closure query.
+	/// @param[in] frame: the frame for which we want to retrieve close keyframes.
+	/// @param[in] filter: the include or exclude bitmap of keyframe ids
+	/// @param[out] retKeyframes_id: a set of keyframe ids which are close to the frame pass in input
+	/// @param[in] partitionMask: bit i is set if keyframes of partition i can be retrieved
+	/// @return FrameworkReturnCode::_SUCCESS if the retrieve succeed, else FrameworkReturnCode::_ERROR_
+	FrameworkReturnCode retrieve(const SRef<datastructure::Frame> frame, const KeyframeFilter& filter, std::vector<uint32_t> &retKeyframes_id,
+								 uint64_t partitionMask = ALL_PARTITIONS);
+
+	/// @brief budget of a bounded retrieve (0 for no bound)
+	struct RetrieveBudget {
+		/// @brief time budget in milliseconds, measured from the call to retrieve
+		double timeBudget = 0.;
+		/// @brief maximal number of candidates whose BoW features are scored
+		uint32_t maxCandidates = 0;
+	};
+
+	/// @brief Retrieve a set of keyframes close to the frame pass in input within a time budget or a number of scored candidates.
+	/// Candidates are scored in descending order of shared words and the best-so-far keyframes are returned when the budget runs out.
+	/// @param[in] frame: the frame for which we want to retrieve close keyframes.
+	/// @param[in] budget: the time budget and maximal number of scored candidates
+	/// @param[out] retKeyframes_id: a set of keyframe ids which are close to the frame pass in input
+	/// @param[out] complete: false if the budget ran out before all candidates were scored
+	/// @param[in] partitionMask: bit i is set if keyframes of partition i can be retrieved
+	/// @param[in] filter: the include or exclude bitmap of keyframe ids (nullptr for no filter)
+	/// @return FrameworkReturnCode::_SUCCESS if the retrieve succeed, else FrameworkReturnCode::_ERROR_
+	FrameworkReturnCode retrieve(const SRef<datastructure::Frame> frame, const RetrieveBudget& budget, std::vector<uint32_t> &retKeyframes_id,
+								 bool& complete, uint64_t partitionMask = ALL_PARTITIONS, const KeyframeFilter* filter = nullptr);
+
+	/// @brief Retrieve a set of keyframes close to the BoW features of a frame, computed with the vocabulary and at the level of the retriever.
+	/// Without the descriptors of the frame, residual signatures are not checked.
+	/// @param[in] bowFeature: the BoW feature of the frame
+	/// @param[in] bowLevelFeature: the BoW level feature of the frame
+	/// @param[out] retKeyframes_id: a set of keyframe ids which are close to the frame
+	/// @param[in] partitionMask: bit i is set if keyframes of partition i can be retrieved
+	/// @return FrameworkReturnCode::_SUCCESS if the retrieve succeed, else FrameworkReturnCode::_ERROR_
+	FrameworkReturnCode retrieve(const datastructure::BoWFeature& bowFeature, const datastructure::BoWLevelFeature& bowLevelFeature,
+								 std::vector<uint32_t> &retKeyframes_id, uint64_t partitionMask = ALL_PARTITIONS);
+
 	/// @brief Retrieve a set of keyframes close to the frame pass in input.
 	/// @param[in] frame: the frame for which we want to retrieve close keyframes.
 	/// @param[in] canKeyframes_id: a set includes id of keyframe candidates
@@ -85,6 +330,34 @@ public:
 	/// @return FrameworkReturnCode::_SUCCESS if the retrieve succeed, else FrameworkReturnCode::_ERROR_
     FrameworkReturnCode retrieve(const SRef<datastructure::Frame> frame, const std::set<unsigned int> & canKeyframes_id, std::vector<uint32_t> & retKeyframes_id) override;
 
+	/// @brief Retrieve a set of keyframes close to a frame of a streaming query session (e.g. consecutive video frames).
+	/// Only the posting lists of the level nodes and the score terms of the words which changed since the previous frame
+	/// of the session are processed. Residual signatures, on-disk segments and spilled keyframes are not handled
+	/// incrementally, the session then runs full queries.
+	/// @param[in] frame: the frame for which we want to retrieve close keyframes.
+	/// @param[in,out] session: the query session of the frame
+	/// @param[out] retKeyframes_id: a set of keyframe ids which are close to the frame pass in input
+	/// @param[in] partitionMask: bit i is set if keyframes of partition i can be retrieved
+	/// @return FrameworkReturnCode::_SUCCESS if the retrieve succeed, else FrameworkReturnCode::_ERROR_
+	FrameworkReturnCode retrieve(const SRef<datastructure::Frame> frame, SolARFBOWQuerySession& session, std::vector<uint32_t> &retKeyframes_id,
+								 uint64_t partitionMask = ALL_PARTITIONS);
+
+	/// @brief Retrieve keyframes close to a frame and match them with the frame.
+	/// The frame is quantized once: its BoW level feature guides the matching of the retrieved keyframes, which are
+	/// matched by decreasing score until nbKeyframes of them have at least minMatches matches.
+	/// @param[in] frame: the frame for which we want to retrieve close keyframes.
+	/// @param[in] nbKeyframes: maximum number of keyframes to return
+	/// @param[in] minMatches: minimum number of matches of a returned keyframe
+	/// @param[in] getKeyframe: function returning the keyframe of an id (e.g. from a keyframes manager), or nullptr if unknown
+	/// @param[out] retKeyframes_id: the verified keyframes sorted by decreasing retrieval score
+	/// @param[out] matches: the matches between the frame and each returned keyframe
+	/// @param[in] partitionMask: bit i is set if keyframes of partition i can be retrieved
+	/// @return FrameworkReturnCode::_SUCCESS if at least one keyframe is returned, else FrameworkReturnCode::_ERROR_
+	FrameworkReturnCode retrieveAndMatch(const SRef<datastructure::Frame> frame, uint32_t nbKeyframes, uint32_t minMatches,
+										 const std::function<SRef<datastructure::Keyframe>(uint32_t)>& getKeyframe,
+										 std::vector<uint32_t>& retKeyframes_id, std::vector<std::vector<datastructure::DescriptorMatch>>& matches,
+										 uint64_t partitionMask = ALL_PARTITIONS);
+
 	/// @brief This method allows to save the keyframe feature to the external file
 	/// @param[in] the file name
 	/// @return FrameworkReturnCode::_SUCCESS_ if the suppression succeed, else FrameworkReturnCode::_ERROR.
@@ -126,7 +399,384 @@ public:
     /// @brief This method is to reset keyframe retrieval contents 
     void resetKeyframeRetrieval() override;
 
+    /// @brief Get the sequence number of the last keyframe queued in asynchronous indexing mode
+    /// @return the sequence number (0 if no keyframe has been queued)
+    uint64_t getQueuedSequence() const;
+
+    /// @brief Get the sequence number of the last keyframe indexed in asynchronous indexing mode
+    /// @return the sequence number (0 if no keyframe has been indexed)
+    uint64_t getIndexedSequence() const;
+
+    /// @brief Wait until the keyframe queued with a given sequence number and all previous ones are visible to retrieve
+    /// @param[in] sequence: the sequence number returned by getQueuedSequence
+    void waitIndexed(uint64_t sequence) const;
+
+    /// @brief Wait until all queued keyframes are visible to retrieve
+    void flush() const;
+
+    /// @brief Get the number of keyframes added to the retrieval model in which each word of the vocabulary appears
+    /// @param[out] wordUsage: number of keyframes for each word id
+    void getWordUsage(std::map<uint32_t, uint32_t>& wordUsage) const;
+
+    /// @brief Save the word usage statistics of the indexed keyframes, to be used for vocabulary compaction
+    /// @param[in] file: the file name
+    /// @return FrameworkReturnCode::_SUCCESS if the saving succeed, else FrameworkReturnCode::_ERROR_
+    FrameworkReturnCode saveWordUsage(const std::string& file) const;
+
+    /// @brief Get the kernel used to transform descriptors into BoW features
+    /// @return "fbow" if fbow::Vocabulary is used, else the name of the cpu kernel of the module
+    std::string getTransformKernel() const;
+
+    /// @brief memory held by the retriever in bytes, estimated from the sizes of its containers
+    struct MemoryStats {
+        /// @brief number of keyframes of the in-memory keyframe retrieval model
+        uint64_t nbKeyframes = 0;
+        /// @brief BoW features of the keyframes
+        uint64_t bowFeatures = 0;
+        /// @brief BoW level features of the keyframes (direct index from nodes to descriptors)
+        uint64_t bowLevelFeatures = 0;
+        /// @brief entries of the inverted index
+        uint64_t invertedIndex = 0;
+        /// @brief vocabulary and its search copy
+        uint64_t vocabulary = 0;
+        /// @brief coarse node histograms
+        uint64_t coarseFeatures = 0;
+        /// @brief residual signatures
+        uint64_t signatures = 0;
+        /// @brief BoW features laid out for scoring
+        uint64_t scoringFeatures = 0;
+        /// @brief new vocabulary and shadow retrieval model of a running vocabulary swap
+        uint64_t vocabularySwap = 0;
+        uint64_t getTotal() const { return bowFeatures + bowLevelFeatures + invertedIndex + vocabulary + coarseFeatures + signatures + scoringFeatures + vocabularySwap; }
+    };
+
+    /// @brief Get the memory held by the retriever. Keyframe structures are accounted incrementally on insertion and removal.
+    /// @param[out] stats: the memory stats
+    void getMemoryStats(MemoryStats& stats) const;
+
+    /// @brief Get the memory held by the keyframe retrieval model for a keyframe
+    /// @param[in] keyframe_id: the keyframe id
+    /// @return the memory in bytes, 0 if the keyframe is not in the in-memory model
+    uint64_t getKeyframeMemory(uint32_t keyframe_id) const;
+
 private:
+	/// @brief Compute the BoW feature and the BoW level feature of a keyframe
+	/// @param[in] keyframe: the keyframe
+	/// @param[in] useMatchedDescriptor: if true bow feature is computed merely from descriptors which are matched to other frames
+	/// @param[in] level: level of the nodes of the BoW level feature
+	/// @param[out] bowFeature: the BoW feature
+	/// @param[out] bowLevelFeature: the BoW level feature
+	void computeBoW(const SRef<datastructure::Keyframe> keyframe, bool useMatchedDescriptor, int level,
+					datastructure::BoWFeature& bowFeature, datastructure::BoWLevelFeature& bowLevelFeature);
+
+	/// @brief Compute the BoW feature and the BoW level feature of a keyframe with a given vocabulary
+	static void computeBoW(fbow::Vocabulary& voc, const SolARFBOWVocabularyTree& vocTree, bool useVOCTree,
+						   const SRef<datastructure::Keyframe> keyframe, bool useMatchedDescriptor, int level,
+						   datastructure::BoWFeature& bowFeature, datastructure::BoWLevelFeature& bowLevelFeature);
+
+	/// @brief Apply the layout, quantization and transform backend properties to a loaded vocabulary
+	/// @param[in,out] voc: the vocabulary
+	/// @param[out] vocTree: the search copy of the vocabulary
+	/// @param[out] useVOCTree: true if vocTree is used instead of voc
+	FrameworkReturnCode prepareVocabulary(fbow::Vocabulary& voc, SolARFBOWVocabularyTree& vocTree, bool& useVOCTree) const;
+
+	/// @brief Compute the memory of a vocabulary and the ids of its internal nodes
+	static FrameworkReturnCode computeVocabularyMemory(const fbow::Vocabulary& voc, const SolARFBOWVocabularyTree& vocTree, bool useVOCTree,
+													   uint64_t& memory, std::vector<uint32_t>& nodes);
+
+	/// @brief features of a keyframe of the shadow retrieval model built by a vocabulary swap or a re-indexing
+	struct SwapKeyframe {
+		datastructure::BoWFeature bowFeature;
+		datastructure::BoWLevelFeature bowLevelFeature;
+		SolARFBOWHammingEmbedding::Signatures signatures;
+	};
+
+	/// @brief Build a shadow retrieval model of keyframes by increasing id, then apply the keyframes added or suppressed during the build
+	/// @param[in] level: level of the BoW level features of the shadow retrieval model
+	/// @param[out] keyframeRetrieval: the shadow retrieval model
+	/// @param[out] swapKeyframes: the features of the keyframes of the shadow retrieval model
+	/// @return FrameworkReturnCode::_SUCCESS if all keyframes are added, else FrameworkReturnCode::_ERROR_
+	FrameworkReturnCode buildShadowModel(const std::vector<SRef<datastructure::Keyframe>>& keyframes, bool useMatchedDescriptor, fbow::Vocabulary& voc,
+										 const SolARFBOWVocabularyTree& vocTree, bool useVOCTree, int level, const SolARFBOWHammingEmbedding& embedding,
+										 SRef<datastructure::KeyframeRetrieval>& keyframeRetrieval, std::map<uint32_t, SwapKeyframe>& swapKeyframes);
+
+	/// @brief Apply the keyframes added or suppressed since the previous call to the shadow retrieval model
+	/// @param[in] last: if true, keyframes are not recorded anymore
+	/// @param[in] level: level of the BoW level features of the shadow retrieval model
+	FrameworkReturnCode applySwapKeyframes(bool last, fbow::Vocabulary& voc, const SolARFBOWVocabularyTree& vocTree, bool useVOCTree, int level,
+										   const SolARFBOWHammingEmbedding& embedding, datastructure::KeyframeRetrieval& keyframeRetrieval,
+										   std::map<uint32_t, SwapKeyframe>& swapKeyframes);
+
+	/// @brief Record keyframes added to the current retrieval model during a vocabulary swap or a re-indexing
+	void recordSwapAddition(const std::vector<SRef<datastructure::Keyframe>>& keyframes, bool useMatchedDescriptor);
+
+	/// @brief Record keyframes suppressed from the current retrieval model during a vocabulary swap or a re-indexing
+	void recordSwapSuppression(const std::vector<uint32_t>& keyframes_id);
+
+	/// @brief Replace the keyframe retrieval model without waiting for queued keyframes.
+	/// m_vocabularyMutex and m_modelMutex must be locked exclusively, and the segment thread stopped.
+	void installKeyframeRetrieval(const SRef<datastructure::KeyframeRetrieval> keyframeRetrieval);
+
+	/// @brief Install the shadow retrieval model of a vocabulary swap or a re-indexing, keeping the partitions and the merged and rejected keyframes.
+	/// m_vocabularyMutex and m_modelMutex must be locked exclusively, and the segment thread stopped.
+	void installShadowModel(const SRef<datastructure::KeyframeRetrieval> keyframeRetrieval, std::map<uint32_t, SwapKeyframe>& swapKeyframes,
+							int level, std::map<uint32_t, uint32_t>& coarseAncestors, SolARFBOWHammingEmbedding& hammingEmbedding);
+
+	/// @brief Add a keyframe to the retrieval model on the calling thread
+	FrameworkReturnCode indexKeyframe(const SRef<datastructure::Keyframe> keyframe, bool useMatchedDescriptor);
+
+	/// @brief Index the queued keyframes until the component is destroyed
+	void indexingLoop();
+
+	/// @brief Stop the indexing thread once the queued keyframes are indexed
+	void stopIndexing();
+
+	/// @brief Estimate the memory used by the keyframe retrieval model to store the BoW features of a keyframe
+	static uint64_t estimateMemory(const datastructure::BoWFeature& bowFeature, const datastructure::BoWLevelFeature& bowLevelFeature);
+
+	/// @brief memory used by the keyframe retrieval model for the BoW features of a keyframe
+	struct KeyframeMemory {
+		uint64_t bowFeature = 0;
+		uint64_t bowLevelFeature = 0;
+		uint64_t invertedIndex = 0;
+	};
+
+	/// @brief Estimate the memory used by each structure of the keyframe retrieval model for a keyframe
+	static KeyframeMemory estimateKeyframeMemory(const datastructure::BoWFeature& bowFeature, const datastructure::BoWLevelFeature& bowLevelFeature);
+
+	/// @brief Account a keyframe added to the keyframe retrieval model
+	void accountKeyframe(uint32_t keyframe_id, const datastructure::BoWFeature& bowFeature, const datastructure::BoWLevelFeature& bowLevelFeature) const;
+
+	/// @brief Account a keyframe removed from the keyframe retrieval model
+	void unaccountKeyframe(uint32_t keyframe_id) const;
+
+	/// @brief Account all keyframes of a keyframe retrieval model which has been loaded or set
+	void rebuildMemoryAccounting() const;
+
+	/// @brief Load spilled keyframes back into the keyframe retrieval model. m_modelMutex must not be locked.
+	void loadSpilledKeyframes(const std::vector<uint32_t>& keyframes_id) const;
+
+	/// @brief Mark keyframes as recently retrieved, then spill keyframes beyond the memory budget. m_modelMutex must not be locked.
+	void touchKeyframes(const std::vector<uint32_t>& keyframes_id) const;
+
+	/// @brief Forget resident and spilled keyframes
+	void clearSpill() const;
+
+	/// @brief Track the memory of a resident keyframe. m_spillMutex must be locked.
+	void trackKeyframe(uint32_t keyframe_id, uint64_t memory) const;
+
+	/// @brief Stop tracking the memory of a keyframe. m_spillMutex must be locked.
+	void untrackKeyframe(uint32_t keyframe_id) const;
+
+	/// @brief Spill least recently retrieved keyframes until the memory budget is met. m_modelMutex must be locked exclusively,
+	/// then the keyframe retrieval model and m_spillMutex.
+	void enforceMemoryBudget() const;
+
+	/// @brief Immutable set of on-disk segments with the deletions not yet applied to them
+	struct SegmentSet {
+		/// @brief segments sorted from the newest to the oldest
+		std::vector<std::shared_ptr<SolARFBOWIndexSegment>> segments;
+		/// @brief suppressed keyframes and the newest segment generation in which they are deleted
+		std::map<uint32_t, uint64_t> tombstones;
+		bool isDeleted(uint32_t id, uint64_t generation) const;
+		/// @brief Find the newest segment holding a keyframe which is not deleted
+		const SolARFBOWIndexSegment* find(uint32_t id) const;
+	};
+
+	/// @brief Get the current set of on-disk segments
+	std::shared_ptr<const SegmentSet> getSegmentSet() const;
+
+	/// @brief Get the BoW feature of a keyframe from the in-memory or the on-disk segments. m_modelMutex must be locked.
+	FrameworkReturnCode getKeyframeBoWFeature(uint32_t keyframe_id, datastructure::BoWFeature& bowFeature) const;
+
+	/// @brief Get the BoW level feature of a keyframe from the in-memory or the on-disk segments. m_modelMutex must be locked.
+	FrameworkReturnCode getKeyframeBoWLevelFeature(uint32_t keyframe_id, datastructure::BoWLevelFeature& bowLevelFeature) const;
+
+	/// @brief Register keyframes added to the in-memory segment
+	void addToMemorySegment(const std::vector<uint32_t>& keyframes_id);
+
+	/// @brief Write the keyframes of the in-memory segment to a new on-disk segment
+	void flushMemorySegment();
+
+	/// @brief Merge all on-disk segments and apply deletions
+	void mergeSegments();
+
+	/// @brief Flush and merge segments until the component is destroyed
+	void segmentLoop();
+
+	/// @brief Stop the segment thread, keeping the segments
+	void stopSegments();
+
+	/// @brief Stop the segment thread and remove all segments
+	void clearSegments();
+
+	/// @brief Remove all segments and restart the segment thread if segments are enabled
+	void restartSegments();
+
+	/// @brief Get a new segment file name
+	std::string getSegmentFileName();
+
+	/// @brief Keyframes suppressed from the keyframe retrieval model but not yet removed from its posting lists
+	struct KeyframeTombstones {
+		std::vector<bool> bits;
+		uint32_t count = 0;
+		bool test(uint32_t id) const { return (id < bits.size()) && bits[id]; }
+		void set(uint32_t id);
+		void reset(uint32_t id);
+	};
+
+	/// @brief Get the current tombstones of the keyframe retrieval model
+	std::shared_ptr<const KeyframeTombstones> getKeyframeTombstones() const;
+
+	/// @brief Suppress a keyframe from all tiers. Keyframes of the keyframe retrieval model are marked in tombstones.
+	/// m_modelMutex must be locked.
+	FrameworkReturnCode removeKeyframe(uint32_t keyframe_id, KeyframeTombstones& tombstones);
+
+	/// @brief Physically remove tombstoned keyframes which are added again. m_modelMutex must be locked exclusively.
+	void purgeTombstones(const std::vector<uint32_t>& keyframes_id);
+
+	/// @brief Physically remove a batch of tombstoned keyframes if their fraction exceeds the tombstone ratio.
+	/// m_modelMutex must not be locked.
+	/// @param[in] all: remove all tombstoned keyframes
+	void compactTombstones(bool all = false) const;
+
+	/// @brief Clear tombstones without removing keyframes
+	void clearTombstones() const;
+
+	/// @brief Retrieve keyframes of some partitions accepted by a filter (if any) close to a query from its BoW feature and
+	/// BoW level feature laid out in flat buffers, and its residual signatures. The budget is counted from startTime and complete
+	/// is set to false if it runs out. Apart from the posting lists copied by the framework, nothing is allocated once the
+	/// buffers of the thread have grown.
+	FrameworkReturnCode retrieveFromBoW(const SolARFBOWFlatBoW& queryBoW, const SolARFBOWHammingEmbedding::Signatures& signatures, uint64_t partitionMask, const KeyframeFilter* filter,
+										const RetrieveBudget& budget, std::chrono::steady_clock::time_point startTime,
+										std::vector<uint32_t>& retKeyframes_id, bool& complete);
+
+	/// @brief Remove all keyframe partitions
+	void clearPartitions();
+
+	/// @brief Get the partition of a keyframe, m_partitionsMutex being locked by the caller
+	uint32_t findKeyframePartition(uint32_t keyframe_id) const;
+
+	/// @brief Log a change of a keyframe of the retrieval model, replayed by the query sessions
+	void recordModelChange(uint32_t keyframe_id) const;
+
+	/// @brief Log a change of the whole retrieval model, after which query sessions run a full query
+	void recordModelReset() const;
+
+	/// @brief Get the keyframes changed since a sequence number
+	/// @param[in] sequence: sequence number of the last change seen by a query session
+	/// @param[out] keyframes_id: the changed keyframes, sorted by id
+	/// @param[out] lastSequence: sequence number of the last change
+	/// @return true if the log holds all the changes since sequence, false if a full query is needed
+	bool getModelChanges(uint64_t sequence, std::vector<uint32_t>& keyframes_id, uint64_t& lastSequence) const;
+
+	/// @brief Find an indexed keyframe of a partition which is a near-duplicate of a keyframe to add. m_modelMutex must be locked
+	/// @return true if a near-duplicate is found
+	bool findDuplicateKeyframe(const datastructure::BoWFeature& bowFeature, const datastructure::BoWLevelFeature& bowLevelFeature,
+							   uint32_t partition, uint32_t& duplicate_id) const;
+
+	/// @brief Apply the near-duplicate policy to a keyframe to add, under the exclusive lock of m_modelMutex which inserts it
+	/// @return FrameworkReturnCode::_SUCCESS if the keyframe must be indexed, FrameworkReturnCode::_STOP if it is a near-duplicate
+	FrameworkReturnCode checkDuplicateKeyframe(uint32_t keyframe_id, const datastructure::BoWFeature& bowFeature,
+											   const datastructure::BoWLevelFeature& bowLevelFeature);
+
+	/// @brief Forget all merged and rejected keyframes
+	void clearMergedKeyframes();
+
+	/// @brief Match query descriptors with a keyframe, guided by the BoW level feature of the query
+	/// @param[in] cvDescriptors: the query descriptors
+	/// @param[in] prepared: the query descriptors prepared by the vocabulary tree (if m_useVOCTree)
+	/// @param[in] bowLevelFeature: the BoW level feature of the query
+	/// @param[in] keyframe: keyframe to match
+	/// @param[out] matches: the matches sorted by query descriptor index
+	FrameworkReturnCode matchFromBoW(const cv::Mat& cvDescriptors, const std::vector<uint8_t>& prepared, const datastructure::BoWLevelFeature& bowLevelFeature,
+									 const SRef<datastructure::Keyframe>& keyframe, std::vector<datastructure::DescriptorMatch>& matches);
+
+	/// @brief Score candidate keyframes against a query BoW feature with the configured metric.
+	/// Candidates are scored in parallel above parallelScoringMinCandidates, under a shared lock of m_modelMutex. Suppressed keyframes are not scored.
+	/// @param[in] candidates: the candidate keyframes
+	/// @param[in] queryWords: the BoW feature of the query as (word id, weight) pairs sorted by word id
+	/// @param[out] distKeyframes: the keyframes whose score is above the threshold, sorted by decreasing score
+	void scoreKeyframes(const std::vector<uint32_t>& candidates, const std::vector<std::pair<uint32_t, float>>& queryWords,
+						std::vector<std::pair<uint32_t, double>>& distKeyframes) const;
+
+	/// @brief Score candidate keyframes as scoreKeyframes, m_modelMutex being locked by the caller
+	void scoreLockedKeyframes(const std::vector<uint32_t>& candidates, const std::vector<std::pair<uint32_t, float>>& queryWords,
+							  std::vector<std::pair<uint32_t, double>>& distKeyframes) const;
+
+	/// @brief Score candidate keyframes with a metric chosen at compile time
+	template<ScoringType T>
+	void scoreKeyframesWith(const std::vector<uint32_t>& candidates, const std::vector<std::pair<uint32_t, float>>& queryWords,
+							std::vector<std::pair<uint32_t, double>>& distKeyframes) const;
+
+	/// @brief Resolve the candidates to score and their BoW features laid out for scoring, under a single lock.
+	/// Suppressed keyframes are skipped. m_modelMutex must be locked: the layouts stay valid while it is held.
+	/// @param[in] candidates: the candidate keyframes
+	/// @param[in] segmentSet: the on-disk segments (nullptr without segments)
+	/// @param[out] scoredCandidates: the candidates which are not suppressed, in candidate order
+	/// @param[out] scoringBoWs: the layout of each scored candidate (nullptr for a keyframe out of memory)
+	/// @param[out] segments: the on-disk segment of each scored candidate out of memory
+	void resolveScoringBoWs(const std::vector<uint32_t>& candidates, const SegmentSet* segmentSet, std::vector<uint32_t>& scoredCandidates,
+							std::vector<const SolARFBOWScoringBoW*>& scoringBoWs, std::vector<const SolARFBOWIndexSegment*>& segments) const;
+
+	/// @brief normalized node histogram at the coarse level, sorted by node id
+	typedef std::vector<std::pair<uint32_t, float>> CoarseFeature;
+
+	/// @brief Compute the ancestors of the nodes of a level used by the coarse stage of retrieve
+	/// @param[in] level: level of the BoW level features
+	/// @param[out] coarseAncestors: the ancestor of each node of level
+	FrameworkReturnCode computeCoarseAncestors(int level, std::map<uint32_t, uint32_t>& coarseAncestors) const;
+	FrameworkReturnCode computeCoarseAncestors(const fbow::Vocabulary& voc, int level, std::map<uint32_t, uint32_t>& coarseAncestors) const;
+
+	/// @brief Compute the coarse node histogram of a BoW level feature
+	void computeCoarseFeature(const datastructure::BoWLevelFeature& bowLevelFeature, CoarseFeature& coarseFeature) const;
+	void computeCoarseFeature(const SolARFBOWFlatBoW& queryBoW, CoarseFeature& coarseFeature) const;
+
+	/// @brief Sum the node counts of each ancestor and normalize them, in place
+	static void mergeCoarseFeature(float nbDescriptors, CoarseFeature& coarseFeature);
+
+	/// @brief Histogram intersection of two coarse features
+	static double scoreCoarseFeatures(const CoarseFeature& coarseFeature1, const CoarseFeature& coarseFeature2);
+
+	/// @brief Store the coarse feature of an indexed keyframe
+	void addCoarseFeature(uint32_t keyframe_id, const datastructure::BoWLevelFeature& bowLevelFeature);
+
+	/// @brief Remove the coarse feature of a suppressed keyframe
+	void removeCoarseFeature(uint32_t keyframe_id);
+
+	/// @brief Remove all coarse features
+	void clearCoarseFeatures();
+
+	/// @brief Shortlist the candidates with the best coarse scores
+	/// @param[in] candidates: the candidate keyframes
+	/// @param[in] queryFeature: the coarse feature of the query
+	/// @param[out] shortlist: the shortlisted candidates
+	void selectCoarseCandidates(const std::vector<uint32_t>& candidates, const CoarseFeature& queryFeature,
+								std::vector<uint32_t>& shortlist) const;
+
+	/// @brief Prepare the Hamming embedding of the nodes of a level
+	/// @param[in] level: level of the BoW level features
+	/// @param[out] embedding: the embedding, left invalid if signatures are disabled
+	FrameworkReturnCode computeHammingEmbedding(int level, SolARFBOWHammingEmbedding& embedding) const;
+	FrameworkReturnCode computeHammingEmbedding(const fbow::Vocabulary& voc, int level, SolARFBOWHammingEmbedding& embedding) const;
+
+	/// @brief Compute the residual signatures of the descriptors of a keyframe
+	/// @param[in] keyframe: the keyframe
+	/// @param[in] embedding: the Hamming embedding of the level of bowLevelFeature
+	/// @param[in] bowLevelFeature: the BoW level feature of the keyframe
+	/// @param[out] signatures: the signatures, empty if signatures are disabled
+	void computeSignatures(const SRef<datastructure::Keyframe> keyframe, const SolARFBOWHammingEmbedding& embedding,
+						   const datastructure::BoWLevelFeature& bowLevelFeature, SolARFBOWHammingEmbedding::Signatures& signatures) const;
+
+	/// @brief Store the residual signatures of an indexed keyframe
+	void addSignatures(uint32_t keyframe_id, SolARFBOWHammingEmbedding::Signatures& signatures);
+
+	/// @brief Remove the residual signatures of a suppressed keyframe
+	void removeSignatures(uint32_t keyframe_id);
+
+	/// @brief Remove all residual signatures
+	void clearSignatures();
+
 	/// @brief Match a feature to a set of features
 	/// @param[in] feature1: a feature
 	/// @param[in] features2: a set of features
@@ -135,8 +785,23 @@ private:
 	/// @param[out] bestDist: the best corresponding distance
 	void findBestMatches(const cv::Mat &feature1, const cv::Mat &features2, std::vector<uint32_t> &idx, int &bestIdx, float &bestDist);
 
+	/// @brief Match a prepared feature to a set of prepared features of the vocabulary tree
+	/// @param[in] feature1: a prepared feature
+	/// @param[in] features2: prepared features, m_VOCTree.getSearchDescriptorSize() bytes each
+	/// @param[in] idx: a set of indices of used features2
+	/// @param[out] bestIdx: the best found index of features2 matched to feature1. (-1: not found)
+	/// @param[out] bestDist: the best corresponding distance
+	void findBestMatchesQuantized(const uint8_t* feature1, const std::vector<uint8_t>& features2, const std::vector<uint32_t> &idx, int &bestIdx, float &bestDist);
+
+	/// @brief Update the word usage statistics with the words of a BoW feature
+	/// @param[in] bowFeature: the BoW feature of an added or suppressed keyframe
+	/// @param[in] added: true if the keyframe is added, false if it is suppressed
+	void updateWordUsage(const datastructure::BoWFeature& bowFeature, bool added);
+
 private:
 	SRef<datastructure::KeyframeRetrieval> m_keyframeRetrieval;
+	/// @brief keyframe retrieval model, locked shared to read it and exclusively, with the lock of the model, to modify it
+	mutable std::shared_mutex m_modelMutex;
 
     /// @brief path to the vocabulary file
     std::string m_VOCPath   = "";
@@ -144,8 +809,8 @@ private:
     /// @brief the threshold above which keyframes are considered valid
     float m_threshold       = 0;
 
-    /// @brief a vocabulary of visual words
-    fbow::Vocabulary        m_VOC;	
+    /// @brief a vocabulary of visual words, replaced as a whole by a vocabulary swap
+    std::unique_ptr<fbow::Vocabulary> m_VOC = std::make_unique<fbow::Vocabulary>();
 
 	/// @brief level stored for BoW2
 	int	m_level				= 3;
@@ -158,6 +823,204 @@ private:
 
     /// @brief distance metric
     int m_distanceMetricId = 0;
+
+    /// @brief path to word usage statistics used to compact the vocabulary
+    std::string m_compactionUsagePath = "";
+
+    /// @brief occupancy below which words are removed when compacting the vocabulary
+    int m_compactionMinOccupancy = 1;
+
+    /// @brief path to the word remap table of a compacted vocabulary
+    std::string m_wordRemapPath = "";
+
+    /// @brief ids of words removed from the vocabulary and the ids of the words replacing them
+    std::map<uint32_t, uint32_t> m_wordRemap;
+
+    /// @brief number of indexed keyframes in which each word appears
+    std::map<uint32_t, uint32_t> m_wordUsage;
+    mutable std::mutex m_wordUsageMutex;
+
+    /// @brief number of top levels stored breadth-first by the layout pass (0 to disable it)
+    int m_layoutTopLevels = 0;
+
+    /// @brief quantization of float descriptors ("none", "uint8" or "int16")
+    std::string m_descriptorQuantization = "none";
+
+    /// @brief copy of the vocabulary searched with quantized descriptors
+    SolARFBOWVocabularyTree m_VOCTree;
+
+    /// @brief true if the quantized vocabulary tree is used instead of m_VOC
+    bool m_useVOCTree = false;
+
+    /// @brief vocabulary and retrieval model used by queries and insertions, locked exclusively to swap in a new vocabulary
+    mutable std::shared_mutex m_vocabularyMutex;
+    /// @brief serializes vocabulary swaps and model replacements
+    std::mutex m_vocabularySwapMutex;
+    /// @brief keyframes added and suppressed while a vocabulary swap or a re-indexing builds its shadow model
+    std::map<uint32_t, std::pair<SRef<datastructure::Keyframe>, bool>> m_swapAddedKeyframes;
+    std::set<uint32_t> m_swapSuppressedKeyframes;
+    bool m_isRecordingKeyframes = false;
+    bool m_isSwappingVocabulary = false;
+    mutable std::mutex m_swapKeyframesMutex;
+    /// @brief memory of the new vocabulary and of the shadow model of the running swap or re-indexing
+    std::atomic<uint64_t> m_vocabularySwapMemory{0};
+    /// @brief thread and result of startVocabularySwap
+    std::thread m_vocabularySwapThread;
+    FrameworkReturnCode m_vocabularySwapResult = FrameworkReturnCode::_ERROR_;
+
+    /// @brief vocabulary transform backend ("fbow" or "cpu")
+    std::string m_transformBackend = "fbow";
+
+    /// @brief kernel of the cpu backend ("auto", "generic", "sse4.2", "avx2" or "avx512")
+    std::string m_transformKernel = "auto";
+
+    /// @brief number of threads used to compute BoW features
+    int m_nbThreads = 0;
+
+    /// @brief threads used to compute BoW features and score candidates in parallel
+    std::unique_ptr<SolARFBOWThreadPool> m_threadPool;
+
+    /// @brief number of candidates above which they are scored in parallel
+    int m_parallelScoringMinCandidates = 1000;
+
+    /// @brief level of the coarse node histograms (0 if the coarse stage is disabled)
+    int m_coarseLevel = 0;
+
+    /// @brief maximum number of candidates kept by the coarse stage
+    int m_coarseShortlistSize = 100;
+
+    /// @brief minimum coarse score of a shortlisted candidate relative to the best one
+    float m_coarseMinScoreRatio = 0.3f;
+
+    /// @brief ancestor at the coarse level of each node at m_level
+    std::map<uint32_t, uint32_t> m_coarseAncestors;
+    /// @brief coarse features of the indexed keyframes, computed at insertion or at the first query
+    mutable std::map<uint32_t, CoarseFeature> m_coarseFeatures;
+    mutable std::mutex m_coarseMutex;
+
+    /// @brief maximum Hamming distance of close residual signatures (0 if signatures are disabled)
+    int m_signatureThreshold = 0;
+
+    /// @brief Hamming embedding of the nodes at m_level
+    SolARFBOWHammingEmbedding m_hammingEmbedding;
+    /// @brief residual signatures of the indexed keyframes
+    std::map<uint32_t, SolARFBOWHammingEmbedding::Signatures> m_signatures;
+    mutable std::mutex m_signaturesMutex;
+
+    /// @brief partition of the keyframes outside the default partition 0
+    std::map<uint32_t, uint8_t> m_keyframePartitions;
+    mutable std::mutex m_partitionsMutex;
+
+    /// @brief memory of each keyframe of the keyframe retrieval model and their sum
+    mutable std::map<uint32_t, KeyframeMemory> m_keyframesMemory;
+
+    /// @brief scoring metric (distanceMetricId, L2 if invalid)
+    ScoringType m_scoringType = ScoringType::L2_NORM;
+
+    /// @brief BoW features of the in-memory keyframes laid out for the scoring metric, updated with the memory accounting
+    mutable std::map<uint32_t, std::shared_ptr<const SolARFBOWScoringBoW>> m_scoringBoWs;
+    mutable std::mutex m_scoringBoWsMutex;
+    mutable KeyframeMemory m_modelMemory;
+    mutable std::mutex m_memoryStatsMutex;
+
+    /// @brief keyframes added to, suppressed from or moved between partitions of the retrieval model as (sequence number, keyframe id)
+    /// pairs, oldest first, replayed by query sessions. A change of the whole retrieval model clears the log
+    mutable std::deque<std::pair<uint64_t, uint32_t>> m_modelChanges;
+    /// @brief sequence number of the last change, and sequence number after which the log holds all the changes
+    mutable uint64_t m_modelSequence = 0;
+    mutable uint64_t m_modelChangesBegin = 0;
+    mutable std::mutex m_modelChangesMutex;
+    /// @brief memory of the vocabulary and its search copy
+    uint64_t m_vocabularyMemory = 0;
+    /// @brief ids of the internal nodes of the vocabulary, which may hold inverted index entries
+    std::vector<uint32_t> m_vocabularyNodes;
+
+    /// @brief asynchronous indexing mode
+    int m_asyncIndexing = 0;
+
+    /// @brief maximal number of queued keyframes
+    int m_indexingQueueSize = 64;
+
+    /// @brief keyframes waiting to be indexed and whether matched descriptors must be used
+    std::deque<std::pair<SRef<datastructure::Keyframe>, bool>> m_indexingQueue;
+    mutable std::mutex m_indexingMutex;
+    /// @brief signaled when a keyframe is queued or when the indexing thread must stop
+    std::condition_variable m_indexingQueuedCondition;
+    /// @brief signaled when a keyframe is indexed
+    mutable std::condition_variable m_indexingDoneCondition;
+    uint64_t m_queuedSequence = 0;
+    std::atomic<uint64_t> m_indexedSequence{0};
+    bool m_stopIndexing = false;
+    std::thread m_indexingThread;
+
+    /// @brief memory budget in MB of the indexed BoW features (0 for no budget)
+    int m_memoryBudget = 0;
+
+    /// @brief path to the file where evicted keyframes are spilled
+    std::string m_spillPath = "keyframeRetrievalFBOW.spill";
+
+    /// @brief keyframes evicted from memory
+    mutable SolARFBOWKeyframeSpill m_spill;
+    /// @brief estimated memory and last access tick of each resident keyframe
+    mutable std::map<uint32_t, std::pair<uint64_t, uint64_t>> m_residentKeyframes;
+    /// @brief resident keyframes ordered by last access tick
+    mutable std::set<std::pair<uint64_t, uint32_t>> m_residentLRU;
+    mutable uint64_t m_residentMemory = 0;
+    mutable uint64_t m_accessTick = 0;
+    mutable std::mutex m_spillMutex;
+
+    /// @brief path prefix of the on-disk index segments
+    std::string m_segmentPath = "";
+
+    /// @brief number of keyframes of the in-memory segment above which it is written to disk
+    int m_segmentMaxKeyframes = 1000;
+
+    /// @brief number of on-disk segments above which they are merged
+    int m_segmentMergeFactor = 4;
+
+    /// @brief on-disk segments, replaced as a whole when modified
+    std::shared_ptr<const SegmentSet> m_segmentSet;
+    /// @brief keyframes of the in-memory segment
+    std::set<uint32_t> m_memorySegmentKeyframes;
+    /// @brief keyframes being written to a new segment
+    std::set<uint32_t> m_flushingKeyframes;
+    /// @brief generation of the newest segment (including the one being written)
+    uint64_t m_segmentGeneration = 0;
+    uint64_t m_segmentFileId = 0;
+    mutable std::mutex m_segmentsMutex;
+    std::condition_variable m_segmentCondition;
+    bool m_flushRequested = false;
+    bool m_stopSegments = false;
+    std::thread m_segmentThread;
+
+    /// @brief fraction of suppressed keyframes above which they are physically removed
+    float m_tombstoneRatio = 0.2f;
+
+    /// @brief maximum number of suppressed keyframes physically removed per call
+    int m_tombstoneCompactionBatch = 100;
+
+    /// @brief score above which a keyframe to add is a near-duplicate (0 to disable the check)
+    float m_duplicateThreshold = 0.f;
+
+    /// @brief number of indexed keyframes scored by the near-duplicate check
+    int m_duplicateNeighbours = 5;
+
+    /// @brief "reject" or "merge"
+    std::string m_duplicatePolicy = "reject";
+
+    /// @brief near-duplicate keyframes merged into an indexed keyframe
+    std::map<uint32_t, uint32_t> m_mergedKeyframes;
+    /// @brief near-duplicate keyframes rejected, with the indexed keyframe they duplicate
+    std::map<uint32_t, uint32_t> m_rejectedKeyframes;
+    mutable std::mutex m_mergedKeyframesMutex;
+
+    /// @brief tombstones of the keyframe retrieval model, replaced as a whole when modified
+    mutable std::shared_ptr<const KeyframeTombstones> m_keyframeTombstones;
+    /// @brief number of keyframes indexed and not suppressed
+    mutable uint64_t m_nbLiveKeyframes = 0;
+    /// @brief true while the compactor removes tombstoned keyframes
+    mutable bool m_compactingTombstones = false;
+    mutable std::mutex m_tombstonesMutex;
 };
 
 }
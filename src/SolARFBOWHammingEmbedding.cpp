@@ -0,0 +1,124 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SolARFBOWHammingEmbedding.h"
+#include <algorithm>
+#include <bitset>
+#include <random>
+
+namespace SolAR {
+using namespace datastructure;
+namespace MODULES {
+namespace FBOW {
+
+FrameworkReturnCode SolARFBOWHammingEmbedding::init(const SolARFBOWVocabularyTree& vocTree, uint32_t level)
+{
+    m_descSize = 0;
+    m_centroids.clear();
+    m_projections.clear();
+    m_sampledBits.clear();
+    if (!vocTree.isValid())
+        return FrameworkReturnCode::_ERROR_;
+    m_descType = vocTree.getDescType();
+    if (m_descType == CV_8UC1) {
+        // bits spread over the whole descriptor
+        uint32_t nbBits = static_cast<uint32_t>(vocTree.getDescSize()) * 8;
+        for (uint32_t i = 0; i < std::min(NB_BITS, nbBits); ++i)
+            m_sampledBits.push_back(static_cast<uint32_t>(static_cast<uint64_t>(i) * nbBits / std::min(NB_BITS, nbBits)));
+    }
+    else {
+        // the random projections only depend on a fixed seed, so that signatures are reproducible
+        uint32_t dim = static_cast<uint32_t>(vocTree.getDescSize() / sizeof(float));
+        std::mt19937 generator(5489u);
+        m_projections.resize(static_cast<size_t>(NB_BITS) * dim);
+        for (auto& p : m_projections)
+            p = (generator() & 1) ? 1.f : -1.f;
+        vocTree.getLevelNodeCentroids(level, m_centroids);
+    }
+    m_descSize = static_cast<uint32_t>(vocTree.getDescSize());
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+uint64_t SolARFBOWHammingEmbedding::computeSignature(const uint8_t* descriptor, const uint8_t* centroid) const
+{
+    uint64_t signature = 0;
+    if (m_descType == CV_8UC1) {
+        for (uint32_t i = 0; i < m_sampledBits.size(); ++i)
+            if (descriptor[m_sampledBits[i] >> 3] & (1 << (m_sampledBits[i] & 7)))
+                signature |= uint64_t(1) << i;
+        return signature;
+    }
+    uint32_t dim = m_descSize / sizeof(float);
+    const float* x = (const float*)descriptor;
+    const float* c = (const float*)centroid;
+    for (uint32_t i = 0; i < NB_BITS; ++i) {
+        const float* p = m_projections.data() + static_cast<size_t>(i) * dim;
+        float projection = 0.f;
+        if (c)
+            for (uint32_t d = 0; d < dim; ++d)
+                projection += p[d] * (x[d] - c[d]);
+        else
+            for (uint32_t d = 0; d < dim; ++d)
+                projection += p[d] * x[d];
+        if (projection > 0.f)
+            signature |= uint64_t(1) << i;
+    }
+    return signature;
+}
+
+void SolARFBOWHammingEmbedding::compute(const cv::Mat& descriptors, const BoWLevelFeature& bowLevelFeature, Signatures& signatures) const
+{
+    signatures.clear();
+    if (!isValid())
+        return;
+    for (const auto& it : bowLevelFeature) {
+        // the root has no centroid
+        auto itCentroid = m_centroids.find(it.first);
+        const uint8_t* centroid = itCentroid != m_centroids.end() ? itCentroid->second.data() : nullptr;
+        for (const auto& row : it.second)
+            signatures.emplace_back(it.first, computeSignature(descriptors.ptr<uint8_t>(static_cast<int>(row)), centroid));
+    }
+    std::sort(signatures.begin(), signatures.end());
+}
+
+void SolARFBOWHammingEmbedding::compute(const cv::Mat& descriptors, const SolARFBOWFlatBoW& flatBoW, Signatures& signatures) const
+{
+    signatures.clear();
+    if (!isValid())
+        return;
+    for (size_t i = 0; i < flatBoW.nodes.size(); ++i) {
+        uint32_t node = flatBoW.nodes[i].first;
+        auto itCentroid = m_centroids.find(node);
+        const uint8_t* centroid = itCentroid != m_centroids.end() ? itCentroid->second.data() : nullptr;
+        for (uint32_t r = flatBoW.getRowsBegin(i); r < flatBoW.nodes[i].second; ++r)
+            signatures.emplace_back(node, computeSignature(descriptors.ptr<uint8_t>(static_cast<int>(flatBoW.rows[r])), centroid));
+    }
+    std::sort(signatures.begin(), signatures.end());
+}
+
+bool SolARFBOWHammingEmbedding::hasCloseSignatures(Signatures::const_iterator begin1, Signatures::const_iterator end1,
+                                                   Signatures::const_iterator begin2, Signatures::const_iterator end2, uint32_t threshold)
+{
+    for (auto it1 = begin1; it1 != end1; ++it1)
+        for (auto it2 = begin2; it2 != end2; ++it2)
+            if (std::bitset<64>(it1->second ^ it2->second).count() <= threshold)
+                return true;
+    return false;
+}
+
+}
+}
+}
@@ -15,6 +15,7 @@
  */
 
 #include "SolARFBOWHelper.h"
+#include "SolARFBOWScoring.h"
 
 namespace SolAR {
 namespace MODULES {
@@ -23,8 +24,9 @@ namespace FBOW {
 datastructure::BoWFeature SolARFBOWHelper::fbow2Solar(const fbow::fBow& fbow)
 {
     datastructure::BoWFeature bowFeature;
+    // words are sorted: each one is inserted at the end in constant time
     for (const auto& it : fbow)
-        bowFeature[it.first] = it.second.var;
+        bowFeature.emplace_hint(bowFeature.end(), it.first, it.second.var);
     return bowFeature;
 }
 
@@ -33,6 +35,137 @@ datastructure::BoWLevelFeature SolARFBOWHelper::fbow2Solar(const fbow::fBow2& fb
     return fbow2;
 }
 
+datastructure::BoWLevelFeature SolARFBOWHelper::fbow2Solar(fbow::fBow2&& fbow2)
+{
+    return std::move(static_cast<datastructure::BoWLevelFeature&>(fbow2));
+}
+
+namespace {
+
+void levelFeature2Flat(const std::map<uint32_t, std::vector<uint32_t>>& bowLevelFeature, SolARFBOWFlatBoW& flatBoW)
+{
+    for (const auto& it : bowLevelFeature) {
+        flatBoW.rows.insert(flatBoW.rows.end(), it.second.begin(), it.second.end());
+        flatBoW.nodes.emplace_back(it.first, static_cast<uint32_t>(flatBoW.rows.size()));
+    }
+}
+
+}
+
+void SolARFBOWHelper::solar2Flat(const datastructure::BoWFeature& bowFeature, const datastructure::BoWLevelFeature& bowLevelFeature, SolARFBOWFlatBoW& flatBoW)
+{
+    flatBoW.clear();
+    flatBoW.words.insert(flatBoW.words.end(), bowFeature.begin(), bowFeature.end());
+    levelFeature2Flat(bowLevelFeature, flatBoW);
+}
+
+void SolARFBOWHelper::fbow2Flat(const fbow::fBow& fbow, const fbow::fBow2& fbow2, SolARFBOWFlatBoW& flatBoW)
+{
+    flatBoW.clear();
+    for (const auto& it : fbow)
+        flatBoW.words.emplace_back(it.first, it.second.var);
+    levelFeature2Flat(fbow2, flatBoW);
+}
+
+namespace {
+
+template<ScoringType T>
+double metricTerm(double kfWeight, double queryWeight)
+{
+    typedef SolARFBOWMetric<T> Metric;
+    return Metric::term(kfWeight, Metric::keyframeTerm(kfWeight), queryWeight, Metric::queryTerm(queryWeight));
+}
+
+template<ScoringType T>
+double metricBase(const datastructure::BoWFeature& kfBow)
+{
+    double base = 0.;
+    for (const auto& it : kfBow)
+        base += SolARFBOWMetric<T>::keyframeBase(it.second);
+    return base;
+}
+
+}
+
+double SolARFBOWHelper::termBoW(ScoringType type, double kfWeight, double queryWeight)
+{
+    switch (type) {
+    case ScoringType::L1_NORM:
+        return metricTerm<ScoringType::L1_NORM>(kfWeight, queryWeight);
+    case ScoringType::CHI_SQUARE:
+        return metricTerm<ScoringType::CHI_SQUARE>(kfWeight, queryWeight);
+    case ScoringType::BHATTACHARYYA:
+        return metricTerm<ScoringType::BHATTACHARYYA>(kfWeight, queryWeight);
+    case ScoringType::DOT_PRODUCT:
+        return metricTerm<ScoringType::DOT_PRODUCT>(kfWeight, queryWeight);
+    case ScoringType::KLS:
+        return metricTerm<ScoringType::KLS>(kfWeight, queryWeight);
+    default:
+        return metricTerm<ScoringType::L2_NORM>(kfWeight, queryWeight);
+    }
+}
+
+double SolARFBOWHelper::baseBoW(ScoringType type, const datastructure::BoWFeature& kfBow)
+{
+    // only KLS scores the keyframe words missing from the query
+    if (type != ScoringType::KLS)
+        return 0.;
+    return metricBase<ScoringType::KLS>(kfBow);
+}
+
+double SolARFBOWHelper::finalizeBoW(ScoringType type, double sum, double queryScale)
+{
+    switch (type) {
+    case ScoringType::L1_NORM:
+        return SolARFBOWMetric<ScoringType::L1_NORM>::finalize(sum);
+    case ScoringType::CHI_SQUARE:
+        return SolARFBOWMetric<ScoringType::CHI_SQUARE>::finalize(sum);
+    case ScoringType::BHATTACHARYYA:
+        // sqrt(v * s * w) = sqrt(s) * sqrt(v * w)
+        return SolARFBOWMetric<ScoringType::BHATTACHARYYA>::finalize(sqrt(queryScale) * sum);
+    case ScoringType::DOT_PRODUCT:
+        return SolARFBOWMetric<ScoringType::DOT_PRODUCT>::finalize(queryScale * sum);
+    case ScoringType::KLS:
+        return SolARFBOWMetric<ScoringType::KLS>::finalize(sum);
+    default:
+        return SolARFBOWMetric<ScoringType::L2_NORM>::finalize(queryScale * sum);
+    }
+}
+
+bool SolARFBOWHelper::hasQueryScale(ScoringType type)
+{
+    return (type == ScoringType::L2_NORM) || (type == ScoringType::BHATTACHARYYA) || (type == ScoringType::DOT_PRODUCT);
+}
+
+void SolARFBOWHelper::remapBoW(const std::map<uint32_t, uint32_t>& wordRemap, datastructure::BoWFeature& bow)
+{
+    if (wordRemap.empty())
+        return;
+    bool isRemapped = false;
+    for (const auto& it : bow)
+        if (wordRemap.find(it.first) != wordRemap.end()) {
+            isRemapped = true;
+            break;
+        }
+    if (!isRemapped)
+        return;
+    // merge weights of remapped words and normalize again (L2)
+    datastructure::BoWFeature remappedBow;
+    for (const auto& it : bow) {
+        auto itRemap = wordRemap.find(it.first);
+        remappedBow[itRemap == wordRemap.end() ? it.first : itRemap->second] += it.second;
+    }
+    double norm = 0.;
+    for (const auto& it : remappedBow)
+        norm += it.second * it.second;
+    if (norm > 0.) {
+        double invNorm = 1. / sqrt(norm);
+        for (auto& it : remappedBow)
+            it.second *= invNorm;
+    }
+    bow.swap(remappedBow);
+}
+
 double SolARFBOWHelper::distanceBoW(const datastructure::BoWFeature& bow1, const datastructure::BoWFeature& bow2)
 {
     datastructure::BoWFeature::const_iterator bow1_it = bow1.begin();
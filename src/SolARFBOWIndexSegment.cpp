@@ -0,0 +1,240 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SolARFBOWIndexSegment.h"
+#include <core/Log.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace bip = boost::interprocess;
+
+namespace SolAR {
+using namespace datastructure;
+namespace MODULES {
+namespace FBOW {
+
+SolARFBOWIndexSegment::~SolARFBOWIndexSegment()
+{
+    // unmap before removing the file
+    m_region = bip::mapped_region();
+    m_mapping = bip::file_mapping();
+    if (m_removeFile)
+        std::remove(m_fileName.c_str());
+}
+
+FrameworkReturnCode SolARFBOWIndexSegment::open(const std::string& file, uint64_t generation)
+{
+    m_fileName = file;
+    m_generation = generation;
+    m_data = nullptr;
+    try {
+        m_mapping = bip::file_mapping(file.c_str(), bip::read_only);
+        m_region = bip::mapped_region(m_mapping, bip::read_only);
+    }
+    catch (const bip::interprocess_exception& e) {
+        LOG_ERROR("SolARFBOWIndexSegment::open: cannot map {}: {}", file, e.what());
+        return FrameworkReturnCode::_ERROR_;
+    }
+    const char* data = static_cast<const char*>(m_region.get_address());
+    uint64_t size = m_region.get_size();
+    if (size < sizeof(Header)) {
+        LOG_ERROR("SolARFBOWIndexSegment::open: invalid segment {}", file);
+        return FrameworkReturnCode::_ERROR_;
+    }
+    std::memcpy(&m_header, data, sizeof(Header));
+    if ((m_header.magic != MAGIC) || (m_header.version != VERSION) ||
+        (m_header.keyframeTableOffset + m_header.nbKeyframes * sizeof(KeyframeEntry) > size) ||
+        (m_header.nodeTableOffset + m_header.nbNodes * sizeof(NodeEntry) > size)) {
+        LOG_ERROR("SolARFBOWIndexSegment::open: invalid segment {}", file);
+        return FrameworkReturnCode::_ERROR_;
+    }
+    m_data = data;
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+uint32_t SolARFBOWIndexSegment::getNbKeyframes() const
+{
+    return m_data ? m_header.nbKeyframes : 0;
+}
+
+uint32_t SolARFBOWIndexSegment::getKeyframeId(uint32_t i) const
+{
+    return getKeyframeTable()[i].id;
+}
+
+const SolARFBOWIndexSegment::KeyframeEntry* SolARFBOWIndexSegment::getKeyframeTable() const
+{
+    return reinterpret_cast<const KeyframeEntry*>(m_data + m_header.keyframeTableOffset);
+}
+
+const SolARFBOWIndexSegment::NodeEntry* SolARFBOWIndexSegment::getNodeTable() const
+{
+    return reinterpret_cast<const NodeEntry*>(m_data + m_header.nodeTableOffset);
+}
+
+const SolARFBOWIndexSegment::KeyframeEntry* SolARFBOWIndexSegment::findKeyframe(uint32_t id) const
+{
+    if (!m_data)
+        return nullptr;
+    const KeyframeEntry* begin = getKeyframeTable();
+    const KeyframeEntry* end = begin + m_header.nbKeyframes;
+    const KeyframeEntry* it = std::lower_bound(begin, end, id, [](const KeyframeEntry& entry, uint32_t value) { return entry.id < value; });
+    return ((it != end) && (it->id == id)) ? it : nullptr;
+}
+
+FrameworkReturnCode SolARFBOWIndexSegment::getBoWFeature(uint32_t id, BoWFeature& bowFeature) const
+{
+    const KeyframeEntry* entry = findKeyframe(id);
+    if (!entry)
+        return FrameworkReturnCode::_ERROR_;
+    bowFeature.clear();
+    const char* words = m_data + entry->offset;
+    for (uint32_t i = 0; i < entry->nbWords; ++i) {
+        uint32_t word;
+        float weight;
+        std::memcpy(&word, words + 8 * i, sizeof(word));
+        std::memcpy(&weight, words + 8 * i + 4, sizeof(weight));
+        bowFeature.emplace_hint(bowFeature.end(), word, weight);
+    }
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+FrameworkReturnCode SolARFBOWIndexSegment::getBoWLevelFeature(uint32_t id, BoWLevelFeature& bowLevelFeature) const
+{
+    const KeyframeEntry* entry = findKeyframe(id);
+    if (!entry)
+        return FrameworkReturnCode::_ERROR_;
+    bowLevelFeature.clear();
+    const uint32_t* level = reinterpret_cast<const uint32_t*>(m_data + entry->offset + 8 * static_cast<uint64_t>(entry->nbWords));
+    for (uint32_t i = 0; i < entry->nbNodes; ++i) {
+        uint32_t nodeId = level[0];
+        uint32_t nbIndices = level[1];
+        bowLevelFeature.emplace_hint(bowLevelFeature.end(), nodeId, std::vector<uint32_t>(level + 2, level + 2 + nbIndices));
+        level += 2 + nbIndices;
+    }
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+const uint32_t* SolARFBOWIndexSegment::getInvertedIndex(uint32_t nodeId, uint32_t& nbKeyframes) const
+{
+    nbKeyframes = 0;
+    if (!m_data)
+        return nullptr;
+    const NodeEntry* begin = getNodeTable();
+    const NodeEntry* end = begin + m_header.nbNodes;
+    const NodeEntry* it = std::lower_bound(begin, end, nodeId, [](const NodeEntry& entry, uint32_t value) { return entry.nodeId < value; });
+    if ((it == end) || (it->nodeId != nodeId))
+        return nullptr;
+    nbKeyframes = it->nbKeyframes;
+    return reinterpret_cast<const uint32_t*>(m_data + it->offset);
+}
+
+FrameworkReturnCode SolARFBOWIndexSegmentWriter::open(const std::string& file)
+{
+    m_fileName = file;
+    m_keyframes.clear();
+    m_invertedIndex.clear();
+    m_file.open(file, std::ios::binary | std::ios::trunc);
+    if (!m_file.is_open()) {
+        LOG_ERROR("SolARFBOWIndexSegmentWriter::open: cannot create {}", file);
+        return FrameworkReturnCode::_ERROR_;
+    }
+    // the header is written on close
+    SolARFBOWIndexSegment::Header header = SolARFBOWIndexSegment::Header();
+    m_file.write((const char*)&header, sizeof(header));
+    m_offset = sizeof(header);
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+FrameworkReturnCode SolARFBOWIndexSegmentWriter::add(uint32_t id, const BoWFeature& bowFeature, const BoWLevelFeature& bowLevelFeature)
+{
+    if (!m_keyframes.empty() && (m_keyframes.back().id >= id)) {
+        LOG_ERROR("SolARFBOWIndexSegmentWriter::add: keyframes must be added by increasing id");
+        return FrameworkReturnCode::_ERROR_;
+    }
+    std::vector<uint32_t> buffer;
+    buffer.reserve(2 * (bowFeature.size() + bowLevelFeature.size()));
+    for (const auto& it : bowFeature) {
+        uint32_t weight;
+        std::memcpy(&weight, &it.second, sizeof(weight));
+        buffer.push_back(it.first);
+        buffer.push_back(weight);
+    }
+    for (const auto& it : bowLevelFeature) {
+        buffer.push_back(it.first);
+        buffer.push_back(static_cast<uint32_t>(it.second.size()));
+        buffer.insert(buffer.end(), it.second.begin(), it.second.end());
+        m_invertedIndex[it.first].push_back(id);
+    }
+    m_file.write((const char*)buffer.data(), buffer.size() * sizeof(uint32_t));
+
+    SolARFBOWIndexSegment::KeyframeEntry entry = SolARFBOWIndexSegment::KeyframeEntry();
+    entry.id = id;
+    entry.nbWords = static_cast<uint32_t>(bowFeature.size());
+    entry.nbNodes = static_cast<uint32_t>(bowLevelFeature.size());
+    entry.offset = m_offset;
+    m_keyframes.push_back(entry);
+    m_offset += buffer.size() * sizeof(uint32_t);
+    return m_file ? FrameworkReturnCode::_SUCCESS : FrameworkReturnCode::_ERROR_;
+}
+
+FrameworkReturnCode SolARFBOWIndexSegmentWriter::close()
+{
+    SolARFBOWIndexSegment::Header header = SolARFBOWIndexSegment::Header();
+    header.magic = SolARFBOWIndexSegment::MAGIC;
+    header.version = SolARFBOWIndexSegment::VERSION;
+    header.nbKeyframes = static_cast<uint32_t>(m_keyframes.size());
+    header.nbNodes = static_cast<uint32_t>(m_invertedIndex.size());
+
+    // keyframe table, aligned on 8 bytes
+    uint64_t padding = (8 - m_offset % 8) % 8;
+    const char zeros[8] = {};
+    m_file.write(zeros, padding);
+    m_offset += padding;
+    header.keyframeTableOffset = m_offset;
+    m_file.write((const char*)m_keyframes.data(), m_keyframes.size() * sizeof(SolARFBOWIndexSegment::KeyframeEntry));
+    m_offset += m_keyframes.size() * sizeof(SolARFBOWIndexSegment::KeyframeEntry);
+
+    // node table followed by the posting lists
+    header.nodeTableOffset = m_offset;
+    uint64_t postingOffset = m_offset + m_invertedIndex.size() * sizeof(SolARFBOWIndexSegment::NodeEntry);
+    for (const auto& it : m_invertedIndex) {
+        SolARFBOWIndexSegment::NodeEntry entry = SolARFBOWIndexSegment::NodeEntry();
+        entry.nodeId = it.first;
+        entry.nbKeyframes = static_cast<uint32_t>(it.second.size());
+        entry.offset = postingOffset;
+        m_file.write((const char*)&entry, sizeof(entry));
+        postingOffset += it.second.size() * sizeof(uint32_t);
+    }
+    for (const auto& it : m_invertedIndex)
+        m_file.write((const char*)it.second.data(), it.second.size() * sizeof(uint32_t));
+
+    m_file.seekp(0);
+    m_file.write((const char*)&header, sizeof(header));
+    m_file.close();
+    m_keyframes.clear();
+    m_invertedIndex.clear();
+    if (m_file.fail()) {
+        LOG_ERROR("SolARFBOWIndexSegmentWriter::close: cannot write {}", m_fileName);
+        return FrameworkReturnCode::_ERROR_;
+    }
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+}
+}
+}
@@ -0,0 +1,168 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SolARFBOWKeyframeSpill.h"
+#include <core/Log.h>
+#include <algorithm>
+#include <cstring>
+
+namespace SolAR {
+using namespace datastructure;
+namespace MODULES {
+namespace FBOW {
+
+FrameworkReturnCode SolARFBOWKeyframeSpill::open(const std::string& file)
+{
+    if (m_file.is_open())
+        m_file.close();
+    m_records.clear();
+    m_invertedIndex.clear();
+    m_fileSize = 0;
+    m_fileName = file;
+    m_file.open(file, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!m_file.is_open()) {
+        LOG_ERROR("SolARFBOWKeyframeSpill::open: cannot open {}", file);
+        return FrameworkReturnCode::_ERROR_;
+    }
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+void SolARFBOWKeyframeSpill::clear()
+{
+    if (m_file.is_open())
+        open(m_fileName);
+}
+
+FrameworkReturnCode SolARFBOWKeyframeSpill::write(uint32_t id, const BoWFeature& bowFeature, const BoWLevelFeature& bowLevelFeature)
+{
+    if (!m_file.is_open())
+        return FrameworkReturnCode::_ERROR_;
+    erase(id);
+
+    // record: nbWords, (word, weight)*, nbNodes, (node, nbIndices, index*)*
+    std::vector<uint32_t> buffer;
+    buffer.reserve(2 + 2 * bowFeature.size() + 2 * bowLevelFeature.size());
+    buffer.push_back(static_cast<uint32_t>(bowFeature.size()));
+    for (const auto& it : bowFeature) {
+        uint32_t weight;
+        static_assert(sizeof(weight) == sizeof(it.second), "BoW weights are expected to be 32 bits floats");
+        std::memcpy(&weight, &it.second, sizeof(weight));
+        buffer.push_back(it.first);
+        buffer.push_back(weight);
+    }
+    Record record;
+    record.offset = m_fileSize;
+    record.nodes.reserve(bowLevelFeature.size());
+    buffer.push_back(static_cast<uint32_t>(bowLevelFeature.size()));
+    for (const auto& it : bowLevelFeature) {
+        buffer.push_back(it.first);
+        buffer.push_back(static_cast<uint32_t>(it.second.size()));
+        buffer.insert(buffer.end(), it.second.begin(), it.second.end());
+        record.nodes.push_back(it.first);
+    }
+
+    m_file.clear();
+    m_file.seekp(static_cast<std::streamoff>(m_fileSize));
+    m_file.write((const char*)buffer.data(), buffer.size() * sizeof(uint32_t));
+    m_file.flush();
+    if (!m_file) {
+        LOG_ERROR("SolARFBOWKeyframeSpill::write: cannot write keyframe {} to {}", id, m_fileName);
+        return FrameworkReturnCode::_ERROR_;
+    }
+    m_fileSize += buffer.size() * sizeof(uint32_t);
+    for (const auto& node : record.nodes)
+        m_invertedIndex[node].push_back(id);
+    m_records[id] = std::move(record);
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+FrameworkReturnCode SolARFBOWKeyframeSpill::read(uint32_t id, BoWFeature& bowFeature, BoWLevelFeature& bowLevelFeature)
+{
+    auto itRecord = m_records.find(id);
+    if (itRecord == m_records.end())
+        return FrameworkReturnCode::_ERROR_;
+    bowFeature.clear();
+    bowLevelFeature.clear();
+
+    m_file.clear();
+    m_file.seekg(static_cast<std::streamoff>(itRecord->second.offset));
+    uint32_t nbWords = 0;
+    m_file.read((char*)&nbWords, sizeof(nbWords));
+    std::vector<uint32_t> words(2 * static_cast<size_t>(nbWords));
+    m_file.read((char*)words.data(), words.size() * sizeof(uint32_t));
+    for (uint32_t i = 0; i < nbWords; ++i) {
+        float weight;
+        std::memcpy(&weight, &words[2 * i + 1], sizeof(weight));
+        bowFeature.emplace_hint(bowFeature.end(), words[2 * i], weight);
+    }
+    uint32_t nbNodes = 0;
+    m_file.read((char*)&nbNodes, sizeof(nbNodes));
+    for (uint32_t i = 0; (i < nbNodes) && m_file; ++i) {
+        uint32_t header[2];
+        m_file.read((char*)header, sizeof(header));
+        std::vector<uint32_t> indices(header[1]);
+        m_file.read((char*)indices.data(), indices.size() * sizeof(uint32_t));
+        bowLevelFeature.emplace_hint(bowLevelFeature.end(), header[0], std::move(indices));
+    }
+    if (!m_file) {
+        LOG_ERROR("SolARFBOWKeyframeSpill::read: cannot read keyframe {} from {}", id, m_fileName);
+        return FrameworkReturnCode::_ERROR_;
+    }
+    eraseFromIndex(id, itRecord->second);
+    m_records.erase(itRecord);
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+bool SolARFBOWKeyframeSpill::erase(uint32_t id)
+{
+    auto itRecord = m_records.find(id);
+    if (itRecord == m_records.end())
+        return false;
+    eraseFromIndex(id, itRecord->second);
+    m_records.erase(itRecord);
+    return true;
+}
+
+void SolARFBOWKeyframeSpill::getKeyframes(std::vector<uint32_t>& ids) const
+{
+    ids.clear();
+    ids.reserve(m_records.size());
+    for (const auto& it : m_records)
+        ids.push_back(it.first);
+}
+
+const std::vector<uint32_t>* SolARFBOWKeyframeSpill::getInvertedIndex(uint32_t nodeId) const
+{
+    auto it = m_invertedIndex.find(nodeId);
+    return it == m_invertedIndex.end() ? nullptr : &it->second;
+}
+
+void SolARFBOWKeyframeSpill::eraseFromIndex(uint32_t id, const Record& record)
+{
+    for (const auto& node : record.nodes) {
+        auto itIndex = m_invertedIndex.find(node);
+        if (itIndex == m_invertedIndex.end())
+            continue;
+        auto& ids = itIndex->second;
+        ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+        if (ids.empty())
+            m_invertedIndex.erase(itIndex);
+    }
+}
+
+}
+}
+}
@@ -0,0 +1,83 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SolARFBOWQueryScratch.h"
+#include <algorithm>
+
+namespace SolAR {
+namespace MODULES {
+namespace FBOW {
+
+SolARFBOWQueryScratch& SolARFBOWQueryScratch::local()
+{
+    thread_local SolARFBOWQueryScratch scratch;
+    return scratch;
+}
+
+void SolARFBOWQueryScratch::resetVotes()
+{
+    // only the entries of the voted keyframes are cleared
+    for (const auto& id : m_votedKeyframes)
+        m_votes[id] = 0;
+    m_votedKeyframes.clear();
+    m_isSorted = true;
+}
+
+void SolARFBOWQueryScratch::vote(uint32_t keyframe_id)
+{
+    if (keyframe_id >= m_votes.size())
+        m_votes.resize(std::max<size_t>(keyframe_id + 1, 2 * m_votes.size()), 0);
+    if (m_votes[keyframe_id]++ == 0) {
+        if (!m_votedKeyframes.empty() && (keyframe_id < m_votedKeyframes.back()))
+            m_isSorted = false;
+        m_votedKeyframes.push_back(keyframe_id);
+    }
+}
+
+const std::vector<uint32_t>& SolARFBOWQueryScratch::getVotedKeyframes()
+{
+    if (!m_isSorted) {
+        std::sort(m_votedKeyframes.begin(), m_votedKeyframes.end());
+        m_isSorted = true;
+    }
+    return m_votedKeyframes;
+}
+
+uint64_t SolARFBOWQueryScratch::getMemory() const
+{
+    auto scoringMemory = [](const SolARFBOWScoringBoW& bow) {
+        return bow.words.capacity() * sizeof(uint32_t) + (bow.weights.capacity() + bow.terms.capacity()) * sizeof(float);
+    };
+    uint64_t memory = sizeof(SolARFBOWQueryScratch);
+    memory += m_votes.capacity() * sizeof(int) + m_votedKeyframes.capacity() * sizeof(uint32_t);
+    memory += (candidates.capacity() + memoryCandidates.capacity() + bestCandidates.capacity() + slice.capacity()) * sizeof(uint32_t);
+    memory += scoredCandidates.capacity() * sizeof(uint32_t) + scoringBoWs.capacity() * sizeof(const SolARFBOWScoringBoW*) +
+              candidateSegments.capacity() * sizeof(const SolARFBOWIndexSegment*);
+    memory += rankedCandidates.capacity() * sizeof(std::pair<uint64_t, uint32_t>);
+    memory += coarseFeature.capacity() * sizeof(std::pair<uint32_t, float>);
+    memory += (coarseScores.capacity() + distKeyframes.capacity() + sliceKeyframes.capacity() + mergedKeyframes.capacity() +
+               chunkMerged.capacity()) * sizeof(std::pair<uint32_t, double>);
+    memory += chunkKeyframes.capacity() * sizeof(ScoredKeyframes);
+    for (const auto& chunk : chunkKeyframes)
+        memory += chunk.capacity() * sizeof(std::pair<uint32_t, double>);
+    memory += scoringMemory(queryBoW) + scoringMemory(keyframeBoW);
+    memory += queryFlatBoW.getMemory() + signatures.capacity() * sizeof(std::pair<uint32_t, uint64_t>);
+    return memory;
+}
+
+}
+}
+}
@@ -0,0 +1,35 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SolARFBOWQuerySession.h"
+
+namespace SolAR {
+namespace MODULES {
+namespace FBOW {
+
+void SolARFBOWQuerySession::reset()
+{
+    m_isValid = false;
+    m_nbQueriesSinceRefresh = 0;
+    m_bowFeature.clear();
+    m_queryScale = 1.;
+    m_bowLevelFeature.clear();
+    m_candidates.clear();
+}
+
+}
+}
+}
@@ -0,0 +1,48 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SolARFBOWScoring.h"
+
+namespace SolAR {
+namespace MODULES {
+namespace FBOW {
+
+void SolARFBOWScoring::prepare(ScoringType type, const datastructure::BoWFeature& bowFeature, bool isQuery, SolARFBOWScoringBoW& scoringBoW)
+{
+    switch (type) {
+    case ScoringType::L1_NORM:
+        prepare<ScoringType::L1_NORM>(bowFeature, isQuery, scoringBoW);
+        break;
+    case ScoringType::CHI_SQUARE:
+        prepare<ScoringType::CHI_SQUARE>(bowFeature, isQuery, scoringBoW);
+        break;
+    case ScoringType::BHATTACHARYYA:
+        prepare<ScoringType::BHATTACHARYYA>(bowFeature, isQuery, scoringBoW);
+        break;
+    case ScoringType::DOT_PRODUCT:
+        prepare<ScoringType::DOT_PRODUCT>(bowFeature, isQuery, scoringBoW);
+        break;
+    case ScoringType::KLS:
+        prepare<ScoringType::KLS>(bowFeature, isQuery, scoringBoW);
+        break;
+    default:
+        prepare<ScoringType::L2_NORM>(bowFeature, isQuery, scoringBoW);
+    }
+}
+
+}
+}
+}
@@ -0,0 +1,100 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SolARFBOWThreadPool.h"
+#include <algorithm>
+
+namespace SolAR {
+namespace MODULES {
+namespace FBOW {
+
+SolARFBOWThreadPool::SolARFBOWThreadPool(uint32_t nbThreads)
+{
+    if (nbThreads == 0)
+        nbThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    for (uint32_t i = 1; i < nbThreads; ++i)
+        m_workers.emplace_back(&SolARFBOWThreadPool::workerLoop, this);
+}
+
+SolARFBOWThreadPool::~SolARFBOWThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_jobCondition.notify_all();
+    for (auto& worker : m_workers)
+        worker.join();
+}
+
+void SolARFBOWThreadPool::parallelFor(size_t nbTasks, const std::function<void(size_t)>& task)
+{
+    std::unique_lock<std::mutex> callerLock(m_callerMutex, std::try_to_lock);
+    if (m_workers.empty() || (nbTasks <= 1) || !callerLock.owns_lock()) {
+        for (size_t i = 0; i < nbTasks; ++i)
+            task(i);
+        return;
+    }
+
+    auto job = std::make_shared<Job>();
+    job->task = &task;
+    job->nbTasks = nbTasks;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_job = job;
+        m_generation++;
+    }
+    m_jobCondition.notify_all();
+    runJob(*job);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_doneCondition.wait(lock, [&job] { return job->done.load() == job->nbTasks; });
+    m_job.reset();
+}
+
+void SolARFBOWThreadPool::workerLoop()
+{
+    uint64_t generation = 0;
+    while (true) {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_jobCondition.wait(lock, [this, generation] { return m_stop || (m_generation != generation); });
+            if (m_stop)
+                return;
+            generation = m_generation;
+            job = m_job;
+        }
+        if (job)
+            runJob(*job);
+    }
+}
+
+void SolARFBOWThreadPool::runJob(Job& job)
+{
+    size_t i;
+    while ((i = job.next.fetch_add(1)) < job.nbTasks) {
+        (*job.task)(i);
+        if (job.done.fetch_add(1) + 1 == job.nbTasks) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_doneCondition.notify_all();
+        }
+    }
+}
+
+}
+}
+}
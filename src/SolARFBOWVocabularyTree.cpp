@@ -0,0 +1,1269 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SolARFBOWVocabularyTree.h"
+#include <core/Log.h>
+#include <algorithm>
+#include <bitset>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define SOLARFBOW_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SOLARFBOW_PREFETCH(address) __builtin_prefetch(address)
+#elif defined(SOLARFBOW_SSE2)
+#define SOLARFBOW_PREFETCH(address) _mm_prefetch((const char*)(address), _MM_HINT_T0)
+#else
+#define SOLARFBOW_PREFETCH(address)
+#endif
+
+// cpu kernels selected at runtime (x86-64 only)
+#if defined(__x86_64__) || defined(_M_X64)
+#define SOLARFBOW_CPU_DISPATCH
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define SOLARFBOW_TARGET(features)
+#else
+#define SOLARFBOW_TARGET(features) __attribute__((target(features)))
+#endif
+#if (defined(__GNUC__) && !defined(__clang__) && (__GNUC__ >= 8)) || (defined(__clang__) && (__clang_major__ >= 7)) || (defined(_MSC_VER) && (_MSC_VER >= 1920))
+#define SOLARFBOW_AVX512
+#endif
+#endif
+
+namespace SolAR {
+namespace MODULES {
+namespace FBOW {
+
+// signature written by fbow::Vocabulary::toStream
+static const uint64_t FBOW_SIGNATURE = 55824124;
+
+// maximal absolute value of int16 quantized descriptors: 11 bits, so that squared distances of
+// 256-dimensional descriptors can be accumulated in 32 bits
+static const float INT16_QUANTIZATION_MAX = 1023.f;
+
+namespace {
+
+inline uint32_t popcount64(uint64_t v)
+{
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return static_cast<uint32_t>((v * 0x0101010101010101ULL) >> 56);
+}
+
+uint32_t distanceHamming(const uint8_t* a, const uint8_t* b, uint32_t nbBytes)
+{
+    uint32_t dist = 0;
+    uint32_t i = 0;
+    for (; i + 8 <= nbBytes; i += 8) {
+        uint64_t va, vb;
+        std::memcpy(&va, a + i, sizeof(va));
+        std::memcpy(&vb, b + i, sizeof(vb));
+        dist += popcount64(va ^ vb);
+    }
+    for (; i < nbBytes; ++i)
+        dist += popcount64(a[i] ^ b[i]);
+    return dist;
+}
+
+// float distances are accumulated in 8 lanes (element i in lane i % 8) and the lanes are summed in a fixed order,
+// so that all kernels compute exactly the same distances. fbow sums in another order, so near-ties may select other
+// words than fbow: the retriever only searches binary and quantized vocabularies with these kernels
+inline float reduceLanes(const float* lanes)
+{
+    return ((lanes[0] + lanes[4]) + (lanes[1] + lanes[5])) + ((lanes[2] + lanes[6]) + (lanes[3] + lanes[7]));
+}
+
+float distanceL2F32(const float* a, const float* b, uint32_t n)
+{
+    float lanes[8] = { 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f };
+    for (uint32_t i = 0; i < n; ++i) {
+        float d = a[i] - b[i];
+        lanes[i & 7] += d * d;
+    }
+    return reduceLanes(lanes);
+}
+
+// n is a multiple of 16
+uint32_t distanceL2U8(const uint8_t* a, const uint8_t* b, uint32_t n)
+{
+#ifdef SOLARFBOW_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (uint32_t i = 0; i < n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i dlo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+        __m128i dhi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(dlo, dlo));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(dhi, dhi));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(acc));
+#else
+    uint32_t dist = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        int32_t d = static_cast<int32_t>(a[i]) - static_cast<int32_t>(b[i]);
+        dist += static_cast<uint32_t>(d * d);
+    }
+    return dist;
+#endif
+}
+
+// n is a multiple of 8
+uint32_t distanceL2S16(const int16_t* a, const int16_t* b, uint32_t n)
+{
+#ifdef SOLARFBOW_SSE2
+    __m128i acc = _mm_setzero_si128();
+    for (uint32_t i = 0; i < n; i += 8) {
+        __m128i d = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(d, d));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(acc));
+#else
+    uint32_t dist = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        int32_t d = static_cast<int32_t>(a[i]) - static_cast<int32_t>(b[i]);
+        dist += static_cast<uint32_t>(d * d);
+    }
+    return dist;
+#endif
+}
+
+// index of the nearest of n features, ties are resolved by the first feature as in fbow
+#define SOLARFBOW_NEAREST_FEATURE(DistanceType, distanceFunction, descriptorType)                 \
+    uint32_t best = 0;                                                                             \
+    DistanceType bestDist = std::numeric_limits<DistanceType>::max();                              \
+    for (uint32_t i = 0; i < n; ++i) {                                                             \
+        DistanceType dist = distanceFunction((const descriptorType*)descriptor,                    \
+                                             (const descriptorType*)(features + i * stride), size); \
+        if (dist < bestDist) {                                                                     \
+            bestDist = dist;                                                                       \
+            best = i;                                                                              \
+        }                                                                                          \
+    }                                                                                              \
+    return best;
+
+uint32_t nearestHammingGeneric(const uint8_t* descriptor, const uint8_t* features, uint64_t stride, uint32_t n, uint32_t size)
+{
+    SOLARFBOW_NEAREST_FEATURE(uint32_t, distanceHamming, uint8_t)
+}
+
+uint32_t nearestL2F32Generic(const uint8_t* descriptor, const uint8_t* features, uint64_t stride, uint32_t n, uint32_t size)
+{
+    SOLARFBOW_NEAREST_FEATURE(float, distanceL2F32, float)
+}
+
+uint32_t nearestL2U8Generic(const uint8_t* descriptor, const uint8_t* features, uint64_t stride, uint32_t n, uint32_t size)
+{
+    SOLARFBOW_NEAREST_FEATURE(uint32_t, distanceL2U8, uint8_t)
+}
+
+uint32_t nearestL2S16Generic(const uint8_t* descriptor, const uint8_t* features, uint64_t stride, uint32_t n, uint32_t size)
+{
+    SOLARFBOW_NEAREST_FEATURE(uint32_t, distanceL2S16, int16_t)
+}
+
+#ifdef SOLARFBOW_CPU_DISPATCH
+
+struct CpuFeatures {
+    bool sse42 = false;
+    bool popcnt = false;
+    bool avx2 = false;
+    bool avx512vpopcntdq = false;
+};
+
+CpuFeatures detectCpuFeatures()
+{
+    CpuFeatures features;
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    features.sse42 = (info[2] & (1 << 20)) != 0;
+    features.popcnt = (info[2] & (1 << 23)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    uint64_t xcr0 = osxsave ? _xgetbv(0) : 0;
+    if (maxLeaf >= 7) {
+        __cpuidex(info, 7, 0);
+        features.avx2 = ((info[1] & (1 << 5)) != 0) && ((xcr0 & 0x6) == 0x6);
+        features.avx512vpopcntdq = ((info[1] & (1 << 16)) != 0) && ((info[1] & (1 << 31)) != 0) &&
+                                   ((info[2] & (1 << 14)) != 0) && ((xcr0 & 0xE6) == 0xE6);
+    }
+#else
+    __builtin_cpu_init();
+    features.sse42 = __builtin_cpu_supports("sse4.2");
+    features.popcnt = __builtin_cpu_supports("popcnt");
+    features.avx2 = __builtin_cpu_supports("avx2");
+#ifdef SOLARFBOW_AVX512
+    features.avx512vpopcntdq = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+                               __builtin_cpu_supports("avx512vpopcntdq");
+#endif
+#endif
+    return features;
+}
+
+const CpuFeatures& getCpuFeatures()
+{
+    static const CpuFeatures features = detectCpuFeatures();
+    return features;
+}
+
+SOLARFBOW_TARGET("sse4.2,popcnt")
+inline uint32_t distanceHammingSSE42(const uint8_t* a, const uint8_t* b, uint32_t nbBytes)
+{
+    uint64_t dist = 0;
+    uint32_t i = 0;
+    for (; i + 8 <= nbBytes; i += 8) {
+        uint64_t va, vb;
+        std::memcpy(&va, a + i, sizeof(va));
+        std::memcpy(&vb, b + i, sizeof(vb));
+        dist += _mm_popcnt_u64(va ^ vb);
+    }
+    for (; i < nbBytes; ++i)
+        dist += _mm_popcnt_u32(a[i] ^ b[i]);
+    return static_cast<uint32_t>(dist);
+}
+
+SOLARFBOW_TARGET("sse4.2")
+inline float distanceL2F32SSE42(const float* a, const float* b, uint32_t n)
+{
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+    }
+    float lanes[8];
+    _mm_storeu_ps(lanes, acc0);
+    _mm_storeu_ps(lanes + 4, acc1);
+    for (; i < n; ++i) {
+        float d = a[i] - b[i];
+        lanes[i & 7] += d * d;
+    }
+    return reduceLanes(lanes);
+}
+
+// popcount of bytes with a nibble lookup table
+SOLARFBOW_TARGET("avx2,popcnt")
+inline uint32_t distanceHammingAVX2(const uint8_t* a, const uint8_t* b, uint32_t nbBytes)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowMask = _mm256_set1_epi8(0x0F);
+    __m256i acc = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 32 <= nbBytes; i += 32) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+        __m256i count = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(v, lowMask)),
+                                        _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(count, _mm256_setzero_si256()));
+    }
+    uint64_t dist = static_cast<uint64_t>(_mm256_extract_epi64(acc, 0)) + static_cast<uint64_t>(_mm256_extract_epi64(acc, 1)) +
+                    static_cast<uint64_t>(_mm256_extract_epi64(acc, 2)) + static_cast<uint64_t>(_mm256_extract_epi64(acc, 3));
+    for (; i + 8 <= nbBytes; i += 8) {
+        uint64_t va, vb;
+        std::memcpy(&va, a + i, sizeof(va));
+        std::memcpy(&vb, b + i, sizeof(vb));
+        dist += _mm_popcnt_u64(va ^ vb);
+    }
+    for (; i < nbBytes; ++i)
+        dist += _mm_popcnt_u32(a[i] ^ b[i]);
+    return static_cast<uint32_t>(dist);
+}
+
+SOLARFBOW_TARGET("avx2")
+inline float distanceL2F32AVX2(const float* a, const float* b, uint32_t n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(d, d));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, acc);
+    for (; i < n; ++i) {
+        float d = a[i] - b[i];
+        lanes[i & 7] += d * d;
+    }
+    return reduceLanes(lanes);
+}
+
+SOLARFBOW_TARGET("avx2")
+inline uint32_t reduceEpi32AVX2(__m256i acc)
+{
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(sum));
+}
+
+// n is a multiple of 16
+SOLARFBOW_TARGET("avx2")
+inline uint32_t distanceL2U8AVX2(const uint8_t* a, const uint8_t* b, uint32_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    for (uint32_t i = 0; i < n; i += 16) {
+        __m256i d = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + i))),
+                                     _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b + i))));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+    }
+    return reduceEpi32AVX2(acc);
+}
+
+// n is a multiple of 8
+SOLARFBOW_TARGET("avx2")
+inline uint32_t distanceL2S16AVX2(const int16_t* a, const int16_t* b, uint32_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i d = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+    }
+    uint32_t dist = reduceEpi32AVX2(acc);
+    for (; i < n; ++i) {
+        int32_t d = static_cast<int32_t>(a[i]) - static_cast<int32_t>(b[i]);
+        dist += static_cast<uint32_t>(d * d);
+    }
+    return dist;
+}
+
+SOLARFBOW_TARGET("sse4.2,popcnt")
+uint32_t nearestHammingSSE42(const uint8_t* descriptor, const uint8_t* features, uint64_t stride, uint32_t n, uint32_t size)
+{
+    SOLARFBOW_NEAREST_FEATURE(uint32_t, distanceHammingSSE42, uint8_t)
+}
+
+SOLARFBOW_TARGET("sse4.2")
+uint32_t nearestL2F32SSE42(const uint8_t* descriptor, const uint8_t* features, uint64_t stride, uint32_t n, uint32_t size)
+{
+    SOLARFBOW_NEAREST_FEATURE(float, distanceL2F32SSE42, float)
+}
+
+SOLARFBOW_TARGET("avx2,popcnt")
+uint32_t nearestHammingAVX2(const uint8_t* descriptor, const uint8_t* features, uint64_t stride, uint32_t n, uint32_t size)
+{
+    SOLARFBOW_NEAREST_FEATURE(uint32_t, distanceHammingAVX2, uint8_t)
+}
+
+SOLARFBOW_TARGET("avx2")
+uint32_t nearestL2F32AVX2(const uint8_t* descriptor, const uint8_t* features, uint64_t stride, uint32_t n, uint32_t size)
+{
+    SOLARFBOW_NEAREST_FEATURE(float, distanceL2F32AVX2, float)
+}
+
+SOLARFBOW_TARGET("avx2")
+uint32_t nearestL2U8AVX2(const uint8_t* descriptor, const uint8_t* features, uint64_t stride, uint32_t n, uint32_t size)
+{
+    SOLARFBOW_NEAREST_FEATURE(uint32_t, distanceL2U8AVX2, uint8_t)
+}
+
+SOLARFBOW_TARGET("avx2")
+uint32_t nearestL2S16AVX2(const uint8_t* descriptor, const uint8_t* features, uint64_t stride, uint32_t n, uint32_t size)
+{
+    SOLARFBOW_NEAREST_FEATURE(uint32_t, distanceL2S16AVX2, int16_t)
+}
+
+#ifdef SOLARFBOW_AVX512
+SOLARFBOW_TARGET("avx512f,avx512vl,avx512vpopcntdq,popcnt")
+inline uint32_t distanceHammingAVX512(const uint8_t* a, const uint8_t* b, uint32_t nbBytes)
+{
+    __m512i acc512 = _mm512_setzero_si512();
+    uint32_t i = 0;
+    for (; i + 64 <= nbBytes; i += 64) {
+        __m512i v = _mm512_xor_si512(_mm512_loadu_si512((const void*)(a + i)), _mm512_loadu_si512((const void*)(b + i)));
+        acc512 = _mm512_add_epi64(acc512, _mm512_popcnt_epi64(v));
+    }
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 32 <= nbBytes; i += 32) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+        acc = _mm256_add_epi64(acc, _mm256_popcnt_epi64(v));
+    }
+    uint64_t lanes[8];
+    _mm512_storeu_si512((void*)lanes, acc512);
+    uint64_t dist = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    dist += static_cast<uint64_t>(_mm256_extract_epi64(acc, 0)) + static_cast<uint64_t>(_mm256_extract_epi64(acc, 1)) +
+                    static_cast<uint64_t>(_mm256_extract_epi64(acc, 2)) + static_cast<uint64_t>(_mm256_extract_epi64(acc, 3));
+    for (; i + 8 <= nbBytes; i += 8) {
+        uint64_t va, vb;
+        std::memcpy(&va, a + i, sizeof(va));
+        std::memcpy(&vb, b + i, sizeof(vb));
+        dist += _mm_popcnt_u64(va ^ vb);
+    }
+    for (; i < nbBytes; ++i)
+        dist += _mm_popcnt_u32(a[i] ^ b[i]);
+    return static_cast<uint32_t>(dist);
+}
+
+SOLARFBOW_TARGET("avx512f,avx512vl,avx512vpopcntdq,popcnt")
+uint32_t nearestHammingAVX512(const uint8_t* descriptor, const uint8_t* features, uint64_t stride, uint32_t n, uint32_t size)
+{
+    SOLARFBOW_NEAREST_FEATURE(uint32_t, distanceHammingAVX512, uint8_t)
+}
+#endif
+
+#endif
+
+void normalizeL2(fbow::fBow& bow)
+{
+    double norm = 0.;
+    for (const auto& it : bow)
+        norm += it.second.var * it.second.var;
+    if (norm > 0.) {
+        double invNorm = 1. / sqrt(norm);
+        for (auto& it : bow)
+            it.second.var *= invNorm;
+    }
+}
+
+}
+
+FrameworkReturnCode SolARFBOWVocabularyTree::readFromFile(const std::string& file)
+{
+    std::ifstream ifs(file, std::ios::binary);
+    if (!ifs.is_open()) {
+        LOG_ERROR("SolARFBOWVocabularyTree::readFromFile: cannot open {}", file);
+        return FrameworkReturnCode::_ERROR_;
+    }
+    return fromStream(ifs);
+}
+
+FrameworkReturnCode SolARFBOWVocabularyTree::saveToFile(const std::string& file) const
+{
+    std::ofstream ofs(file, std::ios::binary);
+    if (!ofs.is_open()) {
+        LOG_ERROR("SolARFBOWVocabularyTree::saveToFile: cannot open {}", file);
+        return FrameworkReturnCode::_ERROR_;
+    }
+    return toStream(ofs);
+}
+
+FrameworkReturnCode SolARFBOWVocabularyTree::fromStream(std::istream& str)
+{
+    m_params = Params();
+    m_data.clear();
+    uint64_t sig = 0;
+    str.read((char*)&sig, sizeof(sig));
+    if (!str || sig != FBOW_SIGNATURE) {
+        LOG_ERROR("SolARFBOWVocabularyTree::fromStream: invalid signature");
+        return FrameworkReturnCode::_ERROR_;
+    }
+    Params params;
+    str.read((char*)&params, sizeof(Params));
+    if (!str || params.k == 0 || params.nbBlocks == 0
+            || params.childOffStart + params.k * sizeof(NodeInfo) > params.blockSizeBytesWp
+            || params.totalSize != params.blockSizeBytesWp * params.nbBlocks) {
+        LOG_ERROR("SolARFBOWVocabularyTree::fromStream: invalid vocabulary parameters");
+        return FrameworkReturnCode::_ERROR_;
+    }
+    BlockData data(params.totalSize);
+    str.read(data.data(), params.totalSize);
+    if (!str) {
+        LOG_ERROR("SolARFBOWVocabularyTree::fromStream: truncated vocabulary data");
+        return FrameworkReturnCode::_ERROR_;
+    }
+    m_params = params;
+    m_data.swap(data);
+    return setQuantization(Quantization::NONE);
+}
+
+FrameworkReturnCode SolARFBOWVocabularyTree::toStream(std::ostream& str) const
+{
+    if (!isValid())
+        return FrameworkReturnCode::_ERROR_;
+    str.write((const char*)&FBOW_SIGNATURE, sizeof(FBOW_SIGNATURE));
+    str.write((const char*)&m_params, sizeof(Params));
+    str.write(m_data.data(), m_params.totalSize);
+    return str ? FrameworkReturnCode::_SUCCESS : FrameworkReturnCode::_ERROR_;
+}
+
+FrameworkReturnCode SolARFBOWVocabularyTree::fromVocabulary(const fbow::Vocabulary& voc)
+{
+    if (!voc.isValid())
+        return FrameworkReturnCode::_ERROR_;
+    std::stringstream ss;
+    voc.toStream(ss);
+    return fromStream(ss);
+}
+
+FrameworkReturnCode SolARFBOWVocabularyTree::toVocabulary(fbow::Vocabulary& voc) const
+{
+    std::stringstream ss;
+    if (toStream(ss) != FrameworkReturnCode::_SUCCESS)
+        return FrameworkReturnCode::_ERROR_;
+    try {
+        voc.fromStream(ss);
+    }
+    catch (const std::exception& e) {
+        LOG_ERROR("SolARFBOWVocabularyTree::toVocabulary: {}", e.what());
+        return FrameworkReturnCode::_ERROR_;
+    }
+    return voc.isValid() ? FrameworkReturnCode::_SUCCESS : FrameworkReturnCode::_ERROR_;
+}
+
+uint16_t SolARFBOWVocabularyTree::getN(uint32_t b) const
+{
+    uint16_t n;
+    std::memcpy(&n, getBlock(b), sizeof(n));
+    return n;
+}
+
+void SolARFBOWVocabularyTree::setN(uint32_t b, uint16_t n)
+{
+    std::memcpy(getBlock(b), &n, sizeof(n));
+}
+
+SolARFBOWVocabularyTree::NodeInfo* SolARFBOWVocabularyTree::getNodeInfo(uint32_t b, uint32_t i)
+{
+    return (NodeInfo*)(getBlock(b) + m_params.childOffStart + i * sizeof(NodeInfo));
+}
+
+const SolARFBOWVocabularyTree::NodeInfo* SolARFBOWVocabularyTree::getNodeInfo(uint32_t b, uint32_t i) const
+{
+    return (const NodeInfo*)(getBlock(b) + m_params.childOffStart + i * sizeof(NodeInfo));
+}
+
+char* SolARFBOWVocabularyTree::getFeature(uint32_t b, uint32_t i)
+{
+    return getBlock(b) + m_params.featureOffStart + i * m_params.descSizeBytesWp;
+}
+
+const char* SolARFBOWVocabularyTree::getFeature(uint32_t b, uint32_t i) const
+{
+    return getBlock(b) + m_params.featureOffStart + i * m_params.descSizeBytesWp;
+}
+
+double SolARFBOWVocabularyTree::featureDistance(const char* f1, const char* f2) const
+{
+    double dist = 0.;
+    if (m_params.descType == CV_8UC1) {
+        // hamming distance
+        for (int32_t i = 0; i < m_params.descSize; ++i)
+            dist += std::bitset<8>((uint8_t)(f1[i] ^ f2[i])).count();
+    }
+    else {
+        // squared L2 distance
+        const float* v1 = (const float*)f1;
+        const float* v2 = (const float*)f2;
+        for (int32_t i = 0; i < m_params.descSize / (int32_t)sizeof(float); ++i)
+            dist += (v1[i] - v2[i]) * (v1[i] - v2[i]);
+    }
+    return dist;
+}
+
+uint32_t SolARFBOWVocabularyTree::getParentId(uint32_t b) const
+{
+    uint32_t parentId;
+    std::memcpy(&parentId, getBlock(b) + sizeof(uint32_t), sizeof(parentId));
+    return parentId;
+}
+
+const uint8_t* SolARFBOWVocabularyTree::getSearchFeature(uint32_t b, uint32_t i) const
+{
+    if (m_quantization == Quantization::NONE)
+        return (const uint8_t*)getFeature(b, i);
+    return m_quantizedFeatures.data() + (static_cast<uint64_t>(b) * m_params.k + i) * m_searchDescSize;
+}
+
+FrameworkReturnCode SolARFBOWVocabularyTree::setQuantization(Quantization quantization)
+{
+    m_quantization = Quantization::NONE;
+    m_quantizedFeatures.clear();
+    m_quantizedDim = 0;
+    m_searchDescSize = static_cast<uint32_t>(m_params.descSize);
+    updateSearchKernel();
+    if (quantization == Quantization::NONE)
+        return FrameworkReturnCode::_SUCCESS;
+    if (!isValid() || (m_params.descType != CV_32FC1)) {
+        LOG_ERROR("SolARFBOWVocabularyTree::setQuantization: quantization is only available for float vocabularies");
+        return FrameworkReturnCode::_ERROR_;
+    }
+
+    // range of the centroid values
+    uint32_t dim = static_cast<uint32_t>(m_params.descSize) / sizeof(float);
+    float minValue = FLT_MAX;
+    float maxValue = -FLT_MAX;
+    for (uint32_t b = 0; b < m_params.nbBlocks; ++b)
+        for (uint32_t i = 0; i < getN(b); ++i) {
+            const float* feature = (const float*)getFeature(b, i);
+            for (uint32_t d = 0; d < dim; ++d) {
+                minValue = std::min(minValue, feature[d]);
+                maxValue = std::max(maxValue, feature[d]);
+            }
+        }
+    if (maxValue <= minValue)
+        maxValue = minValue + 1.f;
+
+    if (quantization == Quantization::UINT8) {
+        m_quantizationOffset = minValue;
+        m_quantizationScale = 255.f / (maxValue - minValue);
+        m_quantizedDim = (dim + 15) / 16 * 16;
+        m_searchDescSize = m_quantizedDim;
+    }
+    else {
+        m_quantizationOffset = 0.5f * (maxValue + minValue);
+        m_quantizationScale = INT16_QUANTIZATION_MAX / (0.5f * (maxValue - minValue));
+        m_quantizedDim = (dim + 7) / 8 * 8;
+        m_searchDescSize = m_quantizedDim * sizeof(int16_t);
+    }
+    m_quantization = quantization;
+
+    // quantize centroids once
+    m_quantizedFeatures.assign(static_cast<uint64_t>(m_params.nbBlocks) * m_params.k * m_searchDescSize, 0);
+    for (uint32_t b = 0; b < m_params.nbBlocks; ++b)
+        for (uint32_t i = 0; i < getN(b); ++i)
+            prepareDescriptor((const uint8_t*)getFeature(b, i), m_quantizedFeatures.data() + (static_cast<uint64_t>(b) * m_params.k + i) * m_searchDescSize);
+    updateSearchKernel();
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+SolARFBOWVocabularyTree::Kernel SolARFBOWVocabularyTree::getBestKernel()
+{
+    if (isKernelSupported(Kernel::AVX512))
+        return Kernel::AVX512;
+    if (isKernelSupported(Kernel::AVX2))
+        return Kernel::AVX2;
+    if (isKernelSupported(Kernel::SSE42))
+        return Kernel::SSE42;
+    return Kernel::GENERIC;
+}
+
+bool SolARFBOWVocabularyTree::isKernelSupported(Kernel kernel)
+{
+#ifdef SOLARFBOW_CPU_DISPATCH
+    const CpuFeatures& features = getCpuFeatures();
+    switch (kernel) {
+    case Kernel::SSE42:
+        return features.sse42 && features.popcnt;
+    case Kernel::AVX2:
+        return features.avx2 && features.popcnt;
+    case Kernel::AVX512:
+#ifdef SOLARFBOW_AVX512
+        return features.avx2 && features.popcnt && features.avx512vpopcntdq;
+#else
+        return false;
+#endif
+    default:
+        return true;
+    }
+#else
+    return kernel == Kernel::GENERIC;
+#endif
+}
+
+std::string SolARFBOWVocabularyTree::getKernelName(Kernel kernel)
+{
+    switch (kernel) {
+    case Kernel::SSE42:
+        return "sse4.2";
+    case Kernel::AVX2:
+        return "avx2";
+    case Kernel::AVX512:
+        return "avx512";
+    default:
+        return "generic";
+    }
+}
+
+FrameworkReturnCode SolARFBOWVocabularyTree::setKernel(Kernel kernel)
+{
+    if (!isKernelSupported(kernel)) {
+        LOG_ERROR("SolARFBOWVocabularyTree::setKernel: the {} kernel is not supported by the cpu", getKernelName(kernel));
+        return FrameworkReturnCode::_ERROR_;
+    }
+    m_kernel = kernel;
+    updateSearchKernel();
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+void SolARFBOWVocabularyTree::updateSearchKernel()
+{
+    // float kernels beyond avx2 keep 8 lanes so that distances are the same for all kernels, and quantized
+    // descriptors have no specialized kernel beyond avx2
+    const bool binary = (m_quantization == Quantization::NONE) && (m_params.descType == CV_8UC1);
+    m_featureStride = (m_quantization == Quantization::NONE) ? m_params.descSizeBytesWp : m_searchDescSize;
+    switch (m_quantization) {
+    case Quantization::UINT8:
+        m_nearestFeature = nearestL2U8Generic;
+        m_nearestFeatureSize = m_quantizedDim;
+        break;
+    case Quantization::INT16:
+        m_nearestFeature = nearestL2S16Generic;
+        m_nearestFeatureSize = m_quantizedDim;
+        break;
+    default:
+        m_nearestFeature = binary ? nearestHammingGeneric : nearestL2F32Generic;
+        m_nearestFeatureSize = binary ? m_searchDescSize : m_searchDescSize / sizeof(float);
+        break;
+    }
+#ifdef SOLARFBOW_CPU_DISPATCH
+    switch (m_kernel) {
+    case Kernel::SSE42:
+        if (m_quantization == Quantization::NONE)
+            m_nearestFeature = binary ? nearestHammingSSE42 : nearestL2F32SSE42;
+        break;
+    case Kernel::AVX2:
+    case Kernel::AVX512:
+        if (m_quantization == Quantization::UINT8)
+            m_nearestFeature = nearestL2U8AVX2;
+        else if (m_quantization == Quantization::INT16)
+            m_nearestFeature = nearestL2S16AVX2;
+        else
+            m_nearestFeature = binary ? nearestHammingAVX2 : nearestL2F32AVX2;
+#ifdef SOLARFBOW_AVX512
+        if (binary && (m_kernel == Kernel::AVX512))
+            m_nearestFeature = nearestHammingAVX512;
+#endif
+        break;
+    default:
+        break;
+    }
+#endif
+}
+
+void SolARFBOWVocabularyTree::prepareDescriptor(const uint8_t* descriptor, uint8_t* prepared) const
+{
+    if (m_quantization == Quantization::NONE) {
+        std::memcpy(prepared, descriptor, m_searchDescSize);
+        return;
+    }
+    uint32_t dim = static_cast<uint32_t>(m_params.descSize) / sizeof(float);
+    const float* values = (const float*)descriptor;
+    if (m_quantization == Quantization::UINT8) {
+        for (uint32_t d = 0; d < dim; ++d) {
+            float q = std::round((values[d] - m_quantizationOffset) * m_quantizationScale);
+            prepared[d] = static_cast<uint8_t>(std::min(std::max(q, 0.f), 255.f));
+        }
+        std::memset(prepared + dim, 0, m_quantizedDim - dim);
+    }
+    else {
+        int16_t* quantized = (int16_t*)prepared;
+        for (uint32_t d = 0; d < dim; ++d) {
+            float q = std::round((values[d] - m_quantizationOffset) * m_quantizationScale);
+            quantized[d] = static_cast<int16_t>(std::min(std::max(q, -INT16_QUANTIZATION_MAX), INT16_QUANTIZATION_MAX));
+        }
+        std::memset(quantized + dim, 0, (m_quantizedDim - dim) * sizeof(int16_t));
+    }
+}
+
+void SolARFBOWVocabularyTree::prepareDescriptors(const cv::Mat& descriptors, std::vector<uint8_t>& prepared) const
+{
+    prepared.resize(static_cast<size_t>(descriptors.rows) * m_searchDescSize);
+    for (int r = 0; r < descriptors.rows; ++r)
+        prepareDescriptor(descriptors.ptr<uint8_t>(r), prepared.data() + static_cast<size_t>(r) * m_searchDescSize);
+}
+
+void SolARFBOWVocabularyTree::prepareDescriptors(const cv::Mat& descriptors, const std::vector<int>& rows, std::vector<uint8_t>& prepared) const
+{
+    prepared.resize(rows.size() * m_searchDescSize);
+    for (size_t i = 0; i < rows.size(); ++i)
+        prepareDescriptor(descriptors.ptr<uint8_t>(rows[i]), prepared.data() + i * m_searchDescSize);
+}
+
+float SolARFBOWVocabularyTree::distance(const uint8_t* descriptor1, const uint8_t* descriptor2) const
+{
+    switch (m_quantization) {
+    case Quantization::UINT8:
+        return std::sqrt(static_cast<float>(distanceL2U8(descriptor1, descriptor2, m_quantizedDim))) / m_quantizationScale;
+    case Quantization::INT16:
+        return std::sqrt(static_cast<float>(distanceL2S16((const int16_t*)descriptor1, (const int16_t*)descriptor2, m_quantizedDim))) / m_quantizationScale;
+    default:
+        if (m_params.descType == CV_8UC1)
+            return static_cast<float>(distanceHamming(descriptor1, descriptor2, m_searchDescSize));
+        return std::sqrt(distanceL2F32((const float*)descriptor1, (const float*)descriptor2, m_searchDescSize / sizeof(float)));
+    }
+}
+
+void SolARFBOWVocabularyTree::findWord(const uint8_t* descriptor, uint32_t level, uint32_t& wordId, float& weight, uint32_t& levelNode) const
+{
+    uint32_t b = 0;
+    uint32_t depth = 0;
+    while (true) {
+        // node at the requested level, or deepest node if a leaf is reached before
+        if (depth <= level)
+            levelNode = getParentId(b);
+        uint16_t n = getN(b);
+        // fetch the blocks of the next level while this one is searched
+        for (uint32_t i = 0; i < n; ++i) {
+            const NodeInfo* info = getNodeInfo(b, i);
+            if (!info->isLeaf()) {
+                SOLARFBOW_PREFETCH(getBlock(info->getChildBlock()));
+                SOLARFBOW_PREFETCH(getSearchFeature(info->getChildBlock(), 0));
+            }
+        }
+        uint32_t best = m_nearestFeature(descriptor, getSearchFeature(b, 0), m_featureStride, n, m_nearestFeatureSize);
+        const NodeInfo* info = getNodeInfo(b, best);
+        if (info->isLeaf()) {
+            wordId = info->getId();
+            weight = info->weight;
+            return;
+        }
+        b = info->getChildBlock();
+        depth++;
+    }
+}
+
+void SolARFBOWVocabularyTree::transform(const cv::Mat& features, int level, fbow::fBow& bow, fbow::fBow2& bow2) const
+{
+    transformRows(features, nullptr, static_cast<size_t>(features.rows), level, bow, bow2);
+}
+
+void SolARFBOWVocabularyTree::transform(const cv::Mat& features, const std::vector<int>& rows, int level, fbow::fBow& bow, fbow::fBow2& bow2) const
+{
+    transformRows(features, rows.data(), rows.size(), level, bow, bow2);
+}
+
+void SolARFBOWVocabularyTree::transformRows(const cv::Mat& features, const int* rows, size_t nbRows, int level, fbow::fBow& bow, fbow::fBow2& bow2) const
+{
+    bow.clear();
+    bow2.clear();
+    std::vector<uint8_t> prepared(m_searchDescSize);
+    for (size_t i = 0; i < nbRows; ++i) {
+        int r = rows ? rows[i] : static_cast<int>(i);
+        uint32_t wordId, levelNode;
+        float weight;
+        prepareDescriptor(features.ptr<uint8_t>(r), prepared.data());
+        findWord(prepared.data(), static_cast<uint32_t>(level), wordId, weight, levelNode);
+        bow[wordId].var += weight;
+        bow2[levelNode].push_back(static_cast<uint32_t>(r));
+    }
+    normalizeL2(bow);
+}
+
+void SolARFBOWVocabularyTree::transform(const cv::Mat& features, int level, SolARFBOWFlatBoW& bow) const
+{
+    bow.clear();
+    bow.prepared.resize(m_searchDescSize);
+    for (int r = 0; r < features.rows; ++r) {
+        uint32_t wordId, levelNode;
+        float weight;
+        prepareDescriptor(features.ptr<uint8_t>(r), bow.prepared.data());
+        findWord(bow.prepared.data(), static_cast<uint32_t>(level), wordId, weight, levelNode);
+        bow.wordEntries.emplace_back((static_cast<uint64_t>(wordId) << 32) | static_cast<uint32_t>(r), weight);
+        bow.nodeEntries.push_back((static_cast<uint64_t>(levelNode) << 32) | static_cast<uint32_t>(r));
+    }
+    // weights of a word are summed in row order, as in the fbow map
+    std::sort(bow.wordEntries.begin(), bow.wordEntries.end());
+    for (const auto& entry : bow.wordEntries) {
+        uint32_t wordId = static_cast<uint32_t>(entry.first >> 32);
+        if (bow.words.empty() || bow.words.back().first != wordId)
+            bow.words.emplace_back(wordId, 0.f);
+        bow.words.back().second += entry.second;
+    }
+    double norm = 0.;
+    for (const auto& it : bow.words)
+        norm += it.second * it.second;
+    if (norm > 0.) {
+        double invNorm = 1. / sqrt(norm);
+        for (auto& it : bow.words)
+            it.second *= invNorm;
+    }
+    std::sort(bow.nodeEntries.begin(), bow.nodeEntries.end());
+    for (uint64_t entry : bow.nodeEntries) {
+        uint32_t levelNode = static_cast<uint32_t>(entry >> 32);
+        if (!bow.nodes.empty() && bow.nodes.back().first == levelNode)
+            bow.nodes.back().second++;
+        else
+            bow.nodes.emplace_back(levelNode, static_cast<uint32_t>(bow.rows.size() + 1));
+        bow.rows.push_back(static_cast<uint32_t>(entry));
+    }
+}
+
+void SolARFBOWVocabularyTree::transform(const cv::Mat& features, fbow::fBow& bow) const
+{
+    bow.clear();
+    std::vector<uint8_t> prepared(m_searchDescSize);
+    for (int r = 0; r < features.rows; ++r) {
+        uint32_t wordId, levelNode;
+        float weight;
+        prepareDescriptor(features.ptr<uint8_t>(r), prepared.data());
+        findWord(prepared.data(), 0, wordId, weight, levelNode);
+        bow[wordId].var += weight;
+    }
+    normalizeL2(bow);
+}
+
+uint32_t SolARFBOWVocabularyTree::transform(const uint8_t* descriptor, int level) const
+{
+    uint32_t wordId, levelNode;
+    float weight;
+    findWord(descriptor, static_cast<uint32_t>(level), wordId, weight, levelNode);
+    return levelNode;
+}
+
+uint32_t SolARFBOWVocabularyTree::getNbWords() const
+{
+    uint32_t nbWords = 0;
+    for (uint32_t b = 0; b < m_params.nbBlocks; ++b)
+        for (uint32_t i = 0; i < getN(b); ++i)
+            if (getNodeInfo(b, i)->isLeaf())
+                nbWords++;
+    return nbWords;
+}
+
+uint32_t SolARFBOWVocabularyTree::compact(const std::map<uint32_t, uint32_t>& wordUsage, uint32_t minOccupancy, uint32_t protectedLevels,
+                                          std::map<uint32_t, uint32_t>& wordRemap)
+{
+    wordRemap.clear();
+    if (!isValid())
+        return 0;
+
+    // get depth and parent node of each block, in breadth-first order
+    std::vector<uint32_t> depth(m_params.nbBlocks, 0);
+    std::vector<std::pair<uint32_t, uint32_t>> parent(m_params.nbBlocks, { 0, 0 });
+    std::vector<uint32_t> order(1, 0);
+    for (size_t i = 0; i < order.size(); ++i) {
+        uint32_t b = order[i];
+        for (uint32_t n = 0; n < getN(b); ++n) {
+            const NodeInfo* info = getNodeInfo(b, n);
+            if (info->isLeaf())
+                continue;
+            uint32_t child = info->getChildBlock();
+            depth[child] = depth[b] + 1;
+            parent[child] = { b, n };
+            order.push_back(child);
+        }
+    }
+
+    std::map<uint32_t, uint32_t> usage(wordUsage);
+    auto getUsage = [&usage](uint32_t id) {
+        auto it = usage.find(id);
+        return it == usage.end() ? 0u : it->second;
+    };
+
+    // deepest blocks first, so that collapsed blocks can make their parent block collapsible
+    uint32_t nbRemovedWords = 0;
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        uint32_t b = *it;
+        if (depth[b] < protectedLevels)
+            continue;
+        uint16_t n = getN(b);
+        bool allLeaves = true;
+        uint64_t totalUsage = 0;
+        uint32_t best = 0;
+        uint32_t bestUsage = 0;
+        for (uint32_t i = 0; i < n && allLeaves; ++i) {
+            const NodeInfo* info = getNodeInfo(b, i);
+            if (!info->isLeaf()) {
+                allLeaves = false;
+                break;
+            }
+            uint32_t u = getUsage(info->getId());
+            totalUsage += u;
+            if (i == 0 || u > bestUsage) {
+                best = i;
+                bestUsage = u;
+            }
+        }
+        // only blocks of leaves are modified, so that positions of internal nodes stay unchanged
+        if (!allLeaves || n == 0)
+            continue;
+        const NodeInfo bestInfo = *getNodeInfo(b, best);
+        if ((b != 0) && (totalUsage < minOccupancy) && (depth[b] > protectedLevels)) {
+            // collapse the block: its parent node becomes a leaf
+            for (uint32_t i = 0; i < n; ++i) {
+                if (i == best)
+                    continue;
+                wordRemap[getNodeInfo(b, i)->getId()] = bestInfo.getId();
+                nbRemovedWords++;
+            }
+            NodeInfo* parentInfo = getNodeInfo(parent[b].first, parent[b].second);
+            parentInfo->setId(bestInfo.getId());
+            parentInfo->weight = bestInfo.weight;
+            usage[bestInfo.getId()] = static_cast<uint32_t>(totalUsage);
+            continue;
+        }
+        // prune the rarely used leaves, each one being replaced by its closest remaining sibling
+        std::vector<uint32_t> kept;
+        for (uint32_t i = 0; i < n; ++i)
+            if ((i == best) || (getUsage(getNodeInfo(b, i)->getId()) >= minOccupancy))
+                kept.push_back(i);
+        if (kept.size() == n)
+            continue;
+        size_t k = 0;
+        for (uint32_t i = 0; i < n; ++i) {
+            if ((k < kept.size()) && (kept[k] == i)) {
+                k++;
+                continue;
+            }
+            uint32_t closest = best;
+            double closestDist = -1.;
+            for (const auto& j : kept) {
+                double dist = featureDistance(getFeature(b, i), getFeature(b, j));
+                if ((closestDist < 0.) || (dist < closestDist)) {
+                    closest = j;
+                    closestDist = dist;
+                }
+            }
+            wordRemap[getNodeInfo(b, i)->getId()] = getNodeInfo(b, closest)->getId();
+            nbRemovedWords++;
+        }
+        for (uint32_t j = 0; j < kept.size(); ++j) {
+            if (kept[j] == j)
+                continue;
+            std::memcpy(getFeature(b, j), getFeature(b, kept[j]), m_params.descSizeBytesWp);
+            *getNodeInfo(b, j) = *getNodeInfo(b, kept[j]);
+        }
+        for (uint32_t j = static_cast<uint32_t>(kept.size()); j < n; ++j) {
+            std::memset(getFeature(b, j), 0, m_params.descSizeBytesWp);
+            std::memset(getNodeInfo(b, j), 0, sizeof(NodeInfo));
+        }
+        setN(b, static_cast<uint16_t>(kept.size()));
+    }
+
+    // a removed word can be replaced by a word which has been collapsed afterwards
+    for (auto& it : wordRemap) {
+        auto next = wordRemap.find(it.second);
+        while (next != wordRemap.end()) {
+            it.second = next->second;
+            next = wordRemap.find(it.second);
+        }
+    }
+
+    // drop collapsed blocks and reorder the remaining ones
+    reorderBreadthFirst();
+    return nbRemovedWords;
+}
+
+void SolARFBOWVocabularyTree::reorderBreadthFirst()
+{
+    if (!isValid())
+        return;
+    // collect the reachable blocks in breadth-first order
+    std::vector<uint32_t> order(1, 0);
+    for (size_t i = 0; i < order.size(); ++i) {
+        uint32_t b = order[i];
+        for (uint32_t n = 0; n < getN(b); ++n) {
+            const NodeInfo* info = getNodeInfo(b, n);
+            if (!info->isLeaf())
+                order.push_back(info->getChildBlock());
+        }
+    }
+    reorderBlocks(order, m_params);
+}
+
+void SolARFBOWVocabularyTree::getLevelNodeAncestors(uint32_t level, uint32_t ancestorLevel, std::map<uint32_t, uint32_t>& ancestors) const
+{
+    ancestors.clear();
+    if (!isValid())
+        return;
+    // blocks with their depth and the node id of their ancestor at ancestorLevel. The search reports the node of
+    // the block at level, or of a shallower block if a leaf is reached before.
+    struct Item {
+        uint32_t block;
+        uint32_t depth;
+        uint32_t ancestor;
+    };
+    std::vector<Item> stack(1, { 0, 0, getParentId(0) });
+    while (!stack.empty()) {
+        Item item = stack.back();
+        stack.pop_back();
+        uint32_t node = getParentId(item.block);
+        if (item.depth <= ancestorLevel)
+            item.ancestor = node;
+        ancestors[node] = item.ancestor;
+        if (item.depth >= level)
+            continue;
+        for (uint32_t n = 0; n < getN(item.block); ++n) {
+            const NodeInfo* info = getNodeInfo(item.block, n);
+            if (!info->isLeaf())
+                stack.push_back({ info->getChildBlock(), item.depth + 1, item.ancestor });
+        }
+    }
+}
+
+void SolARFBOWVocabularyTree::getLevelNodeCentroids(uint32_t level, std::map<uint32_t, std::vector<uint8_t>>& centroids) const
+{
+    centroids.clear();
+    if (!isValid())
+        return;
+    // the centroid of the node of a block is stored in its parent block
+    std::vector<std::pair<uint32_t, uint32_t>> stack(1, { 0, 0 });
+    while (!stack.empty()) {
+        uint32_t b = stack.back().first;
+        uint32_t depth = stack.back().second;
+        stack.pop_back();
+        if (depth >= level)
+            continue;
+        for (uint32_t n = 0; n < getN(b); ++n) {
+            const NodeInfo* info = getNodeInfo(b, n);
+            if (info->isLeaf())
+                continue;
+            const uint8_t* feature = (const uint8_t*)getFeature(b, n);
+            centroids[getParentId(info->getChildBlock())].assign(feature, feature + m_params.descSize);
+            stack.push_back({ info->getChildBlock(), depth + 1 });
+        }
+    }
+}
+
+void SolARFBOWVocabularyTree::optimizeLayout(uint32_t nbTopLevels)
+{
+    if (!isValid())
+        return;
+    // top levels in breadth-first order
+    std::vector<uint32_t> order(1, 0);
+    std::vector<uint32_t> subtrees;
+    uint32_t depth = 0;
+    for (size_t levelStart = 0; levelStart < order.size(); ++depth) {
+        size_t levelEnd = order.size();
+        for (size_t i = levelStart; i < levelEnd; ++i)
+            for (uint32_t n = 0; n < getN(order[i]); ++n) {
+                const NodeInfo* info = getNodeInfo(order[i], n);
+                if (info->isLeaf())
+                    continue;
+                if (depth + 1 < nbTopLevels)
+                    order.push_back(info->getChildBlock());
+                else
+                    subtrees.push_back(info->getChildBlock());
+            }
+        levelStart = levelEnd;
+    }
+    // then each subtree below them contiguously, in depth-first order
+    for (const auto& root : subtrees) {
+        std::vector<uint32_t> stack(1, root);
+        while (!stack.empty()) {
+            uint32_t b = stack.back();
+            stack.pop_back();
+            order.push_back(b);
+            for (uint32_t n = getN(b); n > 0; --n) {
+                const NodeInfo* info = getNodeInfo(b, n - 1);
+                if (!info->isLeaf())
+                    stack.push_back(info->getChildBlock());
+            }
+        }
+    }
+
+    // node information first, then centroids starting on a cache line and never straddling one
+    const uint64_t cacheLine = CacheLineAllocator<char>::ALIGNMENT;
+    auto roundUp = [](uint64_t v, uint64_t a) { return (v + a - 1) / a * a; };
+    Params params = m_params;
+    uint64_t descSize = static_cast<uint64_t>(m_params.descSize);
+    if (descSize <= cacheLine) {
+        params.descSizeBytesWp = 16;
+        while (params.descSizeBytesWp < descSize)
+            params.descSizeBytesWp *= 2;
+    }
+    else
+        params.descSizeBytesWp = roundUp(descSize, cacheLine);
+    params.alignment = std::max(m_params.alignment, static_cast<uint32_t>(cacheLine));
+    params.childOffStart = 2 * sizeof(uint32_t);
+    params.featureOffStart = roundUp(params.childOffStart + params.k * sizeof(NodeInfo), cacheLine);
+    params.blockSizeBytesWp = roundUp(params.featureOffStart + params.k * params.descSizeBytesWp, cacheLine);
+    reorderBlocks(order, params);
+}
+
+void SolARFBOWVocabularyTree::reorderBlocks(const std::vector<uint32_t>& order, const Params& params)
+{
+    std::vector<uint32_t> newIndex(m_params.nbBlocks, 0);
+    for (size_t i = 0; i < order.size(); ++i)
+        newIndex[order[i]] = static_cast<uint32_t>(i);
+    // copy blocks to their new position and update the children references
+    BlockData data(order.size() * params.blockSizeBytesWp, 0);
+    for (size_t i = 0; i < order.size(); ++i) {
+        const char* src = getBlock(order[i]);
+        char* dst = data.data() + i * params.blockSizeBytesWp;
+        uint16_t n = getN(order[i]);
+        // number of nodes and parent id
+        std::memcpy(dst, src, 2 * sizeof(uint32_t));
+        for (uint32_t j = 0; j < n; ++j) {
+            NodeInfo* info = (NodeInfo*)(dst + params.childOffStart + j * sizeof(NodeInfo));
+            std::memcpy(info, src + m_params.childOffStart + j * sizeof(NodeInfo), sizeof(NodeInfo));
+            if (!info->isLeaf())
+                info->idOrChildBlock = newIndex[info->getChildBlock()];
+            std::memcpy(dst + params.featureOffStart + j * params.descSizeBytesWp,
+                        src + m_params.featureOffStart + j * m_params.descSizeBytesWp, m_params.descSize);
+        }
+    }
+    m_data.swap(data);
+    m_params = params;
+    m_params.nbBlocks = static_cast<uint32_t>(order.size());
+    m_params.totalSize = m_params.blockSizeBytesWp * m_params.nbBlocks;
+    // quantized centroids follow the new block order
+    setQuantization(m_quantization);
+}
+
+FrameworkReturnCode SolARFBOWVocabularyTree::readWordUsage(const std::string& file, std::map<uint32_t, uint32_t>& wordUsage)
+{
+    std::ifstream ifs(file);
+    if (!ifs.is_open()) {
+        LOG_ERROR("SolARFBOWVocabularyTree::readWordUsage: cannot open {}", file);
+        return FrameworkReturnCode::_ERROR_;
+    }
+    uint32_t id, count;
+    while (ifs >> id >> count)
+        wordUsage[id] += count;
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+FrameworkReturnCode SolARFBOWVocabularyTree::writeWordUsage(const std::string& file, const std::map<uint32_t, uint32_t>& wordUsage)
+{
+    std::ofstream ofs(file);
+    if (!ofs.is_open()) {
+        LOG_ERROR("SolARFBOWVocabularyTree::writeWordUsage: cannot open {}", file);
+        return FrameworkReturnCode::_ERROR_;
+    }
+    for (const auto& it : wordUsage)
+        ofs << it.first << " " << it.second << std::endl;
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+FrameworkReturnCode SolARFBOWVocabularyTree::readWordRemap(const std::string& file, std::map<uint32_t, uint32_t>& wordRemap)
+{
+    std::ifstream ifs(file);
+    if (!ifs.is_open()) {
+        LOG_ERROR("SolARFBOWVocabularyTree::readWordRemap: cannot open {}", file);
+        return FrameworkReturnCode::_ERROR_;
+    }
+    uint32_t oldId, newId;
+    while (ifs >> oldId >> newId)
+        wordRemap[oldId] = newId;
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+FrameworkReturnCode SolARFBOWVocabularyTree::writeWordRemap(const std::string& file, const std::map<uint32_t, uint32_t>& wordRemap)
+{
+    std::ofstream ofs(file);
+    if (!ofs.is_open()) {
+        LOG_ERROR("SolARFBOWVocabularyTree::writeWordRemap: cannot open {}", file);
+        return FrameworkReturnCode::_ERROR_;
+    }
+    for (const auto& it : wordRemap)
+        ofs << it.first << " " << it.second << std::endl;
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+}
+}
+}
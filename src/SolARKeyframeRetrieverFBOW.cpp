@@ -16,7 +16,13 @@
 
 #include "SolARKeyframeRetrieverFBOW.h"
 #include "SolARFBOWHelper.h"
+#include "SolARFBOWQueryScratch.h"
 #include <core/Log.h>
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <tuple>
 
 namespace xpcf = org::bcom::xpcf;
 
@@ -28,6 +34,11 @@ using namespace datastructure;
 namespace MODULES {
 namespace FBOW {
 
+// number of candidates scored between two deadline checks of a bounded retrieve
+static const size_t BUDGET_SLICE_SIZE = 32;
+// number of keyframe changes kept for the query sessions
+static const size_t MAX_MODEL_CHANGES = 4096;
+
 SolARKeyframeRetrieverFBOW::SolARKeyframeRetrieverFBOW():ConfigurableBase(xpcf::toUUID<SolARKeyframeRetrieverFBOW>())
 {
     addInterface<api::reloc::IKeyframeRetriever>(this);
@@ -38,228 +49,2726 @@ SolARKeyframeRetrieverFBOW::SolARKeyframeRetrieverFBOW():ConfigurableBase(xpcf::
 	declareProperty("matchingDistanceRatio", m_distanceRatio);
 	declareProperty("matchingDistanceMax", m_distanceMax);
     declareProperty("distanceMetricId", m_distanceMetricId);
+    declareProperty("compactionUsagePath", m_compactionUsagePath);
+    declareProperty("compactionMinOccupancy", m_compactionMinOccupancy);
+    declareProperty("wordRemapPath", m_wordRemapPath);
+    declareProperty("layoutTopLevels", m_layoutTopLevels);
+    declareProperty("descriptorQuantization", m_descriptorQuantization);
+    declareProperty("transformBackend", m_transformBackend);
+    declareProperty("transformKernel", m_transformKernel);
+    declareProperty("nbThreads", m_nbThreads);
+    declareProperty("parallelScoringMinCandidates", m_parallelScoringMinCandidates);
+    declareProperty("coarseLevel", m_coarseLevel);
+    declareProperty("coarseShortlistSize", m_coarseShortlistSize);
+    declareProperty("coarseMinScoreRatio", m_coarseMinScoreRatio);
+    declareProperty("signatureThreshold", m_signatureThreshold);
+    declareProperty("asyncIndexing", m_asyncIndexing);
+    declareProperty("indexingQueueSize", m_indexingQueueSize);
+    declareProperty("memoryBudget", m_memoryBudget);
+    declareProperty("spillPath", m_spillPath);
+    declareProperty("segmentPath", m_segmentPath);
+    declareProperty("segmentMaxKeyframes", m_segmentMaxKeyframes);
+    declareProperty("segmentMergeFactor", m_segmentMergeFactor);
+    declareProperty("tombstoneRatio", m_tombstoneRatio);
+    declareProperty("tombstoneCompactionBatch", m_tombstoneCompactionBatch);
+    declareProperty("duplicateThreshold", m_duplicateThreshold);
+    declareProperty("duplicateNeighbours", m_duplicateNeighbours);
+    declareProperty("duplicatePolicy", m_duplicatePolicy);
+    m_segmentSet = std::make_shared<SegmentSet>();
+    m_keyframeTombstones = std::make_shared<KeyframeTombstones>();
 
    LOG_DEBUG("SolARKeyframeRetrieverFBOW constructor");
 
 }
 
-SolARKeyframeRetrieverFBOW::~SolARKeyframeRetrieverFBOW()
+SolARKeyframeRetrieverFBOW::~SolARKeyframeRetrieverFBOW()
+{
+    waitVocabularySwap();
+    stopIndexing();
+    clearSegments();
+    LOG_DEBUG(" SolARKeyframeRetrieverFBOW destructor")
+}
+
+xpcf::XPCFErrorCode SolARKeyframeRetrieverFBOW::onConfigured()
+{
+    LOG_DEBUG(" SolARKeyframeRetrieverFBOW onConfigured");
+
+    // Load a vocabulary from m_VOCpath
+	std::ifstream file(m_VOCPath);
+	if (!file.is_open())
+		LOG_ERROR(" SolARKeyframeRetrieverFBOW onConfigured: Cannot load the vocabulary from file");
+	file.close();
+    m_VOC->readFromFile(m_VOCPath);
+    if (!m_VOC->isValid())
+        return xpcf::XPCFErrorCode::_ERROR_INVALID_ARGUMENT;
+	LOG_DEBUG("Descriptor name: {}", m_VOC->getDescName());
+	LOG_DEBUG("Descriptor type: {}", m_VOC->getDescType());
+	LOG_DEBUG("Descriptor size: {}", m_VOC->getDescSize());	
+	LOG_DEBUG("Nb of cluster per node: {}", m_VOC->getK());
+
+    // Load the remap table of a vocabulary compacted offline
+    m_wordRemap.clear();
+    if (!m_wordRemapPath.empty() && (SolARFBOWVocabularyTree::readWordRemap(m_wordRemapPath, m_wordRemap) != FrameworkReturnCode::_SUCCESS))
+        return xpcf::XPCFErrorCode::_ERROR_INVALID_ARGUMENT;
+
+    // Compact the vocabulary according to word usage statistics
+    if (!m_compactionUsagePath.empty()) {
+        std::map<uint32_t, uint32_t> wordUsage;
+        SolARFBOWVocabularyTree vocTree;
+        if ((SolARFBOWVocabularyTree::readWordUsage(m_compactionUsagePath, wordUsage) != FrameworkReturnCode::_SUCCESS) ||
+            (vocTree.fromVocabulary(*m_VOC) != FrameworkReturnCode::_SUCCESS)) {
+            LOG_ERROR(" SolARKeyframeRetrieverFBOW onConfigured: Cannot compact the vocabulary");
+            return xpcf::XPCFErrorCode::_ERROR_INVALID_ARGUMENT;
+        }
+        uint32_t nbWords = vocTree.getNbWords();
+        std::map<uint32_t, uint32_t> wordRemap;
+        // levels up to m_level are kept unchanged so that BoW level features stay valid
+        uint32_t nbRemovedWords = vocTree.compact(wordUsage, static_cast<uint32_t>(std::max(m_compactionMinOccupancy, 0)), static_cast<uint32_t>(m_level), wordRemap);
+        if (vocTree.toVocabulary(*m_VOC) != FrameworkReturnCode::_SUCCESS)
+            return xpcf::XPCFErrorCode::_ERROR_INVALID_ARGUMENT;
+        // chain the offline remap table with the new one
+        for (auto& it : m_wordRemap) {
+            auto itRemap = wordRemap.find(it.second);
+            if (itRemap != wordRemap.end())
+                it.second = itRemap->second;
+        }
+        m_wordRemap.insert(wordRemap.begin(), wordRemap.end());
+        LOG_INFO("Vocabulary compacted: {} words removed over {}, {} blocks", nbRemovedWords, nbWords, vocTree.getNbBlocks());
+    }
+
+    if ((m_duplicatePolicy != "reject") && (m_duplicatePolicy != "merge")) {
+        LOG_ERROR(" SolARKeyframeRetrieverFBOW onConfigured: Unknown duplicate policy {}", m_duplicatePolicy);
+        return xpcf::XPCFErrorCode::_ERROR_INVALID_ARGUMENT;
+    }
+
+    // Layout, quantization and transform backend of the vocabulary
+    if (prepareVocabulary(*m_VOC, m_VOCTree, m_useVOCTree) != FrameworkReturnCode::_SUCCESS)
+        return xpcf::XPCFErrorCode::_ERROR_INVALID_ARGUMENT;
+
+    // Vocabulary memory and nodes used to account the memory of a loaded keyframe retrieval model
+    if (computeVocabularyMemory(*m_VOC, m_VOCTree, m_useVOCTree, m_vocabularyMemory, m_vocabularyNodes) != FrameworkReturnCode::_SUCCESS)
+        return xpcf::XPCFErrorCode::_ERROR_INVALID_ARGUMENT;
+    m_scoringType = static_cast<ScoringType>(m_distanceMetricId);
+    if ((m_distanceMetricId < 0) || (m_distanceMetricId > static_cast<int>(ScoringType::KLS))) {
+        LOG_WARNING("Invalid BoW metric ID {}, use default L2", m_distanceMetricId);
+        m_scoringType = ScoringType::L2_NORM;
+    }
+    rebuildMemoryAccounting();
+
+    // Ancestors of the level nodes used by the coarse stage of retrieve
+    clearCoarseFeatures();
+    if (computeCoarseAncestors(m_level, m_coarseAncestors) != FrameworkReturnCode::_SUCCESS)
+        return xpcf::XPCFErrorCode::_ERROR_INVALID_ARGUMENT;
+
+    // Centroids and projections of the residual signatures voting for candidates
+    clearSignatures();
+    if (computeHammingEmbedding(m_level, m_hammingEmbedding) != FrameworkReturnCode::_SUCCESS)
+        return xpcf::XPCFErrorCode::_ERROR_INVALID_ARGUMENT;
+    m_threadPool = std::make_unique<SolARFBOWThreadPool>(static_cast<uint32_t>(std::max(m_nbThreads, 0)));
+
+    // Open the spill file used beyond the memory budget
+    clearSpill();
+    if ((m_memoryBudget > 0) && (m_spill.open(m_spillPath) != FrameworkReturnCode::_SUCCESS))
+        return xpcf::XPCFErrorCode::_ERROR_INVALID_ARGUMENT;
+
+    // Start the indexing thread
+    stopIndexing();
+    if (m_asyncIndexing) {
+        m_stopIndexing = false;
+        m_indexingThread = std::thread(&SolARKeyframeRetrieverFBOW::indexingLoop, this);
+    }
+
+    // Start the thread writing and merging index segments
+    restartSegments();
+
+    return xpcf::XPCFErrorCode::_SUCCESS;
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::prepareVocabulary(fbow::Vocabulary& voc, SolARFBOWVocabularyTree& vocTree, bool& useVOCTree) const
+{
+    // Reorder the vocabulary nodes for cache-friendly traversals
+    if (m_layoutTopLevels > 0) {
+        SolARFBOWVocabularyTree layoutTree;
+        if (layoutTree.fromVocabulary(voc) != FrameworkReturnCode::_SUCCESS)
+            return FrameworkReturnCode::_ERROR_;
+        layoutTree.optimizeLayout(static_cast<uint32_t>(m_layoutTopLevels));
+        if (layoutTree.toVocabulary(voc) != FrameworkReturnCode::_SUCCESS)
+            return FrameworkReturnCode::_ERROR_;
+        LOG_INFO("Vocabulary layout optimized: {} top levels breadth-first, {} bytes", m_layoutTopLevels, layoutTree.getDataSize());
+    }
+
+    // Quantize the centroids of a float vocabulary
+    useVOCTree = false;
+    if ((m_transformBackend != "fbow") && (m_transformBackend != "cpu")) {
+        LOG_ERROR("SolARKeyframeRetrieverFBOW::prepareVocabulary: Unknown transform backend {}", m_transformBackend);
+        return FrameworkReturnCode::_ERROR_;
+    }
+    if (m_descriptorQuantization != "none") {
+        SolARFBOWVocabularyTree::Quantization quantization;
+        if (m_descriptorQuantization == "uint8")
+            quantization = SolARFBOWVocabularyTree::Quantization::UINT8;
+        else if (m_descriptorQuantization == "int16")
+            quantization = SolARFBOWVocabularyTree::Quantization::INT16;
+        else {
+            LOG_ERROR("SolARKeyframeRetrieverFBOW::prepareVocabulary: Unknown descriptor quantization {}", m_descriptorQuantization);
+            return FrameworkReturnCode::_ERROR_;
+        }
+        if (voc.getDescType() != CV_32FC1) {
+            LOG_WARNING("Descriptor quantization is only available for float vocabularies, {} is ignored", m_descriptorQuantization);
+        }
+        else {
+            if ((vocTree.fromVocabulary(voc) != FrameworkReturnCode::_SUCCESS) ||
+                (vocTree.setQuantization(quantization) != FrameworkReturnCode::_SUCCESS))
+                return FrameworkReturnCode::_ERROR_;
+            useVOCTree = true;
+            LOG_INFO("Vocabulary quantized to {}", m_descriptorQuantization);
+        }
+    }
+
+    // Select the cpu kernel searching the vocabulary tree. Float distances are not reduced in the order of fbow, which
+    // depends on its build, so near-ties could select other words: unquantized float vocabularies keep fbow
+    if (m_transformBackend == "cpu" && !useVOCTree && (voc.getDescType() == CV_32FC1)) {
+        LOG_WARNING("The cpu transform backend is only available for binary and quantized vocabularies, fbow is used");
+    }
+    else if (m_transformBackend == "cpu" && !useVOCTree) {
+        if ((vocTree.fromVocabulary(voc) != FrameworkReturnCode::_SUCCESS) ||
+            (vocTree.setQuantization(SolARFBOWVocabularyTree::Quantization::NONE) != FrameworkReturnCode::_SUCCESS))
+            return FrameworkReturnCode::_ERROR_;
+        useVOCTree = true;
+    }
+    if (useVOCTree) {
+        SolARFBOWVocabularyTree::Kernel kernel = SolARFBOWVocabularyTree::getBestKernel();
+        if (m_transformKernel != "auto") {
+            bool found = false;
+            for (auto k : { SolARFBOWVocabularyTree::Kernel::GENERIC, SolARFBOWVocabularyTree::Kernel::SSE42,
+                            SolARFBOWVocabularyTree::Kernel::AVX2, SolARFBOWVocabularyTree::Kernel::AVX512 })
+                if (SolARFBOWVocabularyTree::getKernelName(k) == m_transformKernel) {
+                    kernel = k;
+                    found = true;
+                }
+            if (!found) {
+                LOG_ERROR("SolARKeyframeRetrieverFBOW::prepareVocabulary: Unknown transform kernel {}", m_transformKernel);
+                return FrameworkReturnCode::_ERROR_;
+            }
+        }
+        if (vocTree.setKernel(kernel) != FrameworkReturnCode::_SUCCESS)
+            return FrameworkReturnCode::_ERROR_;
+    }
+    LOG_INFO("Vocabulary transform kernel: {}", useVOCTree ? SolARFBOWVocabularyTree::getKernelName(vocTree.getKernel()) : "fbow");
+
+    // fbow detects the cpu features at the first transform: do it now so that transforms can run concurrently
+    std::vector<uint8_t> dummyDescriptor(voc.getDescSize(), 0);
+    voc.transform(cv::Mat(1, voc.getDescType() == CV_32FC1 ? voc.getDescSize() / sizeof(float) : voc.getDescSize(),
+                          voc.getDescType(), dummyDescriptor.data()));
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::computeVocabularyMemory(const fbow::Vocabulary& voc, const SolARFBOWVocabularyTree& vocTree, bool useVOCTree,
+                                                                         uint64_t& memory, std::vector<uint32_t>& nodes)
+{
+    SolARFBOWVocabularyTree tree;
+    if (tree.fromVocabulary(voc) != FrameworkReturnCode::_SUCCESS)
+        return FrameworkReturnCode::_ERROR_;
+    memory = tree.getMemorySize() + (useVOCTree ? vocTree.getMemorySize() : 0);
+    std::map<uint32_t, uint32_t> levelNodes;
+    tree.getLevelNodeAncestors(std::numeric_limits<uint32_t>::max(), 0, levelNodes);
+    nodes.clear();
+    for (const auto& it : levelNodes)
+        nodes.push_back(it.first);
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+void SolARKeyframeRetrieverFBOW::computeBoW(const SRef<Keyframe> keyframe, bool useMatchedDescriptor, int level,
+                                            BoWFeature& bowFeature, BoWLevelFeature& bowLevelFeature)
+{
+	computeBoW(*m_VOC, m_VOCTree, m_useVOCTree, keyframe, useMatchedDescriptor, level, bowFeature, bowLevelFeature);
+}
+
+void SolARKeyframeRetrieverFBOW::computeBoW(fbow::Vocabulary& voc, const SolARFBOWVocabularyTree& vocTree, bool useVOCTree,
+                                            const SRef<Keyframe> keyframe, bool useMatchedDescriptor, int level,
+                                            BoWFeature& bowFeature, BoWLevelFeature& bowLevelFeature)
+{
+	// Convert desc of keyframe to Mat opencv
+	SRef<DescriptorBuffer> desc_Solar = keyframe->getDescriptors();
+	cv::Mat desc_OpenCV(desc_Solar->getNbDescriptors(), desc_Solar->getNbElements(), voc.getDescType(), desc_Solar->data());
+
+	// Select matched descriptors. When keyframe's matched keypoint map is empty, use all descriptors
+	const auto& isMatched = keyframe->getIsKeypointMatched();
+	bool useRows = useMatchedDescriptor && !isMatched.empty();
+	std::vector<int> rows;
+	if (useRows) {
+		rows.reserve(isMatched.size());
+		for (int i = 0; i < desc_OpenCV.rows; i++)
+			if (isMatched[i])
+				rows.push_back(i);
+	}
+
+	// Get bow desc corresponding to keyframe desc. Nodes of the level feature refer to rows of the keyframe descriptors
+	fbow::fBow v_bow;
+	fbow::fBow2 v_bow2;
+	if (useVOCTree) {
+		if (useRows)
+			vocTree.transform(desc_OpenCV, rows, level, v_bow, v_bow2);
+		else
+			vocTree.transform(desc_OpenCV, level, v_bow, v_bow2);
+	}
+	else if (useRows) {
+		// fbow needs contiguous descriptors: gather the selected rows in a single allocation
+		cv::Mat selected(static_cast<int>(rows.size()), desc_OpenCV.cols, desc_OpenCV.type());
+		const size_t rowSize = desc_OpenCV.cols * desc_OpenCV.elemSize();
+		for (size_t i = 0; i < rows.size(); i++)
+			std::memcpy(selected.ptr<uint8_t>(static_cast<int>(i)), desc_OpenCV.ptr<uint8_t>(rows[i]), rowSize);
+		voc.transform(selected, level, v_bow, v_bow2);
+		for (auto& it : v_bow2)
+			for (auto& idx : it.second)
+				idx = static_cast<uint32_t>(rows[idx]);
+	}
+	else
+		voc.transform(desc_OpenCV, level, v_bow, v_bow2);
+
+    // convertir bow to solar
+    bowFeature = SolARFBOWHelper::fbow2Solar(v_bow);
+    bowLevelFeature = SolARFBOWHelper::fbow2Solar(std::move(v_bow2));
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::addKeyframe(const SRef<Keyframe> keyframe, bool useMatchedDescriptor, uint32_t partition)
+{
+	// the partition is known before the keyframe is visible to retrieve
+	if (setKeyframePartition(keyframe->getId(), partition) != FrameworkReturnCode::_SUCCESS)
+		return FrameworkReturnCode::_ERROR_;
+	return addKeyframe(keyframe, useMatchedDescriptor);
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::setKeyframePartition(uint32_t keyframe_id, uint32_t partition)
+{
+	if (partition >= MAX_PARTITIONS) {
+		LOG_ERROR("SolARKeyframeRetrieverFBOW: invalid partition {}", partition);
+		return FrameworkReturnCode::_ERROR_;
+	}
+	std::unique_lock<std::mutex> lock(m_partitionsMutex);
+	// only keyframes outside the default partition are stored, whatever their id
+	if (findKeyframePartition(keyframe_id) == partition)
+		return FrameworkReturnCode::_SUCCESS;
+	if (partition == 0)
+		m_keyframePartitions.erase(keyframe_id);
+	else
+		m_keyframePartitions[keyframe_id] = static_cast<uint8_t>(partition);
+	recordModelChange(keyframe_id);
+	return FrameworkReturnCode::_SUCCESS;
+}
+
+uint32_t SolARKeyframeRetrieverFBOW::getKeyframePartition(uint32_t keyframe_id) const
+{
+	std::unique_lock<std::mutex> lock(m_partitionsMutex);
+	return findKeyframePartition(keyframe_id);
+}
+
+uint32_t SolARKeyframeRetrieverFBOW::findKeyframePartition(uint32_t keyframe_id) const
+{
+	auto it = m_keyframePartitions.find(keyframe_id);
+	return it != m_keyframePartitions.end() ? it->second : 0;
+}
+
+void SolARKeyframeRetrieverFBOW::clearPartitions()
+{
+	std::unique_lock<std::mutex> lock(m_partitionsMutex);
+	m_keyframePartitions.clear();
+}
+
+void SolARKeyframeRetrieverFBOW::recordModelChange(uint32_t keyframe_id) const
+{
+	std::unique_lock<std::mutex> lock(m_modelChangesMutex);
+	m_modelChanges.emplace_back(++m_modelSequence, keyframe_id);
+	// sessions older than the oldest kept change run a full query
+	if (m_modelChanges.size() > MAX_MODEL_CHANGES) {
+		m_modelChangesBegin = m_modelChanges.front().first;
+		m_modelChanges.pop_front();
+	}
+}
+
+void SolARKeyframeRetrieverFBOW::recordModelReset() const
+{
+	std::unique_lock<std::mutex> lock(m_modelChangesMutex);
+	m_modelChanges.clear();
+	m_modelChangesBegin = ++m_modelSequence;
+}
+
+bool SolARKeyframeRetrieverFBOW::getModelChanges(uint64_t sequence, std::vector<uint32_t>& keyframes_id, uint64_t& lastSequence) const
+{
+	keyframes_id.clear();
+	std::unique_lock<std::mutex> lock(m_modelChangesMutex);
+	lastSequence = m_modelSequence;
+	if (sequence < m_modelChangesBegin)
+		return false;
+	auto it = std::upper_bound(m_modelChanges.begin(), m_modelChanges.end(), std::make_pair(sequence, UINT32_MAX));
+	for (; it != m_modelChanges.end(); ++it)
+		keyframes_id.push_back(it->second);
+	lock.unlock();
+	std::sort(keyframes_id.begin(), keyframes_id.end());
+	keyframes_id.erase(std::unique(keyframes_id.begin(), keyframes_id.end()), keyframes_id.end());
+	return true;
+}
+
+bool SolARKeyframeRetrieverFBOW::findDuplicateKeyframe(const BoWFeature& bowFeature, const BoWLevelFeature& bowLevelFeature,
+													   uint32_t partition, uint32_t& duplicate_id) const
+{
+	// indexed keyframes of the partition sharing the most level nodes with the keyframe
+	std::map<uint32_t, int> votes;
+	{
+		std::shared_ptr<const KeyframeTombstones> tombstones = getKeyframeTombstones();
+		std::unique_lock<std::mutex> lock(m_partitionsMutex);
+		for (const auto& it : bowLevelFeature) {
+			std::set<uint32_t> kfs_id;
+			if (m_keyframeRetrieval->getInvertedIndex(it.first, kfs_id) != FrameworkReturnCode::_SUCCESS)
+				continue;
+			for (const auto& keyframe_id : kfs_id)
+				if (!tombstones->test(keyframe_id) &&
+					(findKeyframePartition(keyframe_id) == partition))
+					votes[keyframe_id]++;
+		}
+	}
+	if (votes.empty())
+		return false;
+	std::vector<std::pair<uint32_t, int>> neighbours(votes.begin(), votes.end());
+	size_t nbNeighbours = std::min(neighbours.size(), static_cast<size_t>(std::max(m_duplicateNeighbours, 1)));
+	std::partial_sort(neighbours.begin(), neighbours.begin() + nbNeighbours, neighbours.end(),
+					  [](const std::pair<uint32_t, int>& v1, const std::pair<uint32_t, int>& v2) { return v1.second > v2.second; });
+	std::vector<uint32_t> candidates;
+	for (size_t i = 0; i < nbNeighbours; i++)
+		candidates.push_back(neighbours[i].first);
+
+	// the best scored neighbour is a near-duplicate above the threshold
+	std::vector<std::pair<uint32_t, double>> distKeyframes;
+	scoreLockedKeyframes(candidates, std::vector<std::pair<uint32_t, float>>(bowFeature.begin(), bowFeature.end()), distKeyframes);
+	if (distKeyframes.empty() || (distKeyframes[0].second < m_duplicateThreshold))
+		return false;
+	duplicate_id = distKeyframes[0].first;
+	return true;
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::checkDuplicateKeyframe(uint32_t keyframe_id, const BoWFeature& bowFeature,
+																	   const BoWLevelFeature& bowLevelFeature)
+{
+	if (m_duplicateThreshold <= 0.f)
+		return FrameworkReturnCode::_SUCCESS;
+	uint32_t duplicate_id;
+	if (!findDuplicateKeyframe(bowFeature, bowLevelFeature, getKeyframePartition(keyframe_id), duplicate_id) || (duplicate_id == keyframe_id)) {
+		// a keyframe merged or rejected before is indexed from now on
+		std::unique_lock<std::mutex> lock(m_mergedKeyframesMutex);
+		m_mergedKeyframes.erase(keyframe_id);
+		m_rejectedKeyframes.erase(keyframe_id);
+		return FrameworkReturnCode::_SUCCESS;
+	}
+	std::unique_lock<std::mutex> lock(m_mergedKeyframesMutex);
+	if (m_duplicatePolicy == "merge") {
+		LOG_DEBUG("SolARKeyframeRetrieverFBOW: keyframe {} merged into near-duplicate keyframe {}", keyframe_id, duplicate_id);
+		m_mergedKeyframes[keyframe_id] = duplicate_id;
+	}
+	else {
+		LOG_DEBUG("SolARKeyframeRetrieverFBOW: keyframe {} rejected as near-duplicate of keyframe {}", keyframe_id, duplicate_id);
+		m_rejectedKeyframes[keyframe_id] = duplicate_id;
+	}
+	return FrameworkReturnCode::_STOP;
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::getMergedKeyframe(uint32_t keyframe_id, uint32_t& indexedKeyframe_id) const
+{
+	std::unique_lock<std::mutex> lock(m_mergedKeyframesMutex);
+	auto it = m_mergedKeyframes.find(keyframe_id);
+	if (it == m_mergedKeyframes.end())
+		return FrameworkReturnCode::_ERROR_;
+	indexedKeyframe_id = it->second;
+	return FrameworkReturnCode::_SUCCESS;
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::getRejectedKeyframe(uint32_t keyframe_id, uint32_t& indexedKeyframe_id) const
+{
+	std::unique_lock<std::mutex> lock(m_mergedKeyframesMutex);
+	auto it = m_rejectedKeyframes.find(keyframe_id);
+	if (it == m_rejectedKeyframes.end())
+		return FrameworkReturnCode::_ERROR_;
+	indexedKeyframe_id = it->second;
+	return FrameworkReturnCode::_SUCCESS;
+}
+
+void SolARKeyframeRetrieverFBOW::clearMergedKeyframes()
+{
+	std::unique_lock<std::mutex> lock(m_mergedKeyframesMutex);
+	m_mergedKeyframes.clear();
+	m_rejectedKeyframes.clear();
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::addKeyframe(const SRef<Keyframe> keyframe, bool useMatchedDescriptor)
+{
+	if (!m_indexingThread.joinable())
+		return indexKeyframe(keyframe, useMatchedDescriptor);
+
+	// queue the keyframe, waiting for free space if the queue is full
+	{
+		std::unique_lock<std::mutex> lock(m_indexingMutex);
+		size_t maxSize = static_cast<size_t>(std::max(m_indexingQueueSize, 1));
+		m_indexingDoneCondition.wait(lock, [this, maxSize] { return m_indexingQueue.size() < maxSize; });
+		m_indexingQueue.emplace_back(keyframe, useMatchedDescriptor);
+		m_queuedSequence++;
+	}
+	m_indexingQueuedCondition.notify_one();
+	return FrameworkReturnCode::_SUCCESS;
+}
+
+void SolARKeyframeRetrieverFBOW::indexingLoop()
+{
+	while (true) {
+		std::pair<SRef<Keyframe>, bool> item;
+		{
+			std::unique_lock<std::mutex> lock(m_indexingMutex);
+			m_indexingQueuedCondition.wait(lock, [this] { return m_stopIndexing || !m_indexingQueue.empty(); });
+			// queued keyframes are indexed before stopping
+			if (m_indexingQueue.empty())
+				return;
+			item = m_indexingQueue.front();
+		}
+		FrameworkReturnCode result = indexKeyframe(item.first, item.second);
+		uint32_t duplicate_id;
+		if (result == FrameworkReturnCode::_ERROR_) {
+			LOG_WARNING("SolARKeyframeRetrieverFBOW: cannot index keyframe {}", item.first->getId());
+		}
+		else if ((result == FrameworkReturnCode::_STOP) && (getRejectedKeyframe(item.first->getId(), duplicate_id) == FrameworkReturnCode::_SUCCESS)) {
+			// the caller of addKeyframe does not get the result, the rejection is recorded for getRejectedKeyframe
+			LOG_INFO("SolARKeyframeRetrieverFBOW: keyframe {} rejected as near-duplicate of keyframe {}", item.first->getId(), duplicate_id);
+		}
+		{
+			// the keyframe leaves the queue once visible to retrieve
+			std::unique_lock<std::mutex> lock(m_indexingMutex);
+			m_indexingQueue.pop_front();
+			m_indexedSequence++;
+		}
+		m_indexingDoneCondition.notify_all();
+	}
+}
+
+void SolARKeyframeRetrieverFBOW::stopIndexing()
+{
+	if (!m_indexingThread.joinable())
+		return;
+	{
+		std::unique_lock<std::mutex> lock(m_indexingMutex);
+		m_stopIndexing = true;
+	}
+	m_indexingQueuedCondition.notify_all();
+	m_indexingThread.join();
+}
+
+uint64_t SolARKeyframeRetrieverFBOW::getQueuedSequence() const
+{
+	std::unique_lock<std::mutex> lock(m_indexingMutex);
+	return m_queuedSequence;
+}
+
+uint64_t SolARKeyframeRetrieverFBOW::getIndexedSequence() const
+{
+	return m_indexedSequence.load();
+}
+
+void SolARKeyframeRetrieverFBOW::waitIndexed(uint64_t sequence) const
+{
+	std::unique_lock<std::mutex> lock(m_indexingMutex);
+	m_indexingDoneCondition.wait(lock, [this, sequence] { return m_indexedSequence.load() >= std::min(sequence, m_queuedSequence); });
+}
+
+void SolARKeyframeRetrieverFBOW::flush() const
+{
+	waitIndexed(getQueuedSequence());
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::indexKeyframe(const SRef<Keyframe> keyframe, bool useMatchedDescriptor)
+{
+	std::shared_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
+	// Get bow desc corresponding to keyframe desc
+	datastructure::BoWFeature v_bowFeature;
+	datastructure::BoWLevelFeature v_bowLevelFeature;
+	computeBoW(keyframe, useMatchedDescriptor, m_level, v_bowFeature, v_bowLevelFeature);
+	SolARFBOWHammingEmbedding::Signatures signatures;
+	computeSignatures(keyframe, m_hammingEmbedding, v_bowLevelFeature, signatures);
+
+	// Add bow desc to the database, queries read it under a shared lock
+	{
+		std::unique_lock<std::shared_mutex> modelLock(m_modelMutex);
+		// near-duplicates are checked under the lock which inserts the keyframe, so that concurrent near-duplicates see each other
+		if (checkDuplicateKeyframe(keyframe->getId(), v_bowFeature, v_bowLevelFeature) != FrameworkReturnCode::_SUCCESS)
+			return (m_duplicatePolicy == "merge") ? FrameworkReturnCode::_SUCCESS : FrameworkReturnCode::_STOP;
+		auto lock = m_keyframeRetrieval->acquireLock();
+		purgeTombstones({ keyframe->getId() });
+		if (m_keyframeRetrieval->addDescriptor(keyframe->getId(), v_bowFeature, v_bowLevelFeature) != FrameworkReturnCode::_SUCCESS)
+			return FrameworkReturnCode::_ERROR_;
+		accountKeyframe(keyframe->getId(), v_bowFeature, v_bowLevelFeature);
+		recordModelChange(keyframe->getId());
+		if (m_memoryBudget > 0) {
+			std::unique_lock<std::mutex> spillLock(m_spillMutex);
+			trackKeyframe(keyframe->getId(), estimateMemory(v_bowFeature, v_bowLevelFeature));
+			enforceMemoryBudget();
+		}
+	}
+    updateWordUsage(v_bowFeature, true);
+    addCoarseFeature(keyframe->getId(), v_bowLevelFeature);
+    addSignatures(keyframe->getId(), signatures);
+    {
+        std::unique_lock<std::mutex> lock(m_tombstonesMutex);
+        m_nbLiveKeyframes++;
+    }
+    compactTombstones();
+    addToMemorySegment({ keyframe->getId() });
+    recordSwapAddition({ keyframe }, useMatchedDescriptor);
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::addKeyframes(const std::vector<SRef<Keyframe>>& keyframes, bool useMatchedDescriptor, uint32_t partition)
+{
+	// keep the insertion order of previously queued keyframes
+	flush();
+	for (const auto& keyframe : keyframes)
+		if (setKeyframePartition(keyframe->getId(), partition) != FrameworkReturnCode::_SUCCESS)
+			return FrameworkReturnCode::_ERROR_;
+	std::shared_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
+
+	// Compute bow desc of all keyframes in parallel
+	std::vector<datastructure::BoWFeature> bowFeatures(keyframes.size());
+	std::vector<datastructure::BoWLevelFeature> bowLevelFeatures(keyframes.size());
+	std::vector<SolARFBOWHammingEmbedding::Signatures> signatures(keyframes.size());
+	m_threadPool->parallelFor(keyframes.size(), [&](size_t i) {
+		computeBoW(keyframes[i], useMatchedDescriptor, m_level, bowFeatures[i], bowLevelFeatures[i]);
+		computeSignatures(keyframes[i], m_hammingEmbedding, bowLevelFeatures[i], signatures[i]);
+	});
+
+	// Insert keyframes by increasing id so that posting lists are filled in order
+	FrameworkReturnCode result = FrameworkReturnCode::_SUCCESS;
+	std::vector<size_t> order(keyframes.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&keyframes](size_t i1, size_t i2) { return keyframes[i1]->getId() < keyframes[i2]->getId(); });
+
+	// Add all bow desc to the database with a single lock
+	std::vector<uint32_t> keyframesId;
+	for (const auto& i : order)
+		keyframesId.push_back(keyframes[i]->getId());
+	std::map<uint32_t, uint32_t> addedWords;
+	std::vector<bool> added(keyframes.size(), false);
+	{
+		std::unique_lock<std::shared_mutex> modelLock(m_modelMutex);
+		auto lock = m_keyframeRetrieval->acquireLock();
+		purgeTombstones(keyframesId);
+		for (const auto& i : order) {
+			// near-duplicates of indexed keyframes, including the previous keyframes of the batch, are not inserted
+			if (checkDuplicateKeyframe(keyframes[i]->getId(), bowFeatures[i], bowLevelFeatures[i]) != FrameworkReturnCode::_SUCCESS) {
+				if (m_duplicatePolicy != "merge")
+					result = FrameworkReturnCode::_STOP;
+				continue;
+			}
+			if (m_keyframeRetrieval->addDescriptor(keyframes[i]->getId(), bowFeatures[i], bowLevelFeatures[i]) != FrameworkReturnCode::_SUCCESS) {
+				LOG_WARNING("SolARKeyframeRetrieverFBOW::addKeyframes: cannot add keyframe {}", keyframes[i]->getId());
+				result = FrameworkReturnCode::_ERROR_;
+				continue;
+			}
+			added[i] = true;
+			accountKeyframe(keyframes[i]->getId(), bowFeatures[i], bowLevelFeatures[i]);
+			recordModelChange(keyframes[i]->getId());
+			for (const auto& it : bowFeatures[i])
+				addedWords[it.first]++;
+		}
+		if (m_memoryBudget > 0) {
+			std::unique_lock<std::mutex> spillLock(m_spillMutex);
+			for (const auto& i : order)
+				if (added[i])
+					trackKeyframe(keyframes[i]->getId(), estimateMemory(bowFeatures[i], bowLevelFeatures[i]));
+			enforceMemoryBudget();
+		}
+	}
+	for (const auto& i : order)
+		if (added[i]) {
+			addCoarseFeature(keyframes[i]->getId(), bowLevelFeatures[i]);
+			addSignatures(keyframes[i]->getId(), signatures[i]);
+		}
+	std::vector<uint32_t> addedKeyframes;
+	std::vector<SRef<Keyframe>> swapKeyframes;
+	for (const auto& i : order)
+		if (added[i]) {
+			addedKeyframes.push_back(keyframes[i]->getId());
+			swapKeyframes.push_back(keyframes[i]);
+		}
+	addToMemorySegment(addedKeyframes);
+	recordSwapAddition(swapKeyframes, useMatchedDescriptor);
+	{
+		std::unique_lock<std::mutex> lock(m_tombstonesMutex);
+		m_nbLiveKeyframes += addedKeyframes.size();
+	}
+	compactTombstones();
+
+	std::unique_lock<std::mutex> lock(m_wordUsageMutex);
+	for (const auto& it : addedWords)
+		m_wordUsage[it.first] += it.second;
+	return result;
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::reindex(const std::vector<SRef<Keyframe>>& keyframes, int level, bool useMatchedDescriptor)
+{
+	std::unique_lock<std::mutex> swapLock(m_vocabularySwapMutex);
+	// keyframes queued before re-indexing go to the current retrieval model, later ones are recorded
+	flush();
+	if (level < 0)
+		level = m_level;
+	std::map<uint32_t, uint32_t> coarseAncestors;
+	SolARFBOWHammingEmbedding hammingEmbedding;
+	if ((computeCoarseAncestors(level, coarseAncestors) != FrameworkReturnCode::_SUCCESS) ||
+		(computeHammingEmbedding(level, hammingEmbedding) != FrameworkReturnCode::_SUCCESS))
+		return FrameworkReturnCode::_ERROR_;
+	{
+		std::unique_lock<std::mutex> lock(m_swapKeyframesMutex);
+		m_swapAddedKeyframes.clear();
+		m_swapSuppressedKeyframes.clear();
+		m_isRecordingKeyframes = true;
+	}
+	auto endReindex = [this](FrameworkReturnCode result) {
+		std::unique_lock<std::mutex> lock(m_swapKeyframesMutex);
+		m_swapAddedKeyframes.clear();
+		m_swapSuppressedKeyframes.clear();
+		m_isRecordingKeyframes = false;
+		m_vocabularySwapMemory = 0;
+		return result;
+	};
+
+	// Build the shadow retrieval model with the current vocabulary, which only a swap replaces
+	SRef<KeyframeRetrieval> keyframeRetrieval;
+	std::map<uint32_t, SwapKeyframe> swapKeyframes;
+	FrameworkReturnCode result = buildShadowModel(keyframes, useMatchedDescriptor, *m_VOC, m_VOCTree, m_useVOCTree, level, hammingEmbedding,
+												  keyframeRetrieval, swapKeyframes);
+
+	// Switch to the new retrieval model, queries wait only for this step
+	SRef<KeyframeRetrieval> previousKeyframeRetrieval = m_keyframeRetrieval;
+	stopSegments();
+	{
+		std::unique_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
+		std::unique_lock<std::shared_mutex> modelLock(m_modelMutex);
+		if (applySwapKeyframes(true, *m_VOC, m_VOCTree, m_useVOCTree, level, hammingEmbedding, *keyframeRetrieval, swapKeyframes) != FrameworkReturnCode::_SUCCESS)
+			result = FrameworkReturnCode::_ERROR_;
+		installShadowModel(keyframeRetrieval, swapKeyframes, level, coarseAncestors, hammingEmbedding);
+	}
+	LOG_INFO("Retrieval model rebuilt from {} keyframes at level {}", swapKeyframes.size(), level);
+	// the previous retrieval model is released out of the exclusive lock
+	return endReindex(result);
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::swapVocabulary(const std::string& vocabularyPath, const std::vector<SRef<Keyframe>>& keyframes, bool useMatchedDescriptor)
+{
+	std::unique_lock<std::mutex> swapLock(m_vocabularySwapMutex);
+	// keyframes queued before the swap go to the current retrieval model, later ones are recorded
+	flush();
+	{
+		std::unique_lock<std::mutex> lock(m_swapKeyframesMutex);
+		m_swapAddedKeyframes.clear();
+		m_swapSuppressedKeyframes.clear();
+		m_isRecordingKeyframes = true;
+		m_isSwappingVocabulary = true;
+	}
+	auto endSwap = [this](FrameworkReturnCode result) {
+		std::unique_lock<std::mutex> lock(m_swapKeyframesMutex);
+		m_swapAddedKeyframes.clear();
+		m_swapSuppressedKeyframes.clear();
+		m_isRecordingKeyframes = false;
+		m_isSwappingVocabulary = false;
+		m_vocabularySwapMemory = 0;
+		return result;
+	};
+
+	// Load and prepare the new vocabulary aside
+	std::unique_ptr<fbow::Vocabulary> voc = std::make_unique<fbow::Vocabulary>();
+	try {
+		voc->readFromFile(vocabularyPath);
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("SolARKeyframeRetrieverFBOW::swapVocabulary: cannot load the vocabulary {}: {}", vocabularyPath, e.what());
+		return endSwap(FrameworkReturnCode::_ERROR_);
+	}
+	if (!voc->isValid() || (voc->getDescType() != m_VOC->getDescType()) || (voc->getDescSize() != m_VOC->getDescSize())) {
+		LOG_ERROR("SolARKeyframeRetrieverFBOW::swapVocabulary: {} is not a vocabulary of {} descriptors", vocabularyPath, m_VOC->getDescName());
+		return endSwap(FrameworkReturnCode::_ERROR_);
+	}
+	SolARFBOWVocabularyTree vocTree;
+	bool useVOCTree = false;
+	uint64_t vocabularyMemory = 0;
+	std::vector<uint32_t> vocabularyNodes;
+	std::map<uint32_t, uint32_t> coarseAncestors;
+	SolARFBOWHammingEmbedding hammingEmbedding;
+	if ((prepareVocabulary(*voc, vocTree, useVOCTree) != FrameworkReturnCode::_SUCCESS) ||
+		(computeVocabularyMemory(*voc, vocTree, useVOCTree, vocabularyMemory, vocabularyNodes) != FrameworkReturnCode::_SUCCESS) ||
+		(computeCoarseAncestors(*voc, m_level, coarseAncestors) != FrameworkReturnCode::_SUCCESS) ||
+		(computeHammingEmbedding(*voc, m_level, hammingEmbedding) != FrameworkReturnCode::_SUCCESS))
+		return endSwap(FrameworkReturnCode::_ERROR_);
+	m_vocabularySwapMemory = vocabularyMemory;
+
+	// Build the shadow retrieval model with the new vocabulary
+	SRef<KeyframeRetrieval> keyframeRetrieval;
+	std::map<uint32_t, SwapKeyframe> swapKeyframes;
+	FrameworkReturnCode result = buildShadowModel(keyframes, useMatchedDescriptor, *voc, vocTree, useVOCTree, m_level, hammingEmbedding,
+												  keyframeRetrieval, swapKeyframes);
+
+	// Switch to the new vocabulary and retrieval model, queries wait only for this step
+	SRef<KeyframeRetrieval> previousKeyframeRetrieval = m_keyframeRetrieval;
+	stopSegments();
+	{
+		std::unique_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
+		std::unique_lock<std::shared_mutex> modelLock(m_modelMutex);
+		if (applySwapKeyframes(true, *voc, vocTree, useVOCTree, m_level, hammingEmbedding, *keyframeRetrieval, swapKeyframes) != FrameworkReturnCode::_SUCCESS)
+			result = FrameworkReturnCode::_ERROR_;
+		m_VOC.swap(voc);
+		std::swap(m_VOCTree, vocTree);
+		m_useVOCTree = useVOCTree;
+		// word ids of the new vocabulary are not remapped
+		m_wordRemap.clear();
+		m_vocabularyMemory = vocabularyMemory;
+		m_vocabularyNodes.swap(vocabularyNodes);
+		installShadowModel(keyframeRetrieval, swapKeyframes, m_level, coarseAncestors, hammingEmbedding);
+	}
+	LOG_INFO("Vocabulary {} swapped in with {} keyframes", vocabularyPath, swapKeyframes.size());
+	// the previous vocabulary and retrieval model are released out of the exclusive lock
+	return endSwap(result);
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::buildShadowModel(const std::vector<SRef<Keyframe>>& keyframes, bool useMatchedDescriptor, fbow::Vocabulary& voc,
+																  const SolARFBOWVocabularyTree& vocTree, bool useVOCTree, int level,
+																  const SolARFBOWHammingEmbedding& embedding, SRef<KeyframeRetrieval>& keyframeRetrieval,
+																  std::map<uint32_t, SwapKeyframe>& swapKeyframes)
+{
+	// Compute bow desc of all keyframes in parallel with the vocabulary of the shadow model
+	std::vector<SwapKeyframe> features(keyframes.size());
+	m_threadPool->parallelFor(keyframes.size(), [&](size_t i) {
+		computeBoW(voc, vocTree, useVOCTree, keyframes[i], useMatchedDescriptor, level, features[i].bowFeature, features[i].bowLevelFeature);
+		computeSignatures(keyframes[i], embedding, features[i].bowLevelFeature, features[i].signatures);
+	});
+
+	// Build the shadow retrieval model by increasing keyframe id
+	std::vector<size_t> order(keyframes.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&keyframes](size_t i1, size_t i2) { return keyframes[i1]->getId() < keyframes[i2]->getId(); });
+	keyframeRetrieval = xpcf::utils::make_shared<KeyframeRetrieval>();
+	swapKeyframes.clear();
+	FrameworkReturnCode result = FrameworkReturnCode::_SUCCESS;
+	for (const auto& i : order) {
+		uint32_t id = keyframes[i]->getId();
+		if (keyframeRetrieval->addDescriptor(id, features[i].bowFeature, features[i].bowLevelFeature) != FrameworkReturnCode::_SUCCESS) {
+			LOG_WARNING("SolARKeyframeRetrieverFBOW::buildShadowModel: cannot add keyframe {}", id);
+			result = FrameworkReturnCode::_ERROR_;
+			continue;
+		}
+		m_vocabularySwapMemory += estimateMemory(features[i].bowFeature, features[i].bowLevelFeature);
+		swapKeyframes[id] = std::move(features[i]);
+	}
+	features.clear();
+
+	// Catch up with the keyframes added or suppressed during the build while queries still run
+	if (applySwapKeyframes(false, voc, vocTree, useVOCTree, level, embedding, *keyframeRetrieval, swapKeyframes) != FrameworkReturnCode::_SUCCESS)
+		result = FrameworkReturnCode::_ERROR_;
+	return result;
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::applySwapKeyframes(bool last, fbow::Vocabulary& voc, const SolARFBOWVocabularyTree& vocTree, bool useVOCTree, int level,
+																	const SolARFBOWHammingEmbedding& embedding, KeyframeRetrieval& keyframeRetrieval,
+																	std::map<uint32_t, SwapKeyframe>& swapKeyframes)
+{
+	std::map<uint32_t, std::pair<SRef<Keyframe>, bool>> addedKeyframes;
+	std::set<uint32_t> suppressedKeyframes;
+	{
+		std::unique_lock<std::mutex> lock(m_swapKeyframesMutex);
+		addedKeyframes.swap(m_swapAddedKeyframes);
+		suppressedKeyframes.swap(m_swapSuppressedKeyframes);
+		if (last)
+			m_isRecordingKeyframes = false;
+	}
+
+	// suppressed keyframes and new versions of added keyframes leave the shadow model first
+	FrameworkReturnCode result = FrameworkReturnCode::_SUCCESS;
+	auto removeSwapKeyframe = [&](uint32_t id) {
+		auto it = swapKeyframes.find(id);
+		if (it == swapKeyframes.end())
+			return;
+		if (keyframeRetrieval.removeDescriptor(id) != FrameworkReturnCode::_SUCCESS)
+			result = FrameworkReturnCode::_ERROR_;
+		m_vocabularySwapMemory -= std::min(m_vocabularySwapMemory.load(), estimateMemory(it->second.bowFeature, it->second.bowLevelFeature));
+		swapKeyframes.erase(it);
+	};
+	for (const auto& id : suppressedKeyframes)
+		removeSwapKeyframe(id);
+	for (const auto& it : addedKeyframes)
+		removeSwapKeyframe(it.first);
+
+	// added keyframes are transformed in parallel with the vocabulary of the shadow model, by increasing id
+	std::vector<std::pair<SRef<Keyframe>, bool>> keyframes;
+	for (const auto& it : addedKeyframes)
+		keyframes.push_back(it.second);
+	std::vector<SwapKeyframe> features(keyframes.size());
+	m_threadPool->parallelFor(keyframes.size(), [&](size_t i) {
+		computeBoW(voc, vocTree, useVOCTree, keyframes[i].first, keyframes[i].second, level, features[i].bowFeature, features[i].bowLevelFeature);
+		computeSignatures(keyframes[i].first, embedding, features[i].bowLevelFeature, features[i].signatures);
+	});
+	for (size_t i = 0; i < keyframes.size(); ++i) {
+		uint32_t id = keyframes[i].first->getId();
+		if (keyframeRetrieval.addDescriptor(id, features[i].bowFeature, features[i].bowLevelFeature) != FrameworkReturnCode::_SUCCESS) {
+			LOG_WARNING("SolARKeyframeRetrieverFBOW::applySwapKeyframes: cannot add keyframe {}", id);
+			result = FrameworkReturnCode::_ERROR_;
+			continue;
+		}
+		m_vocabularySwapMemory += estimateMemory(features[i].bowFeature, features[i].bowLevelFeature);
+		swapKeyframes[id] = std::move(features[i]);
+	}
+	return result;
+}
+
+void SolARKeyframeRetrieverFBOW::installShadowModel(const SRef<KeyframeRetrieval> keyframeRetrieval, std::map<uint32_t, SwapKeyframe>& swapKeyframes,
+													int level, std::map<uint32_t, uint32_t>& coarseAncestors, SolARFBOWHammingEmbedding& hammingEmbedding)
+{
+	// keep the partitions, the merged keyframes whose indexed keyframe is in the new retrieval model, and the rejected
+	// keyframes which are not in it
+	std::map<uint32_t, uint8_t> keyframePartitions;
+	std::map<uint32_t, uint32_t> mergedKeyframes;
+	std::map<uint32_t, uint32_t> rejectedKeyframes;
+	{
+		std::unique_lock<std::mutex> lock(m_partitionsMutex);
+		keyframePartitions = m_keyframePartitions;
+	}
+	{
+		std::unique_lock<std::mutex> lock(m_mergedKeyframesMutex);
+		for (const auto& it : m_mergedKeyframes)
+			if ((swapKeyframes.find(it.first) == swapKeyframes.end()) && (swapKeyframes.find(it.second) != swapKeyframes.end()))
+				mergedKeyframes.insert(it);
+		for (const auto& it : m_rejectedKeyframes)
+			if (swapKeyframes.find(it.first) == swapKeyframes.end())
+				rejectedKeyframes.insert(it);
+	}
+	installKeyframeRetrieval(keyframeRetrieval);
+	{
+		std::unique_lock<std::mutex> lock(m_partitionsMutex);
+		m_keyframePartitions.swap(keyframePartitions);
+	}
+	{
+		std::unique_lock<std::mutex> lock(m_mergedKeyframesMutex);
+		m_mergedKeyframes.swap(mergedKeyframes);
+		m_rejectedKeyframes.swap(rejectedKeyframes);
+	}
+	m_level = level;
+	m_coarseAncestors.swap(coarseAncestors);
+	m_hammingEmbedding = std::move(hammingEmbedding);
+	std::map<uint32_t, uint32_t> wordUsage;
+	std::vector<uint32_t> addedKeyframes;
+	for (auto& it : swapKeyframes) {
+		for (const auto& itWord : it.second.bowFeature)
+			wordUsage[itWord.first]++;
+		addCoarseFeature(it.first, it.second.bowLevelFeature);
+		addSignatures(it.first, it.second.signatures);
+		addedKeyframes.push_back(it.first);
+	}
+	{
+		std::unique_lock<std::mutex> lock(m_wordUsageMutex);
+		m_wordUsage.swap(wordUsage);
+	}
+	if (m_memoryBudget > 0) {
+		auto retrievalLock = m_keyframeRetrieval->acquireLock();
+		std::unique_lock<std::mutex> lock(m_spillMutex);
+		for (const auto& it : swapKeyframes)
+			trackKeyframe(it.first, estimateMemory(it.second.bowFeature, it.second.bowLevelFeature));
+		enforceMemoryBudget();
+	}
+	addToMemorySegment(addedKeyframes);
+}
+
+void SolARKeyframeRetrieverFBOW::recordSwapAddition(const std::vector<SRef<Keyframe>>& keyframes, bool useMatchedDescriptor)
+{
+	std::unique_lock<std::mutex> lock(m_swapKeyframesMutex);
+	if (!m_isRecordingKeyframes)
+		return;
+	for (const auto& keyframe : keyframes)
+		m_swapAddedKeyframes[keyframe->getId()] = std::make_pair(keyframe, useMatchedDescriptor);
+}
+
+void SolARKeyframeRetrieverFBOW::recordSwapSuppression(const std::vector<uint32_t>& keyframes_id)
+{
+	std::unique_lock<std::mutex> lock(m_swapKeyframesMutex);
+	if (!m_isRecordingKeyframes)
+		return;
+	for (const auto& id : keyframes_id) {
+		m_swapAddedKeyframes.erase(id);
+		m_swapSuppressedKeyframes.insert(id);
+	}
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::startVocabularySwap(const std::string& vocabularyPath, const std::vector<SRef<Keyframe>>& keyframes, bool useMatchedDescriptor)
+{
+	if (m_vocabularySwapThread.joinable()) {
+		LOG_ERROR("SolARKeyframeRetrieverFBOW::startVocabularySwap: the previous vocabulary swap was not waited for");
+		return FrameworkReturnCode::_ERROR_;
+	}
+	m_vocabularySwapResult = FrameworkReturnCode::_ERROR_;
+	m_vocabularySwapThread = std::thread([this, vocabularyPath, keyframes, useMatchedDescriptor]() {
+		m_vocabularySwapResult = swapVocabulary(vocabularyPath, keyframes, useMatchedDescriptor);
+	});
+	return FrameworkReturnCode::_SUCCESS;
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::waitVocabularySwap()
+{
+	if (!m_vocabularySwapThread.joinable())
+		return FrameworkReturnCode::_ERROR_;
+	m_vocabularySwapThread.join();
+	return m_vocabularySwapResult;
+}
+
+bool SolARKeyframeRetrieverFBOW::isSwappingVocabulary() const
+{
+	std::unique_lock<std::mutex> lock(m_swapKeyframesMutex);
+	return m_isSwappingVocabulary;
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::suppressKeyframe(uint32_t keyframe_id)
+{
+	return suppressKeyframes({ keyframe_id });
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::suppressKeyframes(const std::vector<uint32_t>& keyframes_id)
+{
+	// the keyframes may still be queued
+	flush();
+	std::shared_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
+	recordSwapSuppression(keyframes_id);
+	FrameworkReturnCode result = FrameworkReturnCode::_SUCCESS;
+	std::vector<uint32_t> removedKeyframes;
+	std::vector<uint32_t> indexedKeyframes;
+	{
+		// merged and rejected keyframes are only forgotten
+		std::unique_lock<std::mutex> lock(m_mergedKeyframesMutex);
+		for (const auto& id : keyframes_id)
+			if ((m_mergedKeyframes.erase(id) == 0) && (m_rejectedKeyframes.erase(id) == 0))
+				indexedKeyframes.push_back(id);
+	}
+	{
+		// suppressed keyframes are only marked in the tombstones, the retrieval model is read under a shared lock
+		std::shared_lock<std::shared_mutex> modelLock(m_modelMutex);
+		std::unique_lock<std::mutex> lock(m_tombstonesMutex);
+		auto tombstones = std::make_shared<KeyframeTombstones>(*m_keyframeTombstones);
+		for (const auto& id : indexedKeyframes) {
+			if (removeKeyframe(id, *tombstones) != FrameworkReturnCode::_SUCCESS) {
+				result = FrameworkReturnCode::_ERROR_;
+				continue;
+			}
+			removedKeyframes.push_back(id);
+			if (m_nbLiveKeyframes > 0)
+				m_nbLiveKeyframes--;
+		}
+		m_keyframeTombstones = tombstones;
+		for (const auto& id : removedKeyframes)
+			recordModelChange(id);
+	}
+	for (const auto& id : removedKeyframes) {
+		removeCoarseFeature(id);
+		removeSignatures(id);
+	}
+	if (!removedKeyframes.empty()) {
+		// keyframes merged into a suppressed keyframe cannot be retrieved anymore
+		std::unique_lock<std::mutex> lock(m_mergedKeyframesMutex);
+		std::set<uint32_t> removed(removedKeyframes.begin(), removedKeyframes.end());
+		for (auto it = m_mergedKeyframes.begin(); it != m_mergedKeyframes.end();)
+			it = (removed.find(it->second) != removed.end()) ? m_mergedKeyframes.erase(it) : std::next(it);
+	}
+	compactTombstones();
+	return result;
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::removeKeyframe(uint32_t keyframe_id, KeyframeTombstones& tombstones)
+{
+	if (!m_segmentPath.empty()) {
+		std::unique_lock<std::mutex> lock(m_segmentsMutex);
+		m_memorySegmentKeyframes.erase(keyframe_id);
+		const SolARFBOWIndexSegment* segment = m_segmentSet->find(keyframe_id);
+		if (segment || (m_flushingKeyframes.find(keyframe_id) != m_flushingKeyframes.end())) {
+			// on-disk copies are deleted by a tombstone until the next merge
+			auto segmentSet = std::make_shared<SegmentSet>(*m_segmentSet);
+			segmentSet->tombstones[keyframe_id] = m_segmentGeneration;
+			m_segmentSet = segmentSet;
+		}
+		datastructure::BoWFeature kfBoW;
+		if (segment && !m_spill.contains(keyframe_id) &&
+			(m_keyframeRetrieval->getBoWFeature(keyframe_id, kfBoW) != FrameworkReturnCode::_SUCCESS) &&
+			(segment->getBoWFeature(keyframe_id, kfBoW) == FrameworkReturnCode::_SUCCESS)) {
+			SolARFBOWHelper::remapBoW(m_wordRemap, kfBoW);
+			updateWordUsage(kfBoW, false);
+			return FrameworkReturnCode::_SUCCESS;
+		}
+	}
+	if (m_memoryBudget > 0) {
+		std::unique_lock<std::mutex> lock(m_spillMutex);
+		untrackKeyframe(keyframe_id);
+		datastructure::BoWFeature kfBoW;
+		datastructure::BoWLevelFeature kfBoWLevel;
+		if (m_spill.contains(keyframe_id)) {
+			if (m_spill.read(keyframe_id, kfBoW, kfBoWLevel) == FrameworkReturnCode::_SUCCESS) {
+				SolARFBOWHelper::remapBoW(m_wordRemap, kfBoW);
+				updateWordUsage(kfBoW, false);
+			}
+			// an unreadable record and its posting lists would still vote and be loaded back
+			m_spill.erase(keyframe_id);
+			return FrameworkReturnCode::_SUCCESS;
+		}
+	}
+    datastructure::BoWFeature kfBoW;
+    if (tombstones.test(keyframe_id) || (m_keyframeRetrieval->getBoWFeature(keyframe_id, kfBoW) != FrameworkReturnCode::_SUCCESS))
+        return FrameworkReturnCode::_ERROR_;
+    SolARFBOWHelper::remapBoW(m_wordRemap, kfBoW);
+    updateWordUsage(kfBoW, false);
+    // the keyframe is removed from the posting lists by the compactor
+    tombstones.set(keyframe_id);
+    return FrameworkReturnCode::_SUCCESS;
+}
+
+void SolARKeyframeRetrieverFBOW::KeyframeTombstones::set(uint32_t id)
+{
+	if (id >= bits.size())
+		bits.resize(id + 1, false);
+	if (!bits[id]) {
+		bits[id] = true;
+		count++;
+	}
+}
+
+void SolARKeyframeRetrieverFBOW::KeyframeTombstones::reset(uint32_t id)
+{
+	if (test(id)) {
+		bits[id] = false;
+		count--;
+	}
+}
+
+std::shared_ptr<const SolARKeyframeRetrieverFBOW::KeyframeTombstones> SolARKeyframeRetrieverFBOW::getKeyframeTombstones() const
+{
+	std::unique_lock<std::mutex> lock(m_tombstonesMutex);
+	return m_keyframeTombstones;
+}
+
+void SolARKeyframeRetrieverFBOW::purgeTombstones(const std::vector<uint32_t>& keyframes_id)
+{
+	std::unique_lock<std::mutex> lock(m_tombstonesMutex);
+	std::shared_ptr<KeyframeTombstones> tombstones;
+	for (const auto& id : keyframes_id) {
+		if (!m_keyframeTombstones->test(id))
+			continue;
+		if (!tombstones)
+			tombstones = std::make_shared<KeyframeTombstones>(*m_keyframeTombstones);
+		m_keyframeRetrieval->removeDescriptor(id);
+		unaccountKeyframe(id);
+		tombstones->reset(id);
+	}
+	if (tombstones)
+		m_keyframeTombstones = tombstones;
+}
+
+void SolARKeyframeRetrieverFBOW::compactTombstones(bool all) const
+{
+	{
+		std::unique_lock<std::mutex> lock(m_tombstonesMutex);
+		if (m_keyframeTombstones->count == 0) {
+			m_compactingTombstones = false;
+			return;
+		}
+		if (!all && !m_compactingTombstones) {
+			if (m_keyframeTombstones->count < m_tombstoneRatio * (m_nbLiveKeyframes + m_keyframeTombstones->count))
+				return;
+			m_compactingTombstones = true;
+		}
+	}
+	// remove a batch of keyframes, queries see them as deleted until the new tombstones are published.
+	// The posting lists are modified under the exclusive lock of the retrieval model, taken before m_tombstonesMutex
+	std::unique_lock<std::shared_mutex> modelLock(m_modelMutex);
+	auto retrievalLock = m_keyframeRetrieval->acquireLock();
+	std::unique_lock<std::mutex> lock(m_tombstonesMutex);
+	auto tombstones = std::make_shared<KeyframeTombstones>(*m_keyframeTombstones);
+	uint32_t maxRemoved = all ? tombstones->count : static_cast<uint32_t>(std::max(m_tombstoneCompactionBatch, 1));
+	uint32_t nbRemoved = 0;
+	for (uint32_t id = 0; (id < tombstones->bits.size()) && (nbRemoved < maxRemoved); id++) {
+		if (!tombstones->bits[id])
+			continue;
+		m_keyframeRetrieval->removeDescriptor(id);
+		unaccountKeyframe(id);
+		tombstones->reset(id);
+		nbRemoved++;
+	}
+	m_compactingTombstones = (tombstones->count > 0);
+	m_keyframeTombstones = tombstones;
+	LOG_DEBUG("SolARKeyframeRetrieverFBOW: {} suppressed keyframes removed, {} remaining", nbRemoved, tombstones->count);
+}
+
+void SolARKeyframeRetrieverFBOW::clearTombstones() const
+{
+	std::unique_lock<std::mutex> lock(m_tombstonesMutex);
+	m_keyframeTombstones = std::make_shared<KeyframeTombstones>();
+	m_nbLiveKeyframes = 0;
+	m_compactingTombstones = false;
+}
+
+void SolARKeyframeRetrieverFBOW::resetKeyframeRetrieval()
+{
+    std::unique_lock<std::mutex> swapLock(m_vocabularySwapMutex);
+    flush();
+    // the segment thread locks the retrieval model, it is stopped before the exclusive locks
+    stopSegments();
+    std::unique_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
+    std::unique_lock<std::shared_mutex> modelLock(m_modelMutex);
+    clearSpill();
+    restartSegments();
+    clearTombstones();
+    clearCoarseFeatures();
+    clearSignatures();
+    clearPartitions();
+    clearMergedKeyframes();
+    {
+        auto retrievalLock = m_keyframeRetrieval->acquireLock();
+        m_keyframeRetrieval->reset();
+    }
+    {
+        std::unique_lock<std::mutex> lockStats(m_memoryStatsMutex);
+        m_keyframesMemory.clear();
+        m_modelMemory = KeyframeMemory();
+    }
+    {
+        std::unique_lock<std::mutex> lockScoring(m_scoringBoWsMutex);
+        m_scoringBoWs.clear();
+    }
+    recordModelReset();
+    std::unique_lock<std::mutex> lock(m_wordUsageMutex);
+    m_wordUsage.clear();
+}
+
+void SolARKeyframeRetrieverFBOW::updateWordUsage(const datastructure::BoWFeature& bowFeature, bool added)
+{
+    std::unique_lock<std::mutex> lock(m_wordUsageMutex);
+    for (const auto& it : bowFeature) {
+        if (added)
+            m_wordUsage[it.first]++;
+        else {
+            auto itUsage = m_wordUsage.find(it.first);
+            if (itUsage == m_wordUsage.end())
+                continue;
+            if (itUsage->second <= 1)
+                m_wordUsage.erase(itUsage);
+            else
+                itUsage->second--;
+        }
+    }
+}
+
+void SolARKeyframeRetrieverFBOW::getWordUsage(std::map<uint32_t, uint32_t>& wordUsage) const
+{
+    std::unique_lock<std::mutex> lock(m_wordUsageMutex);
+    wordUsage = m_wordUsage;
+}
+
+std::string SolARKeyframeRetrieverFBOW::getTransformKernel() const
+{
+    std::shared_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
+    return m_useVOCTree ? SolARFBOWVocabularyTree::getKernelName(m_VOCTree.getKernel()) : "fbow";
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::saveWordUsage(const std::string& file) const
+{
+    std::map<uint32_t, uint32_t> wordUsage;
+    getWordUsage(wordUsage);
+    return SolARFBOWVocabularyTree::writeWordUsage(file, wordUsage);
+}
+
+uint64_t SolARKeyframeRetrieverFBOW::estimateMemory(const BoWFeature& bowFeature, const BoWLevelFeature& bowLevelFeature)
+{
+    KeyframeMemory memory = estimateKeyframeMemory(bowFeature, bowLevelFeature);
+    return memory.bowFeature + memory.bowLevelFeature + memory.invertedIndex;
+}
+
+SolARKeyframeRetrieverFBOW::KeyframeMemory SolARKeyframeRetrieverFBOW::estimateKeyframeMemory(const BoWFeature& bowFeature, const BoWLevelFeature& bowLevelFeature)
+{
+    // a std::map or std::set node holds 3 pointers and a color in addition to its value
+    const uint64_t nodeOverhead = 4 * sizeof(void*);
+    KeyframeMemory memory;
+    // direct BoW feature
+    memory.bowFeature = bowFeature.size() * (nodeOverhead + sizeof(BoWFeature::value_type));
+    // BoW level feature and entries of the inverted index
+    for (const auto& it : bowLevelFeature) {
+        memory.bowLevelFeature += nodeOverhead + sizeof(BoWLevelFeature::value_type) + it.second.capacity() * sizeof(uint32_t);
+        memory.invertedIndex += nodeOverhead + sizeof(uint32_t);
+    }
+    return memory;
+}
+
+void SolARKeyframeRetrieverFBOW::accountKeyframe(uint32_t keyframe_id, const BoWFeature& bowFeature, const BoWLevelFeature& bowLevelFeature) const
+{
+    KeyframeMemory memory = estimateKeyframeMemory(bowFeature, bowLevelFeature);
+    {
+        // metric transforms of the keyframe weights are computed once here instead of at each query
+        auto scoringBoW = std::make_shared<SolARFBOWScoringBoW>();
+        if (m_wordRemap.empty())
+            SolARFBOWScoring::prepare(m_scoringType, bowFeature, false, *scoringBoW);
+        else {
+            BoWFeature remappedBoW = bowFeature;
+            SolARFBOWHelper::remapBoW(m_wordRemap, remappedBoW);
+            SolARFBOWScoring::prepare(m_scoringType, remappedBoW, false, *scoringBoW);
+        }
+        std::unique_lock<std::mutex> lockScoring(m_scoringBoWsMutex);
+        m_scoringBoWs[keyframe_id] = scoringBoW;
+    }
+    std::unique_lock<std::mutex> lock(m_memoryStatsMutex);
+    KeyframeMemory& keyframeMemory = m_keyframesMemory[keyframe_id];
+    m_modelMemory.bowFeature += memory.bowFeature - keyframeMemory.bowFeature;
+    m_modelMemory.bowLevelFeature += memory.bowLevelFeature - keyframeMemory.bowLevelFeature;
+    m_modelMemory.invertedIndex += memory.invertedIndex - keyframeMemory.invertedIndex;
+    keyframeMemory = memory;
+}
+
+void SolARKeyframeRetrieverFBOW::unaccountKeyframe(uint32_t keyframe_id) const
+{
+    {
+        std::unique_lock<std::mutex> lockScoring(m_scoringBoWsMutex);
+        m_scoringBoWs.erase(keyframe_id);
+    }
+    std::unique_lock<std::mutex> lock(m_memoryStatsMutex);
+    auto it = m_keyframesMemory.find(keyframe_id);
+    if (it == m_keyframesMemory.end())
+        return;
+    m_modelMemory.bowFeature -= it->second.bowFeature;
+    m_modelMemory.bowLevelFeature -= it->second.bowLevelFeature;
+    m_modelMemory.invertedIndex -= it->second.invertedIndex;
+    m_keyframesMemory.erase(it);
+}
+
+void SolARKeyframeRetrieverFBOW::rebuildMemoryAccounting() const
+{
+    recordModelReset();
+    {
+        std::unique_lock<std::mutex> lockScoring(m_scoringBoWsMutex);
+        m_scoringBoWs.clear();
+    }
+    {
+        std::unique_lock<std::mutex> lock(m_memoryStatsMutex);
+        m_keyframesMemory.clear();
+        m_modelMemory = KeyframeMemory();
+    }
+    // keyframes are found from the inverted index of all the internal nodes of the vocabulary
+    std::set<uint32_t> keyframes_id;
+    auto lock = m_keyframeRetrieval->acquireLock();
+    for (const auto& node : m_vocabularyNodes) {
+        std::set<uint32_t> kfs_id;
+        if (m_keyframeRetrieval->getInvertedIndex(node, kfs_id) == FrameworkReturnCode::_SUCCESS)
+            keyframes_id.insert(kfs_id.begin(), kfs_id.end());
+    }
+    for (const auto& id : keyframes_id) {
+        BoWFeature bowFeature;
+        BoWLevelFeature bowLevelFeature;
+        if ((m_keyframeRetrieval->getBoWFeature(id, bowFeature) == FrameworkReturnCode::_SUCCESS) &&
+            (m_keyframeRetrieval->getBoWLevelFeature(id, bowLevelFeature) == FrameworkReturnCode::_SUCCESS))
+            accountKeyframe(id, bowFeature, bowLevelFeature);
+    }
+}
+
+void SolARKeyframeRetrieverFBOW::getMemoryStats(MemoryStats& stats) const
+{
+    stats = MemoryStats();
+    {
+        std::unique_lock<std::mutex> lock(m_memoryStatsMutex);
+        stats.nbKeyframes = m_keyframesMemory.size();
+        stats.bowFeatures = m_modelMemory.bowFeature;
+        stats.bowLevelFeatures = m_modelMemory.bowLevelFeature;
+        stats.invertedIndex = m_modelMemory.invertedIndex;
+    }
+    {
+        std::shared_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
+        stats.vocabulary = m_vocabularyMemory;
+    }
+    stats.vocabularySwap = m_vocabularySwapMemory.load();
+    const uint64_t nodeOverhead = 4 * sizeof(void*);
+    {
+        std::unique_lock<std::mutex> lock(m_coarseMutex);
+        for (const auto& it : m_coarseFeatures)
+            stats.coarseFeatures += nodeOverhead + sizeof(it) + it.second.capacity() * sizeof(CoarseFeature::value_type);
+    }
+    {
+        std::unique_lock<std::mutex> lock(m_signaturesMutex);
+        for (const auto& it : m_signatures)
+            stats.signatures += nodeOverhead + sizeof(it) + it.second.capacity() * sizeof(SolARFBOWHammingEmbedding::Signatures::value_type);
+    }
+    {
+        std::unique_lock<std::mutex> lock(m_scoringBoWsMutex);
+        for (const auto& it : m_scoringBoWs)
+            stats.scoringFeatures += nodeOverhead + sizeof(it) + sizeof(SolARFBOWScoringBoW) + it.second->words.capacity() * sizeof(uint32_t) +
+                (it.second->weights.capacity() + it.second->terms.capacity()) * sizeof(float);
+    }
+}
+
+uint64_t SolARKeyframeRetrieverFBOW::getKeyframeMemory(uint32_t keyframe_id) const
+{
+    std::unique_lock<std::mutex> lock(m_memoryStatsMutex);
+    auto it = m_keyframesMemory.find(keyframe_id);
+    if (it == m_keyframesMemory.end())
+        return 0;
+    return it->second.bowFeature + it->second.bowLevelFeature + it->second.invertedIndex;
+}
+
+void SolARKeyframeRetrieverFBOW::loadSpilledKeyframes(const std::vector<uint32_t>& keyframes_id) const
+{
+    if (m_memoryBudget <= 0)
+        return;
+    {
+        // the retrieval model is locked exclusively only if a keyframe has to be loaded
+        std::unique_lock<std::mutex> lock(m_spillMutex);
+        if (std::none_of(keyframes_id.begin(), keyframes_id.end(), [this](uint32_t id) { return m_spill.contains(id); }))
+            return;
+    }
+    std::unique_lock<std::shared_mutex> modelLock(m_modelMutex);
+    auto retrievalLock = m_keyframeRetrieval->acquireLock();
+    std::unique_lock<std::mutex> lock(m_spillMutex);
+    for (const auto& id : keyframes_id) {
+        BoWFeature bowFeature;
+        BoWLevelFeature bowLevelFeature;
+        if (!m_spill.contains(id) || (m_spill.read(id, bowFeature, bowLevelFeature) != FrameworkReturnCode::_SUCCESS))
+            continue;
+        if (m_keyframeRetrieval->addDescriptor(id, bowFeature, bowLevelFeature) != FrameworkReturnCode::_SUCCESS) {
+            LOG_ERROR("SolARKeyframeRetrieverFBOW: cannot load spilled keyframe {}", id);
+            continue;
+        }
+        accountKeyframe(id, bowFeature, bowLevelFeature);
+        trackKeyframe(id, estimateMemory(bowFeature, bowLevelFeature));
+    }
+}
+
+void SolARKeyframeRetrieverFBOW::touchKeyframes(const std::vector<uint32_t>& keyframes_id) const
+{
+    if (m_memoryBudget <= 0)
+        return;
+    {
+        std::unique_lock<std::mutex> lock(m_spillMutex);
+        for (const auto& id : keyframes_id) {
+            auto it = m_residentKeyframes.find(id);
+            if (it != m_residentKeyframes.end()) {
+                m_residentLRU.erase(std::make_pair(it->second.second, id));
+                it->second.second = ++m_accessTick;
+                m_residentLRU.insert(std::make_pair(it->second.second, id));
+                continue;
+            }
+            // keyframe indexed before the budget tracking (loaded from file for instance), its memory is already accounted
+            uint64_t memory = getKeyframeMemory(id);
+            if (memory > 0)
+                trackKeyframe(id, memory);
+        }
+        if (m_residentMemory <= static_cast<uint64_t>(m_memoryBudget) * 1024 * 1024)
+            return;
+    }
+    // keyframes beyond the budget are spilled under the exclusive lock of the retrieval model, taken before m_spillMutex
+    std::unique_lock<std::shared_mutex> modelLock(m_modelMutex);
+    auto retrievalLock = m_keyframeRetrieval->acquireLock();
+    std::unique_lock<std::mutex> lock(m_spillMutex);
+    enforceMemoryBudget();
+}
+
+void SolARKeyframeRetrieverFBOW::clearSpill() const
+{
+    std::unique_lock<std::mutex> lock(m_spillMutex);
+    m_spill.clear();
+    m_residentKeyframes.clear();
+    m_residentLRU.clear();
+    m_residentMemory = 0;
+}
+
+void SolARKeyframeRetrieverFBOW::trackKeyframe(uint32_t keyframe_id, uint64_t memory) const
+{
+    untrackKeyframe(keyframe_id);
+    // an older spilled version of the keyframe is obsolete
+    m_spill.erase(keyframe_id);
+    uint64_t tick = ++m_accessTick;
+    m_residentKeyframes[keyframe_id] = std::make_pair(memory, tick);
+    m_residentLRU.insert(std::make_pair(tick, keyframe_id));
+    m_residentMemory += memory;
+}
+
+void SolARKeyframeRetrieverFBOW::untrackKeyframe(uint32_t keyframe_id) const
+{
+    auto it = m_residentKeyframes.find(keyframe_id);
+    if (it == m_residentKeyframes.end())
+        return;
+    m_residentLRU.erase(std::make_pair(it->second.second, keyframe_id));
+    m_residentMemory -= it->second.first;
+    m_residentKeyframes.erase(it);
+}
+
+void SolARKeyframeRetrieverFBOW::enforceMemoryBudget() const
+{
+    const uint64_t budget = static_cast<uint64_t>(m_memoryBudget) * 1024 * 1024;
+    while ((m_residentMemory > budget) && !m_residentLRU.empty()) {
+        uint32_t id = m_residentLRU.begin()->second;
+        BoWFeature bowFeature;
+        BoWLevelFeature bowLevelFeature;
+        if ((m_keyframeRetrieval->getBoWFeature(id, bowFeature) == FrameworkReturnCode::_SUCCESS) &&
+            (m_keyframeRetrieval->getBoWLevelFeature(id, bowLevelFeature) == FrameworkReturnCode::_SUCCESS)) {
+            // keep the keyframe in memory if it cannot be spilled
+            if (m_spill.write(id, bowFeature, bowLevelFeature) != FrameworkReturnCode::_SUCCESS)
+                break;
+            m_keyframeRetrieval->removeDescriptor(id);
+            unaccountKeyframe(id);
+        }
+        untrackKeyframe(id);
+    }
+}
+
+bool SolARKeyframeRetrieverFBOW::SegmentSet::isDeleted(uint32_t id, uint64_t generation) const
+{
+    auto it = tombstones.find(id);
+    return (it != tombstones.end()) && (generation <= it->second);
+}
+
+const SolARFBOWIndexSegment* SolARKeyframeRetrieverFBOW::SegmentSet::find(uint32_t id) const
+{
+    for (const auto& segment : segments)
+        if (segment->contains(id))
+            return isDeleted(id, segment->getGeneration()) ? nullptr : segment.get();
+    return nullptr;
+}
+
+std::shared_ptr<const SolARKeyframeRetrieverFBOW::SegmentSet> SolARKeyframeRetrieverFBOW::getSegmentSet() const
+{
+    std::unique_lock<std::mutex> lock(m_segmentsMutex);
+    return m_segmentSet;
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::getKeyframeBoWFeature(uint32_t keyframe_id, BoWFeature& bowFeature) const
+{
+    if (getKeyframeTombstones()->test(keyframe_id))
+        return FrameworkReturnCode::_ERROR_;
+    if (m_keyframeRetrieval->getBoWFeature(keyframe_id, bowFeature) == FrameworkReturnCode::_SUCCESS)
+        return FrameworkReturnCode::_SUCCESS;
+    if (m_segmentPath.empty())
+        return FrameworkReturnCode::_ERROR_;
+    std::shared_ptr<const SegmentSet> segmentSet = getSegmentSet();
+    const SolARFBOWIndexSegment* segment = segmentSet->find(keyframe_id);
+    return segment ? segment->getBoWFeature(keyframe_id, bowFeature) : FrameworkReturnCode::_ERROR_;
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::getKeyframeBoWLevelFeature(uint32_t keyframe_id, BoWLevelFeature& bowLevelFeature) const
+{
+    if (getKeyframeTombstones()->test(keyframe_id))
+        return FrameworkReturnCode::_ERROR_;
+    if (m_keyframeRetrieval->getBoWLevelFeature(keyframe_id, bowLevelFeature) == FrameworkReturnCode::_SUCCESS)
+        return FrameworkReturnCode::_SUCCESS;
+    if (m_segmentPath.empty())
+        return FrameworkReturnCode::_ERROR_;
+    std::shared_ptr<const SegmentSet> segmentSet = getSegmentSet();
+    const SolARFBOWIndexSegment* segment = segmentSet->find(keyframe_id);
+    return segment ? segment->getBoWLevelFeature(keyframe_id, bowLevelFeature) : FrameworkReturnCode::_ERROR_;
+}
+
+void SolARKeyframeRetrieverFBOW::addToMemorySegment(const std::vector<uint32_t>& keyframes_id)
+{
+    if (m_segmentPath.empty())
+        return;
+    {
+        std::unique_lock<std::mutex> lock(m_segmentsMutex);
+        m_memorySegmentKeyframes.insert(keyframes_id.begin(), keyframes_id.end());
+        if (m_memorySegmentKeyframes.size() < static_cast<size_t>(std::max(m_segmentMaxKeyframes, 1)))
+            return;
+        m_flushRequested = true;
+    }
+    m_segmentCondition.notify_all();
+}
+
+std::string SolARKeyframeRetrieverFBOW::getSegmentFileName()
+{
+    return m_segmentPath + "_" + std::to_string(m_segmentFileId++) + ".seg";
+}
+
+void SolARKeyframeRetrieverFBOW::flushMemorySegment()
+{
+    std::set<uint32_t> keyframes;
+    uint64_t generation;
+    std::string fileName;
+    {
+        std::unique_lock<std::mutex> lock(m_segmentsMutex);
+        m_flushRequested = false;
+        if (m_memorySegmentKeyframes.empty())
+            return;
+        keyframes.swap(m_memorySegmentKeyframes);
+        m_flushingKeyframes = keyframes;
+        generation = ++m_segmentGeneration;
+        fileName = getSegmentFileName();
+    }
+
+    // spilled keyframes are loaded back so that the in-memory segment is in the keyframe retrieval model only
+    loadSpilledKeyframes(std::vector<uint32_t>(keyframes.begin(), keyframes.end()));
+
+    SolARFBOWIndexSegmentWriter writer;
+    bool written = (writer.open(fileName) == FrameworkReturnCode::_SUCCESS);
+    std::vector<uint32_t> segmentKeyframes;
+    std::shared_ptr<const KeyframeTombstones> tombstones = getKeyframeTombstones();
+    for (const auto& id : keyframes) {
+        BoWFeature bowFeature;
+        BoWLevelFeature bowLevelFeature;
+        {
+            // the keyframe may have been suppressed in the meantime
+            std::shared_lock<std::shared_mutex> modelLock(m_modelMutex);
+            if (tombstones->test(id) ||
+                (m_keyframeRetrieval->getBoWFeature(id, bowFeature) != FrameworkReturnCode::_SUCCESS) ||
+                (m_keyframeRetrieval->getBoWLevelFeature(id, bowLevelFeature) != FrameworkReturnCode::_SUCCESS))
+                continue;
+        }
+        written = written && (writer.add(id, bowFeature, bowLevelFeature) == FrameworkReturnCode::_SUCCESS);
+        segmentKeyframes.push_back(id);
+    }
+    written = written && (writer.close() == FrameworkReturnCode::_SUCCESS);
+    auto segment = std::make_shared<SolARFBOWIndexSegment>();
+    if (!written || (segment->open(fileName, generation) != FrameworkReturnCode::_SUCCESS)) {
+        LOG_ERROR("SolARKeyframeRetrieverFBOW: cannot write the index segment {}, keyframes are kept in memory", fileName);
+        segment->removeFileOnClose();
+        std::unique_lock<std::mutex> lock(m_segmentsMutex);
+        m_memorySegmentKeyframes.insert(keyframes.begin(), keyframes.end());
+        m_flushingKeyframes.clear();
+        return;
+    }
+
+    {
+        // the keyframes leave the retrieval model under its exclusive lock, taken before m_segmentsMutex
+        std::unique_lock<std::shared_mutex> modelLock(m_modelMutex);
+        auto retrievalLock = m_keyframeRetrieval->acquireLock();
+        std::unique_lock<std::mutex> lock(m_segmentsMutex);
+        auto segmentSet = std::make_shared<SegmentSet>(*m_segmentSet);
+        segmentSet->segments.insert(segmentSet->segments.begin(), segment);
+        m_segmentSet = segmentSet;
+        // remove the keyframes from the in-memory segment, unless they have been suppressed and added again
+        for (const auto& id : segmentKeyframes)
+            if (m_memorySegmentKeyframes.find(id) == m_memorySegmentKeyframes.end()) {
+                m_keyframeRetrieval->removeDescriptor(id);
+                unaccountKeyframe(id);
+            }
+        m_flushingKeyframes.clear();
+    }
+    if (m_memoryBudget > 0) {
+        std::unique_lock<std::mutex> lock(m_spillMutex);
+        for (const auto& id : segmentKeyframes)
+            untrackKeyframe(id);
+    }
+    LOG_DEBUG("SolARKeyframeRetrieverFBOW: {} keyframes written to index segment {}", segmentKeyframes.size(), fileName);
+}
+
+void SolARKeyframeRetrieverFBOW::mergeSegments()
+{
+    std::shared_ptr<const SegmentSet> segmentSet = getSegmentSet();
+    if (segmentSet->segments.size() < 2)
+        return;
+
+    // newest copy of each keyframe which is not deleted
+    std::map<uint32_t, const SolARFBOWIndexSegment*> keyframes;
+    for (const auto& segment : segmentSet->segments)
+        for (uint32_t i = 0; i < segment->getNbKeyframes(); ++i) {
+            uint32_t id = segment->getKeyframeId(i);
+            if (!segmentSet->isDeleted(id, segment->getGeneration()))
+                keyframes.emplace(id, segment.get());
+        }
+
+    // the merged segment replaces the newest merged one
+    uint64_t generation = segmentSet->segments.front()->getGeneration();
+    std::string fileName;
+    {
+        std::unique_lock<std::mutex> lock(m_segmentsMutex);
+        fileName = getSegmentFileName();
+    }
+    SolARFBOWIndexSegmentWriter writer;
+    bool written = (writer.open(fileName) == FrameworkReturnCode::_SUCCESS);
+    for (const auto& it : keyframes) {
+        BoWFeature bowFeature;
+        BoWLevelFeature bowLevelFeature;
+        written = written &&
+                  (it.second->getBoWFeature(it.first, bowFeature) == FrameworkReturnCode::_SUCCESS) &&
+                  (it.second->getBoWLevelFeature(it.first, bowLevelFeature) == FrameworkReturnCode::_SUCCESS) &&
+                  (writer.add(it.first, bowFeature, bowLevelFeature) == FrameworkReturnCode::_SUCCESS);
+    }
+    written = written && (writer.close() == FrameworkReturnCode::_SUCCESS);
+    auto merged = std::make_shared<SolARFBOWIndexSegment>();
+    if (!written || (merged->open(fileName, generation) != FrameworkReturnCode::_SUCCESS)) {
+        LOG_ERROR("SolARKeyframeRetrieverFBOW: cannot merge index segments into {}", fileName);
+        merged->removeFileOnClose();
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_segmentsMutex);
+    auto newSegmentSet = std::make_shared<SegmentSet>();
+    // segments written during the merge are newer
+    for (const auto& segment : m_segmentSet->segments)
+        if (segment->getGeneration() > generation)
+            newSegmentSet->segments.push_back(segment);
+    newSegmentSet->segments.push_back(merged);
+    // tombstones applied by the merge are dropped
+    for (const auto& it : m_segmentSet->tombstones) {
+        auto itMerged = segmentSet->tombstones.find(it.first);
+        if ((itMerged == segmentSet->tombstones.end()) || (itMerged->second != it.second))
+            newSegmentSet->tombstones.insert(it);
+    }
+    for (const auto& segment : segmentSet->segments)
+        segment->removeFileOnClose();
+    m_segmentSet = newSegmentSet;
+    LOG_DEBUG("SolARKeyframeRetrieverFBOW: {} index segments merged into {}", segmentSet->segments.size(), fileName);
+}
+
+void SolARKeyframeRetrieverFBOW::segmentLoop()
+{
+    bool mergeFailed = false;
+    while (true) {
+        bool flushRequested;
+        {
+            std::unique_lock<std::mutex> lock(m_segmentsMutex);
+            size_t maxSegments = static_cast<size_t>(std::max(m_segmentMergeFactor, 1));
+            m_segmentCondition.wait(lock, [this, maxSegments, &mergeFailed] {
+                return m_stopSegments || m_flushRequested || (!mergeFailed && (m_segmentSet->segments.size() > maxSegments)); });
+            if (m_stopSegments)
+                return;
+            flushRequested = m_flushRequested;
+        }
+        if (flushRequested) {
+            flushMemorySegment();
+            mergeFailed = false;
+        }
+        size_t nbSegments = getSegmentSet()->segments.size();
+        if (nbSegments > static_cast<size_t>(std::max(m_segmentMergeFactor, 1))) {
+            mergeSegments();
+            mergeFailed = (getSegmentSet()->segments.size() == nbSegments);
+        }
+    }
+}
+
+void SolARKeyframeRetrieverFBOW::stopSegments()
+{
+    if (!m_segmentThread.joinable())
+        return;
+    {
+        std::unique_lock<std::mutex> lock(m_segmentsMutex);
+        m_stopSegments = true;
+    }
+    m_segmentCondition.notify_all();
+    m_segmentThread.join();
+}
+
+void SolARKeyframeRetrieverFBOW::clearSegments()
+{
+    stopSegments();
+    std::unique_lock<std::mutex> lock(m_segmentsMutex);
+    for (const auto& segment : m_segmentSet->segments)
+        segment->removeFileOnClose();
+    m_segmentSet = std::make_shared<SegmentSet>();
+    m_memorySegmentKeyframes.clear();
+    m_flushingKeyframes.clear();
+    m_flushRequested = false;
+}
+
+void SolARKeyframeRetrieverFBOW::restartSegments()
+{
+    clearSegments();
+    if (!m_segmentPath.empty()) {
+        m_stopSegments = false;
+        m_segmentThread = std::thread(&SolARKeyframeRetrieverFBOW::segmentLoop, this);
+    }
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::retrieve(const SRef<Frame> frame, std::vector<uint32_t> &retKeyframes_id)
+{
+	return retrieve(frame, ALL_PARTITIONS, retKeyframes_id);
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::retrieve(const SRef<Frame> frame, uint64_t partitionMask, std::vector<uint32_t> &retKeyframes_id)
+{
+	bool complete;
+	return retrieve(frame, RetrieveBudget(), retKeyframes_id, complete, partitionMask);
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::retrieve(const SRef<Frame> frame, const KeyframeFilter& filter, std::vector<uint32_t> &retKeyframes_id,
+														 uint64_t partitionMask)
+{
+	bool complete;
+	return retrieve(frame, RetrieveBudget(), retKeyframes_id, complete, partitionMask, &filter);
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::retrieve(const SRef<Frame> frame, const RetrieveBudget& budget, std::vector<uint32_t> &retKeyframes_id,
+														 bool& complete, uint64_t partitionMask, const KeyframeFilter* filter)
+{
+	auto startTime = std::chrono::steady_clock::now();
+	std::shared_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
+	complete = true;
+	// convert frame desc to Mat opencv
+	SRef<DescriptorBuffer> desc_Solar = frame->getDescriptors();
+	if (desc_Solar->getNbDescriptors() == 0)
+		return FrameworkReturnCode::_ERROR_;
+	cv::Mat desc_OpenCV(desc_Solar->getNbDescriptors(), desc_Solar->getNbElements(), m_VOC->getDescType(), desc_Solar->data());
+
+	// calculate bow desc corresponding to the query frame in the buffers of the thread. fbow allocates its maps
+	SolARFBOWQueryScratch& scratch = SolARFBOWQueryScratch::local();
+	SolARFBOWFlatBoW& queryBoW = scratch.queryFlatBoW;
+	if (m_useVOCTree)
+		m_VOCTree.transform(desc_OpenCV, m_level, queryBoW);
+	else {
+		fbow::fBow v_bow;
+		fbow::fBow2 v_bow2;
+		m_VOC->transform(desc_OpenCV, m_level, v_bow, v_bow2);
+		SolARFBOWHelper::fbow2Flat(v_bow, v_bow2, queryBoW);
+	}
+	SolARFBOWHammingEmbedding::Signatures& signatures = scratch.signatures;
+	signatures.clear();
+	if (m_signatureThreshold > 0)
+		m_hammingEmbedding.compute(desc_OpenCV, queryBoW, signatures);
+	return retrieveFromBoW(queryBoW, signatures, partitionMask, filter, budget, startTime, retKeyframes_id, complete);
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::retrieve(const BoWFeature& bowFeature, const BoWLevelFeature& bowLevelFeature,
+														 std::vector<uint32_t> &retKeyframes_id, uint64_t partitionMask)
 {
-    LOG_DEBUG(" SolARKeyframeRetrieverFBOW destructor")
+	auto startTime = std::chrono::steady_clock::now();
+	std::shared_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
+	if (bowLevelFeature.empty())
+		return FrameworkReturnCode::_ERROR_;
+	SolARFBOWQueryScratch& scratch = SolARFBOWQueryScratch::local();
+	SolARFBOWHelper::solar2Flat(bowFeature, bowLevelFeature, scratch.queryFlatBoW);
+	scratch.signatures.clear();
+	bool complete;
+	return retrieveFromBoW(scratch.queryFlatBoW, scratch.signatures, partitionMask, nullptr, RetrieveBudget(), startTime,
+						   retKeyframes_id, complete);
 }
 
-xpcf::XPCFErrorCode SolARKeyframeRetrieverFBOW::onConfigured()
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::retrieve(const SRef<Frame> frame, SolARFBOWQuerySession& session, std::vector<uint32_t> &retKeyframes_id,
+														 uint64_t partitionMask)
 {
-    LOG_DEBUG(" SolARKeyframeRetrieverFBOW onConfigured");
-
-    // Load a vocabulary from m_VOCpath
-	std::ifstream file(m_VOCPath);
-	if (!file.is_open())
-		LOG_ERROR(" SolARKeyframeRetrieverFBOW onConfigured: Cannot load the vocabulary from file");
-	file.close();
-    m_VOC.readFromFile(m_VOCPath);
-    if (!m_VOC.isValid())
-        return xpcf::XPCFErrorCode::_ERROR_INVALID_ARGUMENT;
-	LOG_DEBUG("Descriptor name: {}", m_VOC.getDescName());
-	LOG_DEBUG("Descriptor type: {}", m_VOC.getDescType());
-	LOG_DEBUG("Descriptor size: {}", m_VOC.getDescSize());	
-	LOG_DEBUG("Nb of cluster per node: {}", m_VOC.getK());
-
-    return xpcf::XPCFErrorCode::_SUCCESS;
-}
+	// residual signatures, on-disk segments and spilled keyframes are only handled by full queries
+	if ((m_signatureThreshold > 0) || !m_segmentPath.empty() || (m_memoryBudget > 0)) {
+		session.reset();
+		session.m_nbFullQueries++;
+		return retrieve(frame, partitionMask, retKeyframes_id);
+	}
+	std::shared_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
+	SRef<DescriptorBuffer> descriptors = frame->getDescriptors();
+	if (descriptors->getNbDescriptors() == 0)
+		return FrameworkReturnCode::_ERROR_;
+	cv::Mat cvDescriptors(descriptors->getNbDescriptors(), descriptors->getNbElements(), m_VOC->getDescType(), descriptors->data());
+	fbow::fBow v_bow;
+	fbow::fBow2 v_bow2;
+	if (m_useVOCTree)
+		m_VOCTree.transform(cvDescriptors, m_level, v_bow, v_bow2);
+	else
+		m_VOC->transform(cvDescriptors, m_level, v_bow, v_bow2);
+	BoWFeature bowFeature = SolARFBOWHelper::fbow2Solar(v_bow);
+	BoWLevelFeature bowLevelFeature = SolARFBOWHelper::fbow2Solar(std::move(v_bow2));
+	const ScoringType scoringType = m_scoringType;
 
-FrameworkReturnCode SolARKeyframeRetrieverFBOW::addKeyframe(const SRef<Keyframe> keyframe, bool useMatchedDescriptor)
-{
-	// Convert desc of keyframe to Mat opencv
-	SRef<DescriptorBuffer> desc_Solar = keyframe->getDescriptors();
-	SRef<DescriptorBuffer> descToComputeBow;
-	if (!useMatchedDescriptor) {
-		descToComputeBow = desc_Solar; // by default, use all descriptors 
+	// scale of the weights of the frame relative to the unscaled weights of the session. Words of unchanged descriptors
+	// are only rescaled by the normalization, their median ratio gives the scale
+	const bool hasQueryScale = SolARFBOWHelper::hasQueryScale(scoringType);
+	double queryScale = 1.;
+	if (hasQueryScale && session.m_isValid) {
+		std::vector<double> ratios;
+		for (const auto& it : bowFeature) {
+			auto itPrevious = session.m_bowFeature.find(it.first);
+			if ((itPrevious != session.m_bowFeature.end()) && (itPrevious->second > 0.f))
+				ratios.push_back(it.second / itPrevious->second);
+		}
+		if (!ratios.empty()) {
+			std::nth_element(ratios.begin(), ratios.begin() + ratios.size() / 2, ratios.end());
+			queryScale = ratios[ratios.size() / 2];
+		}
+		else
+			queryScale = session.m_queryScale;
 	}
-	else {
-		const auto& isMatched = keyframe->getIsKeypointMatched();
-		if (!isMatched.empty()) {
-			descToComputeBow = xpcf::utils::make_shared<DescriptorBuffer>(desc_Solar->getDescriptorType(), desc_Solar->getDescriptorDataType(), desc_Solar->getNbElements(), 0);
-            for (auto i = 0; i < desc_Solar->getNbDescriptors(); i++)
-                if (isMatched[i])
-                    descToComputeBow->append(desc_Solar->getDescriptor(i));
+
+	// words whose unscaled weight changed since the previous frame, with their previous and new unscaled weights (0 if absent)
+	const double tolerance = hasQueryScale ? 1e-5 : 0.;
+	std::vector<std::tuple<uint32_t, float, float>> changedWords;
+	BoWFeature sessionFeature;
+	auto itPrevious = session.m_bowFeature.begin();
+	auto itCurrent = bowFeature.begin();
+	while ((itPrevious != session.m_bowFeature.end()) || (itCurrent != bowFeature.end())) {
+		if ((itCurrent == bowFeature.end()) || ((itPrevious != session.m_bowFeature.end()) && (itPrevious->first < itCurrent->first))) {
+			changedWords.emplace_back(itPrevious->first, itPrevious->second, 0.f);
+			++itPrevious;
+		}
+		else if ((itPrevious == session.m_bowFeature.end()) || (itCurrent->first < itPrevious->first)) {
+			float weight = static_cast<float>(itCurrent->second / queryScale);
+			changedWords.emplace_back(itCurrent->first, 0.f, weight);
+			sessionFeature.emplace_hint(sessionFeature.end(), itCurrent->first, weight);
+			++itCurrent;
 		}
 		else {
-            // when keyframe's matched keypoint map is empty, use all descriptors also
-			descToComputeBow = desc_Solar;
+			if (std::fabs(itCurrent->second - queryScale * itPrevious->second) > tolerance * itCurrent->second) {
+				float weight = static_cast<float>(itCurrent->second / queryScale);
+				changedWords.emplace_back(itCurrent->first, itPrevious->second, weight);
+				sessionFeature.emplace_hint(sessionFeature.end(), itCurrent->first, weight);
+			}
+			else
+				sessionFeature.emplace_hint(sessionFeature.end(), itPrevious->first, itPrevious->second);
+			++itPrevious;
+			++itCurrent;
 		}
 	}
-	cv::Mat desc_OpenCV(descToComputeBow->getNbDescriptors(), descToComputeBow->getNbElements(), m_VOC.getDescType(), descToComputeBow->data());
 
-	// Get bow desc corresponding to keyframe desc
-	fbow::fBow v_bow;
-	fbow::fBow2 v_bow2;
-	m_VOC.transform(desc_OpenCV, m_level, v_bow, v_bow2);
+	// keyframes changed since the previous frame are replayed, unless the change log does not hold all of them
+	std::vector<uint32_t> changedKeyframes;
+	uint64_t modelSequence;
+	bool isReplayable = getModelChanges(session.m_modelSequence, changedKeyframes, modelSequence);
 
-    // convertir bow to solar
-    datastructure::BoWFeature v_bowFeature = SolARFBOWHelper::fbow2Solar(v_bow);
-    datastructure::BoWLevelFeature v_bowLevelFeature = SolARFBOWHelper::fbow2Solar(v_bow2);
+	// a full query starts from an empty previous frame
+	if (!session.m_isValid || !isReplayable || (session.m_partitionMask != partitionMask) ||
+		(changedWords.size() > session.m_maxDelta * std::max<size_t>(bowFeature.size(), 1)) ||
+		((session.m_refreshPeriod > 0) && (session.m_nbQueriesSinceRefresh >= session.m_refreshPeriod))) {
+		session.reset();
+		changedKeyframes.clear();
+		changedWords.clear();
+		for (const auto& it : bowFeature)
+			changedWords.emplace_back(it.first, 0.f, it.second);
+		sessionFeature = bowFeature;
+		queryScale = 1.;
+		session.m_nbFullQueries++;
+	}
+	else {
+		session.m_nbQueriesSinceRefresh++;
+		session.m_nbIncrementalQueries++;
+	}
 
-	// Add bow desc to the database
-	m_keyframeRetrieval->acquireLock();
-    return m_keyframeRetrieval->addDescriptor(keyframe->getId(), v_bowFeature, v_bowLevelFeature);
-}
+	// update the votes of the keyframes from the posting lists of the removed and added level nodes
+	{
+		std::shared_lock<std::shared_mutex> modelLock(m_modelMutex);
+		std::shared_ptr<const KeyframeTombstones> tombstones = getKeyframeTombstones();
+		std::unique_lock<std::mutex> partitionsLock(m_partitionsMutex, std::defer_lock);
+		if (partitionMask != ALL_PARTITIONS)
+			partitionsLock.lock();
+		auto isSelected = [&](uint32_t keyframe_id) {
+			if (tombstones->test(keyframe_id))
+				return false;
+			if (!partitionsLock.owns_lock())
+				return true;
+			uint32_t partition = findKeyframePartition(keyframe_id);
+			return (partitionMask & (uint64_t(1) << partition)) != 0;
+		};
+		// changed keyframes are voted again by the level nodes of the previous frame, and scored again if they are shortlisted
+		for (const auto& keyframe_id : changedKeyframes) {
+			session.m_candidates.erase(keyframe_id);
+			BoWLevelFeature kfBoWLevel;
+			if (!isSelected(keyframe_id) || (m_keyframeRetrieval->getBoWLevelFeature(keyframe_id, kfBoWLevel) != FrameworkReturnCode::_SUCCESS))
+				continue;
+			int votes = 0;
+			for (const auto& it : kfBoWLevel)
+				if (session.m_bowLevelFeature.find(it.first) != session.m_bowLevelFeature.end())
+					votes++;
+			if (votes > 0)
+				session.m_candidates[keyframe_id].votes = votes;
+		}
+		auto updateVotes = [&](uint32_t node, int delta) {
+			std::set<uint32_t> kfs_id;
+			if (m_keyframeRetrieval->getInvertedIndex(node, kfs_id) != FrameworkReturnCode::_SUCCESS)
+				return;
+			for (const auto& keyframe_id : kfs_id) {
+				if (!isSelected(keyframe_id))
+					continue;
+				auto itCandidate = session.m_candidates.emplace(keyframe_id, SolARFBOWQuerySession::Candidate()).first;
+				itCandidate->second.votes += delta;
+				if (itCandidate->second.votes <= 0)
+					session.m_candidates.erase(itCandidate);
+			}
+		};
+		auto itPreviousNode = session.m_bowLevelFeature.begin();
+		auto itCurrentNode = bowLevelFeature.begin();
+		while ((itPreviousNode != session.m_bowLevelFeature.end()) || (itCurrentNode != bowLevelFeature.end())) {
+			if ((itCurrentNode == bowLevelFeature.end()) ||
+				((itPreviousNode != session.m_bowLevelFeature.end()) && (itPreviousNode->first < itCurrentNode->first))) {
+				updateVotes(itPreviousNode->first, -1);
+				++itPreviousNode;
+			}
+			else if ((itPreviousNode == session.m_bowLevelFeature.end()) || (itCurrentNode->first < itPreviousNode->first)) {
+				updateVotes(itCurrentNode->first, 1);
+				++itCurrentNode;
+			}
+			else {
+				++itPreviousNode;
+				++itCurrentNode;
+			}
+		}
+	}
 
-FrameworkReturnCode SolARKeyframeRetrieverFBOW::suppressKeyframe(uint32_t keyframe_id)
-{
-	m_keyframeRetrieval->acquireLock();
-	return m_keyframeRetrieval->removeDescriptor(keyframe_id);	
-}
+	// apply the weight deltas of the changed words to the scored candidates
+	for (auto& it : session.m_candidates) {
+		SolARFBOWQuerySession::Candidate& candidate = it.second;
+		if (!candidate.isScored)
+			continue;
+		for (const auto& word : changedWords) {
+			auto itWord = candidate.bowFeature.find(std::get<0>(word));
+			if (itWord != candidate.bowFeature.end())
+				candidate.sum += SolARFBOWHelper::termBoW(scoringType, itWord->second, std::get<2>(word)) -
+								 SolARFBOWHelper::termBoW(scoringType, itWord->second, std::get<1>(word));
+		}
+	}
+	session.m_bowFeature.swap(sessionFeature);
+	session.m_queryScale = queryScale;
+	session.m_bowLevelFeature.swap(bowLevelFeature);
+	session.m_modelSequence = modelSequence;
+	session.m_partitionMask = partitionMask;
+	session.m_isValid = true;
+	if (session.m_candidates.empty())
+		return FrameworkReturnCode::_ERROR_;
 
-void SolARKeyframeRetrieverFBOW::resetKeyframeRetrieval()
-{
-    m_keyframeRetrieval->acquireLock();
-    m_keyframeRetrieval->reset();
-}
+	// get best candidates as in a full retrieve
+	std::vector<uint32_t> bestCandidates;
+	if (m_coarseLevel > 0) {
+		std::vector<uint32_t> candidates;
+		for (auto const &it : session.m_candidates)
+			candidates.push_back(it.first);
+		CoarseFeature& queryFeature = SolARFBOWQueryScratch::local().coarseFeature;
+		computeCoarseFeature(session.m_bowLevelFeature, queryFeature);
+		selectCoarseCandidates(candidates, queryFeature, bestCandidates);
+	}
+	else {
+		int maxScore = 0;
+		for (auto const &it : session.m_candidates)
+			maxScore = std::max(maxScore, it.second.votes);
+		int minScore = 0.5 * maxScore;
+		for (auto const &it : session.m_candidates)
+			if (it.second.votes > minScore)
+				bestCandidates.push_back(it.first);
+	}
 
-FrameworkReturnCode SolARKeyframeRetrieverFBOW::retrieve(const SRef<Frame> frame, std::vector<uint32_t> &retKeyframes_id)
-{
-	// convert frame desc to Mat opencv
-	SRef<DescriptorBuffer> desc_Solar = frame->getDescriptors();
-	if (desc_Solar->getNbDescriptors() == 0)
+	// best candidates entering the shortlist are scored once, then updated by the deltas of the next frames
+	std::vector<std::pair<uint32_t, double>> distKeyframes;
+	std::shared_lock<std::shared_mutex> modelLock(m_modelMutex);
+	for (const auto& keyframe_id : bestCandidates) {
+		SolARFBOWQuerySession::Candidate& candidate = session.m_candidates[keyframe_id];
+		if (!candidate.isScored) {
+			if (getKeyframeBoWFeature(keyframe_id, candidate.bowFeature) != FrameworkReturnCode::_SUCCESS)
+				continue;
+			SolARFBOWHelper::remapBoW(m_wordRemap, candidate.bowFeature);
+			candidate.sum = SolARFBOWHelper::baseBoW(scoringType, candidate.bowFeature);
+			for (const auto& it : candidate.bowFeature) {
+				auto itWord = session.m_bowFeature.find(it.first);
+				if (itWord != session.m_bowFeature.end())
+					candidate.sum += SolARFBOWHelper::termBoW(scoringType, it.second, itWord->second);
+			}
+			candidate.isScored = true;
+		}
+		double score = SolARFBOWHelper::finalizeBoW(scoringType, candidate.sum, session.m_queryScale);
+		if (score > m_threshold)
+			distKeyframes.push_back(std::make_pair(keyframe_id, score));
+	}
+	modelLock.unlock();
+	std::stable_sort(distKeyframes.begin(), distKeyframes.end(),
+					 [](const std::pair<uint32_t, double>& v1, const std::pair<uint32_t, double>& v2) { return v1.second > v2.second; });
+	if (distKeyframes.size() == 0)
 		return FrameworkReturnCode::_ERROR_;
-	cv::Mat desc_OpenCV(desc_Solar->getNbDescriptors(), desc_Solar->getNbElements(), m_VOC.getDescType(), desc_Solar->data());
+	for (auto const &it : distKeyframes)
+		retKeyframes_id.push_back(it.first);
+	touchKeyframes(retKeyframes_id);
+	return FrameworkReturnCode::_SUCCESS;
+}
 
-	// calculate bow desc corresponding to the query frame
-	fbow::fBow v_bow;
-	fbow::fBow2 v_bow2;
-	m_VOC.transform(desc_OpenCV, m_level, v_bow, v_bow2);
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::retrieveFromBoW(const SolARFBOWFlatBoW& queryBoW, const SolARFBOWHammingEmbedding::Signatures& signatures,
+																 uint64_t partitionMask,
+																 const KeyframeFilter* filter, const RetrieveBudget& budget, std::chrono::steady_clock::time_point startTime,
+																 std::vector<uint32_t> &retKeyframes_id, bool& complete)
+{
+	complete = true;
+	const bool hasDeadline = budget.timeBudget > 0.;
+	const auto deadline = startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::duration<double, std::milli>(budget.timeBudget));
+	auto isExpired = [&]() {
+		if (hasDeadline && complete && (std::chrono::steady_clock::now() >= deadline))
+			complete = false;
+		return !complete;
+	};
 
-    // convertir bow to solar
-    datastructure::BoWFeature v_bowFeature = SolARFBOWHelper::fbow2Solar(v_bow);
-    datastructure::BoWLevelFeature v_bowLevelFeature = SolARFBOWHelper::fbow2Solar(v_bow2);
+	// a shared node votes for a keyframe of the selected partitions accepted by the filter. With signatures, only if
+	// one of its descriptors is close to a query descriptor. Votes and candidates are kept in the buffers of the thread
+	SolARFBOWQueryScratch& scratch = SolARFBOWQueryScratch::local();
+	scratch.resetVotes();
+	std::shared_lock<std::shared_mutex> modelLock(m_modelMutex);
+	std::unique_lock<std::mutex> partitionsLock(m_partitionsMutex, std::defer_lock);
+	if (partitionMask != ALL_PARTITIONS)
+		partitionsLock.lock();
+	std::unique_lock<std::mutex> signaturesLock(m_signaturesMutex, std::defer_lock);
+	if (!signatures.empty())
+		signaturesLock.lock();
+	const uint32_t signatureThreshold = static_cast<uint32_t>(std::max(m_signatureThreshold, 0));
+	auto vote = [&](uint32_t keyframe_id, uint32_t node) {
+		if (filter && !filter->accept(keyframe_id))
+			return;
+		if (partitionsLock.owns_lock()) {
+			uint32_t partition = findKeyframePartition(keyframe_id);
+			if (!(partitionMask & (uint64_t(1) << partition)))
+				return;
+		}
+		if (!signatures.empty()) {
+			auto itSignatures = m_signatures.find(keyframe_id);
+			if (itSignatures != m_signatures.end()) {
+				const auto& kfSignatures = itSignatures->second;
+				auto nodeBegin = std::make_pair(node, uint64_t(0));
+				auto nodeEnd = std::make_pair(node, UINT64_MAX);
+				if (!SolARFBOWHammingEmbedding::hasCloseSignatures(
+						std::lower_bound(signatures.begin(), signatures.end(), nodeBegin), std::upper_bound(signatures.begin(), signatures.end(), nodeEnd),
+						std::lower_bound(kfSignatures.begin(), kfSignatures.end(), nodeBegin), std::upper_bound(kfSignatures.begin(), kfSignatures.end(), nodeEnd),
+						signatureThreshold))
+					return;
+			}
+		}
+		scratch.vote(keyframe_id);
+	};
 
 	// get candidates that have at least 1 common word with the query frame
-	std::map<uint32_t, int> scoreCandidates;
-    for (auto const &it : v_bowLevelFeature) {
+	std::shared_ptr<const KeyframeTombstones> tombstones = getKeyframeTombstones();
+	// the framework returns a copy of each posting list: its nodes are the only allocations of the query
+    for (auto const &it : queryBoW.nodes) {
+		if (isExpired())
+			break;
 		std::set<uint32_t> kfs_id; 		
 		if (m_keyframeRetrieval->getInvertedIndex(it.first, kfs_id) != FrameworkReturnCode::_SUCCESS)
 			continue;
 		for (auto const &it_kf : kfs_id)
-			scoreCandidates[it_kf]++;
+			if (!tombstones->test(it_kf))
+				vote(it_kf, it.first);
+	}
+	// candidates of on-disk segments. Keyframes of the in-memory segment are newer than their on-disk copies
+	if (!m_segmentPath.empty()) {
+		const std::vector<uint32_t>& votedKeyframes = scratch.getVotedKeyframes();
+		std::vector<uint32_t>& memoryCandidates = scratch.memoryCandidates;
+		memoryCandidates.assign(votedKeyframes.begin(), votedKeyframes.end());
+		std::shared_ptr<const SegmentSet> segmentSet = getSegmentSet();
+		for (auto const &it : queryBoW.nodes) {
+			if (isExpired())
+				break;
+			for (auto const &segment : segmentSet->segments) {
+				uint32_t nbKeyframes;
+				const uint32_t* kfs_id = segment->getInvertedIndex(it.first, nbKeyframes);
+				for (uint32_t i = 0; i < nbKeyframes; i++)
+					if (!std::binary_search(memoryCandidates.begin(), memoryCandidates.end(), kfs_id[i]) &&
+						!segmentSet->isDeleted(kfs_id[i], segment->getGeneration()))
+						vote(kfs_id[i], it.first);
+			}
+		}
 	}
-	if (scoreCandidates.size() == 0)
+	// spilled keyframes remain candidates
+	if (m_memoryBudget > 0) {
+		std::unique_lock<std::mutex> lock(m_spillMutex);
+		for (auto const &it : queryBoW.nodes) {
+			if (isExpired())
+				break;
+			const std::vector<uint32_t>* kfs_id = m_spill.getInvertedIndex(it.first);
+			if (kfs_id)
+				for (auto const &it_kf : *kfs_id)
+					vote(it_kf, it.first);
+		}
+	}
+	if (signaturesLock.owns_lock())
+		signaturesLock.unlock();
+	if (partitionsLock.owns_lock())
+		partitionsLock.unlock();
+	modelLock.unlock();
+	const std::vector<uint32_t>& candidates = scratch.getVotedKeyframes();
+	if (candidates.size() == 0)
 		return FrameworkReturnCode::_ERROR_;
 
 	// find max common words
 	int maxScore = 0;
-	for (auto const &it : scoreCandidates)
-		if (it.second > maxScore)
-			maxScore = it.second;
+	for (auto const &id : candidates)
+		maxScore = std::max(maxScore, scratch.getVotes(id));
 	int minScore = 0.5 * maxScore;
 
-	// get best candidates
-	std::vector<uint32_t> bestCandidates;
-	for (auto const &it : scoreCandidates)
-		if (it.second > minScore)
-			bestCandidates.push_back(it.first);
-
-	// find nearest keyframes
-    std::vector<std::pair<int, double>> distKeyframes;
-	for (auto const &it : bestCandidates) {
-        datastructure::BoWFeature kfBoW;
-        if (m_keyframeRetrieval->getBoWFeature(it, kfBoW) != FrameworkReturnCode::_SUCCESS)
-			continue;
-        double score = 0.;
-        ScoringType scoreMethod = static_cast<ScoringType>(m_distanceMetricId);
-        if (scoreMethod == ScoringType::L2_NORM)
-            score = SolARFBOWHelper::distanceBoW(kfBoW, v_bowFeature);
-        else if (scoreMethod == ScoringType::L1_NORM)
-            score = SolARFBOWHelper::distanceL1BoW(kfBoW, v_bowFeature);
-        else if (scoreMethod == ScoringType::BHATTACHARYYA)
-            score = SolARFBOWHelper::distanceBhattacharyyaBoW(kfBoW, v_bowFeature);
-        else if (scoreMethod == ScoringType::CHI_SQUARE)
-            score = SolARFBOWHelper::distanceChiSquareBoW(kfBoW, v_bowFeature);
-        else if (scoreMethod == ScoringType::DOT_PRODUCT)
-            score = SolARFBOWHelper::distanceDotProductBoW(kfBoW, v_bowFeature);
-        else if (scoreMethod == ScoringType::KLS)
-            score = SolARFBOWHelper::distanceKLSBoW(kfBoW, v_bowFeature);
-        else {
-            LOG_WARNING("Invalid BoW metric ID {}, use default L2", m_distanceMetricId);
-            score = SolARFBOWHelper::distanceBoW(kfBoW, v_bowFeature);
-        }
-		if (score > m_threshold)
-            distKeyframes.push_back(std::pair<int, double>(it, score));
+	// get best candidates, shortlisted by their coarse scores in the coarse-to-fine mode
+	std::vector<uint32_t>& bestCandidates = scratch.bestCandidates;
+	bestCandidates.clear();
+	if (m_coarseLevel > 0) {
+		computeCoarseFeature(queryBoW, scratch.coarseFeature);
+		selectCoarseCandidates(candidates, scratch.coarseFeature, bestCandidates);
+	}
+	else {
+		for (auto const &id : candidates)
+			if (scratch.getVotes(id) > minScore)
+				bestCandidates.push_back(id);
 	}
 
+	// a bounded retrieve scores candidates in descending order of shared words
+	std::vector<std::pair<uint32_t, double>>& distKeyframes = scratch.distKeyframes;
+	distKeyframes.clear();
+	if (!hasDeadline && (budget.maxCandidates == 0)) {
+		loadSpilledKeyframes(bestCandidates);
+		scoreKeyframes(bestCandidates, queryBoW.words, distKeyframes);
+	}
+	else {
+		// ranked by descending votes then by shortlist order, as a stable sort would do without its temporary buffer
+		auto& rankedCandidates = scratch.rankedCandidates;
+		rankedCandidates.clear();
+		for (size_t i = 0; i < bestCandidates.size(); i++)
+			rankedCandidates.push_back(std::make_pair((uint64_t(maxScore - scratch.getVotes(bestCandidates[i])) << 32) | i, bestCandidates[i]));
+		std::sort(rankedCandidates.begin(), rankedCandidates.end());
+		for (size_t i = 0; i < rankedCandidates.size(); i++)
+			bestCandidates[i] = rankedCandidates[i].second;
+		if ((budget.maxCandidates > 0) && (bestCandidates.size() > budget.maxCandidates)) {
+			bestCandidates.resize(budget.maxCandidates);
+			complete = false;
+		}
+		// candidates are scored by slices until the deadline
+		size_t sliceSize = hasDeadline ? std::max<size_t>(BUDGET_SLICE_SIZE, m_threadPool->getNbThreads()) : bestCandidates.size();
+		std::vector<uint32_t>& slice = scratch.slice;
+		for (size_t begin = 0; begin < bestCandidates.size(); begin += sliceSize) {
+			if (isExpired())
+				break;
+			slice.assign(bestCandidates.begin() + begin, bestCandidates.begin() + std::min(begin + sliceSize, bestCandidates.size()));
+			loadSpilledKeyframes(slice);
+			std::vector<std::pair<uint32_t, double>>& sliceKeyframes = scratch.sliceKeyframes;
+			std::vector<std::pair<uint32_t, double>>& merged = scratch.mergedKeyframes;
+			sliceKeyframes.clear();
+			merged.clear();
+			scoreKeyframes(slice, queryBoW.words, sliceKeyframes);
+			merged.reserve(distKeyframes.size() + sliceKeyframes.size());
+			std::merge(distKeyframes.begin(), distKeyframes.end(), sliceKeyframes.begin(), sliceKeyframes.end(), std::back_inserter(merged),
+					   [](const std::pair<uint32_t, double>& v1, const std::pair<uint32_t, double>& v2) { return v1.second > v2.second; });
+			distKeyframes.swap(merged);
+		}
+	}
     if (distKeyframes.size() == 0)
 		return FrameworkReturnCode::_ERROR_;
 
-    // sort candidate keyframes according to score
-    std::sort(distKeyframes.begin(), distKeyframes.end(),
-            [](const std::pair<int, double>& v1, const std::pair<int, double>& v2) { return v1.second > v2.second; });
-
     for (auto const &it : distKeyframes) {
         retKeyframes_id.push_back(it.first);
 	}	
+    touchKeyframes(retKeyframes_id);
 
     return FrameworkReturnCode::_SUCCESS;
 }
 
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::computeHammingEmbedding(int level, SolARFBOWHammingEmbedding& embedding) const
+{
+	return computeHammingEmbedding(*m_VOC, level, embedding);
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::computeHammingEmbedding(const fbow::Vocabulary& voc, int level, SolARFBOWHammingEmbedding& embedding) const
+{
+	embedding = SolARFBOWHammingEmbedding();
+	if (m_signatureThreshold <= 0)
+		return FrameworkReturnCode::_SUCCESS;
+	SolARFBOWVocabularyTree vocTree;
+	if (vocTree.fromVocabulary(voc) != FrameworkReturnCode::_SUCCESS)
+		return FrameworkReturnCode::_ERROR_;
+	return embedding.init(vocTree, static_cast<uint32_t>(level));
+}
+
+void SolARKeyframeRetrieverFBOW::computeSignatures(const SRef<Keyframe> keyframe, const SolARFBOWHammingEmbedding& embedding,
+												   const BoWLevelFeature& bowLevelFeature, SolARFBOWHammingEmbedding::Signatures& signatures) const
+{
+	signatures.clear();
+	if (!embedding.isValid())
+		return;
+	SRef<DescriptorBuffer> descriptors = keyframe->getDescriptors();
+	cv::Mat cvDescriptors(descriptors->getNbDescriptors(), descriptors->getNbElements(), m_VOC->getDescType(), descriptors->data());
+	embedding.compute(cvDescriptors, bowLevelFeature, signatures);
+}
+
+void SolARKeyframeRetrieverFBOW::addSignatures(uint32_t keyframe_id, SolARFBOWHammingEmbedding::Signatures& signatures)
+{
+	if (signatures.empty())
+		return;
+	std::unique_lock<std::mutex> lock(m_signaturesMutex);
+	m_signatures[keyframe_id].swap(signatures);
+}
+
+void SolARKeyframeRetrieverFBOW::removeSignatures(uint32_t keyframe_id)
+{
+	std::unique_lock<std::mutex> lock(m_signaturesMutex);
+	m_signatures.erase(keyframe_id);
+}
+
+void SolARKeyframeRetrieverFBOW::clearSignatures()
+{
+	std::unique_lock<std::mutex> lock(m_signaturesMutex);
+	m_signatures.clear();
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::computeCoarseAncestors(int level, std::map<uint32_t, uint32_t>& coarseAncestors) const
+{
+	return computeCoarseAncestors(*m_VOC, level, coarseAncestors);
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::computeCoarseAncestors(const fbow::Vocabulary& voc, int level, std::map<uint32_t, uint32_t>& coarseAncestors) const
+{
+	coarseAncestors.clear();
+	if (m_coarseLevel <= 0)
+		return FrameworkReturnCode::_SUCCESS;
+	SolARFBOWVocabularyTree vocTree;
+	if (vocTree.fromVocabulary(voc) != FrameworkReturnCode::_SUCCESS)
+		return FrameworkReturnCode::_ERROR_;
+	if (m_coarseLevel >= level)
+		LOG_WARNING("Coarse level {} is not above level {}, node histograms of level {} are used", m_coarseLevel, level, level);
+	vocTree.getLevelNodeAncestors(static_cast<uint32_t>(level), static_cast<uint32_t>(std::min(m_coarseLevel, level)), coarseAncestors);
+	return FrameworkReturnCode::_SUCCESS;
+}
+
+void SolARKeyframeRetrieverFBOW::computeCoarseFeature(const BoWLevelFeature& bowLevelFeature, CoarseFeature& coarseFeature) const
+{
+	float nbDescriptors = 0.f;
+	coarseFeature.clear();
+	coarseFeature.reserve(bowLevelFeature.size());
+	for (const auto& it : bowLevelFeature) {
+		auto itAncestor = m_coarseAncestors.find(it.first);
+		coarseFeature.push_back(std::make_pair(itAncestor != m_coarseAncestors.end() ? itAncestor->second : it.first, static_cast<float>(it.second.size())));
+		nbDescriptors += it.second.size();
+	}
+	mergeCoarseFeature(nbDescriptors, coarseFeature);
+}
+
+void SolARKeyframeRetrieverFBOW::computeCoarseFeature(const SolARFBOWFlatBoW& queryBoW, CoarseFeature& coarseFeature) const
+{
+	coarseFeature.clear();
+	for (size_t i = 0; i < queryBoW.nodes.size(); i++) {
+		auto itAncestor = m_coarseAncestors.find(queryBoW.nodes[i].first);
+		coarseFeature.push_back(std::make_pair(itAncestor != m_coarseAncestors.end() ? itAncestor->second : queryBoW.nodes[i].first,
+											   static_cast<float>(queryBoW.nodes[i].second - queryBoW.getRowsBegin(i))));
+	}
+	mergeCoarseFeature(static_cast<float>(queryBoW.rows.size()), coarseFeature);
+}
+
+void SolARKeyframeRetrieverFBOW::mergeCoarseFeature(float nbDescriptors, CoarseFeature& coarseFeature)
+{
+	// the histogram is built in place: counts are sorted by ancestor, then the counts of an ancestor are summed
+	std::sort(coarseFeature.begin(), coarseFeature.end(), [](const std::pair<uint32_t, float>& v1, const std::pair<uint32_t, float>& v2) {
+		return v1.first < v2.first; });
+	size_t nbAncestors = 0;
+	for (size_t i = 0; i < coarseFeature.size(); i++) {
+		if ((nbAncestors > 0) && (coarseFeature[nbAncestors - 1].first == coarseFeature[i].first))
+			coarseFeature[nbAncestors - 1].second += coarseFeature[i].second;
+		else
+			coarseFeature[nbAncestors++] = coarseFeature[i];
+	}
+	coarseFeature.resize(nbAncestors);
+	for (auto& it : coarseFeature)
+		it.second /= std::max(nbDescriptors, 1.f);
+}
+
+double SolARKeyframeRetrieverFBOW::scoreCoarseFeatures(const CoarseFeature& coarseFeature1, const CoarseFeature& coarseFeature2)
+{
+	double score = 0.;
+	auto it1 = coarseFeature1.begin();
+	auto it2 = coarseFeature2.begin();
+	while ((it1 != coarseFeature1.end()) && (it2 != coarseFeature2.end())) {
+		if (it1->first < it2->first)
+			++it1;
+		else if (it2->first < it1->first)
+			++it2;
+		else {
+			score += std::min(it1->second, it2->second);
+			++it1;
+			++it2;
+		}
+	}
+	return score;
+}
+
+void SolARKeyframeRetrieverFBOW::addCoarseFeature(uint32_t keyframe_id, const BoWLevelFeature& bowLevelFeature)
+{
+	if (m_coarseLevel <= 0)
+		return;
+	CoarseFeature coarseFeature;
+	computeCoarseFeature(bowLevelFeature, coarseFeature);
+	std::unique_lock<std::mutex> lock(m_coarseMutex);
+	m_coarseFeatures[keyframe_id].swap(coarseFeature);
+}
+
+void SolARKeyframeRetrieverFBOW::removeCoarseFeature(uint32_t keyframe_id)
+{
+	std::unique_lock<std::mutex> lock(m_coarseMutex);
+	m_coarseFeatures.erase(keyframe_id);
+}
+
+void SolARKeyframeRetrieverFBOW::clearCoarseFeatures()
+{
+	std::unique_lock<std::mutex> lock(m_coarseMutex);
+	m_coarseFeatures.clear();
+}
+
+void SolARKeyframeRetrieverFBOW::selectCoarseCandidates(const std::vector<uint32_t>& candidates, const CoarseFeature& queryFeature,
+														std::vector<uint32_t>& shortlist) const
+{
+	SolARFBOWQueryScratch& scratch = SolARFBOWQueryScratch::local();
+	std::vector<std::pair<uint32_t, double>>& coarseScores = scratch.coarseScores;
+	coarseScores.clear();
+	coarseScores.reserve(candidates.size());
+	std::vector<uint32_t> missingKeyframes;
+	{
+		std::unique_lock<std::mutex> lock(m_coarseMutex);
+		for (const auto& id : candidates) {
+			auto it = m_coarseFeatures.find(id);
+			if (it == m_coarseFeatures.end())
+				missingKeyframes.push_back(id);
+			else
+				coarseScores.push_back(std::make_pair(id, scoreCoarseFeatures(queryFeature, it->second)));
+		}
+	}
+	if (!missingKeyframes.empty()) {
+		// keyframes loaded from a file get their coarse feature at their first query, read out of m_coarseMutex
+		std::vector<std::pair<uint32_t, CoarseFeature>> missingFeatures;
+		{
+			std::shared_lock<std::shared_mutex> modelLock(m_modelMutex);
+			for (const auto& id : missingKeyframes) {
+				BoWLevelFeature kfBoWLevel;
+				if (getKeyframeBoWLevelFeature(id, kfBoWLevel) != FrameworkReturnCode::_SUCCESS)
+					continue;
+				missingFeatures.emplace_back(id, CoarseFeature());
+				computeCoarseFeature(kfBoWLevel, missingFeatures.back().second);
+			}
+		}
+		std::unique_lock<std::mutex> lock(m_coarseMutex);
+		for (auto& it : missingFeatures) {
+			coarseScores.push_back(std::make_pair(it.first, scoreCoarseFeatures(queryFeature, it.second)));
+			m_coarseFeatures[it.first].swap(it.second);
+		}
+	}
+	if (coarseScores.empty())
+		return;
+	size_t shortlistSize = std::min(coarseScores.size(), static_cast<size_t>(std::max(m_coarseShortlistSize, 1)));
+	auto byScore = [](const std::pair<uint32_t, double>& v1, const std::pair<uint32_t, double>& v2) { return v1.second > v2.second; };
+	std::partial_sort(coarseScores.begin(), coarseScores.begin() + shortlistSize, coarseScores.end(), byScore);
+	double minScore = m_coarseMinScoreRatio * coarseScores[0].second;
+	for (size_t i = 0; (i < shortlistSize) && (coarseScores[i].second >= minScore); i++)
+		shortlist.push_back(coarseScores[i].first);
+}
+
+void SolARKeyframeRetrieverFBOW::resolveScoringBoWs(const std::vector<uint32_t>& candidates, const SegmentSet* segmentSet,
+													 std::vector<uint32_t>& scoredCandidates,
+													 std::vector<const SolARFBOWScoringBoW*>& scoringBoWs,
+													 std::vector<const SolARFBOWIndexSegment*>& segments) const
+{
+	scoredCandidates.clear();
+	scoringBoWs.clear();
+	segments.clear();
+	std::shared_ptr<const KeyframeTombstones> tombstones = getKeyframeTombstones();
+	std::unique_lock<std::mutex> lock(m_scoringBoWsMutex);
+	for (const auto& id : candidates) {
+		if (tombstones->test(id))
+			continue;
+		auto it = m_scoringBoWs.find(id);
+		const SolARFBOWIndexSegment* segment = nullptr;
+		if (it == m_scoringBoWs.end()) {
+			// keyframes out of memory are scored from the newest on-disk segment where they are not deleted
+			segment = segmentSet ? segmentSet->find(id) : nullptr;
+			if (!segment)
+				continue;
+		}
+		scoredCandidates.push_back(id);
+		scoringBoWs.push_back(segment ? nullptr : it->second.get());
+		segments.push_back(segment);
+	}
+}
+
+void SolARKeyframeRetrieverFBOW::scoreKeyframes(const std::vector<uint32_t>& candidates, const std::vector<std::pair<uint32_t, float>>& queryWords,
+												 std::vector<std::pair<uint32_t, double>>& distKeyframes) const
+{
+	// workers read the keyframes out of memory under the shared lock of the calling thread
+	std::shared_lock<std::shared_mutex> modelLock(m_modelMutex);
+	scoreLockedKeyframes(candidates, queryWords, distKeyframes);
+}
+
+void SolARKeyframeRetrieverFBOW::scoreLockedKeyframes(const std::vector<uint32_t>& candidates, const std::vector<std::pair<uint32_t, float>>& queryWords,
+													   std::vector<std::pair<uint32_t, double>>& distKeyframes) const
+{
+	// the metric is dispatched once per query
+	switch (m_scoringType) {
+	case ScoringType::L1_NORM:
+		scoreKeyframesWith<ScoringType::L1_NORM>(candidates, queryWords, distKeyframes);
+		break;
+	case ScoringType::CHI_SQUARE:
+		scoreKeyframesWith<ScoringType::CHI_SQUARE>(candidates, queryWords, distKeyframes);
+		break;
+	case ScoringType::BHATTACHARYYA:
+		scoreKeyframesWith<ScoringType::BHATTACHARYYA>(candidates, queryWords, distKeyframes);
+		break;
+	case ScoringType::DOT_PRODUCT:
+		scoreKeyframesWith<ScoringType::DOT_PRODUCT>(candidates, queryWords, distKeyframes);
+		break;
+	case ScoringType::KLS:
+		scoreKeyframesWith<ScoringType::KLS>(candidates, queryWords, distKeyframes);
+		break;
+	default:
+		scoreKeyframesWith<ScoringType::L2_NORM>(candidates, queryWords, distKeyframes);
+	}
+}
+
+template<ScoringType T>
+void SolARKeyframeRetrieverFBOW::scoreKeyframesWith(const std::vector<uint32_t>& candidates, const std::vector<std::pair<uint32_t, float>>& queryWords,
+													std::vector<std::pair<uint32_t, double>>& distKeyframes) const
+{
+	SolARFBOWQueryScratch& scratch = SolARFBOWQueryScratch::local();
+	SolARFBOWScoringBoW& queryBoW = scratch.queryBoW;
+	SolARFBOWScoring::prepare<T>(queryWords, true, queryBoW);
+	auto byScore = [](const std::pair<uint32_t, double>& v1, const std::pair<uint32_t, double>& v2) { return v1.second > v2.second; };
+	// suppressed keyframes are skipped and the layouts of the others are resolved once, so that workers do not lock
+	std::shared_ptr<const SegmentSet> segmentSet = m_segmentPath.empty() ? nullptr : getSegmentSet();
+	std::vector<uint32_t>& scoredCandidates = scratch.scoredCandidates;
+	std::vector<const SolARFBOWScoringBoW*>& scoringBoWs = scratch.scoringBoWs;
+	std::vector<const SolARFBOWIndexSegment*>& segments = scratch.candidateSegments;
+	resolveScoringBoWs(candidates, segmentSet.get(), scoredCandidates, scoringBoWs, segments);
+	// small queries are scored on the calling thread
+	size_t nbChunks = 1;
+	if ((m_parallelScoringMinCandidates >= 0) && (scoredCandidates.size() > static_cast<size_t>(m_parallelScoringMinCandidates)))
+		nbChunks = std::min(static_cast<size_t>(m_threadPool->getNbThreads()), scoredCandidates.size());
+	nbChunks = std::max<size_t>(nbChunks, 1);
+
+	// each chunk of candidates is scored and sorted in its own buffer. A chunk first holds the positions of its candidates
+	// so that keyframes with the same score keep their candidate order without the temporary buffer of a stable sort
+	std::vector<std::vector<std::pair<uint32_t, double>>>& chunkKeyframes = scratch.chunkKeyframes;
+	if (chunkKeyframes.size() < nbChunks)
+		chunkKeyframes.resize(nbChunks);
+	for (size_t chunk = 0; chunk < nbChunks; chunk++)
+		chunkKeyframes[chunk].clear();
+	auto byScoreAndPosition = [](const std::pair<uint32_t, double>& v1, const std::pair<uint32_t, double>& v2) {
+		return (v1.second > v2.second) || ((v1.second == v2.second) && (v1.first < v2.first)); };
+	auto scoreChunk = [&](size_t chunk) {
+		size_t begin = scoredCandidates.size() * chunk / nbChunks;
+		size_t end = scoredCandidates.size() * (chunk + 1) / nbChunks;
+		// the worker lays out keyframes in its own buffer
+		SolARFBOWScoringBoW& kfScoringBoW = SolARFBOWQueryScratch::local().keyframeBoW;
+		for (size_t i = begin; i < end; i++) {
+			// keyframes out of memory (on-disk segments) are laid out on the fly
+			const SolARFBOWScoringBoW* scoringBoW = scoringBoWs[i];
+			if (!scoringBoW) {
+				datastructure::BoWFeature kfBoW;
+				if (segments[i]->getBoWFeature(scoredCandidates[i], kfBoW) != FrameworkReturnCode::_SUCCESS)
+					continue;
+				SolARFBOWHelper::remapBoW(m_wordRemap, kfBoW);
+				SolARFBOWScoring::prepare<T>(kfBoW, false, kfScoringBoW);
+				scoringBoW = &kfScoringBoW;
+			}
+			double score = SolARFBOWScoring::score<T>(*scoringBoW, queryBoW);
+			if (score > m_threshold)
+				chunkKeyframes[chunk].push_back(std::make_pair(static_cast<uint32_t>(i), score));
+		}
+		std::sort(chunkKeyframes[chunk].begin(), chunkKeyframes[chunk].end(), byScoreAndPosition);
+		for (auto& it : chunkKeyframes[chunk])
+			it.first = scoredCandidates[it.first];
+	};
+	if (nbChunks == 1)
+		scoreChunk(0);
+	else
+		m_threadPool->parallelFor(nbChunks, scoreChunk);
+
+	// merge the sorted buffers, keyframes with the same score stay in candidate order
+	distKeyframes.swap(chunkKeyframes[0]);
+	for (size_t chunk = 1; chunk < nbChunks; chunk++) {
+		std::vector<std::pair<uint32_t, double>>& merged = scratch.chunkMerged;
+		merged.clear();
+		merged.reserve(distKeyframes.size() + chunkKeyframes[chunk].size());
+		std::merge(distKeyframes.begin(), distKeyframes.end(), chunkKeyframes[chunk].begin(), chunkKeyframes[chunk].end(),
+				   std::back_inserter(merged), byScore);
+		distKeyframes.swap(merged);
+	}
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::retrieveAndMatch(const SRef<Frame> frame, uint32_t nbKeyframes, uint32_t minMatches,
+																  const std::function<SRef<Keyframe>(uint32_t)>& getKeyframe,
+																  std::vector<uint32_t>& retKeyframes_id, std::vector<std::vector<DescriptorMatch>>& matches,
+																  uint64_t partitionMask)
+{
+	std::shared_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
+	retKeyframes_id.clear();
+	matches.clear();
+	SRef<DescriptorBuffer> descriptors = frame->getDescriptors();
+	if (descriptors->getNbDescriptors() == 0)
+		return FrameworkReturnCode::_ERROR_;
+	cv::Mat cvDescriptors(descriptors->getNbDescriptors(), descriptors->getNbElements(), m_VOC->getDescType(), descriptors->data());
+
+	// quantize the frame once for retrieval and matching
+	fbow::fBow v_bow;
+	fbow::fBow2 v_bow2;
+	std::vector<uint8_t> prepared;
+	if (m_useVOCTree) {
+		m_VOCTree.transform(cvDescriptors, m_level, v_bow, v_bow2);
+		m_VOCTree.prepareDescriptors(cvDescriptors, prepared);
+	}
+	else
+		m_VOC->transform(cvDescriptors, m_level, v_bow, v_bow2);
+	datastructure::BoWFeature bowFeature = SolARFBOWHelper::fbow2Solar(v_bow);
+	datastructure::BoWLevelFeature bowLevelFeature = SolARFBOWHelper::fbow2Solar(std::move(v_bow2));
+	SolARFBOWHammingEmbedding::Signatures signatures;
+	if (m_signatureThreshold > 0)
+		m_hammingEmbedding.compute(cvDescriptors, bowLevelFeature, signatures);
+	SolARFBOWFlatBoW& queryBoW = SolARFBOWQueryScratch::local().queryFlatBoW;
+	SolARFBOWHelper::solar2Flat(bowFeature, bowLevelFeature, queryBoW);
+	std::vector<uint32_t> candidates;
+	bool complete;
+	if (retrieveFromBoW(queryBoW, signatures, partitionMask, nullptr, RetrieveBudget(), std::chrono::steady_clock::now(),
+						candidates, complete) != FrameworkReturnCode::_SUCCESS)
+		return FrameworkReturnCode::_ERROR_;
+
+	// match the ranked candidates until enough of them are verified
+	for (const auto& id : candidates) {
+		if (retKeyframes_id.size() >= nbKeyframes)
+			break;
+		SRef<Keyframe> keyframe = getKeyframe(id);
+		if (!keyframe)
+			continue;
+		std::vector<DescriptorMatch> keyframeMatches;
+		if ((matchFromBoW(cvDescriptors, prepared, bowLevelFeature, keyframe, keyframeMatches) != FrameworkReturnCode::_SUCCESS) ||
+			(keyframeMatches.size() < minMatches))
+			continue;
+		retKeyframes_id.push_back(id);
+		matches.push_back(std::move(keyframeMatches));
+	}
+	return retKeyframes_id.empty() ? FrameworkReturnCode::_ERROR_ : FrameworkReturnCode::_SUCCESS;
+}
+
+FrameworkReturnCode SolARKeyframeRetrieverFBOW::matchFromBoW(const cv::Mat& cvDescriptors, const std::vector<uint8_t>& prepared, const BoWLevelFeature& queryLevelFeature,
+															  const SRef<Keyframe>& keyframe, std::vector<DescriptorMatch>& matches)
+{
+	SRef<DescriptorBuffer> descriptors_kf = keyframe->getDescriptors();
+	if (descriptors_kf->getNbDescriptors() == 0)
+		return FrameworkReturnCode::_ERROR_;
+	cv::Mat cvDescriptors_kf(descriptors_kf->getNbDescriptors(), descriptors_kf->getNbElements(), m_VOC->getDescType(), descriptors_kf->data());
+
+	// get bow level desc of keyframe
+	datastructure::BoWLevelFeature bowLevelFeature;
+	if (m_memoryBudget > 0)
+		loadSpilledKeyframes({ keyframe->getId() });
+	{
+		std::shared_lock<std::shared_mutex> modelLock(m_modelMutex);
+		if (getKeyframeBoWLevelFeature(keyframe->getId(), bowLevelFeature) != FrameworkReturnCode::_SUCCESS)
+			return FrameworkReturnCode::_ERROR_;
+	}
+	std::vector<uint8_t> prepared_kf;
+	if (m_useVOCTree)
+		m_VOCTree.prepareDescriptors(cvDescriptors_kf, prepared_kf);
+	const size_t descSize = m_VOCTree.getSearchDescriptorSize();
+
+	// the nodes of the query descriptors are known from its BoW level feature
+	for (const auto& itQuery : queryLevelFeature) {
+		auto it = bowLevelFeature.find(itQuery.first);
+		if (it == bowLevelFeature.end())
+			continue;
+		for (const auto& i : itQuery.second) {
+			int bestIdx;
+			float bestDist;
+			if (m_useVOCTree)
+				findBestMatchesQuantized(prepared.data() + i * descSize, prepared_kf, it->second, bestIdx, bestDist);
+			else
+				findBestMatches(cvDescriptors.row(i), cvDescriptors_kf, it->second, bestIdx, bestDist);
+			if (bestIdx != -1)
+				matches.push_back(DescriptorMatch(i, bestIdx, bestDist));
+		}
+	}
+	// same order as match
+	std::sort(matches.begin(), matches.end(), [](const DescriptorMatch& m1, const DescriptorMatch& m2) {
+		return m1.getIndexInDescriptorA() < m2.getIndexInDescriptorA(); });
+	return FrameworkReturnCode::_SUCCESS;
+}
+
 FrameworkReturnCode SolARKeyframeRetrieverFBOW::retrieve(const SRef<Frame> frame, const std::set<unsigned int> & canKeyframes_id, std::vector<uint32_t> & retKeyframes_id)
 {
+	std::shared_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
 	// convert frame desc to Mat opencv
 	SRef<DescriptorBuffer> desc_Solar = frame->getDescriptors();
 	if (desc_Solar->getNbDescriptors() == 0)
 		return FrameworkReturnCode::_ERROR_;
-	cv::Mat desc_OpenCV(desc_Solar->getNbDescriptors(), desc_Solar->getNbElements(), m_VOC.getDescType(), desc_Solar->data());
+	cv::Mat desc_OpenCV(desc_Solar->getNbDescriptors(), desc_Solar->getNbElements(), m_VOC->getDescType(), desc_Solar->data());
 
 	// calculate bow desc corresponding to the query frame
 	fbow::fBow v_bow;
-	v_bow = m_VOC.transform(desc_OpenCV);
-
-    // convertir bow to solar
-    datastructure::BoWFeature v_bowFeature = SolARFBOWHelper::fbow2Solar(v_bow);
+	if (m_useVOCTree)
+		m_VOCTree.transform(desc_OpenCV, v_bow);
+	else
+		v_bow = m_VOC->transform(desc_OpenCV);
 
-	// find nearest keyframes
-    std::vector<std::pair<int, double>> distKeyframes;
-	for (auto const &it : canKeyframes_id) {
-        datastructure::BoWFeature kfBoW;
-        if (m_keyframeRetrieval->getBoWFeature(it, kfBoW) != FrameworkReturnCode::_SUCCESS)
-			continue;
-        double score = SolARFBOWHelper::distanceBoW(kfBoW, v_bowFeature);
-        if (score > m_threshold)
-            distKeyframes.push_back(std::pair<int, double>(it, score));
-	}
-
-    if (distKeyframes.size() == 0)
-        return FrameworkReturnCode::_ERROR_;
+	// lay out the bow in the buffers of the thread
+	SolARFBOWFlatBoW& queryBoW = SolARFBOWQueryScratch::local().queryFlatBoW;
+	SolARFBOWHelper::fbow2Flat(v_bow, fbow::fBow2(), queryBoW);
 
-    // sort candidate keyframes according to score
-    std::sort(distKeyframes.begin(), distKeyframes.end(),
-            [](const std::pair<int, double>& v1, const std::pair<int, double>& v2) { return v1.second > v2.second; });
+	// find nearest keyframes sorted according to score, with the configured metric
+	std::vector<uint32_t> candidates(canKeyframes_id.begin(), canKeyframes_id.end());
+	loadSpilledKeyframes(candidates);
+	std::vector<std::pair<uint32_t, double>> distKeyframes;
+	scoreKeyframes(candidates, queryBoW.words, distKeyframes);
+	if (distKeyframes.size() == 0)
+		return FrameworkReturnCode::_ERROR_;
 
     for (auto const &it : distKeyframes) {
         retKeyframes_id.push_back(it.first);
     }
+    touchKeyframes(retKeyframes_id);
 
 	return FrameworkReturnCode::_SUCCESS;
 }
 
 FrameworkReturnCode SolARKeyframeRetrieverFBOW::saveToFile(const std::string& file) const
 {    
+	flush();
+	compactTombstones(true);
+	// spilled keyframes are saved with the others, then spilled again
+	std::vector<uint32_t> spilledKeyframes;
+	{
+		std::unique_lock<std::mutex> lock(m_spillMutex);
+		m_spill.getKeyframes(spilledKeyframes);
+	}
+	loadSpilledKeyframes(spilledKeyframes);
+	// keyframes of on-disk segments are temporarily added to the saved keyframe retrieval model, which queries must not see
+	std::unique_lock<std::shared_mutex> modelLock(m_modelMutex);
+	std::vector<uint32_t> segmentKeyframes;
+	if (!m_segmentPath.empty()) {
+		auto retrievalLock = m_keyframeRetrieval->acquireLock();
+		std::shared_ptr<const SegmentSet> segmentSet = getSegmentSet();
+		for (const auto& segment : segmentSet->segments)
+			for (uint32_t i = 0; i < segment->getNbKeyframes(); i++) {
+				uint32_t id = segment->getKeyframeId(i);
+				BoWFeature bowFeature;
+				BoWLevelFeature bowLevelFeature;
+				if ((segmentSet->find(id) != segment.get()) ||
+					(m_keyframeRetrieval->getBoWFeature(id, bowFeature) == FrameworkReturnCode::_SUCCESS) ||
+					(segment->getBoWFeature(id, bowFeature) != FrameworkReturnCode::_SUCCESS) ||
+					(segment->getBoWLevelFeature(id, bowLevelFeature) != FrameworkReturnCode::_SUCCESS))
+					continue;
+				if (m_keyframeRetrieval->addDescriptor(id, bowFeature, bowLevelFeature) == FrameworkReturnCode::_SUCCESS)
+					segmentKeyframes.push_back(id);
+			}
+	}
 	std::ofstream ofs(file, std::ios::binary);
 	OutputArchive oa(ofs);
 	oa << m_level;
 	oa << m_keyframeRetrieval;
 	ofs.close();
+	auto retrievalLock = m_keyframeRetrieval->acquireLock();
+	for (const auto& id : segmentKeyframes)
+		m_keyframeRetrieval->removeDescriptor(id);
+	if (m_memoryBudget > 0) {
+		std::unique_lock<std::mutex> lock(m_spillMutex);
+		enforceMemoryBudget();
+	}
 	return FrameworkReturnCode::_SUCCESS;
 }
 
 FrameworkReturnCode SolARKeyframeRetrieverFBOW::loadFromFile(const std::string& file)
 {
+	std::unique_lock<std::mutex> swapLock(m_vocabularySwapMutex);
+	flush();
 	std::ifstream ifs(file, std::ios::binary);
 	if (!ifs.is_open())
 		return FrameworkReturnCode::_ERROR_;
+	// the archive is read aside, queries keep using the current retrieval model meanwhile
+	int level;
+	SRef<KeyframeRetrieval> keyframeRetrieval;
     InputArchive ia(ifs);
-	ia >> m_level;
-	ia >> m_keyframeRetrieval;
+	ia >> level;
+	ia >> keyframeRetrieval;
 	ifs.close();
+	// the archived level may differ from the configured one
+	std::map<uint32_t, uint32_t> coarseAncestors;
+	SolARFBOWHammingEmbedding hammingEmbedding;
+	if ((computeCoarseAncestors(level, coarseAncestors) != FrameworkReturnCode::_SUCCESS) ||
+		(computeHammingEmbedding(level, hammingEmbedding) != FrameworkReturnCode::_SUCCESS))
+		return FrameworkReturnCode::_ERROR_;
+	stopSegments();
+	std::unique_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
+	std::unique_lock<std::shared_mutex> modelLock(m_modelMutex);
+	installKeyframeRetrieval(keyframeRetrieval);
+	m_level = level;
+	m_coarseAncestors.swap(coarseAncestors);
+	m_hammingEmbedding = std::move(hammingEmbedding);
 	return FrameworkReturnCode::_SUCCESS;
 }
 
@@ -289,28 +2798,81 @@ void SolARKeyframeRetrieverFBOW::findBestMatches(const cv::Mat &feature1, const
 		bestIdx = -1;
 }
 
+void SolARKeyframeRetrieverFBOW::findBestMatchesQuantized(const uint8_t* feature1, const std::vector<uint8_t>& features2, const std::vector<uint32_t> &idx, int &bestIdx, float &bestDist) {
+	bestIdx = -1;
+	if (idx.size() == 0)
+		return;
+	bestDist = FLT_MAX;
+	float bestDist2 = FLT_MAX;
+	const size_t descSize = m_VOCTree.getSearchDescriptorSize();
+
+	for (auto &it : idx) {
+		float dist = m_VOCTree.distance(feature1, features2.data() + it * descSize);
+
+		if (dist < bestDist)
+		{
+			bestDist2 = bestDist;
+			bestDist = dist;
+			bestIdx = it;
+		}
+		else if (dist < bestDist2)
+		{
+			bestDist2 = dist;
+		}
+	}
+
+	if ((bestDist > m_distanceRatio * bestDist2) || (bestDist > m_distanceMax))
+		bestIdx = -1;
+}
+
 FrameworkReturnCode SolARKeyframeRetrieverFBOW::match(const SRef<Frame> frame, const SRef<Keyframe> keyframe, std::vector<DescriptorMatch> &matches)
 {
+	std::shared_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
 	// convert frame desc to Mat opencv
 	SRef<DescriptorBuffer> descriptors = frame->getDescriptors();
 	if (descriptors->getNbDescriptors() == 0)
 		return FrameworkReturnCode::_ERROR_;
-	cv::Mat cvDescriptors(descriptors->getNbDescriptors(), descriptors->getNbElements(), m_VOC.getDescType(), descriptors->data());
+	cv::Mat cvDescriptors(descriptors->getNbDescriptors(), descriptors->getNbElements(), m_VOC->getDescType(), descriptors->data());
 
 	// convert keyframe desc to Mat opencv
 	SRef<DescriptorBuffer> descriptors_kf = keyframe->getDescriptors();
 	if (descriptors_kf->getNbDescriptors() == 0)
 		return FrameworkReturnCode::_ERROR_;
-	cv::Mat cvDescriptors_kf(descriptors_kf->getNbDescriptors(), descriptors_kf->getNbElements(), m_VOC.getDescType(), descriptors_kf->data());
+	cv::Mat cvDescriptors_kf(descriptors_kf->getNbDescriptors(), descriptors_kf->getNbElements(), m_VOC->getDescType(), descriptors_kf->data());
 
     // get bow level desc of keyframe
     datastructure::BoWLevelFeature bowLevelFeature;
-    if (m_keyframeRetrieval->getBoWLevelFeature(keyframe->getId(), bowLevelFeature) != FrameworkReturnCode::_SUCCESS)
-		return FrameworkReturnCode::_ERROR_;
+    if (m_memoryBudget > 0)
+        loadSpilledKeyframes({ keyframe->getId() });
+    {
+        std::shared_lock<std::shared_mutex> modelLock(m_modelMutex);
+        if (getKeyframeBoWLevelFeature(keyframe->getId(), bowLevelFeature) != FrameworkReturnCode::_SUCCESS)
+            return FrameworkReturnCode::_ERROR_;
+    }
+
+	// quantize frame and keyframe descriptors once
+	if (m_useVOCTree) {
+		std::vector<uint8_t> prepared, prepared_kf;
+		m_VOCTree.prepareDescriptors(cvDescriptors, prepared);
+		m_VOCTree.prepareDescriptors(cvDescriptors_kf, prepared_kf);
+		const size_t descSize = m_VOCTree.getSearchDescriptorSize();
+		for (int i = 0; i < cvDescriptors.rows; i++) {
+			const uint8_t* descriptor = prepared.data() + i * descSize;
+			auto it = bowLevelFeature.find(m_VOCTree.transform(descriptor, m_level));
+			if (it == bowLevelFeature.end())
+				continue;
+			int bestIdx;
+			float bestDist;
+			findBestMatchesQuantized(descriptor, prepared_kf, it->second, bestIdx, bestDist);
+			if (bestIdx != -1)
+				matches.push_back(DescriptorMatch(i, bestIdx, bestDist));
+		}
+		return FrameworkReturnCode::_SUCCESS;
+	}
 
 	for (int i = 0; i < cvDescriptors.rows; i++) {
 		const cv::Mat cvDescriptor = cvDescriptors.row(i);
-		int node = m_VOC.transform(cvDescriptor, m_level);
+		int node = m_VOC->transform(cvDescriptor, m_level);
 		std::vector<uint32_t> candidates;
         auto it = bowLevelFeature.find(node);
         if (it != bowLevelFeature.end())
@@ -329,26 +2891,54 @@ FrameworkReturnCode SolARKeyframeRetrieverFBOW::match(const SRef<Frame> frame, c
 
 FrameworkReturnCode SolARKeyframeRetrieverFBOW::match(const std::vector<int> &indexDescriptors, const SRef<DescriptorBuffer> descriptors, const SRef<Keyframe> keyframe, std::vector<DescriptorMatch> &matches)
 {
+	std::shared_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
 	// convert frame desc to Mat opencv
 	if (descriptors->getNbDescriptors() == 0)
 		return FrameworkReturnCode::_ERROR_;
-	cv::Mat cvDescriptors(descriptors->getNbDescriptors(), descriptors->getNbElements(), m_VOC.getDescType(), descriptors->data());
+	cv::Mat cvDescriptors(descriptors->getNbDescriptors(), descriptors->getNbElements(), m_VOC->getDescType(), descriptors->data());
 
 	// convert keyframe desc to Mat opencv
 	SRef<DescriptorBuffer> descriptors_kf = keyframe->getDescriptors();
 	if (descriptors_kf->getNbDescriptors() == 0)
 		return FrameworkReturnCode::_ERROR_;
-	cv::Mat cvDescriptors_kf(descriptors_kf->getNbDescriptors(), descriptors_kf->getNbElements(), m_VOC.getDescType(), descriptors_kf->data());
+	cv::Mat cvDescriptors_kf(descriptors_kf->getNbDescriptors(), descriptors_kf->getNbElements(), m_VOC->getDescType(), descriptors_kf->data());
 
     // get bow level desc of keyframe
     datastructure::BoWLevelFeature bowLevelFeature;
-    if (m_keyframeRetrieval->getBoWLevelFeature(keyframe->getId(), bowLevelFeature) != FrameworkReturnCode::_SUCCESS)
-        return FrameworkReturnCode::_ERROR_;
+    if (m_memoryBudget > 0)
+        loadSpilledKeyframes({ keyframe->getId() });
+    {
+        std::shared_lock<std::shared_mutex> modelLock(m_modelMutex);
+        if (getKeyframeBoWLevelFeature(keyframe->getId(), bowLevelFeature) != FrameworkReturnCode::_SUCCESS)
+            return FrameworkReturnCode::_ERROR_;
+    }
 
 	std::vector<bool> checkMatches(keyframe->getKeypoints().size(), true);
+	// quantize frame and keyframe descriptors once
+	if (m_useVOCTree) {
+		std::vector<uint8_t> prepared, prepared_kf;
+		m_VOCTree.prepareDescriptors(cvDescriptors, indexDescriptors, prepared);
+		m_VOCTree.prepareDescriptors(cvDescriptors_kf, prepared_kf);
+		const size_t descSize = m_VOCTree.getSearchDescriptorSize();
+		for (size_t i = 0; i < indexDescriptors.size(); i++) {
+			const int it_des = indexDescriptors[i];
+			const uint8_t* descriptor = prepared.data() + i * descSize;
+			auto it = bowLevelFeature.find(m_VOCTree.transform(descriptor, m_level));
+			if (it == bowLevelFeature.end())
+				continue;
+			int bestIdx;
+			float bestDist;
+			findBestMatchesQuantized(descriptor, prepared_kf, it->second, bestIdx, bestDist);
+			if ((bestIdx != -1) && checkMatches[bestIdx]) {
+				matches.push_back(DescriptorMatch(it_des, bestIdx, bestDist));
+				checkMatches[bestIdx] = false;
+			}
+		}
+		return FrameworkReturnCode::_SUCCESS;
+	}
 	for (auto &it_des: indexDescriptors) {
 		const cv::Mat cvDescriptor = cvDescriptors.row(it_des);
-		int node = m_VOC.transform(cvDescriptor, m_level);
+		int node = m_VOC->transform(cvDescriptor, m_level);
 		std::vector<uint32_t> candidates;
         auto it = bowLevelFeature.find(node);
         if (it != bowLevelFeature.end())
@@ -368,18 +2958,49 @@ FrameworkReturnCode SolARKeyframeRetrieverFBOW::match(const std::vector<int> &in
 
 const SRef<datastructure::KeyframeRetrieval>& SolARKeyframeRetrieverFBOW::getConstKeyframeRetrieval() const
 {
+	compactTombstones(true);
 	return m_keyframeRetrieval;
 }
 
 std::unique_lock<std::mutex> SolARKeyframeRetrieverFBOW::getKeyframeRetrieval(SRef<datastructure::KeyframeRetrieval>& keyframeRetrieval)
 {
-	keyframeRetrieval = m_keyframeRetrieval;
-	return m_keyframeRetrieval->acquireLock();
+	compactTombstones(true);
+	{
+		std::shared_lock<std::shared_mutex> modelLock(m_modelMutex);
+		keyframeRetrieval = m_keyframeRetrieval;
+	}
+	return keyframeRetrieval->acquireLock();
 }
 
 void SolARKeyframeRetrieverFBOW::setKeyframeRetrieval(const SRef<datastructure::KeyframeRetrieval> keyframeRetrieval)
 {
+	std::unique_lock<std::mutex> swapLock(m_vocabularySwapMutex);
+	flush();
+	stopSegments();
+	std::unique_lock<std::shared_mutex> vocabularyLock(m_vocabularyMutex);
+	std::unique_lock<std::shared_mutex> modelLock(m_modelMutex);
+	installKeyframeRetrieval(keyframeRetrieval);
+}
+
+void SolARKeyframeRetrieverFBOW::installKeyframeRetrieval(const SRef<datastructure::KeyframeRetrieval> keyframeRetrieval)
+{
+	clearSpill();
+	restartSegments();
+	clearTombstones();
+	clearCoarseFeatures();
+	clearSignatures();
+	clearPartitions();
+	clearMergedKeyframes();
 	m_keyframeRetrieval = keyframeRetrieval;
+	rebuildMemoryAccounting();
+	// the keyframes of the installed model are live, so that suppressions are compacted at the configured ratio
+	uint64_t nbKeyframes;
+	{
+		std::unique_lock<std::mutex> lockStats(m_memoryStatsMutex);
+		nbKeyframes = m_keyframesMemory.size();
+	}
+	std::unique_lock<std::mutex> lock(m_tombstonesMutex);
+	m_nbLiveKeyframes = nbKeyframes;
 }
 
 
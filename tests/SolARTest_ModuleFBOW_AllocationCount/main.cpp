@@ -0,0 +1,329 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <random>
+
+#include <boost/log/core.hpp>
+
+// ADD XPCF HEADERS HERE
+#include "xpcf/xpcf.h"
+
+// ADD COMPONENTS HEADERS HERE
+#include "api/reloc/IKeyframeRetriever.h"
+#include "core/Log.h"
+#include "datastructure/KeyframeCollection.h"
+#include "datastructure/KeyframeRetrieval.h"
+#include "core/SerializationDefinitions.h"
+#include "opencv2/core.hpp"
+#include "fbow.h"
+#include "SolARKeyframeRetrieverFBOW.h"
+#include "SolARFBOWHelper.h"
+
+using namespace SolAR;
+using namespace SolAR::datastructure;
+using namespace SolAR::api;
+using namespace SolAR::MODULES::FBOW;
+
+namespace xpcf = org::bcom::xpcf;
+
+const cv::String keys =
+"{help h usage ?||}"
+"{config|SolARTest_ModuleFBOW_AllocationCount_conf.xml| xml configuration file of the keyframe retriever}"
+"{keyframes|| a keyframe collection archive whose keyframes are indexed then replayed as queries of a whole retrieve}"
+"{queries|200| number of counted queries}"
+;
+
+// Heap allocations of all threads are counted while counting is enabled
+namespace {
+std::atomic<bool> g_isCounting{false};
+std::atomic<uint64_t> g_nbAllocations{0};
+
+void* countedAlloc(std::size_t size)
+{
+    if (g_isCounting)
+        g_nbAllocations++;
+    return std::malloc(size ? size : 1);
+}
+}
+
+void* operator new(std::size_t size)
+{
+    if (void* p = countedAlloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    if (void* p = countedAlloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return countedAlloc(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return countedAlloc(size); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+
+namespace {
+
+/// @brief Count the allocations of a function
+template<typename F> uint64_t countAllocations(F&& f)
+{
+    g_nbAllocations = 0;
+    g_isCounting = true;
+    f();
+    g_isCounting = false;
+    return g_nbAllocations;
+}
+
+/// @brief BoW features of a frame
+struct FrameBoW {
+    BoWFeature bowFeature;
+    BoWLevelFeature bowLevelFeature;
+};
+
+/// @brief Transform descriptors with fbow, as the retriever does with its vocabulary
+FrameBoW transform(fbow::Vocabulary& voc, const cv::Mat& descriptors, int level)
+{
+    fbow::fBow bow;
+    fbow::fBow2 bow2;
+    voc.transform(descriptors, level, bow, bow2);
+    FrameBoW frameBoW;
+    frameBoW.bowFeature = SolARFBOWHelper::fbow2Solar(bow);
+    frameBoW.bowLevelFeature = SolARFBOWHelper::fbow2Solar(std::move(bow2));
+    return frameBoW;
+}
+
+cv::Mat randomDescriptors(std::mt19937& generator, int nbDescriptors, int descriptorSize)
+{
+    std::uniform_int_distribution<int> byteDistribution(0, 255);
+    cv::Mat descriptors(nbDescriptors, descriptorSize, CV_8UC1);
+    for (int r = 0; r < descriptors.rows; ++r)
+        for (int c = 0; c < descriptors.cols; ++c)
+            descriptors.ptr<uint8_t>(r)[c] = static_cast<uint8_t>(byteDistribution(generator));
+    return descriptors;
+}
+
+/// @brief Frame holding a copy of descriptors of the vocabulary
+SRef<Frame> makeFrame(const cv::Mat& descriptors)
+{
+    SRef<DescriptorBuffer> descriptorBuffer = xpcf::utils::make_shared<DescriptorBuffer>(DescriptorType::AKAZE, DescriptorDataType::TYPE_8U,
+                                                                                         descriptors.cols, descriptors.rows);
+    uint8_t* data = static_cast<uint8_t*>(descriptorBuffer->data());
+    for (int r = 0; r < descriptors.rows; ++r)
+        std::copy(descriptors.ptr<uint8_t>(r), descriptors.ptr<uint8_t>(r) + descriptors.cols, data + r * descriptors.cols);
+    return xpcf::utils::make_shared<Keyframe>(std::vector<Keypoint>(descriptors.rows), descriptorBuffer, nullptr);
+}
+
+/// @brief Count the allocations of queries replayed once the per-thread buffers have grown, and check that their results are stable
+template<typename Query> bool countQueries(const std::string& name, uint32_t nbQueries, Query&& query, uint64_t& nbAllocations,
+                                           std::vector<uint32_t>& results)
+{
+    std::vector<uint32_t> warmUpResults;
+    for (uint32_t i = 0; i < nbQueries; i++)
+        warmUpResults.push_back(query(i));
+    results.clear();
+    results.reserve(nbQueries);
+    nbAllocations = countAllocations([&]() {
+        for (uint32_t i = 0; i < nbQueries; i++)
+            results.push_back(query(i));
+    });
+    if (results != warmUpResults) {
+        std::cout << name << ": the results differ from the warm-up queries" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// @brief Check that the queries of the retriever over a synthetic keyframe retrieval model allocate exactly the posting lists
+/// that the framework keyframe retrieval copies for them, once the per-thread buffers have grown. Frames are quantized by the
+/// cpu transform backend of the configuration, BoW features are given by the caller
+bool checkQueries(SRef<SolARKeyframeRetrieverFBOW> retriever, fbow::Vocabulary& voc, int level, uint32_t nbQueries)
+{
+    const uint32_t nbKeyframes = 500;
+    const int nbDescriptors = 300;
+    std::mt19937 generator(42);
+    if (voc.getDescType() != CV_8UC1) {
+        LOG_ERROR("The synthetic keyframes need a binary vocabulary");
+        return false;
+    }
+    std::vector<cv::Mat> keyframeDescriptors;
+    SRef<KeyframeRetrieval> keyframeRetrieval = xpcf::utils::make_shared<KeyframeRetrieval>();
+    for (uint32_t id = 0; id < nbKeyframes; id++) {
+        keyframeDescriptors.push_back(randomDescriptors(generator, nbDescriptors, voc.getDescSize()));
+        FrameBoW keyframeBoW = transform(voc, keyframeDescriptors.back(), level);
+        if (keyframeRetrieval->addDescriptor(id, keyframeBoW.bowFeature, keyframeBoW.bowLevelFeature) != FrameworkReturnCode::_SUCCESS) {
+            LOG_ERROR("Cannot add the synthetic keyframe {}", id);
+            return false;
+        }
+    }
+    retriever->setKeyframeRetrieval(keyframeRetrieval);
+
+    // queries are keyframes with a quarter of their descriptors replaced by noise
+    std::vector<SRef<Frame>> frames;
+    std::vector<FrameBoW> queries;
+    for (uint32_t i = 0; i < nbQueries; i++) {
+        cv::Mat descriptors = keyframeDescriptors[(i * 7) % nbKeyframes].clone();
+        randomDescriptors(generator, nbDescriptors / 4, voc.getDescSize()).copyTo(descriptors.rowRange(0, nbDescriptors / 4));
+        frames.push_back(makeFrame(descriptors));
+        queries.push_back(transform(voc, descriptors, level));
+    }
+
+    std::vector<uint32_t> retKeyframes_id;
+    retKeyframes_id.reserve(nbKeyframes);
+    auto firstResult = [&retKeyframes_id]() { return retKeyframes_id.empty() ? UINT32_MAX : retKeyframes_id[0]; };
+    uint64_t nbFrameAllocations, nbBoWAllocations;
+    std::vector<uint32_t> frameResults, bowResults;
+    if (!countQueries("Frame queries", nbQueries, [&](uint32_t i) {
+            retKeyframes_id.clear();
+            retriever->retrieve(frames[i], retKeyframes_id);
+            return firstResult(); }, nbFrameAllocations, frameResults) ||
+        !countQueries("BoW queries", nbQueries, [&](uint32_t i) {
+            retKeyframes_id.clear();
+            retriever->retrieve(queries[i].bowFeature, queries[i].bowLevelFeature, retKeyframes_id);
+            return firstResult(); }, nbBoWAllocations, bowResults))
+        return false;
+    // the cpu backend quantizes frames into the words and nodes of fbow
+    if (frameResults != bowResults) {
+        std::cout << "Queries: the frame queries and the BoW queries retrieve different keyframes" << std::endl;
+        return false;
+    }
+
+    // the only expected allocations are the nodes of the posting lists that the framework returns as sets for the level nodes of the queries
+    uint64_t nbPostingListAllocations = countAllocations([&]() {
+        for (const auto& query : queries)
+            for (const auto& it : query.bowLevelFeature) {
+                std::set<uint32_t> kfs_id;
+                keyframeRetrieval->getInvertedIndex(it.first, kfs_id);
+            }
+    });
+    std::cout << "Queries: " << nbFrameAllocations << " allocations for " << nbQueries << " frame queries, " << nbBoWAllocations
+              << " for the BoW queries, " << nbPostingListAllocations << " expected allocations of their posting lists" << std::endl;
+    return (nbFrameAllocations == nbPostingListAllocations) && (nbBoWAllocations == nbPostingListAllocations);
+}
+}
+
+int main(int argc, char **argv) {
+
+#if NDEBUG
+    boost::log::core::get()->set_logging_enabled(false);
+#endif
+
+    LOG_ADD_LOG_TO_CONSOLE();
+
+	cv::CommandLineParser parser(argc, argv, keys);
+	if (parser.has("help"))
+	{
+		parser.printMessage();
+		return 0;
+	}
+	std::string configxml = parser.get<std::string>("config");
+	std::string keyframesName = parser.get<std::string>("keyframes");
+	uint32_t nbQueries = static_cast<uint32_t>(std::max(parser.get<int>("queries"), 1));
+
+    // the counter must see the allocations of the test itself
+    std::vector<int> buffer;
+    if ((countAllocations([&buffer]() { buffer.resize(16); }) == 0) || buffer.empty()) {
+        std::cout << "FAILED: the allocations are not counted" << std::endl;
+        return -1;
+    }
+
+    try {
+        SRef<xpcf::IComponentManager> xpcfComponentManager = xpcf::getComponentManagerInstance();
+        if (xpcfComponentManager->load(configxml.c_str()) != org::bcom::xpcf::_SUCCESS)
+        {
+            LOG_ERROR("Failed to load the configuration file {}", configxml);
+            return -1;
+        }
+        auto kfRetriever = xpcfComponentManager->resolve<reloc::IKeyframeRetriever>();
+        auto fbowRetriever = std::dynamic_pointer_cast<SolARKeyframeRetrieverFBOW>(kfRetriever);
+        if (!fbowRetriever) {
+            LOG_ERROR("The keyframe retriever of {} is not SolARKeyframeRetrieverFBOW", configxml);
+            return -1;
+        }
+        auto configurable = kfRetriever->bindTo<xpcf::IConfigurable>();
+        std::string vocabularyPath = configurable->getProperty("VOCpath")->getStringValue();
+        int level = configurable->getProperty("level")->getIntegerValue();
+        fbow::Vocabulary voc;
+        try {
+            voc.readFromFile(vocabularyPath);
+        }
+        catch (const std::exception& e) {
+            LOG_ERROR("Cannot load the vocabulary {}: {}", vocabularyPath, e.what());
+            return -1;
+        }
+        if (!checkQueries(fbowRetriever, voc, level, nbQueries)) {
+            std::cout << "FAILED: the queries do not allocate exactly their posting lists" << std::endl;
+            return -1;
+        }
+        if (keyframesName.empty())
+            return 0;
+
+        // Allocations of a retrieve over real keyframes, reported only
+        kfRetriever->resetKeyframeRetrieval();
+        std::ifstream ifs(keyframesName, std::ios::binary);
+        if (!ifs.is_open()) {
+            LOG_ERROR("Cannot load the keyframes {}", keyframesName);
+            return -1;
+        }
+        SRef<KeyframeCollection> keyframeCollection;
+        InputArchive ia(ifs);
+        ia >> keyframeCollection;
+        std::vector<SRef<Keyframe>> keyframes;
+        keyframeCollection->getAllKeyframes(keyframes);
+        if (keyframes.empty()) {
+            LOG_ERROR("No keyframe in {}", keyframesName);
+            return -1;
+        }
+        for (const auto& keyframe : keyframes)
+            kfRetriever->addKeyframe(keyframe);
+        fbowRetriever->flush();
+
+        std::vector<uint32_t> retKeyframes_id;
+        retKeyframes_id.reserve(keyframes.size());
+        for (const auto& keyframe : keyframes)
+            kfRetriever->retrieve(keyframe, retKeyframes_id);
+        uint64_t nbAllocations = countAllocations([&]() {
+            for (uint32_t i = 0; i < nbQueries; i++) {
+                retKeyframes_id.clear();
+                kfRetriever->retrieve(keyframes[i % keyframes.size()], retKeyframes_id);
+            }
+        });
+        std::cout << "Retrieve: " << static_cast<double>(nbAllocations) / nbQueries << " allocations per query on " << keyframes.size()
+                  << " keyframes" << std::endl;
+    }
+    catch (xpcf::Exception e)
+    {
+        LOG_ERROR ("The following exception has been catched: {}", e.what());
+        return -1;
+    }
+
+    return 0;
+}
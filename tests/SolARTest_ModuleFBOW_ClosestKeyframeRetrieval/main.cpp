@@ -31,11 +31,14 @@
 #include "api/features/IDescriptorsExtractorFromImage.h"
 #include "api/reloc/IKeyframeRetriever.h"
 #include "core/Log.h"
+#include "SolARKeyframeRetrieverFBOW.h"
+#include "SolARFBOWQuerySession.h"
 
 
 using namespace SolAR;
 using namespace SolAR::datastructure;
 using namespace SolAR::api;
+using namespace SolAR::MODULES::FBOW;
 
 namespace xpcf = org::bcom::xpcf;
 
@@ -184,6 +187,55 @@ int main(int argc, char **argv) {
         else
             LOG_INFO("image 4 test is KO ")
 
+        // consecutive frames of a query session which share most of their descriptors are queried incrementally,
+        // with the results of a full query
+        auto fbowRetriever = std::dynamic_pointer_cast<SolARKeyframeRetrieverFBOW>(kfRetriever);
+        if (fbowRetriever) {
+            SolARFBOWQuerySession session;
+            std::vector<uint32_t> sessionKeyframes, fullKeyframes;
+            fbowRetriever->retrieve(frame4, session, sessionKeyframes);
+            // the next frame loses 5% of the descriptors of image 4
+            uint32_t nbDescriptors = descriptors4->getNbDescriptors() - descriptors4->getNbDescriptors() / 20;
+            SRef<DescriptorBuffer> descriptors4b = xpcf::utils::make_shared<DescriptorBuffer>(static_cast<unsigned char*>(descriptors4->data()),
+                descriptors4->getDescriptorType(), descriptors4->getDescriptorDataType(), descriptors4->getNbElements(), nbDescriptors);
+            std::vector<Keypoint> keypoints4b(keypoints4.begin(), keypoints4.begin() + nbDescriptors);
+            SRef<Frame> frame4b = xpcf::utils::make_shared<Frame>(keypoints4b, descriptors4b, image4);
+            sessionKeyframes.clear();
+            FrameworkReturnCode sessionResult = fbowRetriever->retrieve(frame4b, session, sessionKeyframes);
+            FrameworkReturnCode fullResult = kfRetriever->retrieve(frame4b, fullKeyframes);
+            if ((session.getNbIncrementalQueries() > 0) && (sessionResult == fullResult) && (sessionKeyframes == fullKeyframes)) {
+                LOG_INFO("query session test is OK ")
+            }
+            else
+                LOG_INFO("query session test is KO: {} incremental queries", session.getNbIncrementalQueries())
+
+            // a keyframe added then suppressed between frames of the session is replayed without a full query
+            SRef<Keyframe> keyframe4 = xpcf::utils::make_shared<Keyframe>(keypoints4, descriptors4, image4);
+            keyframe4->setId(3);
+            bool isReplayed = true;
+            for (int step = 0; step < 2; step++) {
+                if (step == 0)
+                    kfRetriever->addKeyframe(keyframe4);
+                else
+                    kfRetriever->suppressKeyframe(keyframe4->getId());
+                fbowRetriever->flush();
+                uint32_t nbFullQueries = session.getNbFullQueries();
+                SRef<Frame> frame = (step == 0) ? frame4 : frame4b;
+                sessionKeyframes.clear();
+                fullKeyframes.clear();
+                sessionResult = fbowRetriever->retrieve(frame, session, sessionKeyframes);
+                fullResult = kfRetriever->retrieve(frame, fullKeyframes);
+                bool isFirst = !sessionKeyframes.empty() && (sessionKeyframes[0] == keyframe4->getId());
+                if ((session.getNbFullQueries() != nbFullQueries) || (sessionResult != fullResult) || (sessionKeyframes != fullKeyframes) ||
+                    (isFirst != (step == 0)))
+                    isReplayed = false;
+            }
+            if (isReplayed) {
+                LOG_INFO("query session replay test is OK ")
+            }
+            else
+                LOG_INFO("query session replay test is KO: {} full queries", session.getNbFullQueries())
+        }
 
         // with test image 5 the retriever should not return any keyframe
         SRef<Frame> frame5 = xpcf::utils::make_shared<Frame>(keypoints5, descriptors5, image5);
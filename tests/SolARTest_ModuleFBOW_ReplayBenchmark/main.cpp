@@ -0,0 +1,253 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <thread>
+
+#include <boost/log/core.hpp>
+
+// ADD XPCF HEADERS HERE
+#include "xpcf/xpcf.h"
+
+// ADD COMPONENTS HEADERS HERE
+#include "api/image/IImageLoader.h"
+#include "api/features/IDescriptorsExtractorFromImage.h"
+#include "api/reloc/IKeyframeRetriever.h"
+#include "core/Log.h"
+#include "datastructure/KeyframeCollection.h"
+#include "core/SerializationDefinitions.h"
+#include "opencv2/core.hpp"
+#include "SolARKeyframeRetrieverFBOW.h"
+
+using namespace SolAR;
+using namespace SolAR::datastructure;
+using namespace SolAR::api;
+using namespace SolAR::MODULES::FBOW;
+
+namespace xpcf = org::bcom::xpcf;
+
+const cv::String keys =
+"{help h usage ?||}"
+"{config|SolARTest_ModuleFBOW_ReplayBenchmark_conf.xml| xml configuration file of the keyframe retriever and of the feature extraction}"
+"{images|../../../../../data/multidevice| directory of the images to replay (ignored if keyframes is set)}"
+"{keyframes|| a keyframe collection archive providing precomputed descriptors (e.g. saved by a keyframes manager)}"
+"{stride|1| one image over stride is indexed as a keyframe, all images are replayed as queries}"
+"{queries|1000| number of replayed queries}"
+"{threads|1| number of query threads}"
+"{rate|0| total query rate in Hz (0 to replay queries flat-out)}"
+"{m|0| match the query with its best retrieved keyframe}"
+;
+
+namespace {
+
+/// @brief latencies in milliseconds of the stages of a query
+struct QueryLatency {
+    double retrieve = 0.;
+    double match = 0.;
+    double total = 0.;
+};
+
+double toMilliseconds(std::chrono::steady_clock::duration duration)
+{
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+/// @brief Nearest-rank percentile of sorted values
+double percentile(const std::vector<double>& sortedValues, double p)
+{
+    if (sortedValues.empty())
+        return 0.;
+    size_t rank = static_cast<size_t>(std::ceil(p / 100. * sortedValues.size()));
+    return sortedValues[std::min(std::max(rank, size_t(1)), sortedValues.size()) - 1];
+}
+
+void logStage(const std::string& name, std::vector<double> latencies)
+{
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "  " << std::left << std::setw(9) << name << std::fixed << std::setprecision(3)
+              << " p50: " << percentile(latencies, 50.) << " ms - p95: " << percentile(latencies, 95.)
+              << " ms - p99: " << percentile(latencies, 99.) << " ms - max: " << (latencies.empty() ? 0. : latencies.back()) << " ms" << std::endl;
+}
+
+}
+
+int main(int argc, char **argv) {
+
+#if NDEBUG
+    boost::log::core::get()->set_logging_enabled(false);
+#endif
+
+    LOG_ADD_LOG_TO_CONSOLE();
+
+	cv::CommandLineParser parser(argc, argv, keys);
+	if (parser.has("help"))
+	{
+		parser.printMessage();
+		return 0;
+	}
+	std::string configxml = parser.get<std::string>("config");
+	std::string imagesPath = parser.get<std::string>("images");
+	std::string keyframesName = parser.get<std::string>("keyframes");
+	uint32_t stride = static_cast<uint32_t>(std::max(parser.get<int>("stride"), 1));
+	uint32_t nbQueries = static_cast<uint32_t>(std::max(parser.get<int>("queries"), 0));
+	uint32_t nbThreads = static_cast<uint32_t>(std::max(parser.get<int>("threads"), 1));
+	double rate = std::max(parser.get<double>("rate"), 0.);
+	bool useMatch = parser.get<int>("m") != 0;
+
+    try {
+        SRef<xpcf::IComponentManager> xpcfComponentManager = xpcf::getComponentManagerInstance();
+        if (xpcfComponentManager->load(configxml.c_str()) != org::bcom::xpcf::_SUCCESS)
+        {
+            LOG_ERROR("Failed to load the configuration file {}", configxml);
+            return -1;
+        }
+        auto kfRetriever = std::dynamic_pointer_cast<SolARKeyframeRetrieverFBOW>(xpcfComponentManager->resolve<reloc::IKeyframeRetriever>());
+        if (!kfRetriever) {
+            LOG_ERROR("The keyframe retriever of {} is not a SolARKeyframeRetrieverFBOW", configxml);
+            return -1;
+        }
+
+        // Frames to replay, from precomputed descriptors or from images
+        std::vector<SRef<Keyframe>> frames;
+        if (!keyframesName.empty()) {
+            std::ifstream ifs(keyframesName, std::ios::binary);
+            if (!ifs.is_open()) {
+                LOG_ERROR("Cannot load the keyframes {}", keyframesName);
+                return -1;
+            }
+            SRef<KeyframeCollection> keyframeCollection;
+            InputArchive ia(ifs);
+            ia >> keyframeCollection;
+            keyframeCollection->getAllKeyframes(frames);
+        }
+        else {
+            auto imageLoader = xpcfComponentManager->resolve<image::IImageLoader>();
+            auto extractor = xpcfComponentManager->resolve<features::IDescriptorsExtractorFromImage>();
+            std::vector<std::string> imageFiles;
+            for (const auto& entry : std::filesystem::directory_iterator(imagesPath))
+                if (entry.is_regular_file())
+                    imageFiles.push_back(entry.path().string());
+            std::sort(imageFiles.begin(), imageFiles.end());
+            for (const auto& imageFile : imageFiles) {
+                imageLoader->bindTo<xpcf::IConfigurable>()->getProperty("filePath")->setStringValue(imageFile.c_str());
+                SRef<Image> image;
+                if ((imageLoader->reloadImage() != FrameworkReturnCode::_SUCCESS) || (imageLoader->getImage(image) != FrameworkReturnCode::_SUCCESS)) {
+                    LOG_WARNING("Cannot load the image {}", imageFile);
+                    continue;
+                }
+                std::vector<Keypoint> keypoints;
+                SRef<DescriptorBuffer> descriptors;
+                if (extractor->extract(image, keypoints, descriptors) != FrameworkReturnCode::_SUCCESS)
+                    continue;
+                frames.push_back(xpcf::utils::make_shared<Keyframe>(keypoints, descriptors, image));
+            }
+        }
+        // queries without descriptors are not replayed
+        frames.erase(std::remove_if(frames.begin(), frames.end(), [](const SRef<Keyframe>& frame) {
+            return !frame->getDescriptors() || (frame->getDescriptors()->getNbDescriptors() == 0); }), frames.end());
+        if (frames.empty()) {
+            LOG_ERROR("No frame to replay");
+            return -1;
+        }
+        for (uint32_t i = 0; i < frames.size(); ++i)
+            frames[i]->setId(i);
+
+        // Build the index
+        std::vector<SRef<Keyframe>> keyframes;
+        for (uint32_t i = 0; i < frames.size(); i += stride)
+            keyframes.push_back(frames[i]);
+        auto buildStart = std::chrono::steady_clock::now();
+        if (kfRetriever->addKeyframes(keyframes) == FrameworkReturnCode::_ERROR_)
+            LOG_WARNING("Some keyframes cannot be indexed");
+        double buildTime = toMilliseconds(std::chrono::steady_clock::now() - buildStart);
+        std::cout << std::fixed << std::setprecision(1) << "Index of " << keyframes.size() << " keyframes built in " << buildTime << " ms ("
+                  << (buildTime > 0. ? keyframes.size() * 1000. / buildTime : 0.) << " keyframes/s)" << std::endl;
+
+        // Replay the queries. At a fixed rate, latencies are measured from the scheduled start of the queries
+        std::vector<QueryLatency> latencies(nbQueries);
+        std::atomic<uint32_t> nextQuery{0};
+        std::atomic<uint32_t> nbRetrieved{0};
+        auto replayStart = std::chrono::steady_clock::now();
+        auto replay = [&]() {
+            while (true) {
+                uint32_t q = nextQuery++;
+                if (q >= nbQueries)
+                    return;
+                auto scheduled = std::chrono::steady_clock::now();
+                if (rate > 0.) {
+                    scheduled = replayStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(q / rate));
+                    std::this_thread::sleep_until(scheduled);
+                }
+                const SRef<Keyframe>& frame = frames[q % frames.size()];
+                auto start = std::chrono::steady_clock::now();
+                std::vector<uint32_t> retKeyframes_id;
+                bool retrieved = kfRetriever->retrieve(frame, retKeyframes_id) == FrameworkReturnCode::_SUCCESS;
+                auto retrieveEnd = std::chrono::steady_clock::now();
+                if (retrieved && !retKeyframes_id.empty()) {
+                    nbRetrieved++;
+                    if (useMatch) {
+                        std::vector<DescriptorMatch> matches;
+                        kfRetriever->match(frame, frames[retKeyframes_id[0]], matches);
+                    }
+                }
+                auto end = std::chrono::steady_clock::now();
+                latencies[q].retrieve = toMilliseconds(retrieveEnd - start);
+                latencies[q].match = toMilliseconds(end - retrieveEnd);
+                latencies[q].total = toMilliseconds(end - scheduled);
+            }
+        };
+        std::vector<std::thread> threads;
+        for (uint32_t i = 0; i < nbThreads; ++i)
+            threads.emplace_back(replay);
+        for (auto& thread : threads)
+            thread.join();
+        double replayTime = toMilliseconds(std::chrono::steady_clock::now() - replayStart);
+
+        // Report, also when logs are disabled
+        std::cout << std::fixed << std::setprecision(1) << nbQueries << " queries on " << nbThreads << " threads in " << replayTime << " ms: "
+                  << (replayTime > 0. ? nbQueries * 1000. / replayTime : 0.) << " queries/s, " << nbRetrieved.load() << " with retrieved keyframes" << std::endl;
+        std::vector<double> retrieveLatencies, matchLatencies, totalLatencies;
+        for (const auto& latency : latencies) {
+            retrieveLatencies.push_back(latency.retrieve);
+            matchLatencies.push_back(latency.match);
+            totalLatencies.push_back(latency.total);
+        }
+        logStage("retrieve", retrieveLatencies);
+        if (useMatch)
+            logStage("match", matchLatencies);
+        logStage("total", totalLatencies);
+        SolARKeyframeRetrieverFBOW::MemoryStats memoryStats;
+        kfRetriever->getMemoryStats(memoryStats);
+        std::cout << "Memory of " << memoryStats.nbKeyframes << " keyframes: " << memoryStats.getTotal() << " bytes (vocabulary: "
+                  << memoryStats.vocabulary << " bytes)" << std::endl;
+    }
+    catch (xpcf::Exception e)
+    {
+        LOG_ERROR ("The following exception has been catched: {}", e.what());
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+#include <boost/log/core.hpp>
+
+// ADD XPCF HEADERS HERE
+#include "xpcf/xpcf.h"
+
+// ADD COMPONENTS HEADERS HERE
+#include "api/reloc/IKeyframeRetriever.h"
+#include "core/Log.h"
+#include "datastructure/Keyframe.h"
+#include "opencv2/core.hpp"
+#include "SolARKeyframeRetrieverFBOW.h"
+
+using namespace SolAR;
+using namespace SolAR::datastructure;
+using namespace SolAR::api;
+using namespace SolAR::MODULES::FBOW;
+
+namespace xpcf = org::bcom::xpcf;
+
+const cv::String keys =
+"{help h usage ?||}"
+"{config|SolARTest_ModuleFBOW_SpillSuppression_conf.xml| xml configuration file of the keyframe retriever with a memory budget}"
+"{keyframes|200| number of synthetic keyframes}"
+"{suppressed|50| number of suppressed keyframes among the first indexed ones}"
+;
+
+namespace {
+
+/// @brief Keyframe of random AKAZE descriptors
+SRef<Keyframe> randomKeyframe(std::mt19937& generator, uint32_t id, uint32_t nbDescriptors)
+{
+    const uint32_t descriptorSize = 61;
+    std::uniform_int_distribution<int> byteDistribution(0, 255);
+    SRef<DescriptorBuffer> descriptors = xpcf::utils::make_shared<DescriptorBuffer>(DescriptorType::AKAZE, DescriptorDataType::TYPE_8U,
+                                                                                   descriptorSize, nbDescriptors);
+    uint8_t* data = static_cast<uint8_t*>(descriptors->data());
+    for (uint32_t i = 0; i < descriptorSize * nbDescriptors; ++i)
+        data[i] = static_cast<uint8_t>(byteDistribution(generator));
+    SRef<Keyframe> keyframe = xpcf::utils::make_shared<Keyframe>(std::vector<Keypoint>(nbDescriptors), descriptors, nullptr);
+    keyframe->setId(id);
+    return keyframe;
+}
+
+bool isRetrieved(SRef<SolARKeyframeRetrieverFBOW> retriever, const SRef<Keyframe>& keyframe)
+{
+    std::vector<uint32_t> retKeyframes_id;
+    retriever->retrieve(keyframe, retKeyframes_id);
+    return std::find(retKeyframes_id.begin(), retKeyframes_id.end(), keyframe->getId()) != retKeyframes_id.end();
+}
+
+}
+
+int main(int argc, char **argv) {
+
+#if NDEBUG
+    boost::log::core::get()->set_logging_enabled(false);
+#endif
+
+    LOG_ADD_LOG_TO_CONSOLE();
+
+	cv::CommandLineParser parser(argc, argv, keys);
+	if (parser.has("help"))
+	{
+		parser.printMessage();
+		return 0;
+	}
+	std::string configxml = parser.get<std::string>("config");
+	uint32_t nbKeyframes = static_cast<uint32_t>(std::max(parser.get<int>("keyframes"), 2));
+	uint32_t nbSuppressed = static_cast<uint32_t>(std::min(std::max(parser.get<int>("suppressed"), 1), static_cast<int>(nbKeyframes) - 1));
+
+    try {
+        SRef<xpcf::IComponentManager> xpcfComponentManager = xpcf::getComponentManagerInstance();
+        if (xpcfComponentManager->load(configxml.c_str()) != org::bcom::xpcf::_SUCCESS)
+        {
+            LOG_ERROR("Failed to load the configuration file {}", configxml);
+            return -1;
+        }
+        auto kfRetriever = std::dynamic_pointer_cast<SolARKeyframeRetrieverFBOW>(xpcfComponentManager->resolve<reloc::IKeyframeRetriever>());
+        if (!kfRetriever) {
+            LOG_ERROR("The keyframe retriever of {} is not a SolARKeyframeRetrieverFBOW", configxml);
+            return -1;
+        }
+
+        // keyframes beyond the memory budget are spilled, least recently indexed first
+        std::mt19937 generator(42);
+        std::vector<SRef<Keyframe>> keyframes;
+        for (uint32_t id = 0; id < nbKeyframes; ++id)
+            keyframes.push_back(randomKeyframe(generator, id, 500));
+        if (kfRetriever->addKeyframes(keyframes) != FrameworkReturnCode::_SUCCESS) {
+            std::cout << "FAILED: cannot index the keyframes" << std::endl;
+            return -1;
+        }
+        SolARKeyframeRetrieverFBOW::MemoryStats stats;
+        kfRetriever->getMemoryStats(stats);
+        std::cout << stats.nbKeyframes << " keyframes in memory over " << nbKeyframes << std::endl;
+        if (stats.nbKeyframes + nbSuppressed >= nbKeyframes) {
+            std::cout << "FAILED: the suppressed keyframes and the next one are not all spilled, increase the number of keyframes" << std::endl;
+            return -1;
+        }
+
+        std::vector<uint32_t> suppressed_id;
+        for (uint32_t id = 0; id < nbSuppressed; ++id)
+            suppressed_id.push_back(id);
+        if (kfRetriever->suppressKeyframes(suppressed_id) != FrameworkReturnCode::_SUCCESS) {
+            std::cout << "FAILED: cannot suppress the spilled keyframes" << std::endl;
+            return -1;
+        }
+        // a spilled keyframe that is not suppressed is loaded back
+        if (!isRetrieved(kfRetriever, keyframes[nbSuppressed])) {
+            std::cout << "FAILED: the spilled keyframe " << nbSuppressed << " is not retrieved" << std::endl;
+            return -1;
+        }
+        // queries load spilled candidates back, the suppressed keyframes must not come back with them
+        uint32_t nbRetrieved = 0;
+        for (int pass = 0; pass < 2; ++pass)
+            for (uint32_t id = 0; id < nbSuppressed; ++id)
+                if (isRetrieved(kfRetriever, keyframes[id]))
+                    nbRetrieved++;
+        std::cout << nbRetrieved << " retrievals of suppressed keyframes" << std::endl;
+        if (nbRetrieved > 0) {
+            std::cout << "FAILED: suppressed spilled keyframes are retrieved" << std::endl;
+            return -1;
+        }
+    }
+    catch (xpcf::Exception e)
+    {
+        LOG_ERROR ("The following exception has been catched: {}", e.what());
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,142 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <random>
+
+#include <boost/log/core.hpp>
+
+// ADD COMPONENTS HEADERS HERE
+#include "core/Log.h"
+#include "opencv2/core.hpp"
+#include "fbow.h"
+#include "SolARFBOWVocabularyTree.h"
+
+using namespace SolAR;
+using namespace SolAR::MODULES::FBOW;
+
+const cv::String keys =
+"{help h usage ?||}"
+"{vocabulary|../../../../../data/fbow_voc/akaze.fbow| binary fbow vocabulary}"
+"{descriptors|10000| number of random descriptors transformed}"
+"{level|3| level of the level nodes}"
+;
+
+namespace {
+
+/// @brief Check that a kernel of the cpu backend gives the words, weights and level nodes of fbow
+bool checkKernel(fbow::Vocabulary& voc, SolARFBOWVocabularyTree& vocTree, SolARFBOWVocabularyTree::Kernel kernel,
+                 const cv::Mat& descriptors, int level)
+{
+    std::string name = SolARFBOWVocabularyTree::getKernelName(kernel);
+    if (vocTree.setKernel(kernel) != FrameworkReturnCode::_SUCCESS) {
+        std::cout << name << ": cannot select the kernel" << std::endl;
+        return false;
+    }
+    uint32_t nbDifferences = 0;
+    // descriptors are transformed one by one so that each word and level node is compared
+    for (int r = 0; r < descriptors.rows; ++r) {
+        fbow::fBow bow, vocTreeBow;
+        fbow::fBow2 bow2, vocTreeBow2;
+        voc.transform(descriptors.row(r), level, bow, bow2);
+        vocTree.transform(descriptors.row(r), level, vocTreeBow, vocTreeBow2);
+        bool isSame = (bow.size() == vocTreeBow.size()) && (bow2.size() == vocTreeBow2.size());
+        for (auto it = bow.begin(), itTree = vocTreeBow.begin(); isSame && (it != bow.end()); ++it, ++itTree)
+            isSame = (it->first == itTree->first) && (std::fabs(it->second.var - itTree->second.var) <= 1e-5 * std::fabs(it->second.var));
+        for (auto it = bow2.begin(), itTree = vocTreeBow2.begin(); isSame && (it != bow2.end()); ++it, ++itTree)
+            isSame = (it->first == itTree->first) && (it->second == itTree->second);
+        if (!isSame)
+            nbDifferences++;
+    }
+    // all descriptors at once, as the retriever transforms a frame
+    fbow::fBow bow, vocTreeBow;
+    fbow::fBow2 bow2, vocTreeBow2;
+    voc.transform(descriptors, level, bow, bow2);
+    vocTree.transform(descriptors, level, vocTreeBow, vocTreeBow2);
+    bool isSame = (bow.size() == vocTreeBow.size()) && (bow2 == vocTreeBow2);
+    for (auto it = bow.begin(), itTree = vocTreeBow.begin(); isSame && (it != bow.end()); ++it, ++itTree)
+        isSame = (it->first == itTree->first) && (std::fabs(it->second.var - itTree->second.var) <= 1e-5 * std::fabs(it->second.var));
+    std::cout << name << ": " << nbDifferences << " descriptors out of " << descriptors.rows << " differ from fbow, "
+              << (isSame ? "same" : "different") << " BoW feature of all descriptors" << std::endl;
+    return (nbDifferences == 0) && isSame;
+}
+
+}
+
+int main(int argc, char **argv) {
+
+#if NDEBUG
+    boost::log::core::get()->set_logging_enabled(false);
+#endif
+
+    LOG_ADD_LOG_TO_CONSOLE();
+
+	cv::CommandLineParser parser(argc, argv, keys);
+	if (parser.has("help"))
+	{
+		parser.printMessage();
+		return 0;
+	}
+	std::string vocabularyPath = parser.get<std::string>("vocabulary");
+	int nbDescriptors = std::max(parser.get<int>("descriptors"), 1);
+	int level = parser.get<int>("level");
+
+    fbow::Vocabulary voc;
+    try {
+        voc.readFromFile(vocabularyPath);
+    }
+    catch (const std::exception& e) {
+        LOG_ERROR("Cannot load the vocabulary {}: {}", vocabularyPath, e.what());
+        return -1;
+    }
+    if (voc.getDescType() != CV_8UC1) {
+        LOG_ERROR("{} is not a binary vocabulary: the cpu backend only matches fbow on binary vocabularies", vocabularyPath);
+        return -1;
+    }
+    SolARFBOWVocabularyTree vocTree;
+    if ((vocTree.fromVocabulary(voc) != FrameworkReturnCode::_SUCCESS) ||
+        (vocTree.setQuantization(SolARFBOWVocabularyTree::Quantization::NONE) != FrameworkReturnCode::_SUCCESS)) {
+        LOG_ERROR("Cannot build the vocabulary tree of {}", vocabularyPath);
+        return -1;
+    }
+
+    // random binary descriptors have many Hamming distance ties, which must be resolved as in fbow
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<int> byteDistribution(0, 255);
+    cv::Mat descriptors(nbDescriptors, voc.getDescSize(), CV_8UC1);
+    for (int r = 0; r < descriptors.rows; ++r)
+        for (int c = 0; c < descriptors.cols; ++c)
+            descriptors.ptr<uint8_t>(r)[c] = static_cast<uint8_t>(byteDistribution(generator));
+
+    bool isSuccess = true;
+    for (auto kernel : { SolARFBOWVocabularyTree::Kernel::GENERIC, SolARFBOWVocabularyTree::Kernel::SSE42,
+                         SolARFBOWVocabularyTree::Kernel::AVX2, SolARFBOWVocabularyTree::Kernel::AVX512 }) {
+        if (!SolARFBOWVocabularyTree::isKernelSupported(kernel)) {
+            std::cout << SolARFBOWVocabularyTree::getKernelName(kernel) << ": not supported by the cpu" << std::endl;
+            continue;
+        }
+        if (!checkKernel(voc, vocTree, kernel, descriptors, level))
+            isSuccess = false;
+    }
+    if (!isSuccess) {
+        std::cout << "FAILED: the cpu backend does not match fbow" << std::endl;
+        return -1;
+    }
+    return 0;
+}
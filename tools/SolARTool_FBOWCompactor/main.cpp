@@ -0,0 +1,161 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// SolAR header
+#include <boost/log/core.hpp>
+#include "xpcf/xpcf.h"
+#include "core/Log.h"
+#include "api/input/devices/ICamera.h"
+#include "api/features/IDescriptorsExtractorFromImage.h"
+#include "api/image/IImageConvertor.h"
+// OpenCV header
+#include "opencv2/core.hpp"
+// Fbow header
+#include "fbow.h"
+#include "SolARFBOWVocabularyTree.h"
+
+using namespace SolAR;
+using namespace SolAR::datastructure;
+using namespace SolAR::api;
+using namespace SolAR::MODULES::FBOW;
+namespace xpcf  = org::bcom::xpcf;
+
+const cv::String keys =
+"{help h usage ?||}"
+"{config|SolARTool_FBOWCompactor_conf.xml| xml configuration file used to compute word usage from a set of images}"
+"{voc|voc.fbow| the name of the vocabulary to compact}"
+"{usage|| word usage statistics file (e.g. saved from SolARKeyframeRetrieverFBOW::saveWordUsage). If empty, word usage is computed from the images of the configuration file}"
+"{out|voc_compacted.fbow| the name of output vocabulary file}"
+"{remap|voc_compacted_remap.txt| the name of output word remap table}"
+"{o|1| minimal occupancy of a word}"
+"{p|3| number of protected levels (should be at least the level used by the keyframe retriever)}"
+"{v|0| verbose}"
+;
+
+int main(int argc, char *argv[])
+{
+#if NDEBUG
+    boost::log::core::get()->set_logging_enabled(false);
+#endif
+    LOG_ADD_LOG_TO_CONSOLE();
+
+	cv::CommandLineParser parser(argc, argv, keys);
+	if (parser.has("help"))
+	{
+		parser.printMessage();
+		return 0;
+	}
+
+	// get parameters
+	std::string configxml = parser.get<std::string>("config");
+	std::string vocName = parser.get<std::string>("voc");
+	std::string usageName = parser.get<std::string>("usage");
+	std::string outputName = parser.get<std::string>("out");
+	std::string remapName = parser.get<std::string>("remap");
+	int minOccupancy = parser.get<int>("o");
+	int nbProtectedLevels = parser.get<int>("p");
+	int bVerbose = parser.get<int>("v");
+
+	// load vocabulary
+	fbow::Vocabulary voc;
+	voc.readFromFile(vocName);
+	SolARFBOWVocabularyTree vocTree;
+	if (!voc.isValid() || (vocTree.fromVocabulary(voc) != FrameworkReturnCode::_SUCCESS)) {
+		LOG_ERROR("Cannot load the vocabulary {}", vocName);
+		return -1;
+	}
+
+	// get word usage
+	std::map<uint32_t, uint32_t> wordUsage;
+	if (!usageName.empty()) {
+		if (SolARFBOWVocabularyTree::readWordUsage(usageName, wordUsage) != FrameworkReturnCode::_SUCCESS) {
+			LOG_ERROR("Cannot load the word usage {}", usageName);
+			return -1;
+		}
+	}
+	else {
+		// components
+		SRef<input::devices::ICamera> camera;
+		SRef<features::IDescriptorsExtractorFromImage> descriptorExtractorFromImage;
+		SRef<image::IImageConvertor> imageConvertor;
+		try {
+			SRef<xpcf::IComponentManager> xpcfComponentManager = xpcf::getComponentManagerInstance();
+			if (xpcfComponentManager->load(configxml.c_str()) != org::bcom::xpcf::_SUCCESS)
+			{
+				LOG_ERROR("Failed to load the configuration file {}", configxml.c_str());
+				return -1;
+			}
+			camera = xpcfComponentManager->resolve<input::devices::ICamera>();
+			descriptorExtractorFromImage = xpcfComponentManager->resolve<features::IDescriptorsExtractorFromImage>();
+			imageConvertor = xpcfComponentManager->resolve<image::IImageConvertor>();
+			LOG_INFO("Components created!");
+		}
+		catch (xpcf::Exception e)
+		{
+			LOG_ERROR("The following exception has been catch : {}", e.what());
+			return -1;
+		}
+		if (camera->start() == FrameworkReturnCode::_ERROR_)
+		{
+			LOG_ERROR("Cannot start loader");
+			return -1;
+		}
+		// count the number of images in which each word appears
+		int count(0);
+		while (true)
+		{
+			SRef<Image> image;
+			if (camera->getNextImage(image) != FrameworkReturnCode::_SUCCESS)
+				break;
+			SRef<Image> greyImage;
+			if (image->getImageLayout() != Image::ImageLayout::LAYOUT_GREY)
+				imageConvertor->convert(image, greyImage, datastructure::Image::ImageLayout::LAYOUT_GREY);
+			else
+				greyImage = image;
+			std::vector<Keypoint> keypoints;
+			SRef<DescriptorBuffer> descriptors;
+			if ((descriptorExtractorFromImage->extract(greyImage, keypoints, descriptors) != FrameworkReturnCode::_SUCCESS) ||
+				(descriptors->getNbDescriptors() == 0))
+				continue;
+			cv::Mat cvDescriptors(descriptors->getNbDescriptors(), descriptors->getNbElements(), voc.getDescType(), descriptors->data());
+			fbow::fBow bow = voc.transform(cvDescriptors);
+			for (const auto& it : bow)
+				wordUsage[it.first]++;
+			if (bVerbose)
+				LOG_INFO("Image {} - Number of features: {} - Number of words: {}", count, keypoints.size(), bow.size());
+			count++;
+		}
+		LOG_INFO("Word usage computed from {} images", count);
+	}
+
+	// compact the vocabulary
+	uint32_t nbWords = vocTree.getNbWords();
+	uint64_t dataSize = vocTree.getDataSize();
+	std::map<uint32_t, uint32_t> wordRemap;
+	uint32_t nbRemovedWords = vocTree.compact(wordUsage, static_cast<uint32_t>(minOccupancy), static_cast<uint32_t>(nbProtectedLevels), wordRemap);
+	LOG_INFO("Number of words: {} -> {}", nbWords, nbWords - nbRemovedWords);
+	LOG_INFO("Vocabulary size: {} -> {} bytes", dataSize, vocTree.getDataSize());
+
+	// save the compacted vocabulary and the remap table
+	if ((vocTree.saveToFile(outputName) != FrameworkReturnCode::_SUCCESS) ||
+		(SolARFBOWVocabularyTree::writeWordRemap(remapName, wordRemap) != FrameworkReturnCode::_SUCCESS)) {
+		LOG_ERROR("Cannot save the compacted vocabulary");
+		return -1;
+	}
+	std::cout << "Save compacted dict done!!!" << std::endl;
+
+    return 0;
+}
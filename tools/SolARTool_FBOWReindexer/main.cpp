@@ -0,0 +1,117 @@
+/**
+ * @copyright Copyright (c) 2017 B-com http://www.b-com.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// SolAR header
+#include <boost/log/core.hpp>
+#include <fstream>
+#include "xpcf/xpcf.h"
+#include "core/Log.h"
+#include "core/SerializationDefinitions.h"
+#include "datastructure/KeyframeCollection.h"
+#include "api/reloc/IKeyframeRetriever.h"
+// OpenCV header
+#include "opencv2/core.hpp"
+#include "SolARKeyframeRetrieverFBOW.h"
+
+using namespace SolAR;
+using namespace SolAR::datastructure;
+using namespace SolAR::api;
+using namespace SolAR::MODULES::FBOW;
+namespace xpcf  = org::bcom::xpcf;
+
+const cv::String keys =
+"{help h usage ?||}"
+"{config|SolARTool_FBOWReindexer_conf.xml| xml configuration file of the keyframe retriever (vocabulary and level of the new index)}"
+"{keyframes|keyframes.bin| the keyframe collection archive (e.g. saved by a keyframes manager) providing keyframe descriptors}"
+"{out|keyframe_retriever.bin| the name of output keyframe retriever file}"
+"{l|-1| level of the new index. If negative the level of the configuration file is used}"
+"{m|0| compute BoW features from matched descriptors only}"
+;
+
+int main(int argc, char *argv[])
+{
+#if NDEBUG
+    boost::log::core::get()->set_logging_enabled(false);
+#endif
+    LOG_ADD_LOG_TO_CONSOLE();
+
+	cv::CommandLineParser parser(argc, argv, keys);
+	if (parser.has("help"))
+	{
+		parser.printMessage();
+		return 0;
+	}
+
+	// get parameters
+	std::string configxml = parser.get<std::string>("config");
+	std::string keyframesName = parser.get<std::string>("keyframes");
+	std::string outputName = parser.get<std::string>("out");
+	int level = parser.get<int>("l");
+	bool useMatchedDescriptor = parser.get<int>("m") != 0;
+
+	// keyframe retriever configured with the new vocabulary
+	SRef<SolARKeyframeRetrieverFBOW> kfRetriever;
+	try {
+		SRef<xpcf::IComponentManager> xpcfComponentManager = xpcf::getComponentManagerInstance();
+		if (xpcfComponentManager->load(configxml.c_str()) != org::bcom::xpcf::_SUCCESS)
+		{
+			LOG_ERROR("Failed to load the configuration file {}", configxml.c_str());
+			return -1;
+		}
+		kfRetriever = std::dynamic_pointer_cast<SolARKeyframeRetrieverFBOW>(xpcfComponentManager->resolve<reloc::IKeyframeRetriever>());
+		LOG_INFO("Components created!");
+	}
+	catch (xpcf::Exception e)
+	{
+		LOG_ERROR("The following exception has been catch : {}", e.what());
+		return -1;
+	}
+	if (!kfRetriever) {
+		LOG_ERROR("The keyframe retriever of {} is not a SolARKeyframeRetrieverFBOW", configxml);
+		return -1;
+	}
+
+	// load stored keyframes
+	SRef<KeyframeCollection> keyframeCollection;
+	std::ifstream ifs(keyframesName, std::ios::binary);
+	if (!ifs.is_open()) {
+		LOG_ERROR("Cannot load the keyframes {}", keyframesName);
+		return -1;
+	}
+	InputArchive ia(ifs);
+	ia >> keyframeCollection;
+	ifs.close();
+	std::vector<SRef<Keyframe>> keyframes;
+	keyframeCollection->getAllKeyframes(keyframes);
+	LOG_INFO("Number of keyframes: {}", keyframes.size());
+
+	// rebuild the index in parallel and save it
+	if (kfRetriever->reindex(keyframes, level, useMatchedDescriptor) != FrameworkReturnCode::_SUCCESS)
+		LOG_WARNING("Some keyframes cannot be indexed");
+	SolARKeyframeRetrieverFBOW::MemoryStats memoryStats;
+	kfRetriever->getMemoryStats(memoryStats);
+	LOG_INFO("Memory of {} keyframes: {} bytes", memoryStats.nbKeyframes, memoryStats.getTotal());
+	LOG_INFO("  BoW features: {} - BoW level features: {} - inverted index: {}", memoryStats.bowFeatures, memoryStats.bowLevelFeatures, memoryStats.invertedIndex);
+	LOG_INFO("  vocabulary: {} - coarse features: {} - signatures: {} - scoring features: {}", memoryStats.vocabulary, memoryStats.coarseFeatures,
+			 memoryStats.signatures, memoryStats.scoringFeatures);
+	if (kfRetriever->saveToFile(outputName) != FrameworkReturnCode::_SUCCESS) {
+		LOG_ERROR("Cannot save the keyframe retriever to {}", outputName);
+		return -1;
+	}
+	std::cout << "Save reindexed keyframe retriever done!!!" << std::endl;
+
+    return 0;
+}